@@ -22,17 +22,7 @@ Environment:
 #include <fltKernel.h>
 #include <dontuse.h>
 #include <suppress.h>
-#include "avf.h"
-
-//
-//  Declare PsGetProcessImageFileName (not in public headers)
-//
-
-NTKERNELAPI
-PUCHAR
-PsGetProcessImageFileName(
-    _In_ PEPROCESS Process
-    );
+#include "avfKern.h"
 
 #pragma prefast(disable:__WARNING_ENCODE_MEMBER_FUNCTION_POINTER, "Not valid for kernel mode drivers")
 
@@ -44,12 +34,6 @@ PFLT_FILTER gFilterHandle = NULL;
 PFLT_PORT gServerPort = NULL;
 PFLT_PORT gClientPort = NULL;
 
-//
-//  Pool tags
-//
-
-#define AVF_POOL_TAG 'FvAM'
-
 //
 //  Function prototypes
 //
@@ -80,6 +64,18 @@ AvfInstanceQueryTeardown(
     _In_ FLT_INSTANCE_QUERY_TEARDOWN_FLAGS Flags
     );
 
+VOID
+AvfInstanceTeardownStart(
+    _In_ PCFLT_RELATED_OBJECTS FltObjects,
+    _In_ FLT_INSTANCE_TEARDOWN_FLAGS Flags
+    );
+
+VOID
+AvfInstanceContextCleanup(
+    _In_ PFLT_CONTEXT Context,
+    _In_ FLT_CONTEXT_TYPE ContextType
+    );
+
 FLT_PREOP_CALLBACK_STATUS
 AvfPreRead(
     _Inout_ PFLT_CALLBACK_DATA Data,
@@ -101,6 +97,35 @@ AvfPreCreate(
     _Flt_CompletionContext_Outptr_ PVOID *CompletionContext
     );
 
+FLT_POSTOP_CALLBACK_STATUS
+AvfPostCreate(
+    _Inout_ PFLT_CALLBACK_DATA Data,
+    _In_ PCFLT_RELATED_OBJECTS FltObjects,
+    _In_opt_ PVOID CompletionContext,
+    _In_ FLT_POST_OPERATION_FLAGS Flags
+    );
+
+FLT_PREOP_CALLBACK_STATUS
+AvfPreSetInformation(
+    _Inout_ PFLT_CALLBACK_DATA Data,
+    _In_ PCFLT_RELATED_OBJECTS FltObjects,
+    _Flt_CompletionContext_Outptr_ PVOID *CompletionContext
+    );
+
+FLT_POSTOP_CALLBACK_STATUS
+AvfPostModify(
+    _Inout_ PFLT_CALLBACK_DATA Data,
+    _In_ PCFLT_RELATED_OBJECTS FltObjects,
+    _In_opt_ PVOID CompletionContext,
+    _In_ FLT_POST_OPERATION_FLAGS Flags
+    );
+
+FLT_PREOP_CALLBACK_STATUS
+AvfWatchModification(
+    _In_ PCFLT_RELATED_OBJECTS FltObjects,
+    _Outptr_result_maybenull_ PVOID *CompletionContext
+    );
+
 NTSTATUS
 AvfPortConnect(
     _In_ PFLT_PORT ClientPort,
@@ -134,7 +159,7 @@ CONST FLT_OPERATION_REGISTRATION Callbacks[] = {
     { IRP_MJ_CREATE,
       0,
       AvfPreCreate,
-      NULL },
+      AvfPostCreate },
 
     { IRP_MJ_READ,
       0,
@@ -144,7 +169,12 @@ CONST FLT_OPERATION_REGISTRATION Callbacks[] = {
     { IRP_MJ_WRITE,
       0,
       AvfPreWrite,
-      NULL },
+      AvfPostModify },
+
+    { IRP_MJ_SET_INFORMATION,
+      0,
+      AvfPreSetInformation,
+      AvfPostModify },
 
     { IRP_MJ_OPERATION_END }
 };
@@ -155,6 +185,18 @@ CONST FLT_OPERATION_REGISTRATION Callbacks[] = {
 
 CONST FLT_CONTEXT_REGISTRATION ContextRegistration[] = {
 
+    { FLT_INSTANCE_CONTEXT,
+      0,
+      AvfInstanceContextCleanup,
+      sizeof(AVF_INSTANCE_CONTEXT),
+      AVF_CONTEXT_TAG },
+
+    { FLT_STREAM_CONTEXT,
+      0,
+      NULL,
+      sizeof(AVF_STREAM_CONTEXT),
+      AVF_STREAM_CONTEXT_TAG },
+
     { FLT_CONTEXT_END }
 };
 
@@ -172,7 +214,7 @@ CONST FLT_REGISTRATION FilterRegistration = {
     AvfUnload,                          //  FilterUnload
     AvfInstanceSetup,                   //  InstanceSetup
     AvfInstanceQueryTeardown,           //  InstanceQueryTeardown
-    NULL,                               //  InstanceTeardownStart
+    AvfInstanceTeardownStart,           //  InstanceTeardownStart
     NULL,                               //  InstanceTeardownComplete
     NULL,                               //  GenerateFileName
     NULL,                               //  GenerateDestinationFileName
@@ -226,6 +268,32 @@ Return Value:
         return status;
     }
 
+    //
+    //  Start tracking processes so notifications can carry their image names
+    //
+
+    status = AvfProcessTableInitialize();
+
+    if (!NT_SUCCESS(status)) {
+        FltUnregisterFilter(gFilterHandle);
+        return status;
+    }
+
+    AvfPolicyInitialize();
+
+    //
+    //  Start the dispatchers that deliver pended operations to user mode
+    //
+
+    status = AvfQueueInitialize();
+
+    if (!NT_SUCCESS(status)) {
+        FltUnregisterFilter(gFilterHandle);
+        AvfPolicyUninitialize();
+        AvfProcessTableUninitialize();
+        return status;
+    }
+
     //
     //  Create communication port
     //
@@ -249,12 +317,15 @@ Return Value:
                                             AvfPortConnect,
                                             AvfPortDisconnect,
                                             AvfMessageNotify,
-                                            1);
+                                            AVF_MAX_ENGINE_CONNECTIONS + 1);
 
         FltFreeSecurityDescriptor(sd);
 
         if (!NT_SUCCESS(status)) {
+            AvfQueueUninitialize();
             FltUnregisterFilter(gFilterHandle);
+            AvfPolicyUninitialize();
+            AvfProcessTableUninitialize();
             return status;
         }
     }
@@ -267,7 +338,10 @@ Return Value:
 
     if (!NT_SUCCESS(status)) {
         FltCloseCommunicationPort(gServerPort);
+        AvfQueueUninitialize();
         FltUnregisterFilter(gFilterHandle);
+        AvfPolicyUninitialize();
+        AvfProcessTableUninitialize();
         return status;
     }
 
@@ -302,10 +376,20 @@ Return Value:
         FltCloseCommunicationPort(gServerPort);
     }
 
+    //
+    //  Stop queueing and let every pended operation through before the
+    //  instances go away
+    //
+
+    AvfQueueUninitialize();
+
     if (gFilterHandle != NULL) {
         FltUnregisterFilter(gFilterHandle);
     }
 
+    AvfPolicyUninitialize();
+    AvfProcessTableUninitialize();
+
     DbgPrint("AVF: Driver unloaded\n");
     return STATUS_SUCCESS;
 }
@@ -324,6 +408,10 @@ Routine Description:
 
     This routine is called whenever a new instance is created on a volume.
 
+    Once a policy is loaded, only volumes that contain protected paths are
+    attached.  Before that every local volume is attached so that the first
+    policy can take effect without remounting anything.
+
 Arguments:
 
     FltObjects - Pointer to the FLT_RELATED_OBJECTS structure.
@@ -338,7 +426,12 @@ Return Value:
 
 --*/
 {
-    UNREFERENCED_PARAMETER(FltObjects);
+    NTSTATUS status;
+    PAVF_INSTANCE_CONTEXT instanceContext = NULL;
+    PAVF_VOLUME_RULES rules;
+    BOOLEAN policyLoaded;
+    ULONG nameLength;
+
     UNREFERENCED_PARAMETER(Flags);
     UNREFERENCED_PARAMETER(VolumeFilesystemType);
 
@@ -350,7 +443,139 @@ Return Value:
         return STATUS_FLT_DO_NOT_ATTACH;
     }
 
-    return STATUS_SUCCESS;
+    status = FltAllocateContext(FltObjects->Filter,
+                                FLT_INSTANCE_CONTEXT,
+                                sizeof(AVF_INSTANCE_CONTEXT),
+                                NonPagedPoolNx,
+                                &instanceContext);
+
+    if (!NT_SUCCESS(status)) {
+        return status;
+    }
+
+    RtlZeroMemory(instanceContext, sizeof(AVF_INSTANCE_CONTEXT));
+    instanceContext->Instance = FltObjects->Instance;
+    FltInitializePushLock(&instanceContext->RulesLock);
+
+    //
+    //  Get the NT device name of the volume, which is how the policy
+    //  identifies it
+    //
+
+    status = FltGetVolumeName(FltObjects->Volume, NULL, &nameLength);
+
+    if (status == STATUS_BUFFER_TOO_SMALL) {
+
+        instanceContext->VolumeName.Buffer = ExAllocatePoolZero(PagedPool,
+                                                                nameLength,
+                                                                AVF_NAME_TAG);
+
+        if (instanceContext->VolumeName.Buffer == NULL) {
+            status = STATUS_INSUFFICIENT_RESOURCES;
+        } else {
+            instanceContext->VolumeName.MaximumLength = (USHORT)nameLength;
+            status = FltGetVolumeName(FltObjects->Volume,
+                                      &instanceContext->VolumeName,
+                                      NULL);
+        }
+    }
+
+    if (!NT_SUCCESS(status)) {
+        FltReleaseContext(instanceContext);
+        return status;
+    }
+
+    rules = AvfLookupVolumeRules(&instanceContext->VolumeName, &policyLoaded);
+
+    if (rules == NULL && policyLoaded) {
+
+        //
+        //  Nothing on this volume is protected
+        //
+
+        FltReleaseContext(instanceContext);
+        return STATUS_FLT_DO_NOT_ATTACH;
+    }
+
+    instanceContext->Rules = rules;
+
+    status = FltSetInstanceContext(FltObjects->Instance,
+                                   FLT_SET_CONTEXT_KEEP_IF_EXISTS,
+                                   instanceContext,
+                                   NULL);
+
+    FltReleaseContext(instanceContext);
+
+    return status;
+}
+
+
+VOID
+AvfInstanceTeardownStart(
+    _In_ PCFLT_RELATED_OBJECTS FltObjects,
+    _In_ FLT_INSTANCE_TEARDOWN_FLAGS Flags
+    )
+/*++
+
+Routine Description:
+
+    Called when an instance starts tearing down.  Operations still pended
+    on the instance are allowed so the teardown can finish.
+
+Arguments:
+
+    FltObjects - Pointer to the FLT_RELATED_OBJECTS structure.
+    Flags - Reason for the teardown.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    UNREFERENCED_PARAMETER(Flags);
+
+    AvfFlushRequests(FltObjects->Instance);
+}
+
+
+VOID
+AvfInstanceContextCleanup(
+    _In_ PFLT_CONTEXT Context,
+    _In_ FLT_CONTEXT_TYPE ContextType
+    )
+/*++
+
+Routine Description:
+
+    Frees the resources held by an instance context.
+
+Arguments:
+
+    Context - The instance context.
+    ContextType - FLT_INSTANCE_CONTEXT.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    PAVF_INSTANCE_CONTEXT instanceContext = Context;
+
+    UNREFERENCED_PARAMETER(ContextType);
+
+    if (instanceContext->Rules != NULL) {
+        AvfReleaseVolumeRules(instanceContext->Rules);
+        instanceContext->Rules = NULL;
+    }
+
+    if (instanceContext->VolumeName.Buffer != NULL) {
+        ExFreePoolWithTag(instanceContext->VolumeName.Buffer, AVF_NAME_TAG);
+        instanceContext->VolumeName.Buffer = NULL;
+    }
+
+    FltDeletePushLock(&instanceContext->RulesLock);
 }
 
 
@@ -383,280 +608,609 @@ Return Value:
 }
 
 
-BOOLEAN
-AvfSendNotification(
+NTSTATUS
+AvfGetParsedFileName(
     _In_ PFLT_CALLBACK_DATA Data,
-    _In_ PCFLT_RELATED_OBJECTS FltObjects,
-    _In_ UCHAR MajorFunction
+    _Outptr_ PFLT_FILE_NAME_INFORMATION *NameInfo
     )
 /*++
 
 Routine Description:
 
-    Sends a file access notification to the user-mode listener.
+    Gets and parses the normalized name of the file an operation targets.
 
 Arguments:
 
     Data - Pointer to the filter callbackData.
-    FltObjects - Pointer to the FLT_RELATED_OBJECTS structure.
-    MajorFunction - IRP major function code (read/write).
+    NameInfo - Receives the name information on success.
 
 Return Value:
 
-    TRUE if operation should be blocked, FALSE to allow.
+    The status of the name query.
 
 --*/
 {
     NTSTATUS status;
-    PFLT_FILE_NAME_INFORMATION nameInfo = NULL;
-    AVF_FILE_NOTIFICATION notification;
-    AVF_REPLY reply;
-    PEPROCESS process;
-    LARGE_INTEGER timeout;
-    ULONG replyLength;
-
-    UNREFERENCED_PARAMETER(FltObjects);
-
-    //
-    //  Check if we have a client connected
-    //
-
-    if (gClientPort == NULL) {
-        return FALSE;  // No client, allow operation
-    }
 
-    //
-    //  Get the file name
-    //
+    *NameInfo = NULL;
 
     status = FltGetFileNameInformation(Data,
                                        FLT_FILE_NAME_NORMALIZED |
                                        FLT_FILE_NAME_QUERY_DEFAULT,
-                                       &nameInfo);
+                                       NameInfo);
 
-    if (!NT_SUCCESS(status)) {
-        return FALSE;  // Can't get name, allow operation
-    }
+    if (NT_SUCCESS(status)) {
 
-    status = FltParseFileNameInformation(nameInfo);
+        status = FltParseFileNameInformation(*NameInfo);
 
-    if (!NT_SUCCESS(status)) {
-        FltReleaseFileNameInformation(nameInfo);
-        return FALSE;  // Can't parse name, allow operation
+        if (!NT_SUCCESS(status)) {
+            FltReleaseFileNameInformation(*NameInfo);
+            *NameInfo = NULL;
+        }
     }
 
-    //
-    //  Initialize notification structure
-    //
-
-    RtlZeroMemory(&notification, sizeof(notification));
-    RtlZeroMemory(&reply, sizeof(reply));
-
-    notification.ProcessId = (ULONG)(ULONG_PTR)PsGetCurrentProcessId();
-    notification.MajorFunction = MajorFunction;
+    return status;
+}
 
-    //
-    //  Copy file name
-    //
 
-    if (nameInfo->Name.Length < sizeof(notification.FileName) - sizeof(WCHAR)) {
-        RtlCopyMemory(notification.FileName,
-                      nameInfo->Name.Buffer,
-                      nameInfo->Name.Length);
-        notification.FileName[nameInfo->Name.Length / sizeof(WCHAR)] = L'\0';
-    }
+VOID
+AvfBuildVerdictKey(
+    _In_ PFLT_CALLBACK_DATA Data,
+    _In_ UCHAR MajorFunction,
+    _In_ PAVF_STREAM_CONTEXT StreamContext,
+    _In_ ULONG ProcessKey,
+    _Out_ PAVF_VERDICT_KEY Key
+    )
+/*++
 
-    FltReleaseFileNameInformation(nameInfo);
+Routine Description:
 
-    //
-    //  Get process name
-    //
+    Builds the verdict cache key of an operation.  Creates are keyed by
+    their access and disposition as well, since opening a file to read it
+    and opening it to overwrite it can get different verdicts.
 
-    process = PsGetCurrentProcess();
-    if (process != NULL) {
-        PUCHAR imageName = PsGetProcessImageFileName(process);
-        if (imageName != NULL) {
-            //
-            //  Convert ANSI process name to Unicode
-            //
-            ANSI_STRING ansiName;
-            UNICODE_STRING unicodeName;
+Arguments:
 
-            RtlInitAnsiString(&ansiName, (PCSZ)imageName);
-            unicodeName.Buffer = notification.ProcessName;
-            unicodeName.MaximumLength = sizeof(notification.ProcessName) - sizeof(WCHAR);
-            unicodeName.Length = 0;
+    Data - Pointer to the filter callbackData.
+    MajorFunction - IRP major function code (create/read/write).
+    StreamContext - Stream context holding the file ID.
+    ProcessKey - Process table key of the calling process.
+    Key - Receives the key.
 
-            RtlAnsiStringToUnicodeString(&unicodeName, &ansiName, FALSE);
-        }
-    }
+Return Value:
 
-    //
-    //  Send notification to user mode and wait for reply
-    //
+    None.
 
-    replyLength = sizeof(reply);
-    timeout.QuadPart = -600000000LL;  // 60 second timeout (100ns units, negative = relative)
+--*/
+{
+    RtlZeroMemory(Key, sizeof(AVF_VERDICT_KEY));
 
-    status = FltSendMessage(gFilterHandle,
-                            &gClientPort,
-                            &notification,
-                            sizeof(notification),
-                            &reply,
-                            &replyLength,
-                            &timeout);
+    Key->FileId = StreamContext->FileId;
+    Key->ProcessKey = ProcessKey;
+    Key->MajorFunction = MajorFunction;
 
-    if (NT_SUCCESS(status)) {
-        //
-        //  Got a reply - check if we should block
-        //
-        if (reply.BlockOperation != 0) {
-            DbgPrint("AVF: Blocking operation on %wZ\n", &notification.FileName);
-            return TRUE;  // Block the operation
-        }
-    } else {
-        //
-        //  Failed to send or timeout - allow operation by default
-        //
-        if (status == STATUS_TIMEOUT) {
-            DbgPrint("AVF: Timeout waiting for user response\n");
-        } else if (status != STATUS_PORT_DISCONNECTED) {
-            DbgPrint("AVF: Failed to send notification, status=0x%x\n", status);
-        }
+    if (MajorFunction == IRP_MJ_CREATE) {
+        Key->DesiredAccess = Data->Iopb->Parameters.Create.SecurityContext->DesiredAccess;
+        Key->CreateDisposition = (Data->Iopb->Parameters.Create.Options >> 24) & 0xFF;
     }
-
-    return FALSE;  // Allow operation
 }
 
 
-FLT_PREOP_CALLBACK_STATUS
-AvfPreCreate(
-    _Inout_ PFLT_CALLBACK_DATA Data,
-    _In_ PCFLT_RELATED_OBJECTS FltObjects,
-    _Flt_CompletionContext_Outptr_ PVOID *CompletionContext
+BOOLEAN
+AvfCheckVerdictCache(
+    _In_ PFLT_CALLBACK_DATA Data,
+    _In_ UCHAR MajorFunction,
+    _In_ PAVF_STREAM_CONTEXT StreamContext,
+    _In_ PAVF_INSTANCE_CONTEXT InstanceContext,
+    _Out_ PBOOLEAN Block
     )
 /*++
 
 Routine Description:
 
-    Pre-create callback. Notifies userspace about file open/create access.
+    Looks up the verdict cache for an operation on a protected file and
+    updates the volume counters on a hit.
 
 Arguments:
 
     Data - Pointer to the filter callbackData.
-    FltObjects - Pointer to the FLT_RELATED_OBJECTS structure.
-    CompletionContext - Pointer to completion context.
+    MajorFunction - IRP major function code (create/read/write).
+    StreamContext - Stream context of the file.
+    InstanceContext - Instance context of the volume.
+    Block - Receives the cached verdict on a hit.
 
 Return Value:
 
-    FLT_PREOP_SUCCESS_NO_CALLBACK or FLT_PREOP_COMPLETE if blocked.
+    TRUE on a hit.
 
 --*/
 {
-    BOOLEAN shouldBlock;
-
-    UNREFERENCED_PARAMETER(CompletionContext);
+    AVF_VERDICT_KEY key;
+    ULONG processKey;
 
-    //
-    //  Skip kernel mode requests
-    //
+    *Block = FALSE;
 
-    if (Data->RequestorMode == KernelMode) {
-        return FLT_PREOP_SUCCESS_NO_CALLBACK;
+    if (!AvfLookupProcess(PsGetCurrentProcessId(), &processKey, NULL, 0, NULL)) {
+        return FALSE;
     }
 
-    //
-    //  Skip directory opens (we only care about files)
-    //
+    AvfBuildVerdictKey(Data, MajorFunction, StreamContext, processKey, &key);
 
-    if (FlagOn(Data->Iopb->Parameters.Create.Options, FILE_DIRECTORY_FILE)) {
-        return FLT_PREOP_SUCCESS_NO_CALLBACK;
+    if (!AvfLookupVerdict(&key, Block)) {
+        return FALSE;
     }
 
-    //
-    //  Send notification to userspace and check if we should block
-    //
-
-    shouldBlock = AvfSendNotification(Data, FltObjects, IRP_MJ_CREATE);
+    InterlockedIncrement64(&InstanceContext->CacheHits);
 
-    if (shouldBlock) {
-        //
-        //  Block the operation - return ACCESS_DENIED
-        //
-        Data->IoStatus.Status = STATUS_ACCESS_DENIED;
-        Data->IoStatus.Information = 0;
-        return FLT_PREOP_COMPLETE;
+    if (*Block) {
+        InterlockedIncrement64(&InstanceContext->Blocked);
     }
 
-    return FLT_PREOP_SUCCESS_NO_CALLBACK;
+    return TRUE;
 }
 
 
-FLT_PREOP_CALLBACK_STATUS
-AvfPreRead(
-    _Inout_ PFLT_CALLBACK_DATA Data,
+NTSTATUS
+AvfPendOperation(
+    _In_ PFLT_CALLBACK_DATA Data,
     _In_ PCFLT_RELATED_OBJECTS FltObjects,
-    _Flt_CompletionContext_Outptr_ PVOID *CompletionContext
+    _In_ UCHAR MajorFunction,
+    _In_ PFLT_FILE_NAME_INFORMATION NameInfo,
+    _In_ ULONG NotifyFlags,
+    _In_opt_ PAVF_STREAM_CONTEXT StreamContext,
+    _In_ BOOLEAN PostOperation
     )
 /*++
 
 Routine Description:
 
-    Pre-read callback. Notifies userspace about file read access.
+    Builds the notification for an operation and queues it for a verdict.
 
 Arguments:
 
     Data - Pointer to the filter callbackData.
     FltObjects - Pointer to the FLT_RELATED_OBJECTS structure.
-    CompletionContext - Pointer to completion context.
+    MajorFunction - IRP major function code (create/read/write).
+    NameInfo - Parsed name of the file.
+    NotifyFlags - AVF_NOTIFY_FLAG_* for the notification.
+    StreamContext - Stream context of the file, if known.  The verdict is
+                    only cached if it is.
+    PostOperation - TRUE if called from the post-create callback.
 
 Return Value:
 
-    FLT_PREOP_SUCCESS_NO_CALLBACK or FLT_PREOP_COMPLETE if blocked.
+    STATUS_PENDING if the operation was queued, otherwise see
+    AvfQueueRequest.
 
 --*/
 {
-    BOOLEAN shouldBlock;
+    NTSTATUS status;
+    PAVF_PENDED_REQUEST request;
+    PAVF_FILE_NOTIFICATION notification;
 
-    UNREFERENCED_PARAMETER(CompletionContext);
+    request = AvfAllocateRequest(Data, FltObjects->Instance);
+
+    if (request == NULL) {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    request->PostOperation = PostOperation;
 
     //
-    //  Skip kernel mode requests
+    //  Initialize notification structure
     //
 
-    if (Data->RequestorMode == KernelMode) {
-        return FLT_PREOP_SUCCESS_NO_CALLBACK;
-    }
+    notification = &request->Notification;
+    notification->Flags = NotifyFlags;
+    notification->ProcessId = (ULONG)(ULONG_PTR)PsGetCurrentProcessId();
+    notification->MajorFunction = MajorFunction;
 
     //
-    //  Skip paging I/O
+    //  What user mode needs to tell an interactive open from a service's
+    //  or a background copy's I/O
     //
 
-    if (FlagOn(Data->Iopb->IrpFlags, IRP_PAGING_IO)) {
-        return FLT_PREOP_SUCCESS_NO_CALLBACK;
+    notification->IoPriority = (UCHAR)FltGetIoPriorityHint(Data);
+
+    if (!NT_SUCCESS(FltGetRequestorSessionId(Data, &notification->SessionId))) {
+        notification->SessionId = AVF_SESSION_UNKNOWN;
+    }
+
+    if (MajorFunction == IRP_MJ_CREATE) {
+        notification->DesiredAccess = Data->Iopb->Parameters.Create.SecurityContext->DesiredAccess;
+        notification->ShareAccess = Data->Iopb->Parameters.Create.ShareAccess;
+        notification->CreateDisposition = (Data->Iopb->Parameters.Create.Options >> 24) & 0xFF;
+        notification->CreateOptions = Data->Iopb->Parameters.Create.Options & FILE_VALID_OPTION_FLAGS;
+    } else if (MajorFunction == IRP_MJ_READ) {
+        notification->Length = Data->Iopb->Parameters.Read.Length;
+    } else {
+        notification->Length = Data->Iopb->Parameters.Write.Length;
+    }
+
+    //
+    //  Copy file name
+    //
+
+    if (NameInfo->Name.Length < sizeof(notification->FileName) - sizeof(WCHAR)) {
+        RtlCopyMemory(notification->FileName,
+                      NameInfo->Name.Buffer,
+                      NameInfo->Name.Length);
+        notification->FileName[NameInfo->Name.Length / sizeof(WCHAR)] = L'\0';
+    }
+
+    //
+    //  Get process identity from the process table
+    //
+
+    AvfLookupProcess(PsGetCurrentProcessId(),
+                     &notification->ProcessKey,
+                     notification->ProcessName,
+                     sizeof(notification->ProcessName),
+                     &notification->Dropped);
+
+    //
+    //  Sample the file's epoch now, so that the verdict is not cached as
+    //  current if the file changes before it arrives
+    //
+
+    if (StreamContext != NULL) {
+
+        notification->FileId = StreamContext->FileId;
+        SetFlag(notification->Flags, AVF_NOTIFY_FLAG_FILE_ID_VALID);
+
+        if (notification->ProcessKey != 0) {
+
+            AvfBuildVerdictKey(Data,
+                               MajorFunction,
+                               StreamContext,
+                               notification->ProcessKey,
+                               &request->CacheKey);
+
+            request->FileEpoch = AvfGetFileEpoch(&StreamContext->FileId);
+            request->Cacheable = TRUE;
+        }
+
+        if (MajorFunction == IRP_MJ_WRITE) {
+            FltReferenceContext(StreamContext);
+            request->StreamContext = StreamContext;
+        }
+    }
+
+    status = AvfQueueRequest(request);
+
+    if (status != STATUS_PENDING) {
+        AvfDereferenceRequest(request);
+    }
+
+    return status;
+}
+
+
+FLT_PREOP_CALLBACK_STATUS
+AvfQueueNotification(
+    _Inout_ PFLT_CALLBACK_DATA Data,
+    _In_ PCFLT_RELATED_OBJECTS FltObjects,
+    _In_ UCHAR MajorFunction,
+    _Outptr_result_maybenull_ PVOID *CompletionContext
+    )
+/*++
+
+Routine Description:
+
+    Decides whether an operation needs a verdict from the user-mode
+    listener and, if so, pends it until the verdict arrives.
+
+    Files protected by ID are recognized from their stream context on
+    reads and writes.  On creates the file ID is not known until the file
+    is open, so the decision is left to the post-create callback unless
+    the create would overwrite the file.
+
+    Operations on protected files are answered from the verdict cache when
+    the same process already got a verdict for the same operation on the
+    file.
+
+Arguments:
+
+    Data - Pointer to the filter callbackData.
+    FltObjects - Pointer to the FLT_RELATED_OBJECTS structure.
+    MajorFunction - IRP major function code (create/read/write).
+    CompletionContext - Receives the referenced stream context of a write
+                        that is allowed, for AvfPostWrite.
+
+Return Value:
+
+    FLT_PREOP_SUCCESS_NO_CALLBACK - allow the operation now.
+    FLT_PREOP_SUCCESS_WITH_CALLBACK - decide in post-create, or invalidate
+                                      cached verdicts in post-write.
+    FLT_PREOP_PENDING - the operation was queued for a verdict.
+    FLT_PREOP_DISALLOW_FASTIO - reissue the operation as an IRP.
+    FLT_PREOP_COMPLETE - the operation was blocked or cancelled.
+
+--*/
+{
+    NTSTATUS status;
+    PAVF_INSTANCE_CONTEXT instanceContext = NULL;
+    PAVF_VOLUME_RULES rules = NULL;
+    PAVF_STREAM_CONTEXT streamContext = NULL;
+    PFLT_FILE_NAME_INFORMATION nameInfo = NULL;
+    FLT_PREOP_CALLBACK_STATUS callbackStatus = FLT_PREOP_SUCCESS_NO_CALLBACK;
+    UNICODE_STRING relativePath;
+    ULONG notifyFlags = 0;
+    ULONG disposition;
+    BOOLEAN block;
+
+    *CompletionContext = NULL;
+
+    //
+    //  Check if we have a client connected
+    //
+
+    if (gEngineConnections == 0) {
+        return FLT_PREOP_SUCCESS_NO_CALLBACK;  // No client, allow operation
+    }
+
+    //
+    //  Volumes without protected paths run in pass-through
+    //
+
+    status = FltGetInstanceContext(FltObjects->Instance, &instanceContext);
+
+    if (!NT_SUCCESS(status)) {
+        return FLT_PREOP_SUCCESS_NO_CALLBACK;
+    }
+
+    InterlockedIncrement64(&instanceContext->Operations);
+
+    rules = AvfGetInstanceRules(instanceContext);
+
+    if (rules == NULL) {
+        goto Cleanup;
+    }
+
+    //
+    //  Opens that can neither read nor change content are allowed here,
+    //  before paying for a name query
+    //
+
+    if (MajorFunction == IRP_MJ_CREATE &&
+        !AvfCreateNeedsReport(rules, Data)) {
+
+        InterlockedIncrement64(&instanceContext->CreatesFiltered);
+        goto Cleanup;
+    }
+
+    //
+    //  Reads and writes of a file protected by ID need no path match.  The
+    //  stream context is only created when the volume has ID rules; without
+    //  them an existing one is still picked up, since a write to a file
+    //  with cached verdicts must invalidate them.
+    //
+
+    if (MajorFunction != IRP_MJ_CREATE) {
+
+        if (AvfHasFileIdRules(rules)) {
+            status = AvfGetStreamContext(FltObjects->Instance, FltObjects->FileObject, &streamContext);
+        } else {
+            status = FltGetStreamContext(FltObjects->Instance, FltObjects->FileObject, &streamContext);
+        }
+
+        if (!NT_SUCCESS(status)) {
+            streamContext = NULL;
+        }
+
+        if (streamContext != NULL) {
+            notifyFlags = AvfGetStreamProtection(streamContext, rules);
+        }
+
+        if (notifyFlags == 0 && !rules->MonitorAll && rules->RuleCount == 0) {
+
+            goto Cleanup;  // Nothing else could match
+        }
+    }
+
+    //
+    //  In monitor-all mode only the operations picked by sampling, within
+    //  their process's rate, are reported.  The rest are allowed here,
+    //  before paying for a name query, and counted.
+    //
+
+    if (rules->MonitorAll && !AvfSampleOperation(rules, instanceContext)) {
+        goto Cleanup;
+    }
+
+    //
+    //  Get the file name
+    //
+
+    status = AvfGetParsedFileName(Data, &nameInfo);
+
+    if (!NT_SUCCESS(status)) {
+        goto Cleanup;  // Can't get name, allow operation
+    }
+
+    //
+    //  Match the volume-relative path, without any stream suffix, against
+    //  the volume's rules
+    //
+
+    if (notifyFlags == 0 && !rules->MonitorAll) {
+
+        relativePath.Buffer = Add2Ptr(nameInfo->Name.Buffer, nameInfo->Volume.Length);
+        relativePath.Length = nameInfo->Name.Length -
+                              nameInfo->Volume.Length -
+                              nameInfo->Stream.Length;
+        relativePath.MaximumLength = relativePath.Length;
+
+        if (AvfMatchPathRules(rules, &relativePath)) {
+
+            notifyFlags = AVF_NOTIFY_FLAG_RULE_MATCH;
+
+        } else if (MajorFunction == IRP_MJ_CREATE && AvfHasFileIdRules(rules)) {
+
+            //
+            //  Supersede and overwrite destroy the old content before a
+            //  post-create check could refuse them, so look those up by ID
+            //  now.  Every other create is checked once the file is open.
+            //
+
+            disposition = (Data->Iopb->Parameters.Create.Options >> 24) & 0xFF;
+
+            if (disposition != FILE_SUPERSEDE &&
+                disposition != FILE_OVERWRITE &&
+                disposition != FILE_OVERWRITE_IF) {
+
+                callbackStatus = FLT_PREOP_SUCCESS_WITH_CALLBACK;
+                goto Cleanup;
+            }
+
+            status = AvfGetStreamContextByName(FltObjects->Instance, &nameInfo->Name, &streamContext);
+
+            if (NT_SUCCESS(status)) {
+                notifyFlags = AvfGetStreamProtection(streamContext, rules);
+            } else {
+                streamContext = NULL;
+            }
+        }
+
+        if (notifyFlags == 0) {
+            goto Cleanup;  // Not protected, allow operation
+        }
+    }
+
+    if (FlagOn(notifyFlags, AVF_NOTIFY_FLAG_BLOOM_MATCH)) {
+        InterlockedIncrement64(&instanceContext->BloomPositives);
+    }
+
+    //
+    //  The file is (or, for a Bloom filter match, may be) protected.  Find
+    //  its ID and answer from the verdict cache if this process has asked
+    //  before.
+    //
+
+    if (notifyFlags != 0) {
+
+        if (streamContext == NULL) {
+
+            if (MajorFunction == IRP_MJ_CREATE) {
+                status = AvfGetStreamContextByName(FltObjects->Instance, &nameInfo->Name, &streamContext);
+            } else {
+                status = AvfGetStreamContext(FltObjects->Instance, FltObjects->FileObject, &streamContext);
+            }
+
+            if (!NT_SUCCESS(status)) {
+                streamContext = NULL;  // Not cacheable, e.g. a new file
+            }
+        }
+
+        if (streamContext != NULL &&
+            AvfCheckVerdictCache(Data, MajorFunction, streamContext, instanceContext, &block)) {
+
+            if (block) {
+                Data->IoStatus.Status = STATUS_ACCESS_DENIED;
+                Data->IoStatus.Information = 0;
+                callbackStatus = FLT_PREOP_COMPLETE;
+            }
+
+            goto Cleanup;
+        }
+    }
+
+    //
+    //  Only IRP-based operations can be pended.  Fast I/O on a protected
+    //  file is sent back down as an IRP.
+    //
+
+    if (!FLT_IS_IRP_OPERATION(Data)) {
+
+        if (FLT_IS_FASTIO_OPERATION(Data)) {
+            callbackStatus = FLT_PREOP_DISALLOW_FASTIO;
+        }
+
+        goto Cleanup;
     }
 
     //
-    //  Send notification to userspace and check if we should block
+    //  A pended read or write is resumed in another process's context (the
+    //  verdict comes in on avf.exe's thread, or on a dispatcher thread), so
+    //  the file system must not be left to use the caller's user buffer
+    //  address.  Lock the buffer down into an MDL now; a buffer that cannot
+    //  be locked would fail the operation in the file system anyway.
     //
 
-    shouldBlock = AvfSendNotification(Data, FltObjects, IRP_MJ_READ);
+    if (MajorFunction != IRP_MJ_CREATE) {
+
+        status = FltLockUserBuffer(Data);
+
+        if (!NT_SUCCESS(status)) {
+
+            Data->IoStatus.Status = status;
+            Data->IoStatus.Information = 0;
+            callbackStatus = FLT_PREOP_COMPLETE;
+            goto Cleanup;
+        }
+    }
+
+    //
+    //  Pend the operation until user mode answers
+    //
+
+    status = AvfPendOperation(Data,
+                              FltObjects,
+                              MajorFunction,
+                              nameInfo,
+                              notifyFlags,
+                              streamContext,
+                              FALSE);
+
+    if (status == STATUS_PENDING) {
+
+        InterlockedIncrement64(&instanceContext->Notified);
+        callbackStatus = FLT_PREOP_PENDING;
+
+    } else if (status == STATUS_CANCELLED) {
+
+        Data->IoStatus.Status = STATUS_CANCELLED;
+        Data->IoStatus.Information = 0;
+        callbackStatus = FLT_PREOP_COMPLETE;
+    }
+
+Cleanup:
+
+    if (streamContext != NULL) {
 
-    if (shouldBlock) {
         //
-        //  Block the operation - return ACCESS_DENIED
+        //  A write that goes ahead now invalidates cached verdicts for the
+        //  file once it completes
         //
-        Data->IoStatus.Status = STATUS_ACCESS_DENIED;
-        Data->IoStatus.Information = 0;
-        return FLT_PREOP_COMPLETE;
+
+        if (MajorFunction == IRP_MJ_WRITE &&
+            callbackStatus == FLT_PREOP_SUCCESS_NO_CALLBACK) {
+
+            *CompletionContext = streamContext;
+            callbackStatus = FLT_PREOP_SUCCESS_WITH_CALLBACK;
+
+        } else {
+
+            FltReleaseContext(streamContext);
+        }
+    }
+
+    if (nameInfo != NULL) {
+        FltReleaseFileNameInformation(nameInfo);
     }
 
-    return FLT_PREOP_SUCCESS_NO_CALLBACK;
+    if (rules != NULL) {
+        AvfReleaseVolumeRules(rules);
+    }
+
+    FltReleaseContext(instanceContext);
+
+    return callbackStatus;
 }
 
 
 FLT_PREOP_CALLBACK_STATUS
-AvfPreWrite(
+AvfPreCreate(
     _Inout_ PFLT_CALLBACK_DATA Data,
     _In_ PCFLT_RELATED_OBJECTS FltObjects,
     _Flt_CompletionContext_Outptr_ PVOID *CompletionContext
@@ -665,7 +1219,9 @@ AvfPreWrite(
 
 Routine Description:
 
-    Pre-write callback. Notifies userspace about file write access.
+    Pre-create callback. Notifies userspace about file open/create access.
+    Opens the policy's create filter finds harmless (for example
+    attribute-only opens) are allowed without a notification.
 
 Arguments:
 
@@ -675,14 +1231,182 @@ Arguments:
 
 Return Value:
 
-    FLT_PREOP_SUCCESS_NO_CALLBACK or FLT_PREOP_COMPLETE if blocked.
+    FLT_PREOP_PENDING if the operation waits for a verdict, otherwise see
+    AvfQueueNotification.
+
+--*/
+{
+    //
+    //  Skip kernel mode requests
+    //
+
+    if (Data->RequestorMode == KernelMode) {
+        return FLT_PREOP_SUCCESS_NO_CALLBACK;
+    }
+
+    //
+    //  Skip directory opens (we only care about files)
+    //
+
+    if (FlagOn(Data->Iopb->Parameters.Create.Options, FILE_DIRECTORY_FILE)) {
+        return FLT_PREOP_SUCCESS_NO_CALLBACK;
+    }
+
+    //
+    //  Pend the operation until userspace decides whether to block it
+    //
+
+    return AvfQueueNotification(Data, FltObjects, IRP_MJ_CREATE, CompletionContext);
+}
+
+
+FLT_POSTOP_CALLBACK_STATUS
+AvfPostCreate(
+    _Inout_ PFLT_CALLBACK_DATA Data,
+    _In_ PCFLT_RELATED_OBJECTS FltObjects,
+    _In_opt_ PVOID CompletionContext,
+    _In_ FLT_POST_OPERATION_FLAGS Flags
+    )
+/*++
+
+Routine Description:
+
+    Post-create callback.  Only requested by AvfPreCreate for opens on
+    volumes with file ID rules that no path rule matched.  Now that the
+    file is open its ID is known; if it is (or, by the Bloom filter, may
+    be) protected, the create is answered from the verdict cache or pended
+    for a verdict, and cancelled with FltCancelFileOpen if it is blocked.
+
+Arguments:
+
+    Data - Pointer to the filter callbackData.
+    FltObjects - Pointer to the FLT_RELATED_OBJECTS structure.
+    CompletionContext - Not used.
+    Flags - Post-operation flags.
+
+Return Value:
+
+    FLT_POSTOP_MORE_PROCESSING_REQUIRED if the create waits for a verdict,
+    FLT_POSTOP_FINISHED_PROCESSING otherwise.
 
 --*/
 {
-    BOOLEAN shouldBlock;
+    NTSTATUS status;
+    PAVF_INSTANCE_CONTEXT instanceContext = NULL;
+    PAVF_VOLUME_RULES rules;
+    PAVF_STREAM_CONTEXT streamContext = NULL;
+    PFLT_FILE_NAME_INFORMATION nameInfo = NULL;
+    FLT_POSTOP_CALLBACK_STATUS callbackStatus = FLT_POSTOP_FINISHED_PROCESSING;
+    ULONG notifyFlags = 0;
+    BOOLEAN block;
 
     UNREFERENCED_PARAMETER(CompletionContext);
 
+    if (FlagOn(Flags, FLTFL_POST_OPERATION_DRAINING) ||
+        !NT_SUCCESS(Data->IoStatus.Status) ||
+        Data->IoStatus.Status == STATUS_REPARSE ||
+        gEngineConnections == 0) {
+
+        return FLT_POSTOP_FINISHED_PROCESSING;
+    }
+
+    status = FltGetInstanceContext(FltObjects->Instance, &instanceContext);
+
+    if (!NT_SUCCESS(status)) {
+        return FLT_POSTOP_FINISHED_PROCESSING;
+    }
+
+    rules = AvfGetInstanceRules(instanceContext);
+
+    if (rules == NULL) {
+        FltReleaseContext(instanceContext);
+        return FLT_POSTOP_FINISHED_PROCESSING;
+    }
+
+    status = AvfGetStreamContext(FltObjects->Instance, FltObjects->FileObject, &streamContext);
+
+    if (NT_SUCCESS(status)) {
+        notifyFlags = AvfGetStreamProtection(streamContext, rules);
+    }
+
+    AvfReleaseVolumeRules(rules);
+
+    if (notifyFlags == 0) {
+        goto Cleanup;
+    }
+
+    if (FlagOn(notifyFlags, AVF_NOTIFY_FLAG_BLOOM_MATCH)) {
+        InterlockedIncrement64(&instanceContext->BloomPositives);
+    }
+
+    if (AvfCheckVerdictCache(Data, IRP_MJ_CREATE, streamContext, instanceContext, &block)) {
+
+        if (block) {
+            FltCancelFileOpen(FltObjects->Instance, FltObjects->FileObject);
+            Data->IoStatus.Status = STATUS_ACCESS_DENIED;
+            Data->IoStatus.Information = 0;
+        }
+
+        goto Cleanup;
+    }
+
+    status = AvfGetParsedFileName(Data, &nameInfo);
+
+    if (NT_SUCCESS(status)) {
+
+        status = AvfPendOperation(Data,
+                                  FltObjects,
+                                  IRP_MJ_CREATE,
+                                  nameInfo,
+                                  notifyFlags,
+                                  streamContext,
+                                  TRUE);
+
+        FltReleaseFileNameInformation(nameInfo);
+
+        if (status == STATUS_PENDING) {
+            InterlockedIncrement64(&instanceContext->Notified);
+            callbackStatus = FLT_POSTOP_MORE_PROCESSING_REQUIRED;
+        }
+    }
+
+Cleanup:
+
+    if (streamContext != NULL) {
+        FltReleaseContext(streamContext);
+    }
+
+    FltReleaseContext(instanceContext);
+
+    return callbackStatus;
+}
+
+
+FLT_PREOP_CALLBACK_STATUS
+AvfPreRead(
+    _Inout_ PFLT_CALLBACK_DATA Data,
+    _In_ PCFLT_RELATED_OBJECTS FltObjects,
+    _Flt_CompletionContext_Outptr_ PVOID *CompletionContext
+    )
+/*++
+
+Routine Description:
+
+    Pre-read callback. Notifies userspace about file read access.
+
+Arguments:
+
+    Data - Pointer to the filter callbackData.
+    FltObjects - Pointer to the FLT_RELATED_OBJECTS structure.
+    CompletionContext - Pointer to completion context.
+
+Return Value:
+
+    FLT_PREOP_PENDING if the operation waits for a verdict, otherwise see
+    AvfQueueNotification.
+
+--*/
+{
     //
     //  Skip kernel mode requests
     //
@@ -700,21 +1424,194 @@ Return Value:
     }
 
     //
-    //  Send notification to userspace and check if we should block
+    //  Pend the operation until userspace decides whether to block it
     //
 
-    shouldBlock = AvfSendNotification(Data, FltObjects, IRP_MJ_WRITE);
+    return AvfQueueNotification(Data, FltObjects, IRP_MJ_READ, CompletionContext);
+}
+
 
-    if (shouldBlock) {
-        //
-        //  Block the operation - return ACCESS_DENIED
-        //
-        Data->IoStatus.Status = STATUS_ACCESS_DENIED;
-        Data->IoStatus.Information = 0;
-        return FLT_PREOP_COMPLETE;
+FLT_PREOP_CALLBACK_STATUS
+AvfPreWrite(
+    _Inout_ PFLT_CALLBACK_DATA Data,
+    _In_ PCFLT_RELATED_OBJECTS FltObjects,
+    _Flt_CompletionContext_Outptr_ PVOID *CompletionContext
+    )
+/*++
+
+Routine Description:
+
+    Pre-write callback. Notifies userspace about file write access.
+    Every successful write invalidates the cached verdicts of its file in
+    AvfPostModify.
+
+Arguments:
+
+    Data - Pointer to the filter callbackData.
+    FltObjects - Pointer to the FLT_RELATED_OBJECTS structure.
+    CompletionContext - Pointer to completion context.
+
+Return Value:
+
+    FLT_PREOP_PENDING if the operation waits for a verdict, otherwise see
+    AvfQueueNotification.
+
+--*/
+{
+    //
+    //  Kernel mode and paging writes are not reported, but still
+    //  invalidate cached verdicts
+    //
+
+    if (Data->RequestorMode == KernelMode ||
+        FlagOn(Data->Iopb->IrpFlags, IRP_PAGING_IO)) {
+
+        return AvfWatchModification(FltObjects, CompletionContext);
+    }
+
+    //
+    //  Pend the operation until userspace decides whether to block it
+    //
+
+    return AvfQueueNotification(Data, FltObjects, IRP_MJ_WRITE, CompletionContext);
+}
+
+
+FLT_PREOP_CALLBACK_STATUS
+AvfWatchModification(
+    _In_ PCFLT_RELATED_OBJECTS FltObjects,
+    _Outptr_result_maybenull_ PVOID *CompletionContext
+    )
+/*++
+
+Routine Description:
+
+    Arranges for AvfPostModify to invalidate the cached verdicts of a file
+    that is being changed.  Only files that already have a stream context
+    can have cached verdicts, so no context is created here.
+
+Arguments:
+
+    FltObjects - Pointer to the FLT_RELATED_OBJECTS structure.
+    CompletionContext - Receives the referenced stream context.
+
+Return Value:
+
+    FLT_PREOP_SUCCESS_WITH_CALLBACK if the file has a stream context,
+    FLT_PREOP_SUCCESS_NO_CALLBACK otherwise.
+
+--*/
+{
+    PAVF_STREAM_CONTEXT streamContext;
+
+    *CompletionContext = NULL;
+
+    if (!NT_SUCCESS(FltGetStreamContext(FltObjects->Instance,
+                                        FltObjects->FileObject,
+                                        &streamContext))) {
+        return FLT_PREOP_SUCCESS_NO_CALLBACK;
     }
 
-    return FLT_PREOP_SUCCESS_NO_CALLBACK;
+    *CompletionContext = streamContext;
+    return FLT_PREOP_SUCCESS_WITH_CALLBACK;
+}
+
+
+FLT_PREOP_CALLBACK_STATUS
+AvfPreSetInformation(
+    _Inout_ PFLT_CALLBACK_DATA Data,
+    _In_ PCFLT_RELATED_OBJECTS FltObjects,
+    _Flt_CompletionContext_Outptr_ PVOID *CompletionContext
+    )
+/*++
+
+Routine Description:
+
+    Pre-set-information callback.  Renames, new links, deletes, attribute
+    and size changes invalidate the cached verdicts of the file.  They are
+    not reported to userspace.
+
+Arguments:
+
+    Data - Pointer to the filter callbackData.
+    FltObjects - Pointer to the FLT_RELATED_OBJECTS structure.
+    CompletionContext - Receives the stream context for AvfPostModify.
+
+Return Value:
+
+    See AvfWatchModification.
+
+--*/
+{
+    *CompletionContext = NULL;
+
+    switch (Data->Iopb->Parameters.SetFileInformation.FileInformationClass) {
+
+    case FileBasicInformation:
+    case FileRenameInformation:
+    case FileRenameInformationEx:
+    case FileLinkInformation:
+    case FileLinkInformationEx:
+    case FileDispositionInformation:
+    case FileDispositionInformationEx:
+    case FileEndOfFileInformation:
+    case FileAllocationInformation:
+    case FileValidDataLengthInformation:
+        return AvfWatchModification(FltObjects, CompletionContext);
+
+    default:
+        return FLT_PREOP_SUCCESS_NO_CALLBACK;
+    }
+}
+
+
+FLT_POSTOP_CALLBACK_STATUS
+AvfPostModify(
+    _Inout_ PFLT_CALLBACK_DATA Data,
+    _In_ PCFLT_RELATED_OBJECTS FltObjects,
+    _In_opt_ PVOID CompletionContext,
+    _In_ FLT_POST_OPERATION_FLAGS Flags
+    )
+/*++
+
+Routine Description:
+
+    Post-write and post-set-information callback.  Invalidates the cached
+    verdicts of a file that was changed.  May run at DISPATCH_LEVEL.
+
+Arguments:
+
+    Data - Pointer to the filter callbackData.
+    FltObjects - Pointer to the FLT_RELATED_OBJECTS structure.
+    CompletionContext - Referenced stream context of the file.
+    Flags - Post-operation flags.
+
+Return Value:
+
+    FLT_POSTOP_FINISHED_PROCESSING.
+
+--*/
+{
+    PAVF_STREAM_CONTEXT streamContext = CompletionContext;
+
+    UNREFERENCED_PARAMETER(Data);
+    UNREFERENCED_PARAMETER(FltObjects);
+    UNREFERENCED_PARAMETER(Flags);
+
+    if (streamContext == NULL) {
+        return FLT_POSTOP_FINISHED_PROCESSING;
+    }
+
+    //
+    //  Invalidate even if the operation failed, since a write can fail
+    //  after changing part of the file
+    //
+
+    AvfInvalidateFile(&streamContext->FileId);
+
+    FltReleaseContext(streamContext);
+
+    return FLT_POSTOP_FINISHED_PROCESSING;
 }
 
 
@@ -731,29 +1628,70 @@ AvfPortConnect(
 Routine Description:
 
     Called when a user-mode application connects to the communication port.
+    The client connects once for its commands and once for each of its
+    engine workers.
 
 Arguments:
 
     ClientPort - Client port that will be used to send messages.
     ServerPortCookie - Not used.
-    ConnectionContext - Context data from the connection request.
+    ConnectionContext - AVF_ENGINE_CONNECT for an engine connection, else NULL.
     SizeOfContext - Size of the context data.
     ConnectionCookie - Returned connection cookie.
 
 Return Value:
 
-    STATUS_SUCCESS
+    STATUS_SUCCESS, STATUS_INVALID_PARAMETER for a malformed engine
+    connection context, or STATUS_CONNECTION_COUNT_LIMIT if the client is
+    already connected or has no engine connection slot left.
 
 --*/
 {
+    NTSTATUS status;
+    BOOLEAN first;
+    ULONG slot;
+
     UNREFERENCED_PARAMETER(ServerPortCookie);
-    UNREFERENCED_PARAMETER(ConnectionContext);
-    UNREFERENCED_PARAMETER(SizeOfContext);
 
-    gClientPort = ClientPort;
-    *ConnectionCookie = NULL;
+    //
+    //  Without a context this is the client's command connection, of
+    //  which there is one
+    //
+
+    if (ConnectionContext == NULL) {
+
+        if (InterlockedCompareExchangePointer(&gClientPort, ClientPort, NULL) != NULL) {
+            return STATUS_CONNECTION_COUNT_LIMIT;
+        }
+
+        *ConnectionCookie = NULL;
+
+        DbgPrint("AVF: Client connected\n");
+        return STATUS_SUCCESS;
+    }
+
+    if (SizeOfContext < sizeof(AVF_ENGINE_CONNECT) ||
+        ((PAVF_ENGINE_CONNECT)ConnectionContext)->Size != sizeof(AVF_ENGINE_CONNECT)) {
+
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    status = AvfAddEnginePort(ClientPort, ConnectionContext, &slot, &first);
+
+    if (!NT_SUCCESS(status)) {
+        return status;
+    }
+
+    *ConnectionCookie = (PVOID)(ULONG_PTR)(slot + 1);
+
+    //
+    //  Verdicts from an earlier client do not carry over
+    //
+
+    if (first) {
+        AvfInvalidateVerdictCache();
+    }
 
-    DbgPrint("AVF: Client connected\n");
     return STATUS_SUCCESS;
 }
 
@@ -770,7 +1708,8 @@ Routine Description:
 
 Arguments:
 
-    ConnectionCookie - Connection cookie (not used).
+    ConnectionCookie - NULL for the command connection, else one more
+                       than the engine connection's slot.
 
 Return Value:
 
@@ -778,12 +1717,23 @@ Return Value:
 
 --*/
 {
-    UNREFERENCED_PARAMETER(ConnectionCookie);
+    if (ConnectionCookie == NULL) {
+
+        FltCloseClientPort(gFilterHandle, &gClientPort);
+        gClientPort = NULL;
 
-    FltCloseClientPort(gFilterHandle, &gClientPort);
-    gClientPort = NULL;
+        DbgPrint("AVF: Client disconnected\n");
+        return;
+    }
+
+    //
+    //  No verdicts will arrive for what is still pended once the last
+    //  engine connection is gone
+    //
 
-    DbgPrint("AVF: Client disconnected\n");
+    if (AvfRemoveEnginePort((ULONG)(ULONG_PTR)ConnectionCookie - 1)) {
+        AvfFlushRequests(NULL);
+    }
 }
 
 
@@ -817,7 +1767,11 @@ Return Value:
 
 --*/
 {
-    PCOMMAND_MESSAGE command;
+    NTSTATUS status = STATUS_SUCCESS;
+    AVF_COMMAND command;
+    AVF_VERDICT verdict;
+    PVOID data;
+    ULONG dataLength;
 
     UNREFERENCED_PARAMETER(PortCookie);
 
@@ -827,22 +1781,114 @@ Return Value:
         return STATUS_INVALID_PARAMETER;
     }
 
-    command = (PCOMMAND_MESSAGE)InputBuffer;
+    //
+    //  The input and output buffers are raw user-mode memory.  FltMgr has
+    //  already probed them, but they must still be accessed under try/except.
+    //
+
+    __try {
+
+        command = ((PCOMMAND_MESSAGE)InputBuffer)->Command;
 
-    switch (command->Command) {
+    } __except (EXCEPTION_EXECUTE_HANDLER) {
+
+        return GetExceptionCode();
+    }
+
+    switch (command) {
 
     case GetAvfVersion:
         if (OutputBuffer != NULL && OutputBufferLength >= sizeof(AVFVER)) {
-            PAVFVER version = (PAVFVER)OutputBuffer;
-            version->Major = AVF_MAJ_VERSION;
-            version->Minor = AVF_MIN_VERSION;
-            *ReturnOutputBufferLength = sizeof(AVFVER);
+            __try {
+                PAVFVER version = (PAVFVER)OutputBuffer;
+                version->Major = AVF_MAJ_VERSION;
+                version->Minor = AVF_MIN_VERSION;
+                *ReturnOutputBufferLength = sizeof(AVFVER);
+            } __except (EXCEPTION_EXECUTE_HANDLER) {
+                status = GetExceptionCode();
+            }
+        }
+        break;
+
+    case SetAvfPolicy:
+
+        //
+        //  Capture the policy before parsing it so user mode cannot change
+        //  it underneath us
+        //
+
+        dataLength = InputBufferLength - FIELD_OFFSET(COMMAND_MESSAGE, Data);
+
+        if (dataLength > AVF_MAX_POLICY_SIZE) {
+            status = STATUS_INVALID_PARAMETER;
+            break;
+        }
+
+        data = ExAllocatePoolZero(PagedPool, max(dataLength, sizeof(ULONG)), AVF_POLICY_TAG);
+
+        if (data == NULL) {
+            status = STATUS_INSUFFICIENT_RESOURCES;
+            break;
+        }
+
+        __try {
+            RtlCopyMemory(data, ((PCOMMAND_MESSAGE)InputBuffer)->Data, dataLength);
+        } __except (EXCEPTION_EXECUTE_HANDLER) {
+            status = GetExceptionCode();
+        }
+
+        if (NT_SUCCESS(status)) {
+            status = AvfSetPolicy(data, dataLength);
+        }
+
+        ExFreePoolWithTag(data, AVF_POLICY_TAG);
+        break;
+
+    case ReplyVerdict:
+        if (InputBufferLength < FIELD_OFFSET(COMMAND_MESSAGE, Data) + sizeof(AVF_VERDICT)) {
+            status = STATUS_INVALID_PARAMETER;
+            break;
+        }
+
+        __try {
+            RtlCopyMemory(&verdict, ((PCOMMAND_MESSAGE)InputBuffer)->Data, sizeof(verdict));
+        } __except (EXCEPTION_EXECUTE_HANDLER) {
+            status = GetExceptionCode();
+            break;
+        }
+
+        //
+        //  An audited verdict is for an operation completed already by a
+        //  speculative one, which only ever allows
+        //
+
+        if (FlagOn(verdict.Flags, AVF_VERDICT_FLAG_AUDITED)) {
+            status = AvfCompleteAudit(verdict.RequestId, verdict.BlockOperation != 0);
+        } else if (FlagOn(verdict.Flags, AVF_VERDICT_FLAG_SPECULATIVE) && verdict.BlockOperation != 0) {
+            status = STATUS_INVALID_PARAMETER;
+        } else {
+            status = AvfCompleteVerdict(verdict.RequestId,
+                                        verdict.BlockOperation != 0,
+                                        BooleanFlagOn(verdict.Flags, AVF_VERDICT_FLAG_SPECULATIVE),
+                                        BooleanFlagOn(verdict.Flags, AVF_VERDICT_FLAG_NO_CACHE));
         }
         break;
 
-        default:
+    case GetVolumeStatistics:
+        if (OutputBuffer == NULL) {
+            status = STATUS_INVALID_PARAMETER;
             break;
+        }
+
+        status = AvfGetVolumeStatistics(OutputBuffer,
+                                        OutputBufferLength,
+                                        ReturnOutputBufferLength);
+        break;
+
+    default:
+        status = STATUS_INVALID_PARAMETER;
+        break;
     }
 
-    return STATUS_SUCCESS;
+    return status;
 }
@@ -0,0 +1,499 @@
+/*++
+
+Copyright (c) 1989-2002  Microsoft Corporation
+Modified for AV Filter functionality
+
+Module Name:
+
+    avfCache.c
+
+Abstract:
+
+    This module caches user-mode verdicts so that a process which opens,
+    reads or writes the same protected file again is answered in the
+    pre-operation callback instead of another round trip to user mode.
+
+    The cache is a fixed-size, two-way set associative table.  Each entry
+    is guarded by a sequence count that is odd while the entry is being
+    rewritten, so lookups take no lock and simply miss if they race with
+    an update.
+
+    Entries are never removed one by one.  Instead every entry records the
+    cache epoch and the epoch of its file when the operation was seen:
+
+    - The cache epoch is bumped when the policy or the client changes,
+      which invalidates every entry.
+
+    - File epochs live in a small table indexed by a hash of the file ID
+      and are bumped when a file is written, renamed, linked, deleted or
+      has its attributes changed.  Files sharing a bucket invalidate each
+      other, which only costs a cache miss.
+
+    Operations the client allowed speculatively leave their key in the
+    audit table, so that the consultant's verdict, which comes later, can
+    still be cached under it.
+
+Environment:
+
+    Kernel mode
+
+--*/
+
+#include <fltKernel.h>
+#include <dontuse.h>
+#include <suppress.h>
+#include "avfKern.h"
+
+typedef struct _AVF_VERDICT_ENTRY {
+
+    //
+    //  Odd while the entry is being written.  Zero if never written.
+    //
+
+    volatile LONG Sequence;
+
+    ULONG CacheEpoch;
+    ULONG FileEpoch;
+    BOOLEAN Block;
+
+    AVF_VERDICT_KEY Key;
+
+} AVF_VERDICT_ENTRY, *PAVF_VERDICT_ENTRY;
+
+//
+//  The key of an operation allowed speculatively, guarded by a sequence
+//  count like a cache entry
+//
+
+typedef struct _AVF_AUDIT_ENTRY {
+
+    volatile LONG Sequence;
+
+    ULONG RequestId;
+    ULONG CacheEpoch;
+    ULONG FileEpoch;
+
+    AVF_VERDICT_KEY Key;
+
+} AVF_AUDIT_ENTRY, *PAVF_AUDIT_ENTRY;
+
+//
+//  Cache state.  The cache epoch starts at one so that never-written
+//  entries do not match.
+//
+
+AVF_VERDICT_ENTRY gVerdictCache[AVF_VERDICT_CACHE_SIZE];
+volatile LONG gVerdictCacheEpoch = 1;
+volatile LONG gFileEpochs[AVF_FILE_EPOCH_BUCKETS];
+AVF_AUDIT_ENTRY gAuditTable[AVF_AUDIT_TABLE_SIZE];
+
+//
+//  Function prototypes
+//
+
+ULONG
+AvfHash(
+    _In_reads_bytes_(Length) PVOID Buffer,
+    _In_ ULONG Length
+    );
+
+BOOLEAN
+AvfReadVerdictEntry(
+    _In_ PAVF_VERDICT_ENTRY Entry,
+    _Out_ PAVF_VERDICT_ENTRY Copy
+    );
+
+//
+//  The cache is used from pre-operation callbacks at up to APC_LEVEL and
+//  from post-write at up to DISPATCH_LEVEL, so none of it is pageable
+//
+
+
+ULONG
+AvfHash(
+    _In_reads_bytes_(Length) PVOID Buffer,
+    _In_ ULONG Length
+    )
+/*++
+
+Routine Description:
+
+    FNV-1a hash of a buffer.
+
+Arguments:
+
+    Buffer - The bytes to hash.
+    Length - Number of bytes.
+
+Return Value:
+
+    The hash.
+
+--*/
+{
+    PUCHAR bytes = (PUCHAR)Buffer;
+    ULONG hash = 2166136261;
+    ULONG i;
+
+    for (i = 0; i < Length; i++) {
+        hash ^= bytes[i];
+        hash *= 16777619;
+    }
+
+    return hash;
+}
+
+
+ULONG
+AvfGetFileEpoch(
+    _In_ PFILE_ID_128 FileId
+    )
+/*++
+
+Routine Description:
+
+    Returns the invalidation count of a file.  Callers sample it before
+    asking user mode, so a verdict for a file that changed while the
+    question was outstanding is never cached as current.
+
+Arguments:
+
+    FileId - The file ID.
+
+Return Value:
+
+    The file's epoch.
+
+--*/
+{
+    return (ULONG)gFileEpochs[AvfHash(FileId, sizeof(FILE_ID_128)) & (AVF_FILE_EPOCH_BUCKETS - 1)];
+}
+
+
+VOID
+AvfInvalidateFile(
+    _In_ PFILE_ID_128 FileId
+    )
+/*++
+
+Routine Description:
+
+    Invalidates every cached verdict for a file.
+
+Arguments:
+
+    FileId - The file ID.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    InterlockedIncrement(&gFileEpochs[AvfHash(FileId, sizeof(FILE_ID_128)) & (AVF_FILE_EPOCH_BUCKETS - 1)]);
+}
+
+
+VOID
+AvfInvalidateVerdictCache(
+    VOID
+    )
+/*++
+
+Routine Description:
+
+    Invalidates every cached verdict.  Called when the policy is replaced
+    and when the user-mode client connects or disconnects.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    InterlockedIncrement(&gVerdictCacheEpoch);
+}
+
+
+BOOLEAN
+AvfReadVerdictEntry(
+    _In_ PAVF_VERDICT_ENTRY Entry,
+    _Out_ PAVF_VERDICT_ENTRY Copy
+    )
+/*++
+
+Routine Description:
+
+    Takes a consistent copy of a cache entry without locking.
+
+Arguments:
+
+    Entry - The entry.
+    Copy - Receives the copy.
+
+Return Value:
+
+    FALSE if the entry is being written or was rewritten during the copy.
+
+--*/
+{
+    LONG sequence;
+
+    sequence = Entry->Sequence;
+    KeMemoryBarrier();
+
+    if (sequence == 0 || (sequence & 1) != 0) {
+        return FALSE;
+    }
+
+    Copy->CacheEpoch = Entry->CacheEpoch;
+    Copy->FileEpoch = Entry->FileEpoch;
+    Copy->Block = Entry->Block;
+    Copy->Key = Entry->Key;
+
+    KeMemoryBarrier();
+
+    return (BOOLEAN)(Entry->Sequence == sequence);
+}
+
+
+BOOLEAN
+AvfLookupVerdict(
+    _In_ PAVF_VERDICT_KEY Key,
+    _Out_ PBOOLEAN Block
+    )
+/*++
+
+Routine Description:
+
+    Looks up a cached verdict.
+
+Arguments:
+
+    Key - The key.  Unused fields must be zero.
+    Block - Receives the cached verdict on a hit.
+
+Return Value:
+
+    TRUE on a hit.
+
+--*/
+{
+    AVF_VERDICT_ENTRY copy;
+    ULONG set;
+    ULONG way;
+
+    set = AvfHash(Key, sizeof(AVF_VERDICT_KEY)) & (AVF_VERDICT_CACHE_SIZE - 2);
+
+    for (way = 0; way < 2; way++) {
+
+        if (!AvfReadVerdictEntry(&gVerdictCache[set + way], &copy)) {
+            continue;
+        }
+
+        if (copy.CacheEpoch == (ULONG)gVerdictCacheEpoch &&
+            RtlEqualMemory(&copy.Key, Key, sizeof(AVF_VERDICT_KEY)) &&
+            copy.FileEpoch == AvfGetFileEpoch(&Key->FileId)) {
+
+            *Block = copy.Block;
+            return TRUE;
+        }
+    }
+
+    return FALSE;
+}
+
+
+VOID
+AvfInsertVerdict(
+    _In_ PAVF_VERDICT_KEY Key,
+    _In_ ULONG FileEpoch,
+    _In_ BOOLEAN Block
+    )
+/*++
+
+Routine Description:
+
+    Caches a verdict.  Replaces the entry for the same key if there is
+    one, otherwise a stale entry, otherwise the older-looking of the two
+    entries in the set.  If another thread is writing the chosen entry
+    the verdict is simply not cached.
+
+Arguments:
+
+    Key - The key.  Unused fields must be zero.
+    FileEpoch - The file's epoch when the operation was seen.
+    Block - The verdict.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    PAVF_VERDICT_ENTRY entry = NULL;
+    AVF_VERDICT_ENTRY copy;
+    ULONG hash;
+    ULONG set;
+    ULONG way;
+    LONG sequence;
+
+    hash = AvfHash(Key, sizeof(AVF_VERDICT_KEY));
+    set = hash & (AVF_VERDICT_CACHE_SIZE - 2);
+
+    for (way = 0; way < 2; way++) {
+
+        if (!AvfReadVerdictEntry(&gVerdictCache[set + way], &copy) ||
+            copy.CacheEpoch != (ULONG)gVerdictCacheEpoch) {
+
+            if (entry == NULL) {
+                entry = &gVerdictCache[set + way];
+            }
+
+        } else if (RtlEqualMemory(&copy.Key, Key, sizeof(AVF_VERDICT_KEY))) {
+
+            entry = &gVerdictCache[set + way];
+            break;
+        }
+    }
+
+    if (entry == NULL) {
+        entry = &gVerdictCache[set + ((hash >> 16) & 1)];
+    }
+
+    sequence = entry->Sequence;
+
+    if ((sequence & 1) != 0 ||
+        InterlockedCompareExchange(&entry->Sequence, sequence + 1, sequence) != sequence) {
+        return;
+    }
+
+    entry->CacheEpoch = (ULONG)gVerdictCacheEpoch;
+    entry->FileEpoch = FileEpoch;
+    entry->Block = Block;
+    entry->Key = *Key;
+
+    KeMemoryBarrier();
+    InterlockedIncrement(&entry->Sequence);
+}
+
+
+VOID
+AvfRememberAudit(
+    _In_ ULONG RequestId,
+    _In_ PAVF_VERDICT_KEY Key,
+    _In_ ULONG FileEpoch
+    )
+/*++
+
+Routine Description:
+
+    Keeps the cache key of an operation that was allowed speculatively
+    until its audited verdict arrives.  If another thread is writing the
+    slot the key is simply not kept.
+
+Arguments:
+
+    RequestId - Request ID of the operation.
+    Key - The operation's key.
+    FileEpoch - The file's epoch when the operation was seen.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    PAVF_AUDIT_ENTRY entry = &gAuditTable[RequestId & (AVF_AUDIT_TABLE_SIZE - 1)];
+    LONG sequence;
+
+    sequence = entry->Sequence;
+
+    if ((sequence & 1) != 0 ||
+        InterlockedCompareExchange(&entry->Sequence, sequence + 1, sequence) != sequence) {
+        return;
+    }
+
+    entry->RequestId = RequestId;
+    entry->CacheEpoch = (ULONG)gVerdictCacheEpoch;
+    entry->FileEpoch = FileEpoch;
+    entry->Key = *Key;
+
+    KeMemoryBarrier();
+    InterlockedIncrement(&entry->Sequence);
+}
+
+
+NTSTATUS
+AvfCompleteAudit(
+    _In_ ULONG RequestId,
+    _In_ BOOLEAN Block
+    )
+/*++
+
+Routine Description:
+
+    Caches the audited verdict of an operation that was allowed
+    speculatively.  A block is cached against the file's current epoch,
+    so that the writes the speculative allow let through do not undo it,
+    and also blocks the process's later reads and writes of the file.
+
+Arguments:
+
+    RequestId - Request ID of the operation.
+    Block - The consultant's verdict.
+
+Return Value:
+
+    STATUS_SUCCESS, or STATUS_NOT_FOUND if the operation's key is no
+    longer kept or the cache was invalidated since.
+
+--*/
+{
+    PAVF_AUDIT_ENTRY entry = &gAuditTable[RequestId & (AVF_AUDIT_TABLE_SIZE - 1)];
+    AVF_VERDICT_KEY key;
+    ULONG cacheEpoch;
+    ULONG fileEpoch;
+    LONG sequence;
+
+    sequence = entry->Sequence;
+    KeMemoryBarrier();
+
+    if (sequence == 0 || (sequence & 1) != 0 || entry->RequestId != RequestId) {
+        return STATUS_NOT_FOUND;
+    }
+
+    cacheEpoch = entry->CacheEpoch;
+    fileEpoch = entry->FileEpoch;
+    key = entry->Key;
+
+    KeMemoryBarrier();
+
+    if (entry->Sequence != sequence || cacheEpoch != (ULONG)gVerdictCacheEpoch) {
+        return STATUS_NOT_FOUND;
+    }
+
+    if (!Block) {
+        AvfInsertVerdict(&key, fileEpoch, FALSE);
+        return STATUS_SUCCESS;
+    }
+
+    fileEpoch = AvfGetFileEpoch(&key.FileId);
+
+    AvfInsertVerdict(&key, fileEpoch, TRUE);
+
+    key.DesiredAccess = 0;
+    key.CreateDisposition = 0;
+
+    key.MajorFunction = IRP_MJ_READ;
+    AvfInsertVerdict(&key, fileEpoch, TRUE);
+
+    key.MajorFunction = IRP_MJ_WRITE;
+    AvfInsertVerdict(&key, fileEpoch, TRUE);
+
+    return STATUS_SUCCESS;
+}
@@ -0,0 +1,579 @@
+/*++
+
+Copyright (c) 1989-2002  Microsoft Corporation
+Modified for AV Filter functionality
+
+Module Name:
+
+    avfKern.h
+
+Abstract:
+
+    Header file which contains the structures, type definitions,
+    constants, global variables and function prototypes that are
+    only visible within the kernel mode portion of AVF.
+
+Environment:
+
+    Kernel mode
+
+--*/
+#ifndef __AVFKERN_H__
+#define __AVFKERN_H__
+
+#include "avf.h"
+
+//
+//  Pool tags
+//
+
+#define AVF_POOL_TAG                'FvAM'
+#define AVF_PROCESS_TAG             'PfvA'
+#define AVF_POLICY_TAG              'LfvA'
+#define AVF_CONTEXT_TAG             'CfvA'
+#define AVF_NAME_TAG                'NfvA'
+#define AVF_REQUEST_TAG             'RfvA'
+#define AVF_STREAM_CONTEXT_TAG      'SfvA'
+
+//
+//  Global variables
+//
+
+extern PFLT_FILTER gFilterHandle;
+extern PFLT_PORT gClientPort;              // Command connection
+extern volatile LONG gEngineConnections;   // Connections notifications go to
+
+//
+//  Process table
+//
+//  The process table maps a process ID to the full NT path of its image.
+//  Entries are added from the process-creation notification (or lazily, for
+//  processes that were already running when the driver loaded) and removed
+//  on process exit, so the image name is converted exactly once per process.
+//
+
+#define AVF_PROCESS_TABLE_BUCKETS   256     // Must be a power of 2
+
+typedef struct _AVF_PROCESS_ENTRY {
+
+    LIST_ENTRY Link;
+
+    HANDLE ProcessId;
+
+    //
+    //  Driver-assigned key that is unique for the lifetime of the driver,
+    //  so a recycled PID never aliases an earlier process.
+    //
+
+    ULONG ProcessKey;
+
+    //
+    //  Full NT path of the process image.  Buffer points just past this
+    //  structure.
+    //
+
+    UNICODE_STRING ImageName;
+
+    //
+    //  Report rate limit (see "Sampling" in avf.h).  ReportTime is the
+    //  interrupt time at which the process's token bucket is full again;
+    //  Dropped counts its operations not reported since its last report.
+    //  The entry is paged, so both are updated with interlocked operations.
+    //
+
+    volatile LONG64 ReportTime;
+    volatile LONG Dropped;
+
+} AVF_PROCESS_ENTRY, *PAVF_PROCESS_ENTRY;
+
+NTSTATUS
+AvfProcessTableInitialize(
+    VOID
+    );
+
+VOID
+AvfProcessTableUninitialize(
+    VOID
+    );
+
+BOOLEAN
+AvfLookupProcess(
+    _In_ HANDLE ProcessId,
+    _Out_opt_ PULONG ProcessKey,
+    _Out_writes_bytes_opt_(NameSize) PWCHAR Name,
+    _In_ ULONG NameSize,
+    _Out_opt_ PULONG Dropped
+    );
+
+BOOLEAN
+AvfAdmitProcessReport(
+    _In_ HANDLE ProcessId,
+    _In_ BOOLEAN Sampled,
+    _In_ PAVF_SAMPLING Sampling
+    );
+
+//
+//  Policy
+//
+//  The loaded policy is split into one rule set per volume.  Rule sets are
+//  reference counted: the policy holds one reference and every instance
+//  context attached to the volume holds another, so a policy can be
+//  replaced while operations on the old rule set are still in flight.
+//
+
+typedef struct _AVF_PATH_ENTRY {
+
+    UNICODE_STRING Path;        // Volume-relative path
+    ULONG Flags;                // AVF_PATH_RULE_*
+
+} AVF_PATH_ENTRY, *PAVF_PATH_ENTRY;
+
+typedef struct _AVF_VOLUME_RULES {
+
+    volatile LONG RefCount;
+
+    //
+    //  TRUE if every file on the volume is reported (no path rules)
+    //
+
+    BOOLEAN MonitorAll;
+
+    //
+    //  Copy of the policy's create filter
+    //
+
+    AVF_CREATE_FILTER CreateFilter;
+
+    //
+    //  MonitorAll only: the policy's sampling settings, the operations
+    //  seen (in the current window for AVF_SAMPLE_RESERVOIR) and the
+    //  interrupt time the window began
+    //
+
+    AVF_SAMPLING Sampling;
+    volatile LONG SampleCount;
+    volatile LONG64 WindowStart;
+    ULONG RandomSeed;
+
+    UNICODE_STRING VolumeName;
+
+    //
+    //  Driver-assigned sequence number of the policy this rule set came
+    //  from.  Cached per-stream decisions are only valid for it.
+    //
+
+    ULONG Generation;
+
+    //
+    //  Protected file IDs, sorted for binary search
+    //
+
+    ULONG FileIdCount;
+    PFILE_ID_128 FileIds;
+
+    //
+    //  Bloom filter over further protected file IDs; BloomBitCount is 0
+    //  if there is none
+    //
+
+    ULONG BloomBitCount;
+    ULONG BloomHashCount;
+    PULONG BloomBits;
+
+    ULONG RuleCount;
+    AVF_PATH_ENTRY Rules[ANYSIZE_ARRAY];
+
+} AVF_VOLUME_RULES, *PAVF_VOLUME_RULES;
+
+#define AvfHasFileIdRules(_rules) \
+    ((_rules)->FileIdCount != 0 || (_rules)->BloomBitCount != 0)
+
+typedef struct _AVF_POLICY {
+
+    ULONG Generation;
+    ULONG Flags;                // AVF_POLICY_FLAG_*
+    AVF_CREATE_FILTER CreateFilter;
+    AVF_SAMPLING Sampling;
+
+    //
+    //  Rule set shared by every volume when AVF_POLICY_FLAG_MONITOR_ALL
+    //  is set
+    //
+
+    PAVF_VOLUME_RULES MonitorAllRules;
+
+    ULONG VolumeCount;
+    PAVF_VOLUME_RULES Volumes[ANYSIZE_ARRAY];
+
+} AVF_POLICY, *PAVF_POLICY;
+
+//
+//  Largest policy accepted from user mode
+//
+
+#define AVF_MAX_POLICY_SIZE         (16 * 1024 * 1024)
+
+//
+//  Instance context
+//
+//  One per attached volume.  Carries the rule subset for the volume, which
+//  is NULL while the volume runs in pass-through, and the volume counters.
+//
+
+typedef struct _AVF_INSTANCE_CONTEXT {
+
+    PFLT_INSTANCE Instance;
+
+    UNICODE_STRING VolumeName;
+
+    //
+    //  Protects Rules
+    //
+
+    EX_PUSH_LOCK RulesLock;
+    PAVF_VOLUME_RULES Rules;
+
+    volatile LONG64 Operations;
+    volatile LONG64 Notified;
+    volatile LONG64 Blocked;
+    volatile LONG64 CreatesFiltered;
+    volatile LONG64 CacheHits;
+    volatile LONG64 BloomPositives;
+    volatile LONG64 SampledOut;
+    volatile LONG64 RateLimited;
+
+} AVF_INSTANCE_CONTEXT, *PAVF_INSTANCE_CONTEXT;
+
+VOID
+AvfPolicyInitialize(
+    VOID
+    );
+
+VOID
+AvfPolicyUninitialize(
+    VOID
+    );
+
+NTSTATUS
+AvfSetPolicy(
+    _In_reads_bytes_(Length) PAVF_POLICY_HEADER Header,
+    _In_ ULONG Length
+    );
+
+PAVF_VOLUME_RULES
+AvfLookupVolumeRules(
+    _In_ PCUNICODE_STRING VolumeName,
+    _Out_opt_ PBOOLEAN PolicyLoaded
+    );
+
+VOID
+AvfReleaseVolumeRules(
+    _In_ PAVF_VOLUME_RULES Rules
+    );
+
+PAVF_VOLUME_RULES
+AvfGetInstanceRules(
+    _In_ PAVF_INSTANCE_CONTEXT InstanceContext
+    );
+
+VOID
+AvfSetInstanceRules(
+    _In_ PAVF_INSTANCE_CONTEXT InstanceContext,
+    _In_opt_ PAVF_VOLUME_RULES Rules
+    );
+
+BOOLEAN
+AvfMatchPathRules(
+    _In_ PAVF_VOLUME_RULES Rules,
+    _In_ PCUNICODE_STRING RelativePath
+    );
+
+BOOLEAN
+AvfMatchFileId(
+    _In_ PAVF_VOLUME_RULES Rules,
+    _In_ PFILE_ID_128 FileId
+    );
+
+BOOLEAN
+AvfBloomContains(
+    _In_ PAVF_VOLUME_RULES Rules,
+    _In_ PFILE_ID_128 FileId
+    );
+
+BOOLEAN
+AvfCreateNeedsReport(
+    _In_ PAVF_VOLUME_RULES Rules,
+    _In_ PFLT_CALLBACK_DATA Data
+    );
+
+BOOLEAN
+AvfSampleOperation(
+    _In_ PAVF_VOLUME_RULES Rules,
+    _In_ PAVF_INSTANCE_CONTEXT InstanceContext
+    );
+
+NTSTATUS
+AvfGetVolumeStatistics(
+    _Out_writes_bytes_to_(OutputBufferLength, *ReturnOutputBufferLength) PAVF_VOLUME_STATISTICS OutputBuffer,
+    _In_ ULONG OutputBufferLength,
+    _Out_ PULONG ReturnOutputBufferLength
+    );
+
+//
+//  Stream context
+//
+//  Holds the file ID of a stream, queried once when the context is created,
+//  and caches whether the file is protected by ID.  ProtectionState holds
+//  the rule set generation in its upper 32 bits and the AVF_NOTIFY_FLAG_*
+//  bits the ID earned in its lower 32, and is ignored once the generation
+//  no longer matches.
+//
+//  Every file with a cached verdict has a stream context, which is how the
+//  write and set-information callbacks find the file ID to invalidate.
+//
+
+typedef struct _AVF_STREAM_CONTEXT {
+
+    FILE_ID_128 FileId;
+
+    volatile LONG64 ProtectionState;
+
+} AVF_STREAM_CONTEXT, *PAVF_STREAM_CONTEXT;
+
+#define AvfMakeProtectionState(_gen, _flags) \
+    ((LONG64)(((ULONG64)(_gen) << 32) | (ULONG)(_flags)))
+
+NTSTATUS
+AvfGetStreamContext(
+    _In_ PFLT_INSTANCE Instance,
+    _In_ PFILE_OBJECT FileObject,
+    _Outptr_ PAVF_STREAM_CONTEXT *StreamContext
+    );
+
+ULONG
+AvfGetStreamProtection(
+    _In_ PAVF_STREAM_CONTEXT StreamContext,
+    _In_ PAVF_VOLUME_RULES Rules
+    );
+
+NTSTATUS
+AvfGetStreamContextByName(
+    _In_ PFLT_INSTANCE Instance,
+    _In_ PUNICODE_STRING FileName,
+    _Outptr_ PAVF_STREAM_CONTEXT *StreamContext
+    );
+
+//
+//  Verdict cache
+//
+//  Verdicts from user mode are cached by file ID, process and operation so
+//  that repeated access to a protected file by the same process is decided
+//  in the pre-operation callback.  See avfCache.c.
+//
+
+#define AVF_VERDICT_CACHE_SIZE      4096    // Entries, must be a power of 2
+#define AVF_FILE_EPOCH_BUCKETS      1024    // Must be a power of 2
+
+//
+//  Operations allowed speculatively whose audited verdict is still to come
+//  (AVF_VERDICT_FLAG_SPECULATIVE), by request ID.  A slot is reused by a
+//  later request; the verdict of the one it held is then not cached.
+//
+
+#define AVF_AUDIT_TABLE_SIZE        1024    // Entries, must be a power of 2
+
+typedef struct _AVF_VERDICT_KEY {
+
+    FILE_ID_128 FileId;
+    ULONG ProcessKey;           // From the process table
+    ULONG MajorFunction;
+
+    //
+    //  Creates only; zero otherwise
+    //
+
+    ACCESS_MASK DesiredAccess;
+    ULONG CreateDisposition;
+
+} AVF_VERDICT_KEY, *PAVF_VERDICT_KEY;
+
+ULONG
+AvfGetFileEpoch(
+    _In_ PFILE_ID_128 FileId
+    );
+
+VOID
+AvfInvalidateFile(
+    _In_ PFILE_ID_128 FileId
+    );
+
+VOID
+AvfInvalidateVerdictCache(
+    VOID
+    );
+
+BOOLEAN
+AvfLookupVerdict(
+    _In_ PAVF_VERDICT_KEY Key,
+    _Out_ PBOOLEAN Block
+    );
+
+VOID
+AvfInsertVerdict(
+    _In_ PAVF_VERDICT_KEY Key,
+    _In_ ULONG FileEpoch,
+    _In_ BOOLEAN Block
+    );
+
+VOID
+AvfRememberAudit(
+    _In_ ULONG RequestId,
+    _In_ PAVF_VERDICT_KEY Key,
+    _In_ ULONG FileEpoch
+    );
+
+NTSTATUS
+AvfCompleteAudit(
+    _In_ ULONG RequestId,
+    _In_ BOOLEAN Block
+    );
+
+//
+//  Pended operations
+//
+//  Operations that need a verdict are pended in their pre-operation
+//  callback and queued.  Dispatcher threads deliver the notifications to
+//  user mode, which answers with a ReplyVerdict command; the operation is
+//  then completed with FltCompletePendedPreOperation.  Operations that are
+//  cancelled, time out, or are still queued when the client disconnects
+//  or the instance is torn down are completed without waiting.
+//
+//  The client has an engine connection per worker.  A notification goes
+//  to the worker that takes the operations of the processor it was raised
+//  on, so that its buffers stay near that processor; if that worker has no
+//  buffer waiting it goes to the next one in turn instead.
+//
+
+#define AVF_DISPATCH_THREAD_COUNT   2
+#define AVF_PENDED_BUCKETS          1024    // Must be a power of 2
+
+//
+//  How long an operation waits for its verdict before it is allowed
+//  (100ns units)
+//
+
+#define AVF_VERDICT_TIMEOUT         (60LL * 1000 * 1000 * 10)
+
+typedef struct _AVF_PENDED_REQUEST {
+
+    //
+    //  Every queued request is on the pended list and in the pended table
+    //  bucket of its request ID; requests not yet delivered to user mode
+    //  are also on the send list.  All are protected by the queue lock.
+    //
+
+    LIST_ENTRY Link;
+    LIST_ENTRY HashLink;
+    LIST_ENTRY SendLink;
+
+    volatile LONG RefCount;
+
+    BOOLEAN Queued;             // On the pended list
+    BOOLEAN Sent;               // Off the send list
+
+    //
+    //  TRUE for a create pended in its post-operation callback.  It is not
+    //  cancellable, and a block cancels the open with FltCancelFileOpen.
+    //
+
+    BOOLEAN PostOperation;
+
+    //
+    //  TRUE if the verdict is cached under CacheKey.  FileEpoch is the
+    //  file's epoch when the operation was seen.
+    //
+
+    BOOLEAN Cacheable;
+    ULONG FileEpoch;
+    AVF_VERDICT_KEY CacheKey;
+
+    //
+    //  Referenced stream context of a write, handed to AvfPostWrite if the
+    //  write is allowed
+    //
+
+    PAVF_STREAM_CONTEXT StreamContext;
+
+    PFLT_CALLBACK_DATA Data;
+    PFLT_INSTANCE Instance;
+
+    //
+    //  Interrupt time after which the operation is allowed
+    //
+
+    ULONGLONG Deadline;
+
+    //
+    //  Processor the operation was raised on; the notification goes to the
+    //  engine connection that takes its operations
+    //
+
+    PROCESSOR_NUMBER Processor;
+
+    AVF_FILE_NOTIFICATION Notification;
+
+} AVF_PENDED_REQUEST, *PAVF_PENDED_REQUEST;
+
+NTSTATUS
+AvfQueueInitialize(
+    VOID
+    );
+
+VOID
+AvfQueueUninitialize(
+    VOID
+    );
+
+PAVF_PENDED_REQUEST
+AvfAllocateRequest(
+    _In_ PFLT_CALLBACK_DATA Data,
+    _In_ PFLT_INSTANCE Instance
+    );
+
+VOID
+AvfDereferenceRequest(
+    _In_ PAVF_PENDED_REQUEST Request
+    );
+
+NTSTATUS
+AvfQueueRequest(
+    _In_ PAVF_PENDED_REQUEST Request
+    );
+
+NTSTATUS
+AvfCompleteVerdict(
+    _In_ ULONG RequestId,
+    _In_ BOOLEAN Block,
+    _In_ BOOLEAN Speculative,
+    _In_ BOOLEAN NoCache
+    );
+
+VOID
+AvfFlushRequests(
+    _In_opt_ PFLT_INSTANCE Instance
+    );
+
+NTSTATUS
+AvfAddEnginePort(
+    _In_ PFLT_PORT ClientPort,
+    _In_ PAVF_ENGINE_CONNECT Connect,
+    _Out_ PULONG Slot,
+    _Out_ PBOOLEAN First
+    );
+
+BOOLEAN
+AvfRemoveEnginePort(
+    _In_ ULONG Slot
+    );
+
+#endif /* __AVFKERN_H__ */
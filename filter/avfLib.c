@@ -20,17 +20,7 @@ Environment:
 #include <fltKernel.h>
 #include <dontuse.h>
 #include <suppress.h>
-#include "avf.h"
-
-//
-//  Declare PsGetProcessImageFileName (not in public headers)
-//
-
-NTKERNELAPI
-PUCHAR
-PsGetProcessImageFileName(
-    _In_ PEPROCESS Process
-    );
+#include "avfKern.h"
 
 //
 //  Function declarations
@@ -44,14 +34,9 @@ AvfGetProcessName(
 
 #ifdef ALLOC_PRAGMA
 #pragma alloc_text(PAGE, AvfGetProcessName)
+#pragma alloc_text(PAGE, AvfGetStreamContextByName)
 #endif
 
-//
-//  Pool tag for allocations
-//
-
-#define AVF_NAME_TAG 'NfvA'
-
 
 NTSTATUS
 AvfGetProcessName(
@@ -62,7 +47,7 @@ AvfGetProcessName(
 
 Routine Description:
 
-    Gets the current process name.
+    Gets the full image path of the current process from the process table.
 
 Arguments:
 
@@ -75,12 +60,6 @@ Return Value:
 
 --*/
 {
-    PEPROCESS process;
-    PUCHAR imageName;
-    ANSI_STRING ansiName;
-    UNICODE_STRING unicodeName;
-    NTSTATUS status;
-
     PAGED_CODE();
 
     if (ProcessName == NULL || BufferSize < sizeof(WCHAR)) {
@@ -89,29 +68,11 @@ Return Value:
 
     RtlZeroMemory(ProcessName, BufferSize);
 
-    process = PsGetCurrentProcess();
-    if (process == NULL) {
-        return STATUS_UNSUCCESSFUL;
-    }
-
-    imageName = PsGetProcessImageFileName(process);
-    if (imageName == NULL) {
-        return STATUS_UNSUCCESSFUL;
+    if (!AvfLookupProcess(PsGetCurrentProcessId(), NULL, ProcessName, BufferSize, NULL)) {
+        return STATUS_NOT_FOUND;
     }
 
-    //
-    //  Convert ANSI to Unicode
-    //
-
-    RtlInitAnsiString(&ansiName, (PCSZ)imageName);
-
-    unicodeName.Buffer = ProcessName;
-    unicodeName.MaximumLength = (USHORT)(BufferSize - sizeof(WCHAR));
-    unicodeName.Length = 0;
-
-    status = RtlAnsiStringToUnicodeString(&unicodeName, &ansiName, FALSE);
-
-    return status;
+    return STATUS_SUCCESS;
 }
 
 
@@ -145,3 +106,227 @@ Return Value:
 
     return TRUE;
 }
+
+
+
+NTSTATUS
+AvfGetStreamContext(
+    _In_ PFLT_INSTANCE Instance,
+    _In_ PFILE_OBJECT FileObject,
+    _Outptr_ PAVF_STREAM_CONTEXT *StreamContext
+    )
+/*++
+
+Routine Description:
+
+    Gets the stream context of an open file, creating it if needed.  A new
+    context needs the file ID, which is only queried at PASSIVE_LEVEL.
+
+Arguments:
+
+    Instance - Instance the file is open on.
+    FileObject - The open file.
+    StreamContext - Receives the referenced stream context.
+
+Return Value:
+
+    STATUS_SUCCESS, or the failure status.
+
+--*/
+{
+    NTSTATUS status;
+    PAVF_STREAM_CONTEXT streamContext = NULL;
+    PAVF_STREAM_CONTEXT oldContext = NULL;
+    FILE_ID_INFORMATION idInfo;
+
+    *StreamContext = NULL;
+
+    status = FltGetStreamContext(Instance, FileObject, &streamContext);
+
+    if (NT_SUCCESS(status)) {
+        *StreamContext = streamContext;
+        return STATUS_SUCCESS;
+    }
+
+    if (KeGetCurrentIrql() != PASSIVE_LEVEL) {
+        return STATUS_UNSUCCESSFUL;
+    }
+
+    status = FltQueryInformationFile(Instance,
+                                     FileObject,
+                                     &idInfo,
+                                     sizeof(idInfo),
+                                     FileIdInformation,
+                                     NULL);
+
+    if (!NT_SUCCESS(status)) {
+        return status;
+    }
+
+    status = FltAllocateContext(gFilterHandle,
+                                FLT_STREAM_CONTEXT,
+                                sizeof(AVF_STREAM_CONTEXT),
+                                NonPagedPoolNx,
+                                &streamContext);
+
+    if (!NT_SUCCESS(status)) {
+        return status;
+    }
+
+    streamContext->FileId = idInfo.FileId;
+    streamContext->ProtectionState = 0;     // Generations start at 1
+
+    status = FltSetStreamContext(Instance,
+                                 FileObject,
+                                 FLT_SET_CONTEXT_KEEP_IF_EXISTS,
+                                 streamContext,
+                                 &oldContext);
+
+    if (status == STATUS_FLT_CONTEXT_ALREADY_DEFINED) {
+
+        //
+        //  Another thread set the context first; use that one
+        //
+
+        FltReleaseContext(streamContext);
+        *StreamContext = oldContext;
+        return STATUS_SUCCESS;
+    }
+
+    if (!NT_SUCCESS(status)) {
+        FltReleaseContext(streamContext);
+        return status;
+    }
+
+    *StreamContext = streamContext;
+    return STATUS_SUCCESS;
+}
+
+
+ULONG
+AvfGetStreamProtection(
+    _In_ PAVF_STREAM_CONTEXT StreamContext,
+    _In_ PAVF_VOLUME_RULES Rules
+    )
+/*++
+
+Routine Description:
+
+    Checks whether a stream belongs to a file protected by ID, either
+    exactly or through the volume's Bloom filter.  The answer is cached in
+    the stream context, so the ID rules are searched once per stream and
+    policy rather than once per operation.
+
+Arguments:
+
+    StreamContext - The stream context of the file.
+    Rules - The rule set of the volume.
+
+Return Value:
+
+    AVF_NOTIFY_FLAG_RULE_MATCH | AVF_NOTIFY_FLAG_FILE_ID_MATCH if the file
+    is protected, AVF_NOTIFY_FLAG_BLOOM_MATCH if it may be, or 0.
+
+--*/
+{
+    LONG64 state;
+    ULONG flags = 0;
+
+    if (!AvfHasFileIdRules(Rules)) {
+        return 0;
+    }
+
+    state = StreamContext->ProtectionState;
+
+    if ((ULONG)(state >> 32) == Rules->Generation) {
+        return (ULONG)state;
+    }
+
+    //
+    //  Not cached, or cached under an older policy
+    //
+
+    if (AvfMatchFileId(Rules, &StreamContext->FileId)) {
+        flags = AVF_NOTIFY_FLAG_RULE_MATCH | AVF_NOTIFY_FLAG_FILE_ID_MATCH;
+    } else if (AvfBloomContains(Rules, &StreamContext->FileId)) {
+        flags = AVF_NOTIFY_FLAG_BLOOM_MATCH;
+    }
+
+    InterlockedExchange64(&StreamContext->ProtectionState,
+                          AvfMakeProtectionState(Rules->Generation, flags));
+
+    return flags;
+}
+
+
+NTSTATUS
+AvfGetStreamContextByName(
+    _In_ PFLT_INSTANCE Instance,
+    _In_ PUNICODE_STRING FileName,
+    _Outptr_ PAVF_STREAM_CONTEXT *StreamContext
+    )
+/*++
+
+Routine Description:
+
+    Gets the stream context of the file a create is about to open.  Used in
+    pre-create, before the file is open, to learn its ID.  Opens the file
+    below this filter for attributes only; the context is attached to the
+    stream, so the create finds it again once it is open.
+
+Arguments:
+
+    Instance - Instance the create is on.
+    FileName - Normalized name of the file.
+    StreamContext - Receives the referenced stream context.
+
+Return Value:
+
+    STATUS_SUCCESS, or the failure status (for example if the file does
+    not exist yet).
+
+--*/
+{
+    NTSTATUS status;
+    OBJECT_ATTRIBUTES oa;
+    IO_STATUS_BLOCK ioStatus;
+    HANDLE fileHandle;
+    PFILE_OBJECT fileObject;
+
+    PAGED_CODE();
+
+    *StreamContext = NULL;
+
+    InitializeObjectAttributes(&oa,
+                               FileName,
+                               OBJ_KERNEL_HANDLE | OBJ_CASE_INSENSITIVE,
+                               NULL,
+                               NULL);
+
+    status = FltCreateFileEx(gFilterHandle,
+                             Instance,
+                             &fileHandle,
+                             &fileObject,
+                             FILE_READ_ATTRIBUTES | SYNCHRONIZE,
+                             &oa,
+                             &ioStatus,
+                             NULL,
+                             FILE_ATTRIBUTE_NORMAL,
+                             FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+                             FILE_OPEN,
+                             FILE_NON_DIRECTORY_FILE | FILE_SYNCHRONOUS_IO_NONALERT,
+                             NULL,
+                             0,
+                             IO_IGNORE_SHARE_ACCESS_CHECK);
+
+    if (!NT_SUCCESS(status)) {
+        return status;
+    }
+
+    status = AvfGetStreamContext(Instance, fileObject, StreamContext);
+
+    ObDereferenceObject(fileObject);
+    FltClose(fileHandle);
+
+    return status;
+}
@@ -0,0 +1,1264 @@
+/*++
+
+Copyright (c) 1989-2002  Microsoft Corporation
+Modified for AV Filter functionality
+
+Module Name:
+
+    avfPolicy.c
+
+Abstract:
+
+    This module holds the policy loaded by the user-mode component and
+    distributes it to the filter instances.  The policy is compiled into one
+    rule set per volume; each instance context references the rule set for
+    its volume, and volumes without protected paths run in pass-through.
+
+Environment:
+
+    Kernel mode
+
+--*/
+
+#include <fltKernel.h>
+#include <dontuse.h>
+#include <suppress.h>
+#include "avfKern.h"
+
+//
+//  The currently loaded policy, protected by gPolicyLock.  Policy updates
+//  are serialized by gPolicyUpdateLock.
+//
+
+EX_PUSH_LOCK gPolicyLock;
+EX_PUSH_LOCK gPolicyUpdateLock;
+PAVF_POLICY gPolicy = NULL;
+
+//
+//  Sequence number stamped on each compiled rule set.  Unlike the
+//  caller-assigned generation it never repeats while the driver is loaded.
+//
+
+volatile LONG gPolicySequence = 0;
+
+//
+//  Function prototypes
+//
+
+PAVF_VOLUME_RULES
+AvfBuildVolumeRules(
+    _In_ PAVF_VOLUME_POLICY VolumePolicy,
+    _In_ ULONG Sequence
+    );
+
+VOID
+AvfFreePolicy(
+    _In_ PAVF_POLICY Policy
+    );
+
+VOID
+AvfApplyPolicy(
+    _In_ PAVF_POLICY Policy
+    );
+
+NTSTATUS
+AvfEnumerateInstances(
+    _Outptr_result_buffer_(*InstanceCount) PFLT_INSTANCE **Instances,
+    _Out_ PULONG InstanceCount
+    );
+
+VOID
+AvfFreeInstanceList(
+    _In_reads_(InstanceCount) PFLT_INSTANCE *Instances,
+    _In_ ULONG InstanceCount
+    );
+
+#ifdef ALLOC_PRAGMA
+#pragma alloc_text(INIT, AvfPolicyInitialize)
+#pragma alloc_text(PAGE, AvfPolicyUninitialize)
+#pragma alloc_text(PAGE, AvfSetPolicy)
+#pragma alloc_text(PAGE, AvfBuildVolumeRules)
+#pragma alloc_text(PAGE, AvfFreePolicy)
+#pragma alloc_text(PAGE, AvfApplyPolicy)
+#pragma alloc_text(PAGE, AvfEnumerateInstances)
+#pragma alloc_text(PAGE, AvfFreeInstanceList)
+#pragma alloc_text(PAGE, AvfGetVolumeStatistics)
+#endif
+
+
+VOID
+AvfPolicyInitialize(
+    VOID
+    )
+/*++
+
+Routine Description:
+
+    Initializes the policy state.  No policy is loaded until the user-mode
+    component sends one; until then every volume is attached.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    FltInitializePushLock(&gPolicyLock);
+    FltInitializePushLock(&gPolicyUpdateLock);
+    gPolicy = NULL;
+}
+
+
+VOID
+AvfPolicyUninitialize(
+    VOID
+    )
+/*++
+
+Routine Description:
+
+    Frees the loaded policy.  Called after all instances are torn down.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    PAGED_CODE();
+
+    if (gPolicy != NULL) {
+        AvfFreePolicy(gPolicy);
+        gPolicy = NULL;
+    }
+
+    FltDeletePushLock(&gPolicyUpdateLock);
+    FltDeletePushLock(&gPolicyLock);
+}
+
+
+NTSTATUS
+AvfSetPolicy(
+    _In_reads_bytes_(Length) PAVF_POLICY_HEADER Header,
+    _In_ ULONG Length
+    )
+/*++
+
+Routine Description:
+
+    Validates and compiles a policy sent by user mode, makes it the current
+    policy and pushes the new rule sets to every instance.
+
+Arguments:
+
+    Header - Captured (kernel) copy of the policy.
+    Length - Length of the policy in bytes.
+
+Return Value:
+
+    STATUS_SUCCESS, or an error if the policy is malformed.
+
+--*/
+{
+    PAVF_POLICY policy;
+    PAVF_POLICY oldPolicy;
+    PAVF_VOLUME_POLICY volumePolicy;
+    ULONG sequence;
+    ULONG offset;
+    ULONG i;
+
+    PAGED_CODE();
+
+    if (Length < sizeof(AVF_POLICY_HEADER) ||
+        Header->Size < sizeof(AVF_POLICY_HEADER) ||
+        Header->Size > Length ||
+        Header->VolumeCount > (Header->Size - sizeof(AVF_POLICY_HEADER)) / sizeof(AVF_VOLUME_POLICY)) {
+
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    if (Header->Sampling.Mode > AVF_SAMPLE_RESERVOIR ||
+        (Header->Sampling.Mode != AVF_SAMPLE_ALL && Header->Sampling.Rate == 0) ||
+        (Header->Sampling.Mode == AVF_SAMPLE_RESERVOIR && Header->Sampling.WindowMs == 0)) {
+
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    policy = ExAllocatePoolZero(PagedPool,
+                                FIELD_OFFSET(AVF_POLICY, Volumes) +
+                                    (Header->VolumeCount + 1) * sizeof(PAVF_VOLUME_RULES),
+                                AVF_POLICY_TAG);
+
+    if (policy == NULL) {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    policy->Generation = Header->Generation;
+    policy->Flags = Header->Flags;
+    policy->CreateFilter = Header->CreateFilter;
+    policy->Sampling = Header->Sampling;
+
+    if (policy->Sampling.ProcessRate != 0 && policy->Sampling.ProcessBurst == 0) {
+        policy->Sampling.ProcessBurst = 1;
+    }
+
+    sequence = (ULONG)InterlockedIncrement(&gPolicySequence);
+
+    //
+    //  Compile each volume block into a rule set
+    //
+
+    offset = sizeof(AVF_POLICY_HEADER);
+
+    for (i = 0; i < Header->VolumeCount; i++) {
+
+        volumePolicy = Add2Ptr(Header, offset);
+
+        if (Header->Size - offset < sizeof(AVF_VOLUME_POLICY) ||
+            volumePolicy->Size < sizeof(AVF_VOLUME_POLICY) ||
+            volumePolicy->Size > Header->Size - offset ||
+            !IS_ALIGNED(volumePolicy->Size, sizeof(ULONG))) {
+
+            AvfFreePolicy(policy);
+            return STATUS_INVALID_PARAMETER;
+        }
+
+        policy->Volumes[i] = AvfBuildVolumeRules(volumePolicy, sequence);
+
+        if (policy->Volumes[i] == NULL) {
+            AvfFreePolicy(policy);
+            return STATUS_INVALID_PARAMETER;
+        }
+
+        policy->Volumes[i]->CreateFilter = policy->CreateFilter;
+        policy->VolumeCount++;
+        offset += volumePolicy->Size;
+    }
+
+    if (FlagOn(policy->Flags, AVF_POLICY_FLAG_MONITOR_ALL)) {
+
+        policy->MonitorAllRules = ExAllocatePoolZero(PagedPool,
+                                                     sizeof(AVF_VOLUME_RULES),
+                                                     AVF_POLICY_TAG);
+
+        if (policy->MonitorAllRules == NULL) {
+            AvfFreePolicy(policy);
+            return STATUS_INSUFFICIENT_RESOURCES;
+        }
+
+        policy->MonitorAllRules->RefCount = 1;
+        policy->MonitorAllRules->MonitorAll = TRUE;
+        policy->MonitorAllRules->Generation = sequence;
+        policy->MonitorAllRules->CreateFilter = policy->CreateFilter;
+        policy->MonitorAllRules->Sampling = policy->Sampling;
+        policy->MonitorAllRules->WindowStart = (LONG64)KeQueryInterruptTime();
+        policy->MonitorAllRules->RandomSeed = (ULONG)policy->MonitorAllRules->WindowStart;
+    }
+
+    //
+    //  Publish the new policy, then move every instance over to it.  Until
+    //  an instance is switched it keeps its old rule set, so there is no
+    //  window in which an attached volume has no rules at all.
+    //
+
+    FltAcquirePushLockExclusive(&gPolicyUpdateLock);
+
+    FltAcquirePushLockExclusive(&gPolicyLock);
+    oldPolicy = gPolicy;
+    gPolicy = policy;
+    FltReleasePushLock(&gPolicyLock);
+
+    AvfApplyPolicy(policy);
+
+    //
+    //  Verdicts given under the old policy no longer apply
+    //
+
+    AvfInvalidateVerdictCache();
+
+    if (oldPolicy != NULL) {
+        AvfFreePolicy(oldPolicy);
+    }
+
+    DbgPrint("AVF: Policy generation %lu loaded (%lu volume(s)%s%s)\n",
+             policy->Generation,
+             policy->VolumeCount,
+             FlagOn(policy->Flags, AVF_POLICY_FLAG_MONITOR_ALL) ? ", monitor all" : "",
+             FlagOn(policy->CreateFilter.Flags, AVF_CREATE_FILTER_ENABLED) ? ", create filter" : "");
+
+    FltReleasePushLock(&gPolicyUpdateLock);
+
+    return STATUS_SUCCESS;
+}
+
+
+PAVF_VOLUME_RULES
+AvfBuildVolumeRules(
+    _In_ PAVF_VOLUME_POLICY VolumePolicy,
+    _In_ ULONG Sequence
+    )
+/*++
+
+Routine Description:
+
+    Validates one volume block of a policy and compiles it into a rule set.
+
+Arguments:
+
+    VolumePolicy - The volume block.  Its Size has already been validated
+                   against the enclosing policy.
+    Sequence - Driver-assigned sequence number of the policy.
+
+Return Value:
+
+    The new rule set with one reference, or NULL if the block is malformed
+    or memory could not be allocated.
+
+--*/
+{
+    PAVF_VOLUME_RULES rules;
+    PAVF_PATH_RULE pathRule;
+    PFILE_ID_128 fileIds;
+    PULONG bloomBits;
+    PWCHAR stringPool;
+    SIZE_T stringBytes;
+    ULONG fileIdBytes;
+    ULONG bloomBytes;
+    ULONG offset;
+    ULONG i;
+
+    PAGED_CODE();
+
+    if (VolumePolicy->VolumeNameLength == 0 ||
+        VolumePolicy->VolumeNameLength > sizeof(VolumePolicy->VolumeName) ||
+        !IS_ALIGNED(VolumePolicy->VolumeNameLength, sizeof(WCHAR)) ||
+        VolumePolicy->FileIdCount > (VolumePolicy->Size - sizeof(AVF_VOLUME_POLICY)) / sizeof(FILE_ID_128)) {
+
+        return NULL;
+    }
+
+    //
+    //  File IDs come first and must be strictly ascending
+    //
+
+    fileIds = Add2Ptr(VolumePolicy, sizeof(AVF_VOLUME_POLICY));
+    fileIdBytes = VolumePolicy->FileIdCount * sizeof(FILE_ID_128);
+
+    for (i = 1; i < VolumePolicy->FileIdCount; i++) {
+        if (memcmp(&fileIds[i - 1], &fileIds[i], sizeof(FILE_ID_128)) >= 0) {
+            return NULL;
+        }
+    }
+
+    //
+    //  Then the Bloom filter, if any
+    //
+
+    bloomBits = Add2Ptr(fileIds, fileIdBytes);
+    bloomBytes = VolumePolicy->BloomBitCount / 8;
+
+    if (VolumePolicy->BloomBitCount != 0 &&
+        (VolumePolicy->BloomBitCount > AVF_MAX_BLOOM_BITS ||
+         !IS_ALIGNED(VolumePolicy->BloomBitCount, 32) ||
+         VolumePolicy->BloomHashCount == 0 ||
+         VolumePolicy->BloomHashCount > AVF_MAX_BLOOM_HASHES)) {
+
+        return NULL;
+    }
+
+    if (bloomBytes > VolumePolicy->Size - sizeof(AVF_VOLUME_POLICY) - fileIdBytes ||
+        VolumePolicy->RuleCount > (VolumePolicy->Size - sizeof(AVF_VOLUME_POLICY) - fileIdBytes - bloomBytes) /
+                                      sizeof(AVF_PATH_RULE)) {
+
+        return NULL;
+    }
+
+    //
+    //  First pass: validate the rules and size the string pool
+    //
+
+    stringBytes = VolumePolicy->VolumeNameLength;
+    offset = sizeof(AVF_VOLUME_POLICY) + fileIdBytes + bloomBytes;
+
+    for (i = 0; i < VolumePolicy->RuleCount; i++) {
+
+        pathRule = Add2Ptr(VolumePolicy, offset);
+
+        if (VolumePolicy->Size - offset < sizeof(AVF_PATH_RULE) ||
+            pathRule->Size > VolumePolicy->Size - offset ||
+            pathRule->Size < FIELD_OFFSET(AVF_PATH_RULE, Path) + pathRule->PathLength ||
+            !IS_ALIGNED(pathRule->Size, sizeof(ULONG)) ||
+            !IS_ALIGNED(pathRule->PathLength, sizeof(WCHAR)) ||
+            pathRule->PathLength == 0) {
+
+            return NULL;
+        }
+
+        stringBytes += pathRule->PathLength;
+        offset += pathRule->Size;
+    }
+
+    rules = ExAllocatePoolZero(PagedPool,
+                               FIELD_OFFSET(AVF_VOLUME_RULES, Rules) +
+                                   VolumePolicy->RuleCount * sizeof(AVF_PATH_ENTRY) +
+                                   fileIdBytes +
+                                   bloomBytes +
+                                   stringBytes,
+                               AVF_POLICY_TAG);
+
+    if (rules == NULL) {
+        return NULL;
+    }
+
+    rules->RefCount = 1;
+    rules->Generation = Sequence;
+    rules->RuleCount = VolumePolicy->RuleCount;
+
+    //
+    //  The file IDs follow the rules, then the Bloom filter, then the
+    //  string pool
+    //
+
+    rules->FileIdCount = VolumePolicy->FileIdCount;
+    rules->FileIds = (PFILE_ID_128)&rules->Rules[rules->RuleCount];
+    RtlCopyMemory(rules->FileIds, fileIds, fileIdBytes);
+
+    rules->BloomBitCount = VolumePolicy->BloomBitCount;
+    rules->BloomHashCount = VolumePolicy->BloomHashCount;
+    rules->BloomBits = Add2Ptr(rules->FileIds, fileIdBytes);
+    RtlCopyMemory(rules->BloomBits, bloomBits, bloomBytes);
+
+    //
+    //  Second pass: copy the strings into the pool
+    //
+
+    stringPool = Add2Ptr(rules->BloomBits, bloomBytes);
+
+    rules->VolumeName.Buffer = stringPool;
+    rules->VolumeName.Length = VolumePolicy->VolumeNameLength;
+    rules->VolumeName.MaximumLength = VolumePolicy->VolumeNameLength;
+    RtlCopyMemory(stringPool, VolumePolicy->VolumeName, VolumePolicy->VolumeNameLength);
+    stringPool = Add2Ptr(stringPool, VolumePolicy->VolumeNameLength);
+
+    offset = sizeof(AVF_VOLUME_POLICY) + fileIdBytes + bloomBytes;
+
+    for (i = 0; i < rules->RuleCount; i++) {
+
+        pathRule = Add2Ptr(VolumePolicy, offset);
+
+        rules->Rules[i].Flags = pathRule->Flags;
+        rules->Rules[i].Path.Buffer = stringPool;
+        rules->Rules[i].Path.Length = pathRule->PathLength;
+        rules->Rules[i].Path.MaximumLength = pathRule->PathLength;
+        RtlCopyMemory(stringPool, pathRule->Path, pathRule->PathLength);
+
+        stringPool = Add2Ptr(stringPool, pathRule->PathLength);
+        offset += pathRule->Size;
+    }
+
+    return rules;
+}
+
+
+VOID
+AvfFreePolicy(
+    _In_ PAVF_POLICY Policy
+    )
+/*++
+
+Routine Description:
+
+    Drops the policy's references on its rule sets and frees it.
+
+Arguments:
+
+    Policy - The policy to free.  It must no longer be gPolicy.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    ULONG i;
+
+    PAGED_CODE();
+
+    for (i = 0; i < Policy->VolumeCount; i++) {
+        AvfReleaseVolumeRules(Policy->Volumes[i]);
+    }
+
+    if (Policy->MonitorAllRules != NULL) {
+        AvfReleaseVolumeRules(Policy->MonitorAllRules);
+    }
+
+    ExFreePoolWithTag(Policy, AVF_POLICY_TAG);
+}
+
+
+VOID
+AvfReleaseVolumeRules(
+    _In_ PAVF_VOLUME_RULES Rules
+    )
+/*++
+
+Routine Description:
+
+    Drops a reference on a rule set, freeing it with the last reference.
+
+Arguments:
+
+    Rules - The rule set.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    if (InterlockedDecrement(&Rules->RefCount) == 0) {
+        ExFreePoolWithTag(Rules, AVF_POLICY_TAG);
+    }
+}
+
+
+PAVF_VOLUME_RULES
+AvfLookupVolumeRules(
+    _In_ PCUNICODE_STRING VolumeName,
+    _Out_opt_ PBOOLEAN PolicyLoaded
+    )
+/*++
+
+Routine Description:
+
+    Finds the rule set for a volume in the current policy.
+
+Arguments:
+
+    VolumeName - NT device name of the volume.
+    PolicyLoaded - Receives TRUE if a policy is loaded.
+
+Return Value:
+
+    A referenced rule set, or NULL if the volume has no protected paths
+    (or no policy is loaded).  The caller releases it with
+    AvfReleaseVolumeRules.
+
+--*/
+{
+    PAVF_VOLUME_RULES rules = NULL;
+    ULONG i;
+
+    FltAcquirePushLockShared(&gPolicyLock);
+
+    if (PolicyLoaded != NULL) {
+        *PolicyLoaded = (gPolicy != NULL);
+    }
+
+    if (gPolicy != NULL) {
+
+        if (gPolicy->MonitorAllRules != NULL) {
+
+            rules = gPolicy->MonitorAllRules;
+
+        } else {
+
+            for (i = 0; i < gPolicy->VolumeCount; i++) {
+                if (RtlEqualUnicodeString(&gPolicy->Volumes[i]->VolumeName, VolumeName, TRUE)) {
+                    rules = gPolicy->Volumes[i];
+                    break;
+                }
+            }
+        }
+
+        if (rules != NULL) {
+            InterlockedIncrement(&rules->RefCount);
+        }
+    }
+
+    FltReleasePushLock(&gPolicyLock);
+
+    return rules;
+}
+
+
+PAVF_VOLUME_RULES
+AvfGetInstanceRules(
+    _In_ PAVF_INSTANCE_CONTEXT InstanceContext
+    )
+/*++
+
+Routine Description:
+
+    Returns a referenced pointer to the rule set of an instance.
+
+Arguments:
+
+    InstanceContext - The instance context.
+
+Return Value:
+
+    The rule set, or NULL if the instance is in pass-through.
+
+--*/
+{
+    PAVF_VOLUME_RULES rules;
+
+    FltAcquirePushLockShared(&InstanceContext->RulesLock);
+
+    rules = InstanceContext->Rules;
+    if (rules != NULL) {
+        InterlockedIncrement(&rules->RefCount);
+    }
+
+    FltReleasePushLock(&InstanceContext->RulesLock);
+
+    return rules;
+}
+
+
+VOID
+AvfSetInstanceRules(
+    _In_ PAVF_INSTANCE_CONTEXT InstanceContext,
+    _In_opt_ PAVF_VOLUME_RULES Rules
+    )
+/*++
+
+Routine Description:
+
+    Replaces the rule set of an instance.  The instance takes its own
+    reference on Rules.
+
+Arguments:
+
+    InstanceContext - The instance context.
+    Rules - The new rule set, or NULL to put the instance in pass-through.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    PAVF_VOLUME_RULES oldRules;
+
+    if (Rules != NULL) {
+        InterlockedIncrement(&Rules->RefCount);
+    }
+
+    FltAcquirePushLockExclusive(&InstanceContext->RulesLock);
+    oldRules = InstanceContext->Rules;
+    InstanceContext->Rules = Rules;
+    FltReleasePushLock(&InstanceContext->RulesLock);
+
+    if (oldRules != NULL) {
+        AvfReleaseVolumeRules(oldRules);
+    }
+}
+
+
+VOID
+AvfApplyPolicy(
+    _In_ PAVF_POLICY Policy
+    )
+/*++
+
+Routine Description:
+
+    Pushes the rule sets of a newly loaded policy to all instances, and
+    attaches to volumes that the policy names but that we are not attached
+    to (they were skipped by an earlier policy).
+
+Arguments:
+
+    Policy - The policy that was just published.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    NTSTATUS status;
+    PFLT_INSTANCE *instances;
+    ULONG instanceCount;
+    PAVF_INSTANCE_CONTEXT instanceContext;
+    PAVF_VOLUME_RULES rules;
+    PFLT_VOLUME volume;
+    ULONG i;
+
+    PAGED_CODE();
+
+    status = AvfEnumerateInstances(&instances, &instanceCount);
+
+    if (NT_SUCCESS(status)) {
+
+        for (i = 0; i < instanceCount; i++) {
+
+            status = FltGetInstanceContext(instances[i], &instanceContext);
+            if (!NT_SUCCESS(status)) {
+                continue;
+            }
+
+            rules = AvfLookupVolumeRules(&instanceContext->VolumeName, NULL);
+            AvfSetInstanceRules(instanceContext, rules);
+
+            if (rules != NULL) {
+                AvfReleaseVolumeRules(rules);
+            }
+
+            FltReleaseContext(instanceContext);
+        }
+
+        AvfFreeInstanceList(instances, instanceCount);
+    }
+
+    for (i = 0; i < Policy->VolumeCount; i++) {
+
+        status = FltGetVolumeFromName(gFilterHandle,
+                                      &Policy->Volumes[i]->VolumeName,
+                                      &volume);
+
+        if (!NT_SUCCESS(status)) {
+            DbgPrint("AVF: Policy volume %wZ not found, status=0x%x\n",
+                     &Policy->Volumes[i]->VolumeName, status);
+            continue;
+        }
+
+        //
+        //  Fails with STATUS_FLT_INSTANCE_NAME_COLLISION when we are already
+        //  attached, which is the common case.
+        //
+
+        FltAttachVolume(gFilterHandle, volume, NULL, NULL);
+        FltObjectDereference(volume);
+    }
+}
+
+
+NTSTATUS
+AvfEnumerateInstances(
+    _Outptr_result_buffer_(*InstanceCount) PFLT_INSTANCE **Instances,
+    _Out_ PULONG InstanceCount
+    )
+/*++
+
+Routine Description:
+
+    Returns a referenced list of all instances of this filter.
+
+Arguments:
+
+    Instances - Receives the instance array.  Free with AvfFreeInstanceList.
+    InstanceCount - Receives the number of instances.
+
+Return Value:
+
+    STATUS_SUCCESS or an error status.
+
+--*/
+{
+    NTSTATUS status;
+    PFLT_INSTANCE *instances = NULL;
+    ULONG count = 0;
+
+    PAGED_CODE();
+
+    *Instances = NULL;
+    *InstanceCount = 0;
+
+    for (;;) {
+
+        status = FltEnumerateInstances(NULL,
+                                       gFilterHandle,
+                                       instances,
+                                       count,
+                                       &count);
+
+        if (status != STATUS_BUFFER_TOO_SMALL) {
+            break;
+        }
+
+        if (instances != NULL) {
+            ExFreePoolWithTag(instances, AVF_POLICY_TAG);
+        }
+
+        instances = ExAllocatePoolZero(PagedPool,
+                                       count * sizeof(PFLT_INSTANCE),
+                                       AVF_POLICY_TAG);
+
+        if (instances == NULL) {
+            return STATUS_INSUFFICIENT_RESOURCES;
+        }
+    }
+
+    if (!NT_SUCCESS(status)) {
+        if (instances != NULL) {
+            ExFreePoolWithTag(instances, AVF_POLICY_TAG);
+        }
+        return status;
+    }
+
+    *Instances = instances;
+    *InstanceCount = count;
+    return STATUS_SUCCESS;
+}
+
+
+VOID
+AvfFreeInstanceList(
+    _In_reads_(InstanceCount) PFLT_INSTANCE *Instances,
+    _In_ ULONG InstanceCount
+    )
+/*++
+
+Routine Description:
+
+    Dereferences and frees a list returned by AvfEnumerateInstances.
+
+Arguments:
+
+    Instances - The instance array.
+    InstanceCount - The number of instances.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    ULONG i;
+
+    PAGED_CODE();
+
+    if (Instances == NULL) {
+        return;
+    }
+
+    for (i = 0; i < InstanceCount; i++) {
+        FltObjectDereference(Instances[i]);
+    }
+
+    ExFreePoolWithTag(Instances, AVF_POLICY_TAG);
+}
+
+
+BOOLEAN
+AvfMatchPathRules(
+    _In_ PAVF_VOLUME_RULES Rules,
+    _In_ PCUNICODE_STRING RelativePath
+    )
+/*++
+
+Routine Description:
+
+    Checks a volume-relative path against the rules of a volume.
+
+Arguments:
+
+    Rules - The rule set of the volume.
+    RelativePath - Volume-relative path, without any stream suffix.
+
+Return Value:
+
+    TRUE if the path is protected.
+
+--*/
+{
+    PAVF_PATH_ENTRY entry;
+    USHORT prefixChars;
+    ULONG i;
+
+    if (Rules->MonitorAll) {
+        return TRUE;
+    }
+
+    for (i = 0; i < Rules->RuleCount; i++) {
+
+        entry = &Rules->Rules[i];
+
+        if (FlagOn(entry->Flags, AVF_PATH_RULE_PREFIX)) {
+
+            if (!RtlPrefixUnicodeString(&entry->Path, RelativePath, TRUE)) {
+                continue;
+            }
+
+            //
+            //  "\Data" must match "\Data\x" but not "\Database"
+            //
+
+            prefixChars = entry->Path.Length / sizeof(WCHAR);
+
+            if (RelativePath->Length == entry->Path.Length ||
+                entry->Path.Buffer[prefixChars - 1] == L'\\' ||
+                RelativePath->Buffer[prefixChars] == L'\\') {
+
+                return TRUE;
+            }
+
+        } else if (RtlEqualUnicodeString(&entry->Path, RelativePath, TRUE)) {
+
+            return TRUE;
+        }
+    }
+
+    return FALSE;
+}
+
+
+BOOLEAN
+AvfMatchFileId(
+    _In_ PAVF_VOLUME_RULES Rules,
+    _In_ PFILE_ID_128 FileId
+    )
+/*++
+
+Routine Description:
+
+    Checks a file ID against the protected file IDs of a volume.
+
+Arguments:
+
+    Rules - The rule set of the volume.
+    FileId - 128-bit file ID of the file.
+
+Return Value:
+
+    TRUE if the file is protected.
+
+--*/
+{
+    ULONG low = 0;
+    ULONG high = Rules->FileIdCount;
+    ULONG mid;
+    int cmp;
+
+    while (low < high) {
+
+        mid = low + (high - low) / 2;
+        cmp = memcmp(FileId, &Rules->FileIds[mid], sizeof(FILE_ID_128));
+
+        if (cmp == 0) {
+            return TRUE;
+        }
+
+        if (cmp < 0) {
+            high = mid;
+        } else {
+            low = mid + 1;
+        }
+    }
+
+    return FALSE;
+}
+
+
+BOOLEAN
+AvfBloomContains(
+    _In_ PAVF_VOLUME_RULES Rules,
+    _In_ PFILE_ID_128 FileId
+    )
+/*++
+
+Routine Description:
+
+    Checks a file ID against the Bloom filter of a volume.  A FALSE answer
+    is exact; a TRUE answer may be a false positive and is settled by user
+    mode.
+
+Arguments:
+
+    Rules - The rule set of the volume.
+    FileId - 128-bit file ID of the file.
+
+Return Value:
+
+    TRUE if the file may be protected.
+
+--*/
+{
+    ULONGLONG hash;
+    ULONG bit;
+    ULONG i;
+
+    if (Rules->BloomBitCount == 0) {
+        return FALSE;
+    }
+
+    hash = AvfHashFileId(FileId);
+
+    for (i = 0; i < Rules->BloomHashCount; i++) {
+
+        bit = AvfBloomProbe(hash, i, Rules->BloomBitCount);
+
+        if (!FlagOn(Rules->BloomBits[bit / 32], 1UL << (bit % 32))) {
+            return FALSE;
+        }
+    }
+
+    return TRUE;
+}
+
+
+BOOLEAN
+AvfCreateNeedsReport(
+    _In_ PAVF_VOLUME_RULES Rules,
+    _In_ PFLT_CALLBACK_DATA Data
+    )
+/*++
+
+Routine Description:
+
+    Applies the create filter of a volume to a pre-create operation.
+
+Arguments:
+
+    Rules - The rule set of the volume.
+    Data - Callback data of the create.
+
+Return Value:
+
+    TRUE if the open must be reported to user mode, FALSE if it cannot read
+    or modify content and may be allowed without asking.
+
+--*/
+{
+    PAVF_CREATE_FILTER filter = &Rules->CreateFilter;
+    ACCESS_MASK desiredAccess;
+    ULONG createOptions;
+    ULONG disposition;
+    USHORT shareAccess;
+
+    if (!FlagOn(filter->Flags, AVF_CREATE_FILTER_ENABLED)) {
+        return TRUE;
+    }
+
+    desiredAccess = Data->Iopb->Parameters.Create.SecurityContext->DesiredAccess;
+    createOptions = Data->Iopb->Parameters.Create.Options & FILE_VALID_OPTION_FLAGS;
+    disposition = (Data->Iopb->Parameters.Create.Options >> 24) & 0xFF;
+    shareAccess = Data->Iopb->Parameters.Create.ShareAccess;
+
+    if (FlagOn(desiredAccess, filter->AccessMask)) {
+        return TRUE;
+    }
+
+    if (disposition <= FILE_MAXIMUM_DISPOSITION &&
+        FlagOn(filter->Dispositions, 1UL << disposition)) {
+        return TRUE;
+    }
+
+    if (FlagOn(filter->ShareDenyMask, ~(ULONG)shareAccess)) {
+        return TRUE;
+    }
+
+    if (FlagOn(filter->Flags, AVF_CREATE_FILTER_DELETE_ON_CLOSE) &&
+        FlagOn(createOptions, FILE_DELETE_ON_CLOSE)) {
+        return TRUE;
+    }
+
+    return FALSE;
+}
+
+
+
+
+BOOLEAN
+AvfSampleOperation(
+    _In_ PAVF_VOLUME_RULES Rules,
+    _In_ PAVF_INSTANCE_CONTEXT InstanceContext
+    )
+/*++
+
+Routine Description:
+
+    Decides whether an operation in monitor-all mode is reported: it must
+    be picked by the policy's sampling and be within its process's report
+    rate (see "Sampling" in avf.h).  Operations that are not reported are
+    counted against the volume and the process.
+
+Arguments:
+
+    Rules - The monitor-all rule set.
+    InstanceContext - The instance context of the volume.
+
+Return Value:
+
+    TRUE if the operation must be reported, FALSE if it is allowed without.
+
+--*/
+{
+    PAVF_SAMPLING sampling = &Rules->Sampling;
+    BOOLEAN sampled;
+    LONG64 now;
+    LONG64 windowStart;
+    ULONG seen;
+
+    switch (sampling->Mode) {
+
+    case AVF_SAMPLE_ONE_IN_N:
+
+        seen = (ULONG)InterlockedIncrement(&Rules->SampleCount);
+        sampled = (seen % sampling->Rate) == 0;
+        break;
+
+    case AVF_SAMPLE_RESERVOIR:
+
+        //
+        //  Whoever sees the window expire starts the next one.  Operations
+        //  racing with the reset count in either window, which only shifts
+        //  a report or two between them.
+        //
+
+        now = (LONG64)KeQueryInterruptTime();
+        windowStart = Rules->WindowStart;
+
+        if (now - windowStart >= (LONG64)sampling->WindowMs * 10000 &&
+            InterlockedCompareExchange64(&Rules->WindowStart, now, windowStart) == windowStart) {
+
+            InterlockedExchange(&Rules->SampleCount, 0);
+        }
+
+        seen = (ULONG)InterlockedIncrement(&Rules->SampleCount);
+
+        //
+        //  The first Rate operations fill the reservoir; the n-th after
+        //  them is admitted with probability Rate / n.  The seed is shared
+        //  without a lock: a lost update only repeats a random number.
+        //
+
+        sampled = seen <= sampling->Rate ||
+                  (ULONGLONG)RtlRandomEx(&Rules->RandomSeed) * seen <
+                      (ULONGLONG)sampling->Rate * MAXLONG;
+        break;
+
+    default:
+
+        sampled = TRUE;
+        break;
+    }
+
+    if (!sampled) {
+        InterlockedIncrement64(&InstanceContext->SampledOut);
+        AvfAdmitProcessReport(PsGetCurrentProcessId(), FALSE, sampling);
+        return FALSE;
+    }
+
+    if (sampling->ProcessRate != 0 &&
+        !AvfAdmitProcessReport(PsGetCurrentProcessId(), TRUE, sampling)) {
+
+        InterlockedIncrement64(&InstanceContext->RateLimited);
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+
+NTSTATUS
+AvfGetVolumeStatistics(
+    _Out_writes_bytes_to_(OutputBufferLength, *ReturnOutputBufferLength) PAVF_VOLUME_STATISTICS OutputBuffer,
+    _In_ ULONG OutputBufferLength,
+    _Out_ PULONG ReturnOutputBufferLength
+    )
+/*++
+
+Routine Description:
+
+    Returns the counters of every attached volume.
+
+Arguments:
+
+    OutputBuffer - User-mode buffer receiving an array of
+                   AVF_VOLUME_STATISTICS.
+    OutputBufferLength - Size of the buffer in bytes.
+    ReturnOutputBufferLength - Receives the number of bytes written.
+
+Return Value:
+
+    STATUS_SUCCESS, or STATUS_BUFFER_OVERFLOW if not every volume fit.
+
+--*/
+{
+    NTSTATUS status;
+    PFLT_INSTANCE *instances;
+    ULONG instanceCount;
+    PAVF_INSTANCE_CONTEXT instanceContext;
+    PAVF_VOLUME_RULES rules;
+    AVF_VOLUME_STATISTICS statistics;
+    ULONG written = 0;
+    ULONG i;
+
+    PAGED_CODE();
+
+    *ReturnOutputBufferLength = 0;
+
+    status = AvfEnumerateInstances(&instances, &instanceCount);
+    if (!NT_SUCCESS(status)) {
+        return status;
+    }
+
+    for (i = 0; i < instanceCount; i++) {
+
+        if (OutputBufferLength - written < sizeof(AVF_VOLUME_STATISTICS)) {
+            status = STATUS_BUFFER_OVERFLOW;
+            break;
+        }
+
+        if (!NT_SUCCESS(FltGetInstanceContext(instances[i], &instanceContext))) {
+            continue;
+        }
+
+        RtlZeroMemory(&statistics, sizeof(statistics));
+
+        RtlCopyMemory(statistics.VolumeName,
+                      instanceContext->VolumeName.Buffer,
+                      min(instanceContext->VolumeName.Length,
+                          sizeof(statistics.VolumeName) - sizeof(WCHAR)));
+
+        rules = AvfGetInstanceRules(instanceContext);
+        if (rules != NULL) {
+            statistics.Active = 1;
+            statistics.RuleCount = rules->RuleCount;
+            statistics.FileIdCount = rules->FileIdCount;
+            statistics.BloomBitCount = rules->BloomBitCount;
+            statistics.BloomHashCount = rules->BloomHashCount;
+            AvfReleaseVolumeRules(rules);
+        }
+
+        statistics.Operations = instanceContext->Operations;
+        statistics.Notified = instanceContext->Notified;
+        statistics.Blocked = instanceContext->Blocked;
+        statistics.CreatesFiltered = instanceContext->CreatesFiltered;
+        statistics.CacheHits = instanceContext->CacheHits;
+        statistics.BloomPositives = instanceContext->BloomPositives;
+        statistics.SampledOut = instanceContext->SampledOut;
+        statistics.RateLimited = instanceContext->RateLimited;
+
+        FltReleaseContext(instanceContext);
+
+        __try {
+
+            RtlCopyMemory(Add2Ptr(OutputBuffer, written), &statistics, sizeof(statistics));
+
+        } __except (EXCEPTION_EXECUTE_HANDLER) {
+
+            status = GetExceptionCode();
+            break;
+        }
+
+        written += sizeof(AVF_VOLUME_STATISTICS);
+    }
+
+    AvfFreeInstanceList(instances, instanceCount);
+
+    *ReturnOutputBufferLength = written;
+    return status;
+}
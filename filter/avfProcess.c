@@ -0,0 +1,569 @@
+/*++
+
+Copyright (c) 1989-2002  Microsoft Corporation
+Modified for AV Filter functionality
+
+Module Name:
+
+    avfProcess.c
+
+Abstract:
+
+    This module maintains the PID-keyed process table used to attach
+    process identity to file access notifications.  The table is fed by
+    process create/exit notifications so that the image name of a process
+    is looked up and converted once, instead of on every file event.
+
+Environment:
+
+    Kernel mode
+
+--*/
+
+#include <fltKernel.h>
+#include <dontuse.h>
+#include <suppress.h>
+#include "avfKern.h"
+
+//
+//  Process table state
+//
+
+LIST_ENTRY gProcessBuckets[AVF_PROCESS_TABLE_BUCKETS];
+EX_PUSH_LOCK gProcessTableLock;
+volatile LONG gProcessKeySequence = 0;
+BOOLEAN gProcessNotifyRegistered = FALSE;
+
+#define AvfProcessBucket(_pid) \
+    (&gProcessBuckets[((ULONG_PTR)(_pid) >> 2) & (AVF_PROCESS_TABLE_BUCKETS - 1)])
+
+//
+//  Function prototypes
+//
+
+VOID
+AvfProcessNotify(
+    _Inout_ PEPROCESS Process,
+    _In_ HANDLE ProcessId,
+    _Inout_opt_ PPS_CREATE_NOTIFY_INFO CreateInfo
+    );
+
+PAVF_PROCESS_ENTRY
+AvfFindProcessLocked(
+    _In_ HANDLE ProcessId
+    );
+
+VOID
+AvfInsertProcess(
+    _In_ PEPROCESS Process,
+    _In_ HANDLE ProcessId,
+    _In_ BOOLEAN Replace
+    );
+
+VOID
+AvfRemoveProcess(
+    _In_ HANDLE ProcessId
+    );
+
+#ifdef ALLOC_PRAGMA
+#pragma alloc_text(INIT, AvfProcessTableInitialize)
+#pragma alloc_text(PAGE, AvfProcessTableUninitialize)
+#pragma alloc_text(PAGE, AvfProcessNotify)
+#pragma alloc_text(PAGE, AvfInsertProcess)
+#pragma alloc_text(PAGE, AvfRemoveProcess)
+#endif
+
+
+NTSTATUS
+AvfProcessTableInitialize(
+    VOID
+    )
+/*++
+
+Routine Description:
+
+    Initializes the process table and registers for process create/exit
+    notifications.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    STATUS_SUCCESS, or the status returned by
+    PsSetCreateProcessNotifyRoutineEx.
+
+--*/
+{
+    NTSTATUS status;
+    ULONG i;
+
+    for (i = 0; i < AVF_PROCESS_TABLE_BUCKETS; i++) {
+        InitializeListHead(&gProcessBuckets[i]);
+    }
+
+    FltInitializePushLock(&gProcessTableLock);
+
+    //
+    //  Requires the image to be linked with /INTEGRITYCHECK.
+    //
+
+    status = PsSetCreateProcessNotifyRoutineEx(AvfProcessNotify, FALSE);
+
+    if (!NT_SUCCESS(status)) {
+        DbgPrint("AVF: Failed to register process notify routine, status=0x%x\n", status);
+        FltDeletePushLock(&gProcessTableLock);
+        return status;
+    }
+
+    gProcessNotifyRegistered = TRUE;
+    return STATUS_SUCCESS;
+}
+
+
+VOID
+AvfProcessTableUninitialize(
+    VOID
+    )
+/*++
+
+Routine Description:
+
+    Unregisters the process notification routine and frees every entry in
+    the process table.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    PLIST_ENTRY link;
+    PAVF_PROCESS_ENTRY entry;
+    ULONG i;
+
+    PAGED_CODE();
+
+    if (!gProcessNotifyRegistered) {
+        return;
+    }
+
+    PsSetCreateProcessNotifyRoutineEx(AvfProcessNotify, TRUE);
+    gProcessNotifyRegistered = FALSE;
+
+    FltAcquirePushLockExclusive(&gProcessTableLock);
+
+    for (i = 0; i < AVF_PROCESS_TABLE_BUCKETS; i++) {
+        while (!IsListEmpty(&gProcessBuckets[i])) {
+            link = RemoveHeadList(&gProcessBuckets[i]);
+            entry = CONTAINING_RECORD(link, AVF_PROCESS_ENTRY, Link);
+            ExFreePoolWithTag(entry, AVF_PROCESS_TAG);
+        }
+    }
+
+    FltReleasePushLock(&gProcessTableLock);
+    FltDeletePushLock(&gProcessTableLock);
+}
+
+
+VOID
+AvfProcessNotify(
+    _Inout_ PEPROCESS Process,
+    _In_ HANDLE ProcessId,
+    _Inout_opt_ PPS_CREATE_NOTIFY_INFO CreateInfo
+    )
+/*++
+
+Routine Description:
+
+    Process create/exit notification routine.  Adds the new process to the
+    table on creation and removes it on exit.
+
+Arguments:
+
+    Process - The process being created or exiting.
+    ProcessId - The ID of the process.
+    CreateInfo - Creation information, or NULL if the process is exiting.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    PAGED_CODE();
+
+    if (CreateInfo != NULL) {
+        AvfInsertProcess(Process, ProcessId, TRUE);
+    } else {
+        AvfRemoveProcess(ProcessId);
+    }
+}
+
+
+PAVF_PROCESS_ENTRY
+AvfFindProcessLocked(
+    _In_ HANDLE ProcessId
+    )
+/*++
+
+Routine Description:
+
+    Finds the process table entry for a process ID.  The caller must hold
+    gProcessTableLock.
+
+Arguments:
+
+    ProcessId - The ID of the process.
+
+Return Value:
+
+    The entry, or NULL if the process is not in the table.
+
+--*/
+{
+    PLIST_ENTRY bucket = AvfProcessBucket(ProcessId);
+    PLIST_ENTRY link;
+    PAVF_PROCESS_ENTRY entry;
+
+    for (link = bucket->Flink; link != bucket; link = link->Flink) {
+        entry = CONTAINING_RECORD(link, AVF_PROCESS_ENTRY, Link);
+        if (entry->ProcessId == ProcessId) {
+            return entry;
+        }
+    }
+
+    return NULL;
+}
+
+
+VOID
+AvfInsertProcess(
+    _In_ PEPROCESS Process,
+    _In_ HANDLE ProcessId,
+    _In_ BOOLEAN Replace
+    )
+/*++
+
+Routine Description:
+
+    Resolves the full image path of a process and inserts it into the
+    process table with a new process key.
+
+    A new process replaces any entry left for its ID: an entry whose
+    process is gone must not pass its name, key and so its cached verdicts
+    on to the process that reuses the ID.  Otherwise an entry is only added
+    if there is none and the process is not exiting, since its exit
+    notification may already have run and nothing would remove it.  The
+    exit status is checked under the table lock, which the exit
+    notification needs to remove an entry, so the two cannot cross.
+
+Arguments:
+
+    Process - The process object.
+    ProcessId - The ID of the process.
+    Replace - TRUE when called for a new process.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    NTSTATUS status;
+    PUNICODE_STRING imageName = NULL;
+    PAVF_PROCESS_ENTRY entry;
+    PAVF_PROCESS_ENTRY oldEntry;
+    USHORT nameLength = 0;
+
+    PAGED_CODE();
+
+    status = SeLocateProcessImageName(Process, &imageName);
+
+    if (NT_SUCCESS(status) && imageName != NULL) {
+        nameLength = imageName->Length;
+    }
+
+    entry = ExAllocatePoolZero(PagedPool,
+                               sizeof(AVF_PROCESS_ENTRY) + nameLength,
+                               AVF_PROCESS_TAG);
+
+    if (entry != NULL) {
+
+        entry->ProcessId = ProcessId;
+        entry->ProcessKey = (ULONG)InterlockedIncrement(&gProcessKeySequence);
+        entry->ImageName.Buffer = (PWCH)(entry + 1);
+        entry->ImageName.Length = nameLength;
+        entry->ImageName.MaximumLength = nameLength;
+
+        if (nameLength != 0) {
+            RtlCopyMemory(entry->ImageName.Buffer, imageName->Buffer, nameLength);
+        }
+
+        FltAcquirePushLockExclusive(&gProcessTableLock);
+
+        oldEntry = AvfFindProcessLocked(ProcessId);
+
+        if (Replace && oldEntry != NULL) {
+            RemoveEntryList(&oldEntry->Link);
+        } else {
+            oldEntry = NULL;
+        }
+
+        if (Replace ||
+            (AvfFindProcessLocked(ProcessId) == NULL &&
+             PsGetProcessExitStatus(Process) == STATUS_PENDING)) {
+
+            InsertHeadList(AvfProcessBucket(ProcessId), &entry->Link);
+            entry = NULL;
+        }
+
+        FltReleasePushLock(&gProcessTableLock);
+
+        if (entry != NULL) {
+            ExFreePoolWithTag(entry, AVF_PROCESS_TAG);
+        }
+
+        if (oldEntry != NULL) {
+            ExFreePoolWithTag(oldEntry, AVF_PROCESS_TAG);
+        }
+    }
+
+    if (imageName != NULL) {
+        ExFreePool(imageName);
+    }
+}
+
+
+VOID
+AvfRemoveProcess(
+    _In_ HANDLE ProcessId
+    )
+/*++
+
+Routine Description:
+
+    Removes a process from the process table.
+
+Arguments:
+
+    ProcessId - The ID of the exiting process.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    PAVF_PROCESS_ENTRY entry;
+
+    PAGED_CODE();
+
+    FltAcquirePushLockExclusive(&gProcessTableLock);
+
+    entry = AvfFindProcessLocked(ProcessId);
+    if (entry != NULL) {
+        RemoveEntryList(&entry->Link);
+    }
+
+    FltReleasePushLock(&gProcessTableLock);
+
+    if (entry != NULL) {
+        ExFreePoolWithTag(entry, AVF_PROCESS_TAG);
+    }
+}
+
+
+BOOLEAN
+AvfLookupProcess(
+    _In_ HANDLE ProcessId,
+    _Out_opt_ PULONG ProcessKey,
+    _Out_writes_bytes_opt_(NameSize) PWCHAR Name,
+    _In_ ULONG NameSize,
+    _Out_opt_ PULONG Dropped
+    )
+/*++
+
+Routine Description:
+
+    Looks up a process in the process table and returns its key and image
+    path.  Processes that were started before the driver loaded are added
+    on first lookup when called at PASSIVE_LEVEL.
+
+    If the image path does not fit in the buffer, its tail is returned
+    since the final components are the most identifying part of the path.
+
+Arguments:
+
+    ProcessId - The ID of the process.
+    ProcessKey - Receives the driver-assigned process key (0 if not found).
+    Name - Buffer to receive the null-terminated image path.
+    NameSize - Size of the Name buffer in bytes.
+    Dropped - Receives the operations of the process that were not reported
+              since it was last looked up with Dropped, and resets them.
+
+Return Value:
+
+    TRUE if the process was found, FALSE otherwise.
+
+--*/
+{
+    PAVF_PROCESS_ENTRY entry;
+    PEPROCESS process;
+    USHORT offset;
+    USHORT length;
+    BOOLEAN retried = FALSE;
+
+    if (ProcessKey != NULL) {
+        *ProcessKey = 0;
+    }
+
+    if (Name != NULL && NameSize >= sizeof(WCHAR)) {
+        Name[0] = UNICODE_NULL;
+    }
+
+    if (Dropped != NULL) {
+        *Dropped = 0;
+    }
+
+    for (;;) {
+
+        FltAcquirePushLockShared(&gProcessTableLock);
+
+        entry = AvfFindProcessLocked(ProcessId);
+
+        if (entry != NULL) {
+
+            if (ProcessKey != NULL) {
+                *ProcessKey = entry->ProcessKey;
+            }
+
+            if (Dropped != NULL) {
+                *Dropped = (ULONG)InterlockedExchange(&entry->Dropped, 0);
+            }
+
+            if (Name != NULL && NameSize >= sizeof(WCHAR)) {
+
+                length = entry->ImageName.Length;
+                offset = 0;
+
+                if (length > NameSize - sizeof(WCHAR)) {
+                    offset = length - (USHORT)((NameSize - sizeof(WCHAR)) & ~1);
+                    length -= offset;
+                }
+
+                RtlCopyMemory(Name, Add2Ptr(entry->ImageName.Buffer, offset), length);
+                Name[length / sizeof(WCHAR)] = UNICODE_NULL;
+            }
+        }
+
+        FltReleasePushLock(&gProcessTableLock);
+
+        if (entry != NULL) {
+            return TRUE;
+        }
+
+        //
+        //  Not in the table.  The process predates the driver, so add it now
+        //  if we are allowed to resolve its image name here.  A process that
+        //  is exiting is not added back (see AvfInsertProcess).
+        //
+
+        if (retried || KeGetCurrentIrql() != PASSIVE_LEVEL) {
+            return FALSE;
+        }
+
+        if (!NT_SUCCESS(PsLookupProcessByProcessId(ProcessId, &process))) {
+            return FALSE;
+        }
+
+        AvfInsertProcess(process, ProcessId, FALSE);
+        ObDereferenceObject(process);
+
+        retried = TRUE;
+    }
+}
+
+
+BOOLEAN
+AvfAdmitProcessReport(
+    _In_ HANDLE ProcessId,
+    _In_ BOOLEAN Sampled,
+    _In_ PAVF_SAMPLING Sampling
+    )
+/*++
+
+Routine Description:
+
+    Charges an operation that sampling picked for reporting to its
+    process's token bucket, or counts an operation that is not reported
+    against its process.
+
+    The bucket is kept as the time at which it is full again (a virtual
+    scheduling token bucket): each report moves that time one period of
+    1 / ProcessRate seconds on, and a report is refused if that would put
+    it more than ProcessBurst periods ahead of now.  This needs a single
+    compare-exchange, with no lock on the paged entry.
+
+    Processes that are not in the table yet are not limited.
+
+Arguments:
+
+    ProcessId - The ID of the process.
+    Sampled - TRUE if the operation was picked for reporting.
+    Sampling - The policy's sampling settings.
+
+Return Value:
+
+    TRUE if the operation must be reported, FALSE if it is allowed without.
+
+--*/
+{
+    PAVF_PROCESS_ENTRY entry;
+    LONG64 now;
+    LONG64 period;
+    LONG64 reportTime;
+    LONG64 next;
+    BOOLEAN admitted = Sampled;
+
+    FltAcquirePushLockShared(&gProcessTableLock);
+
+    entry = AvfFindProcessLocked(ProcessId);
+
+    if (entry != NULL) {
+
+        if (Sampled) {
+
+            now = (LONG64)KeQueryInterruptTime();
+            period = 10000000 / max(Sampling->ProcessRate, 1);
+
+            for (;;) {
+
+                reportTime = entry->ReportTime;
+                next = max(reportTime, now) + period;
+
+                if (next - now > period * Sampling->ProcessBurst) {
+                    admitted = FALSE;
+                    break;
+                }
+
+                if (InterlockedCompareExchange64(&entry->ReportTime, next, reportTime) == reportTime) {
+                    break;
+                }
+            }
+        }
+
+        if (!admitted) {
+            InterlockedIncrement(&entry->Dropped);
+        }
+    }
+
+    FltReleasePushLock(&gProcessTableLock);
+
+    return admitted;
+}
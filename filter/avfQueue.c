@@ -0,0 +1,1093 @@
+/*++
+
+Copyright (c) 1989-2002  Microsoft Corporation
+Modified for AV Filter functionality
+
+Module Name:
+
+    avfQueue.c
+
+Abstract:
+
+    This module holds the operations that are pended while user mode
+    decides on them.  The pre-operation callback queues a request and
+    returns FLT_PREOP_PENDING, so the thread that issued the I/O is not
+    held in FltSendMessage.  Dispatcher threads deliver the notifications,
+    each to the engine worker near the processor its operation was raised
+    on, and the verdicts complete the operations.
+
+Environment:
+
+    Kernel mode
+
+--*/
+
+#include <fltKernel.h>
+#include <dontuse.h>
+#include <suppress.h>
+#include "avfKern.h"
+
+//
+//  Queue state.  gPendedList holds every queued request in arrival order,
+//  and gPendedBuckets the same requests by request ID, for verdicts to
+//  find them; gSendList holds the ones that have not been delivered yet.
+//  All are protected by gQueueLock.
+//
+
+KSPIN_LOCK gQueueLock;
+LIST_ENTRY gPendedList;
+LIST_ENTRY gPendedBuckets[AVF_PENDED_BUCKETS];
+LIST_ENTRY gSendList;
+BOOLEAN gQueueShutdown = FALSE;
+
+#define AvfPendedBucket(_id) \
+    (&gPendedBuckets[(_id) & (AVF_PENDED_BUCKETS - 1)])
+
+KEVENT gQueueWorkEvent;
+KEVENT gQueueShutdownEvent;
+
+PKTHREAD gDispatchThreads[AVF_DISPATCH_THREAD_COUNT];
+
+volatile LONG gRequestIdSequence = 0;
+
+//
+//  Engine connections, by slot.  A connection claims a free slot by setting
+//  InUse, fills in Group and Mask (the processors whose operations it
+//  takes) and only then publishes Port, so the dispatchers, which read the
+//  table without a lock, never see a port with another connection's
+//  processors.  The slot is given back by clearing InUse once
+//  FltCloseClientPort has cleared Port.  gEnginePortLimit is one more than
+//  the highest slot taken so far.
+//
+
+typedef struct _AVF_ENGINE_PORT {
+    PFLT_PORT Port;
+    USHORT Group;
+    ULONGLONG Mask;
+    volatile LONG InUse;
+} AVF_ENGINE_PORT, *PAVF_ENGINE_PORT;
+
+AVF_ENGINE_PORT gEnginePorts[AVF_MAX_ENGINE_CONNECTIONS];
+volatile LONG gEngineConnections = 0;
+volatile LONG gEnginePortLimit = 0;
+volatile LONG gEnginePortNext = 0;
+
+//
+//  Function prototypes
+//
+
+KSTART_ROUTINE AvfDispatchThread;
+VOID
+AvfDispatchThread(
+    _In_ PVOID StartContext
+    );
+
+VOID
+AvfCancelPendedOperation(
+    _In_ PFLT_CALLBACK_DATA Data
+    );
+
+BOOLEAN
+AvfDequeueRequestLocked(
+    _In_ PAVF_PENDED_REQUEST Request
+    );
+
+VOID
+AvfCompleteRequest(
+    _In_ PAVF_PENDED_REQUEST Request,
+    _In_ BOOLEAN Block
+    );
+
+VOID
+AvfExpireRequests(
+    VOID
+    );
+
+NTSTATUS
+AvfSendNotification(
+    _In_ PAVF_PENDED_REQUEST Request
+    );
+
+//
+//  Everything else here takes gQueueLock and so stays in nonpaged code
+//
+
+#ifdef ALLOC_PRAGMA
+#pragma alloc_text(INIT, AvfQueueInitialize)
+#endif
+
+
+NTSTATUS
+AvfQueueInitialize(
+    VOID
+    )
+/*++
+
+Routine Description:
+
+    Initializes the pended operation queue and starts the dispatcher
+    threads.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    STATUS_SUCCESS, or the status returned by PsCreateSystemThread.
+
+--*/
+{
+    NTSTATUS status;
+    OBJECT_ATTRIBUTES oa;
+    HANDLE threadHandle;
+    ULONG i;
+
+    KeInitializeSpinLock(&gQueueLock);
+    InitializeListHead(&gPendedList);
+
+    for (i = 0; i < AVF_PENDED_BUCKETS; i++) {
+        InitializeListHead(&gPendedBuckets[i]);
+    }
+    InitializeListHead(&gSendList);
+    gQueueShutdown = FALSE;
+
+    KeInitializeEvent(&gQueueWorkEvent, SynchronizationEvent, FALSE);
+    KeInitializeEvent(&gQueueShutdownEvent, NotificationEvent, FALSE);
+
+    InitializeObjectAttributes(&oa, NULL, OBJ_KERNEL_HANDLE, NULL, NULL);
+
+    for (i = 0; i < AVF_DISPATCH_THREAD_COUNT; i++) {
+
+        status = PsCreateSystemThread(&threadHandle,
+                                      THREAD_ALL_ACCESS,
+                                      &oa,
+                                      NULL,
+                                      NULL,
+                                      AvfDispatchThread,
+                                      NULL);
+
+        if (NT_SUCCESS(status)) {
+
+            status = ObReferenceObjectByHandle(threadHandle,
+                                               THREAD_ALL_ACCESS,
+                                               *PsThreadType,
+                                               KernelMode,
+                                               &gDispatchThreads[i],
+                                               NULL);
+            ZwClose(threadHandle);
+        }
+
+        if (!NT_SUCCESS(status)) {
+            DbgPrint("AVF: Failed to start dispatch thread, status=0x%x\n", status);
+            AvfQueueUninitialize();
+            return status;
+        }
+    }
+
+    return STATUS_SUCCESS;
+}
+
+
+VOID
+AvfQueueUninitialize(
+    VOID
+    )
+/*++
+
+Routine Description:
+
+    Stops the dispatcher threads and allows every operation that is still
+    queued.  No request is queued after this returns.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    KIRQL oldIrql;
+    ULONG i;
+
+    KeAcquireSpinLock(&gQueueLock, &oldIrql);
+    gQueueShutdown = TRUE;
+    KeReleaseSpinLock(&gQueueLock, oldIrql);
+
+    KeSetEvent(&gQueueShutdownEvent, IO_NO_INCREMENT, FALSE);
+
+    for (i = 0; i < AVF_DISPATCH_THREAD_COUNT; i++) {
+
+        if (gDispatchThreads[i] != NULL) {
+            KeWaitForSingleObject(gDispatchThreads[i], Executive, KernelMode, FALSE, NULL);
+            ObDereferenceObject(gDispatchThreads[i]);
+            gDispatchThreads[i] = NULL;
+        }
+    }
+
+    AvfFlushRequests(NULL);
+}
+
+
+PAVF_PENDED_REQUEST
+AvfAllocateRequest(
+    _In_ PFLT_CALLBACK_DATA Data,
+    _In_ PFLT_INSTANCE Instance
+    )
+/*++
+
+Routine Description:
+
+    Allocates a request for an operation and assigns it a request ID.
+
+Arguments:
+
+    Data - Callback data of the operation.
+    Instance - Instance the operation was seen on.
+
+Return Value:
+
+    The request with one reference, or NULL if out of memory.
+
+--*/
+{
+    PAVF_PENDED_REQUEST request;
+
+    request = ExAllocatePoolZero(NonPagedPoolNx,
+                                 sizeof(AVF_PENDED_REQUEST),
+                                 AVF_REQUEST_TAG);
+
+    if (request == NULL) {
+        return NULL;
+    }
+
+    request->RefCount = 1;
+    request->Data = Data;
+    request->Instance = Instance;
+
+    //
+    //  Zero is never a valid request ID
+    //
+
+    do {
+        request->Notification.RequestId = (ULONG)InterlockedIncrement(&gRequestIdSequence);
+    } while (request->Notification.RequestId == 0);
+
+    return request;
+}
+
+
+VOID
+AvfDereferenceRequest(
+    _In_ PAVF_PENDED_REQUEST Request
+    )
+/*++
+
+Routine Description:
+
+    Drops a reference on a request, freeing it with the last reference.
+
+Arguments:
+
+    Request - The request.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    if (InterlockedDecrement(&Request->RefCount) == 0) {
+
+        if (Request->StreamContext != NULL) {
+            FltReleaseContext(Request->StreamContext);
+        }
+
+        ExFreePoolWithTag(Request, AVF_REQUEST_TAG);
+    }
+}
+
+
+NTSTATUS
+AvfQueueRequest(
+    _In_ PAVF_PENDED_REQUEST Request
+    )
+/*++
+
+Routine Description:
+
+    Queues a request for delivery to user mode.  On success the queue owns
+    the caller's reference and the caller must return FLT_PREOP_PENDING
+    (or FLT_POSTOP_MORE_PROCESSING_REQUIRED for a post-operation request);
+    the operation may already have been completed by the time this returns.
+
+Arguments:
+
+    Request - The request, with its notification filled in.
+
+Return Value:
+
+    STATUS_PENDING - the request was queued.
+    STATUS_CANCELLED - the operation was cancelled; the caller completes it.
+    STATUS_FLT_DELETING_OBJECT - the queue is shutting down; the caller
+                                 lets the operation through.
+
+--*/
+{
+    NTSTATUS status;
+    KIRQL oldIrql;
+
+    Request->Deadline = KeQueryInterruptTime() + AVF_VERDICT_TIMEOUT;
+    KeGetCurrentProcessorNumberEx(&Request->Processor);
+
+    if (!Request->PostOperation) {
+        Request->Data->QueueContext[0] = Request;
+    }
+
+    KeAcquireSpinLock(&gQueueLock, &oldIrql);
+
+    if (gQueueShutdown) {
+        KeReleaseSpinLock(&gQueueLock, oldIrql);
+        return STATUS_FLT_DELETING_OBJECT;
+    }
+
+    InsertTailList(&gPendedList, &Request->Link);
+    InsertTailList(AvfPendedBucket(Request->Notification.RequestId), &Request->HashLink);
+    InsertTailList(&gSendList, &Request->SendLink);
+    Request->Queued = TRUE;
+
+    //
+    //  If the operation is cancelled from here on, AvfCancelPendedOperation
+    //  waits for the queue lock and completes it.  A create pended after
+    //  the file system completed it cannot be cancelled.
+    //
+
+    if (Request->PostOperation) {
+        status = STATUS_SUCCESS;
+    } else {
+        status = FltSetCancelCompletion(Request->Data, AvfCancelPendedOperation);
+    }
+
+    if (!NT_SUCCESS(status)) {
+        RemoveEntryList(&Request->Link);
+        RemoveEntryList(&Request->HashLink);
+        RemoveEntryList(&Request->SendLink);
+        Request->Queued = FALSE;
+    }
+
+    KeReleaseSpinLock(&gQueueLock, oldIrql);
+
+    if (!NT_SUCCESS(status)) {
+        return STATUS_CANCELLED;
+    }
+
+    KeSetEvent(&gQueueWorkEvent, IO_NO_INCREMENT, FALSE);
+
+    return STATUS_PENDING;
+}
+
+
+BOOLEAN
+AvfDequeueRequestLocked(
+    _In_ PAVF_PENDED_REQUEST Request
+    )
+/*++
+
+Routine Description:
+
+    Takes a request off the queue so the caller can complete it.  Fails if
+    the request was already taken or if its operation is being cancelled,
+    in which case AvfCancelPendedOperation completes it.  The caller must
+    hold gQueueLock.
+
+Arguments:
+
+    Request - The request.
+
+Return Value:
+
+    TRUE if the caller now owns the queue's reference and must complete
+    the operation.
+
+--*/
+{
+    if (!Request->Queued) {
+        return FALSE;
+    }
+
+    if (!Request->PostOperation &&
+        !NT_SUCCESS(FltClearCancelCompletion(Request->Data))) {
+        return FALSE;
+    }
+
+    RemoveEntryList(&Request->Link);
+    RemoveEntryList(&Request->HashLink);
+
+    if (!Request->Sent) {
+        RemoveEntryList(&Request->SendLink);
+        Request->Sent = TRUE;
+    }
+
+    Request->Queued = FALSE;
+    return TRUE;
+}
+
+
+VOID
+AvfCompleteRequest(
+    _In_ PAVF_PENDED_REQUEST Request,
+    _In_ BOOLEAN Block
+    )
+/*++
+
+Routine Description:
+
+    Completes the pended operation of a dequeued request and drops the
+    queue's reference.  Must be called at PASSIVE_LEVEL for a
+    post-operation request, since blocking it cancels the open.
+
+Arguments:
+
+    Request - The request, already taken off the queue.
+    Block - TRUE to fail the operation with STATUS_ACCESS_DENIED.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    PFLT_CALLBACK_DATA data = Request->Data;
+
+    if (Request->PostOperation) {
+
+        if (Block) {
+            FltCancelFileOpen(Request->Instance, data->Iopb->TargetFileObject);
+            data->IoStatus.Status = STATUS_ACCESS_DENIED;
+            data->IoStatus.Information = 0;
+        }
+
+        FltCompletePendedPostOperation(data);
+
+    } else if (Block) {
+
+        data->IoStatus.Status = STATUS_ACCESS_DENIED;
+        data->IoStatus.Information = 0;
+        FltCompletePendedPreOperation(data, FLT_PREOP_COMPLETE, NULL);
+
+    } else if (Request->StreamContext != NULL) {
+
+        //
+        //  An allowed write hands its stream context reference to
+        //  AvfPostWrite
+        //
+
+        FltCompletePendedPreOperation(data,
+                                      FLT_PREOP_SUCCESS_WITH_CALLBACK,
+                                      Request->StreamContext);
+        Request->StreamContext = NULL;
+
+    } else {
+
+        FltCompletePendedPreOperation(data, FLT_PREOP_SUCCESS_NO_CALLBACK, NULL);
+    }
+
+    AvfDereferenceRequest(Request);
+}
+
+
+VOID
+AvfCancelPendedOperation(
+    _In_ PFLT_CALLBACK_DATA Data
+    )
+/*++
+
+Routine Description:
+
+    Called by FltMgr when a pended operation is cancelled.  Removes its
+    request from the queue and completes it with STATUS_CANCELLED.
+
+Arguments:
+
+    Data - Callback data of the cancelled operation.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    PAVF_PENDED_REQUEST request = Data->QueueContext[0];
+    BOOLEAN removed = FALSE;
+    KIRQL oldIrql;
+
+    KeAcquireSpinLock(&gQueueLock, &oldIrql);
+
+    if (request->Queued) {
+
+        RemoveEntryList(&request->Link);
+        RemoveEntryList(&request->HashLink);
+
+        if (!request->Sent) {
+            RemoveEntryList(&request->SendLink);
+            request->Sent = TRUE;
+        }
+
+        request->Queued = FALSE;
+        removed = TRUE;
+    }
+
+    KeReleaseSpinLock(&gQueueLock, oldIrql);
+
+    if (removed) {
+
+        Data->IoStatus.Status = STATUS_CANCELLED;
+        Data->IoStatus.Information = 0;
+        FltCompletePendedPreOperation(Data, FLT_PREOP_COMPLETE, NULL);
+
+        AvfDereferenceRequest(request);
+    }
+}
+
+
+NTSTATUS
+AvfCompleteVerdict(
+    _In_ ULONG RequestId,
+    _In_ BOOLEAN Block,
+    _In_ BOOLEAN Speculative,
+    _In_ BOOLEAN NoCache
+    )
+/*++
+
+Routine Description:
+
+    Completes the operation a verdict from user mode refers to.
+
+Arguments:
+
+    RequestId - Request ID from the notification.
+    Block - TRUE to fail the operation with STATUS_ACCESS_DENIED.
+    Speculative - The operation is allowed ahead of the consultant's
+        verdict (AVF_VERDICT_FLAG_SPECULATIVE); its key is kept for that
+        verdict instead of caching this one.
+    NoCache - The verdict only holds for now (AVF_VERDICT_FLAG_NO_CACHE)
+        and is not cached.
+
+Return Value:
+
+    STATUS_SUCCESS, or STATUS_NOT_FOUND if the operation already completed
+    (it timed out or was cancelled).
+
+--*/
+{
+    PAVF_PENDED_REQUEST request = NULL;
+    PAVF_INSTANCE_CONTEXT instanceContext;
+    PLIST_ENTRY bucket = AvfPendedBucket(RequestId);
+    PLIST_ENTRY link;
+    KIRQL oldIrql;
+
+    KeAcquireSpinLock(&gQueueLock, &oldIrql);
+
+    for (link = bucket->Flink; link != bucket; link = link->Flink) {
+
+        request = CONTAINING_RECORD(link, AVF_PENDED_REQUEST, HashLink);
+
+        if (request->Notification.RequestId == RequestId) {
+            break;
+        }
+
+        request = NULL;
+    }
+
+    if (request != NULL && !AvfDequeueRequestLocked(request)) {
+        request = NULL;
+    }
+
+    KeReleaseSpinLock(&gQueueLock, oldIrql);
+
+    if (request == NULL) {
+        return STATUS_NOT_FOUND;
+    }
+
+    if (request->Cacheable && !NoCache) {
+        if (Speculative) {
+            AvfRememberAudit(RequestId, &request->CacheKey, request->FileEpoch);
+        } else {
+            AvfInsertVerdict(&request->CacheKey, request->FileEpoch, Block);
+        }
+    }
+
+    //
+    //  Count the block before completing; the instance may go away once the
+    //  operation is no longer pended
+    //
+
+    if (Block) {
+
+        DbgPrint("AVF: Blocking operation on %ws\n", request->Notification.FileName);
+
+        if (NT_SUCCESS(FltGetInstanceContext(request->Instance, &instanceContext))) {
+            InterlockedIncrement64(&instanceContext->Blocked);
+            FltReleaseContext(instanceContext);
+        }
+    }
+
+    AvfCompleteRequest(request, Block);
+
+    return STATUS_SUCCESS;
+}
+
+
+VOID
+AvfFlushRequests(
+    _In_opt_ PFLT_INSTANCE Instance
+    )
+/*++
+
+Routine Description:
+
+    Allows every queued operation, or every queued operation on one
+    instance.  Called when the client disconnects, when an instance is
+    torn down and when the driver unloads.
+
+Arguments:
+
+    Instance - Instance whose operations are flushed, or NULL for all.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    PAVF_PENDED_REQUEST request;
+    PLIST_ENTRY link;
+    PLIST_ENTRY next;
+    LIST_ENTRY flushList;
+    KIRQL oldIrql;
+
+    InitializeListHead(&flushList);
+
+    KeAcquireSpinLock(&gQueueLock, &oldIrql);
+
+    for (link = gPendedList.Flink; link != &gPendedList; link = next) {
+
+        next = link->Flink;
+        request = CONTAINING_RECORD(link, AVF_PENDED_REQUEST, Link);
+
+        if ((Instance == NULL || request->Instance == Instance) &&
+            AvfDequeueRequestLocked(request)) {
+
+            InsertTailList(&flushList, &request->Link);
+        }
+    }
+
+    KeReleaseSpinLock(&gQueueLock, oldIrql);
+
+    while (!IsListEmpty(&flushList)) {
+        link = RemoveHeadList(&flushList);
+        request = CONTAINING_RECORD(link, AVF_PENDED_REQUEST, Link);
+        AvfCompleteRequest(request, FALSE);
+    }
+}
+
+
+VOID
+AvfExpireRequests(
+    VOID
+    )
+/*++
+
+Routine Description:
+
+    Allows every queued operation whose verdict is overdue.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    PAVF_PENDED_REQUEST request;
+    PLIST_ENTRY link;
+    PLIST_ENTRY next;
+    LIST_ENTRY expiredList;
+    ULONGLONG now = KeQueryInterruptTime();
+    KIRQL oldIrql;
+
+    InitializeListHead(&expiredList);
+
+    KeAcquireSpinLock(&gQueueLock, &oldIrql);
+
+    //
+    //  The list is in arrival order and every request gets the same
+    //  timeout, so the overdue ones are at the front
+    //
+
+    for (link = gPendedList.Flink; link != &gPendedList; link = next) {
+
+        next = link->Flink;
+        request = CONTAINING_RECORD(link, AVF_PENDED_REQUEST, Link);
+
+        if (request->Deadline > now) {
+            break;
+        }
+
+        if (AvfDequeueRequestLocked(request)) {
+            InsertTailList(&expiredList, &request->Link);
+        }
+    }
+
+    KeReleaseSpinLock(&gQueueLock, oldIrql);
+
+    while (!IsListEmpty(&expiredList)) {
+        link = RemoveHeadList(&expiredList);
+        request = CONTAINING_RECORD(link, AVF_PENDED_REQUEST, Link);
+        DbgPrint("AVF: Timeout waiting for user response\n");
+        AvfCompleteRequest(request, FALSE);
+    }
+}
+
+
+VOID
+AvfDispatchThread(
+    _In_ PVOID StartContext
+    )
+/*++
+
+Routine Description:
+
+    Dispatcher thread.  Delivers queued notifications to user mode and
+    allows operations whose verdict is overdue.
+
+Arguments:
+
+    StartContext - Not used.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    NTSTATUS status;
+    PVOID waitObjects[2];
+    PAVF_PENDED_REQUEST request;
+    LARGE_INTEGER pollInterval;
+    LARGE_INTEGER retryInterval;
+    LONGLONG remaining;
+    PLIST_ENTRY link;
+    BOOLEAN dequeued;
+    BOOLEAN requeued = FALSE;
+    KIRQL oldIrql;
+
+    UNREFERENCED_PARAMETER(StartContext);
+
+    waitObjects[0] = &gQueueShutdownEvent;
+    waitObjects[1] = &gQueueWorkEvent;
+
+    pollInterval.QuadPart = -10LL * 1000 * 1000;    // 1 second
+    retryInterval.QuadPart = -10LL * 1000;          // 1 millisecond
+
+    for (;;) {
+
+        //
+        //  After every worker was found busy, look again shortly
+        //
+
+        status = KeWaitForMultipleObjects(2,
+                                          waitObjects,
+                                          WaitAny,
+                                          Executive,
+                                          KernelMode,
+                                          FALSE,
+                                          requeued ? &retryInterval : &pollInterval,
+                                          NULL);
+
+        if (status == STATUS_WAIT_0) {
+            break;
+        }
+
+        requeued = FALSE;
+
+        AvfExpireRequests();
+
+        //
+        //  Deliver everything that is waiting to be sent
+        //
+
+        for (;;) {
+
+            request = NULL;
+
+            KeAcquireSpinLock(&gQueueLock, &oldIrql);
+
+            if (!IsListEmpty(&gSendList)) {
+                link = RemoveHeadList(&gSendList);
+                request = CONTAINING_RECORD(link, AVF_PENDED_REQUEST, SendLink);
+                request->Sent = TRUE;
+                InterlockedIncrement(&request->RefCount);
+            }
+
+            KeReleaseSpinLock(&gQueueLock, oldIrql);
+
+            if (request == NULL) {
+                break;
+            }
+
+            //
+            //  Let the other dispatchers pick up the rest of the queue
+            //
+
+            KeSetEvent(&gQueueWorkEvent, IO_NO_INCREMENT, FALSE);
+
+            remaining = (LONGLONG)(request->Deadline - KeQueryInterruptTime());
+
+            //
+            //  Tell user mode how long it has to decide
+            //
+
+            request->Notification.TimeoutMs = (ULONG)(max(remaining, 0) / (10 * 1000));
+
+            status = AvfSendNotification(request);
+
+            if (status == STATUS_TIMEOUT) {
+
+                //
+                //  Every worker is busy.  Rather than hold this dispatcher,
+                //  and everything behind it, on one of them, put the
+                //  request back at the front and look again shortly.  It
+                //  still expires at its deadline meanwhile.  The event set
+                //  above for the other dispatchers is cleared, or they
+                //  would spin on the same busy workers.
+                //
+
+                KeAcquireSpinLock(&gQueueLock, &oldIrql);
+
+                if (request->Queued) {
+                    InsertHeadList(&gSendList, &request->SendLink);
+                    request->Sent = FALSE;
+                }
+
+                KeReleaseSpinLock(&gQueueLock, oldIrql);
+
+                KeClearEvent(&gQueueWorkEvent);
+                AvfDereferenceRequest(request);
+                requeued = TRUE;
+                break;
+            }
+
+            if (status != STATUS_SUCCESS) {
+
+                //
+                //  No one will answer; let the operation through
+                //
+
+                if (status != STATUS_PORT_DISCONNECTED) {
+                    DbgPrint("AVF: Failed to send notification, status=0x%x\n", status);
+                }
+
+                KeAcquireSpinLock(&gQueueLock, &oldIrql);
+                dequeued = AvfDequeueRequestLocked(request);
+                KeReleaseSpinLock(&gQueueLock, oldIrql);
+
+                if (dequeued) {
+                    AvfCompleteRequest(request, FALSE);
+                }
+            }
+
+            AvfDereferenceRequest(request);
+        }
+    }
+
+    PsTerminateSystemThread(STATUS_SUCCESS);
+}
+
+
+NTSTATUS
+AvfSendNotification(
+    _In_ PAVF_PENDED_REQUEST Request
+    )
+/*++
+
+Routine Description:
+
+    Delivers a request's notification on an engine connection that has a
+    buffer waiting: the one that takes the operations of the processor it
+    was raised on, else the others in turn.  Never waits for a buffer.
+
+Arguments:
+
+    Request - The request, referenced by the caller.
+
+Return Value:
+
+    The status returned by FltSendMessage, STATUS_TIMEOUT if every worker
+    is busy, or STATUS_PORT_DISCONNECTED if there is no engine connection.
+
+--*/
+{
+    NTSTATUS status;
+    LARGE_INTEGER noWait;
+    ULONG home = AVF_MAX_ENGINE_CONNECTIONS;
+    BOOLEAN tried = FALSE;
+    ULONG limit = (ULONG)gEnginePortLimit;
+    ULONG start;
+    ULONG slot;
+    ULONG i;
+
+    if (limit == 0) {
+        return STATUS_PORT_DISCONNECTED;
+    }
+
+    for (i = 0; i < limit; i++) {
+
+        if (gEnginePorts[i].Port != NULL &&
+            gEnginePorts[i].Group == Request->Processor.Group &&
+            FlagOn(gEnginePorts[i].Mask, 1ULL << Request->Processor.Number)) {
+
+            home = i;
+            break;
+        }
+    }
+
+    noWait.QuadPart = 0;
+    start = (ULONG)InterlockedIncrement(&gEnginePortNext);
+
+    for (i = 0; i <= limit; i++) {
+
+        if (i == 0) {
+            slot = home;
+        } else {
+            slot = (start + i) % limit;
+        }
+
+        if (slot == AVF_MAX_ENGINE_CONNECTIONS || gEnginePorts[slot].Port == NULL ||
+            (i != 0 && slot == home)) {
+
+            continue;
+        }
+
+        tried = TRUE;
+
+        status = FltSendMessage(gFilterHandle,
+                                &gEnginePorts[slot].Port,
+                                &Request->Notification,
+                                sizeof(Request->Notification),
+                                NULL,
+                                NULL,
+                                &noWait);
+
+        if (status != STATUS_TIMEOUT && status != STATUS_PORT_DISCONNECTED) {
+            return status;
+        }
+    }
+
+    if (!tried) {
+        return STATUS_PORT_DISCONNECTED;
+    }
+
+    //
+    //  Every worker is busy; the caller queues the request again
+    //
+
+    return STATUS_TIMEOUT;
+}
+
+
+NTSTATUS
+AvfAddEnginePort(
+    _In_ PFLT_PORT ClientPort,
+    _In_ PAVF_ENGINE_CONNECT Connect,
+    _Out_ PULONG Slot,
+    _Out_ PBOOLEAN First
+    )
+/*++
+
+Routine Description:
+
+    Gives a new engine connection its slot.
+
+Arguments:
+
+    ClientPort - The connection's client port.
+    Connect - The connection context, validated by the caller.
+    Slot - Receives the slot.
+    First - Receives TRUE if no other engine connection is open.
+
+Return Value:
+
+    STATUS_SUCCESS, or STATUS_CONNECTION_COUNT_LIMIT if every slot is
+    taken.
+
+--*/
+{
+    LONG limit;
+    ULONG i;
+
+    for (i = 0; i < AVF_MAX_ENGINE_CONNECTIONS; i++) {
+
+        if (InterlockedCompareExchange(&gEnginePorts[i].InUse, TRUE, FALSE) == FALSE) {
+            break;
+        }
+    }
+
+    if (i == AVF_MAX_ENGINE_CONNECTIONS) {
+        return STATUS_CONNECTION_COUNT_LIMIT;
+    }
+
+    gEnginePorts[i].Group = Connect->Group;
+    gEnginePorts[i].Mask = Connect->Mask;
+    InterlockedExchangePointer(&gEnginePorts[i].Port, ClientPort);
+
+    do {
+        limit = gEnginePortLimit;
+    } while (limit <= (LONG)i &&
+             InterlockedCompareExchange(&gEnginePortLimit, i + 1, limit) != limit);
+
+    *Slot = i;
+    *First = (InterlockedIncrement(&gEngineConnections) == 1);
+
+    DbgPrint("AVF: Engine connection %lu connected (group %u, mask 0x%I64x)\n",
+             i, Connect->Group, Connect->Mask);
+
+    return STATUS_SUCCESS;
+}
+
+
+BOOLEAN
+AvfRemoveEnginePort(
+    _In_ ULONG Slot
+    )
+/*++
+
+Routine Description:
+
+    Closes an engine connection and frees its slot.
+
+Arguments:
+
+    Slot - The connection's slot.
+
+Return Value:
+
+    TRUE if it was the last engine connection.
+
+--*/
+{
+    gEnginePorts[Slot].Mask = 0;
+
+    FltCloseClientPort(gFilterHandle, &gEnginePorts[Slot].Port);
+    InterlockedExchange(&gEnginePorts[Slot].InUse, FALSE);
+
+    DbgPrint("AVF: Engine connection %lu disconnected\n", Slot);
+
+    return (InterlockedDecrement(&gEngineConnections) == 0);
+}
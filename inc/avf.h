@@ -85,6 +85,24 @@ typedef struct _AVFVER {
 
 #define AVF_PORT_NAME                   L"\\AvfPort"
 
+//
+//  Engine connections.  Besides its own connection, which carries commands,
+//  the client may connect once per engine worker, passing an
+//  AVF_ENGINE_CONNECT as the connection context.  Notifications are sent
+//  only on engine connections: on the one whose Mask holds the processor
+//  the operation was raised on, or, if that one has no buffer waiting or
+//  there is none, on any other.
+//
+
+#define AVF_MAX_ENGINE_CONNECTIONS      64
+
+typedef struct _AVF_ENGINE_CONNECT {
+    ULONG Size;                         // sizeof(AVF_ENGINE_CONNECT)
+    USHORT Group;                       // Processor group of Mask
+    USHORT Reserved;
+    ULONGLONG Mask;                     // Processors whose operations it takes; may be 0
+} AVF_ENGINE_CONNECT, *PAVF_ENGINE_CONNECT;
+
 //
 //  Local definitions for passing parameters between the filter and user mode
 //
@@ -199,7 +217,10 @@ typedef struct _RECORD_LIST {
 typedef enum _AVF_COMMAND {
 
     QueryFileAccess,
-    GetAvfVersion
+    GetAvfVersion,
+    SetAvfPolicy,
+    GetVolumeStatistics,
+    ReplyVerdict
 
 } AVF_COMMAND;
 
@@ -209,6 +230,13 @@ typedef enum _AVF_COMMAND {
 
 #define AVF_MAX_PATH 520
 
+//
+//  Maximum length, in characters, of the process image name carried in
+//  notifications and consultant requests
+//
+
+#define AVF_MAX_PROCESS_NAME 260
+
 //
 //  File access notification sent from kernel to user mode
 //
@@ -216,22 +244,303 @@ typedef enum _AVF_COMMAND {
 typedef struct _AVF_FILE_NOTIFICATION {
 
     ULONG ProcessId;
+    ULONG ProcessKey;              // Driver-assigned key, unique per process instance
+    ULONG RequestId;               // Echoed back in AVF_VERDICT
     UCHAR MajorFunction;           // IRP_MJ_CREATE, IRP_MJ_READ, or IRP_MJ_WRITE
-    UCHAR Reserved[3];
+    UCHAR IoPriority;              // IO_PRIORITY_HINT of the operation
+    UCHAR Reserved[2];
+    ULONG Flags;                   // AVF_NOTIFY_FLAG_*
+    ULONG SessionId;               // Session of the requestor, or AVF_SESSION_UNKNOWN
+    ULONG TimeoutMs;               // Time left when delivered before the operation is allowed
+    ULONG DesiredAccess;           // IRP_MJ_CREATE only: requested access mask
+    ULONG ShareAccess;             // IRP_MJ_CREATE only: FILE_SHARE_* mode
+    ULONG CreateDisposition;       // IRP_MJ_CREATE only: FILE_SUPERSEDE .. FILE_OVERWRITE_IF
+    ULONG CreateOptions;           // IRP_MJ_CREATE only: FILE_* create options
+    ULONG Dropped;                 // The process's operations not reported since its last one
+    ULONG Length;                  // IRP_MJ_READ and IRP_MJ_WRITE only: bytes to transfer
+    FILE_ID_128 FileId;            // Valid if AVF_NOTIFY_FLAG_FILE_ID_VALID
     WCHAR FileName[AVF_MAX_PATH];
-    WCHAR ProcessName[260];
+    WCHAR ProcessName[AVF_MAX_PROCESS_NAME];   // Full NT image path (tail if truncated)
 
 } AVF_FILE_NOTIFICATION, *PAVF_FILE_NOTIFICATION;
 
 //
-//  Reply structure sent from user mode to kernel
+//  Flags for AVF_FILE_NOTIFICATION.Flags
+//
+
+#define AVF_NOTIFY_FLAG_RULE_MATCH      0x00000001  // Matched a driver-side protection rule
+#define AVF_NOTIFY_FLAG_FILE_ID_MATCH   0x00000002  // Matched by file ID rather than by path
+#define AVF_NOTIFY_FLAG_BLOOM_MATCH     0x00000004  // File ID may be in the volume's Bloom filter
+#define AVF_NOTIFY_FLAG_FILE_ID_VALID   0x00000008  // FileId is set
+
+#define AVF_SESSION_UNKNOWN             0xFFFFFFFF
+
+//
+//  AVF_FILE_NOTIFICATION.IoPriority values, as IO_PRIORITY_HINT.  Processes
+//  in background mode issue their I/O below AVF_IO_PRIORITY_NORMAL.
+//
+
+#define AVF_IO_PRIORITY_VERY_LOW        0
+#define AVF_IO_PRIORITY_LOW             1
+#define AVF_IO_PRIORITY_NORMAL          2
+#define AVF_IO_PRIORITY_HIGH            3
+#define AVF_IO_PRIORITY_CRITICAL        4
+
+//
+//  Verdict sent from user mode to kernel as the Data of a ReplyVerdict
+//  command.  The operation named by RequestId stays pended in the filter
+//  until its verdict arrives or it times out.
+//
+//  Speculative allow: for files the client audits rather than guards, it
+//  allows the operation at once with AVF_VERDICT_FLAG_SPECULATIVE and asks
+//  the consultant afterwards.  That allow is not cached; the filter keeps
+//  the operation's cache key instead, and the consultant's verdict, sent
+//  later with AVF_VERDICT_FLAG_AUDITED and the same RequestId, is cached
+//  under it.  An audited block also blocks later reads and writes of the
+//  file by the process, which is as far as a handle that is already open
+//  can be enforced on.
+//
+//  A verdict with AVF_VERDICT_FLAG_NO_CACHE only holds at the time it was
+//  made, e.g. by a local rule with a time window, and is not cached.
 //
 
-typedef struct _AVF_REPLY {
+typedef struct _AVF_VERDICT {
 
+    ULONG RequestId;               // From AVF_FILE_NOTIFICATION
     ULONG BlockOperation;          // Non-zero to block, zero to allow
+    ULONG Flags;                   // AVF_VERDICT_FLAG_*
+
+} AVF_VERDICT, *PAVF_VERDICT;
+
+#define AVF_VERDICT_FLAG_SPECULATIVE    0x00000001  // Allowed ahead of the consultant's verdict
+#define AVF_VERDICT_FLAG_AUDITED        0x00000002  // The consultant's verdict on a speculative allow
+#define AVF_VERDICT_FLAG_NO_CACHE       0x00000004  // Not to be cached
+
+//
+//  ============================================================================
+//  Filter Policy
+//  ============================================================================
+//
+//  The policy tells the filter which volumes contain protected paths and
+//  which paths on each volume are protected.  It is sent as the Data of a
+//  SetAvfPolicy command and replaces any previously loaded policy.
+//
+//  Layout:
+//
+//      AVF_POLICY_HEADER
+//      AVF_VOLUME_POLICY   (VolumeCount times, each followed by its rules)
+//          FILE_ID_128     (FileIdCount times, ascending, no duplicates)
+//          ULONG           (BloomBitCount / 32 times, the Bloom filter bits)
+//          AVF_PATH_RULE   (RuleCount times)
+//
+//  Every block starts on a ULONG boundary and its Size includes any padding.
+//  Volumes that do not appear in the policy are not attached, or run in
+//  pass-through if they already were.
+//
+//  Existing files should be protected by file ID, which also covers their
+//  hard links, short names and alternate data streams and survives
+//  renames.  Path rules are for directories and for files that do not
+//  exist yet.  File IDs are ordered by byte-wise comparison (memcmp).
+//
+//  Large sets of file IDs can be sent as a Bloom filter instead of a list.
+//  The filter then reports every operation whose file ID may be in the set
+//  with AVF_NOTIFY_FLAG_BLOOM_MATCH, and user mode makes the exact check.
+//  Bit n of the filter is bit (n % 32) of ULONG (n / 32).  A file ID sets
+//  or tests bits AvfBloomProbe(AvfHashFileId(id), i, BloomBitCount) for i
+//  in 0 .. BloomHashCount - 1.
+//
+
+#define AVF_MAX_VOLUME_NAME             64      // Characters
+
+#define AVF_POLICY_FLAG_MONITOR_ALL     0x00000001  // Report every file on every volume
+
+//
+//  Create filter
+//
+//  Decides in the kernel which opens of a protected file are worth a trip
+//  to user mode.  An open is reported if any of the following holds:
+//
+//      - it requests any access bit in AccessMask
+//      - its disposition is in Dispositions (AVF_DISPOSITION_*)
+//      - it denies other openers a FILE_SHARE_* bit set in ShareDenyMask
+//      - it is a delete-on-close open and AVF_CREATE_FILTER_DELETE_ON_CLOSE
+//        is set
+//
+//  Opens matching none of these, such as FILE_READ_ATTRIBUTES | SYNCHRONIZE
+//  opens made by Explorer and indexers, are allowed without asking.  When
+//  AVF_CREATE_FILTER_ENABLED is clear every open is reported.
+//
+
+#define AVF_CREATE_FILTER_ENABLED           0x00000001
+#define AVF_CREATE_FILTER_DELETE_ON_CLOSE   0x00000002
+
+#define AVF_DISPOSITION_SUPERSEDE           0x00000001  // 1 << FILE_SUPERSEDE
+#define AVF_DISPOSITION_OPEN                0x00000002  // 1 << FILE_OPEN
+#define AVF_DISPOSITION_CREATE              0x00000004  // 1 << FILE_CREATE
+#define AVF_DISPOSITION_OPEN_IF             0x00000008  // 1 << FILE_OPEN_IF
+#define AVF_DISPOSITION_OVERWRITE           0x00000010  // 1 << FILE_OVERWRITE
+#define AVF_DISPOSITION_OVERWRITE_IF        0x00000020  // 1 << FILE_OVERWRITE_IF
+
+//
+//  Access that can read, change, run or delete content, or change who may
+//
+
+#define AVF_DEFAULT_CREATE_ACCESS_MASK  (FILE_READ_DATA | FILE_WRITE_DATA | \
+                                         FILE_APPEND_DATA | FILE_EXECUTE | \
+                                         FILE_WRITE_EA | DELETE | WRITE_DAC | \
+                                         WRITE_OWNER | MAXIMUM_ALLOWED | \
+                                         GENERIC_READ | GENERIC_WRITE | \
+                                         GENERIC_EXECUTE | GENERIC_ALL)
+
+#define AVF_DEFAULT_CREATE_DISPOSITIONS (AVF_DISPOSITION_SUPERSEDE | \
+                                         AVF_DISPOSITION_OVERWRITE | \
+                                         AVF_DISPOSITION_OVERWRITE_IF)
+
+typedef struct _AVF_CREATE_FILTER {
+
+    ULONG Flags;                       // AVF_CREATE_FILTER_*
+    ULONG AccessMask;                  // Access bits that warrant a report
+    ULONG Dispositions;                // AVF_DISPOSITION_* that warrant a report
+    ULONG ShareDenyMask;               // FILE_SHARE_* bits that must not be denied
+
+} AVF_CREATE_FILTER, *PAVF_CREATE_FILTER;
+
+//
+//  Sampling
+//
+//  With AVF_POLICY_FLAG_MONITOR_ALL every operation on the machine would be
+//  reported and wait for its verdict.  Sampling has the filter allow most
+//  of them at once, before their names are even queried, and only report:
+//
+//      - one in every Rate operations (AVF_SAMPLE_ONE_IN_N), or
+//      - the ones a reservoir sample of Rate operations per WindowMs admits
+//        (AVF_SAMPLE_RESERVOIR): each of the first Rate operations of a
+//        window, then the n-th with probability Rate / n.  A report cannot
+//        be taken back, so about Rate * (1 + ln(n / Rate)) of a window's n
+//        operations are reported.
+//
+//  Of those, a process has at most ProcessRate reported a second, in
+//  bursts of up to ProcessBurst (a token bucket per process; ProcessRate 0
+//  for no limit).  Operations not reported are counted per volume
+//  (AVF_VOLUME_STATISTICS), and per process in the Dropped of its next
+//  notification.
+//
+
+#define AVF_SAMPLE_ALL                  0
+#define AVF_SAMPLE_ONE_IN_N             1
+#define AVF_SAMPLE_RESERVOIR            2
+
+typedef struct _AVF_SAMPLING {
+
+    ULONG Mode;                        // AVF_SAMPLE_*
+    ULONG Rate;                        // N, or the reservoir size
+    ULONG WindowMs;                    // AVF_SAMPLE_RESERVOIR only
+    ULONG ProcessRate;                 // Reports a second per process, or 0
+    ULONG ProcessBurst;                // Reports a process may have at once
 
-} AVF_REPLY, *PAVF_REPLY;
+} AVF_SAMPLING, *PAVF_SAMPLING;
+
+typedef struct _AVF_POLICY_HEADER {
+
+    ULONG Size;                        // Total size of the policy in bytes
+    ULONG Generation;                  // Caller-assigned policy generation
+    ULONG Flags;                       // AVF_POLICY_FLAG_*
+    ULONG VolumeCount;                 // Number of AVF_VOLUME_POLICY blocks
+    AVF_CREATE_FILTER CreateFilter;    // Applies to every volume
+    AVF_SAMPLING Sampling;             // With AVF_POLICY_FLAG_MONITOR_ALL
+
+} AVF_POLICY_HEADER, *PAVF_POLICY_HEADER;
+
+typedef struct _AVF_VOLUME_POLICY {
+
+    ULONG Size;                        // Size of this block including its rules
+    ULONG RuleCount;                   // Number of AVF_PATH_RULE entries
+    ULONG FileIdCount;                 // Number of FILE_ID_128 entries
+    ULONG BloomBitCount;               // Bloom filter size, multiple of 32; 0 if none
+    ULONG BloomHashCount;              // Bits set per file ID
+    USHORT VolumeNameLength;           // In bytes, e.g. "\Device\HarddiskVolume3"
+    USHORT Reserved;
+    WCHAR VolumeName[AVF_MAX_VOLUME_NAME];
+
+} AVF_VOLUME_POLICY, *PAVF_VOLUME_POLICY;
+
+#define AVF_MAX_BLOOM_BITS              (64 * 1024 * 1024)
+#define AVF_MAX_BLOOM_HASHES            16
+
+//
+//  64-bit FNV-1a hash of a file ID, and the bit index of its Probe-th
+//  Bloom filter probe.  The two halves of the hash are combined by double
+//  hashing, so one hash serves every probe.
+//
+
+FORCEINLINE
+ULONGLONG
+AvfHashFileId(
+    _In_ const FILE_ID_128 *FileId
+    )
+{
+    ULONGLONG hash = 14695981039346656037ULL;
+    ULONG i;
+
+    for (i = 0; i < sizeof(FileId->Identifier); i++) {
+        hash ^= FileId->Identifier[i];
+        hash *= 1099511628211ULL;
+    }
+
+    return hash;
+}
+
+FORCEINLINE
+ULONG
+AvfBloomProbe(
+    _In_ ULONGLONG Hash,
+    _In_ ULONG Probe,
+    _In_ ULONG BitCount
+    )
+{
+    return (ULONG)(((Hash & 0xFFFFFFFF) +
+                    (ULONGLONG)Probe * ((Hash >> 32) | 1)) % BitCount);
+}
+
+#define AVF_PATH_RULE_PREFIX            0x0001      // Protects everything below Path
+
+#pragma warning(push)
+#pragma warning(disable:4200) // disable warnings for structures with zero length arrays.
+
+typedef struct _AVF_PATH_RULE {
+
+    USHORT Size;                       // Size of this entry including padding
+    USHORT Flags;                      // AVF_PATH_RULE_*
+    USHORT PathLength;                 // In bytes
+    WCHAR Path[];                      // Volume-relative path, e.g. "\Users\Secret.txt"
+
+} AVF_PATH_RULE, *PAVF_PATH_RULE;
+
+#pragma warning(pop)
+
+//
+//  Per-volume counters returned by GetVolumeStatistics
+//
+
+typedef struct _AVF_VOLUME_STATISTICS {
+
+    WCHAR VolumeName[AVF_MAX_VOLUME_NAME];
+    ULONG Active;                      // Non-zero if the volume has policy rules
+    ULONG RuleCount;
+    ULONG FileIdCount;
+    ULONG BloomBitCount;
+    ULONG BloomHashCount;
+    ULONG Reserved;
+    LONGLONG Operations;               // Operations seen on the volume
+    LONGLONG Notified;                 // Operations sent to user mode
+    LONGLONG Blocked;                  // Operations blocked
+    LONGLONG CreatesFiltered;          // Opens allowed by the create filter
+    LONGLONG CacheHits;                // Operations answered from the verdict cache
+    LONGLONG BloomPositives;           // Operations whose file ID passed the Bloom filter
+    LONGLONG SampledOut;               // Operations allowed unreported by sampling
+    LONGLONG RateLimited;              // Operations allowed unreported over their process's rate
+
+} AVF_VOLUME_STATISTICS, *PAVF_VOLUME_STATISTICS;
 
 //
 //  ============================================================================
@@ -249,25 +558,97 @@ typedef struct _AVF_REPLY {
 //  3. Consultant processes and replies with AVF_CONSULTANT_RESPONSE
 //  4. AVF uses the response to allow/block the operation
 //
+//  The handshake request (RequestId 0, Operation 0xFF) is always sent at
+//  AVF_CONSULTANT_REQUEST_V1_SIZE with Version set to the newest version
+//  AVF speaks.  The consultant answers with the version it speaks, and AVF
+//  sizes every following request for that version.
+//
+//  Ring transport (version 3 and later):
+//
+//  After the handshake AVF offers to move requests to a shared memory ring
+//  (avfRing.h) by sending a request with Operation AVF_CONSULTANT_OP_RING_OFFER
+//  and FileName set to a base name, e.g. "Local\AvfConsultantRing.1234.1".
+//  AVF has created:
+//
+//      <base>              File mapping holding an initialized AVF_RING
+//      <base>.Request      Auto-reset event for the ring's doorbell
+//      <base>.Slot<n>      Auto-reset event for the doorbell of slot n,
+//                          n = 0 .. AVF_RING_SLOT_COUNT - 1
+//
+//  A consultant that opens them all answers AVF_DECISION_ALLOW, and from
+//  then on takes requests from the ring and completes them there with an
+//  AVF_CONSULTANT_RESPONSE; the pipe stays open to tell either side when
+//  the other goes away.  A consultant answering AVF_DECISION_BLOCK keeps
+//  using the pipe.
+//
+//  Capabilities (version 4 and later):
+//
+//  A consultant answering the handshake with version 4 or later puts the
+//  AVF_CONSULTANT_CAP_* bits it supports in the handshake response's Reason.
+//
+//  Batches (AVF_CONSULTANT_CAP_BATCH):
+//
+//  On the pipe, AVF may then send up to AVF_CONSULTANT_MAX_BATCH requests in
+//  one message: an AVF_CONSULTANT_BATCH_HEADER with Operation
+//  AVF_CONSULTANT_OP_BATCH followed by Count requests of the agreed size.
+//  The header overlays the first fields of a request, so a consultant can
+//  tell the two apart by Operation.  The consultant answers with one
+//  message: a batch header with the same BatchId and Count followed by the
+//  Count responses, in any order.  A lone request is still sent on its own.
+//
+//  Pipelining:
+//
+//  On the pipe, AVF may send further requests or batches before the earlier
+//  ones are answered.  The consultant answers the messages in the order it
+//  reads them, one reply message each.
+//
+//  Health checks:
+//
+//  While connected, AVF sends a request with Operation
+//  AVF_CONSULTANT_OP_PING every few seconds, on the same transport as the
+//  other requests.  The consultant answers it like any other request; the
+//  decision is ignored.  Until a consultant that missed one answers again,
+//  AVF sends it no file accesses and allows them.
+//
 
 #define AVF_CONSULTANT_PIPE_NAME    L"\\\\.\\pipe\\AvfSecurityConsultant"
 #define AVF_CONSULTANT_TIMEOUT_MS   60000   // 60 second timeout for consultation
 
+#define AVF_CONSULTANT_OP_HANDSHAKE     0xFF
+#define AVF_CONSULTANT_OP_RING_OFFER    0xFE
+#define AVF_CONSULTANT_OP_BATCH         0xFD
+#define AVF_CONSULTANT_OP_PING          0xFC
+
+#define AVF_CONSULTANT_CAP_BATCH        0x00000001
+
+#define AVF_CONSULTANT_MAX_BATCH        16
+
 //
 //  Request sent from AVF to the security consultant
 //
 
 typedef struct _AVF_CONSULTANT_REQUEST {
 
-    ULONG Version;                     // Protocol version (currently 1)
+    ULONG Version;                     // Protocol version (see AVF_CONSULTANT_PROTOCOL_VERSION)
     ULONG RequestId;                   // Unique request ID for correlation
     ULONG ProcessId;                   // PID of process accessing the file
     ULONG Operation;                   // IRP_MJ_CREATE (0), IRP_MJ_READ (3), or IRP_MJ_WRITE (4)
-    WCHAR ProcessName[260];            // Name of the accessing process
+    WCHAR ProcessName[AVF_MAX_PROCESS_NAME];   // Image path of the accessing process
     WCHAR FileName[AVF_MAX_PATH];      // Full NT path of the file
 
+    //
+    //  Version 2 and later.  Zero unless Operation is IRP_MJ_CREATE.
+    //
+
+    ULONG DesiredAccess;               // Requested access mask
+    ULONG ShareAccess;                 // FILE_SHARE_* mode
+    ULONG CreateDisposition;           // FILE_SUPERSEDE .. FILE_OVERWRITE_IF
+    ULONG CreateOptions;               // FILE_* create options
+
 } AVF_CONSULTANT_REQUEST, *PAVF_CONSULTANT_REQUEST;
 
+#define AVF_CONSULTANT_REQUEST_V1_SIZE  FIELD_OFFSET(AVF_CONSULTANT_REQUEST, DesiredAccess)
+
 //
 //  Response sent from security consultant back to AVF
 //
@@ -281,6 +662,19 @@ typedef struct _AVF_CONSULTANT_RESPONSE {
 
 } AVF_CONSULTANT_RESPONSE, *PAVF_CONSULTANT_RESPONSE;
 
+//
+//  Leads a batch of requests or responses
+//
+
+typedef struct _AVF_CONSULTANT_BATCH_HEADER {
+
+    ULONG Version;                     // Protocol version
+    ULONG BatchId;                     // Echoed in the response batch
+    ULONG Count;                       // Requests or responses that follow
+    ULONG Operation;                   // AVF_CONSULTANT_OP_BATCH
+
+} AVF_CONSULTANT_BATCH_HEADER, *PAVF_CONSULTANT_BATCH_HEADER;
+
 //
 //  Decision codes for AVF_CONSULTANT_RESPONSE.Decision
 //
@@ -292,7 +686,8 @@ typedef struct _AVF_CONSULTANT_RESPONSE {
 //  Protocol version
 //
 
-#define AVF_CONSULTANT_PROTOCOL_VERSION     1
+#define AVF_CONSULTANT_PROTOCOL_VERSION     4
+#define AVF_CONSULTANT_PROTOCOL_VERSION_MIN 1
 
 //
 //  Defines the command structure between the utility and the filter.
@@ -354,5 +749,13 @@ typedef struct _COMMAND_MESSAGE {
 #define FlagOn(_F,_SF)        ((_F) & (_SF))
 #endif
 
+#ifndef SetFlag
+#define SetFlag(_F,_SF)       ((_F) |= (_SF))
+#endif
+
+#ifndef ClearFlag
+#define ClearFlag(_F,_SF)     ((_F) &= ~(_SF))
+#endif
+
 #endif /* __AVF_H__ */
 
@@ -0,0 +1,108 @@
+/*++
+
+Copyright (c) 1989-2002  Microsoft Corporation
+Modified for AV Filter functionality
+
+Module Name:
+
+    avfPlugin.h
+
+Abstract:
+
+    The interface of a security consultant plugin: a DLL that avf.exe
+    loads (-plugin) and calls from its engine workers, without a round
+    trip to another process.
+
+    A plugin exports, undecorated, the functions typedef'd below under the
+    names AVF_PLUGIN_*_NAME.  AvfPluginEvaluate and AvfPluginEvaluateBatch
+    are called from every engine worker at once and must not block for
+    long: the worker has other file accesses waiting on it.
+
+    Requests are AVF_CONSULTANT_REQUEST, as sent to a consultant on the
+    pipe, always with Version AVF_CONSULTANT_PROTOCOL_VERSION and of that
+    version's size.  The request only grows at its end, so a plugin built
+    against an older avf.h reads the fields it knows.  RequestId is not
+    used.  The plugin fills in Decision and Reason of the response.
+
+    A plugin answers AVF_DECISION_DEFER for what it has no verdict on;
+    those requests go to the security consultants on the pipe as if there
+    were no plugin, as does a request whose evaluation failed.
+
+Environment:
+
+    User mode
+
+--*/
+#ifndef __AVFPLUGIN_H__
+#define __AVFPLUGIN_H__
+
+#include "avf.h"
+
+//
+//  Bumped when a function's signature or meaning changes.  A plugin that
+//  does not speak avf.exe's version fails AvfPluginInitialize.
+//
+
+#define AVF_PLUGIN_ABI_VERSION          1
+
+#define AVF_PLUGIN_MAX_BATCH            32
+
+//
+//  AVF_CONSULTANT_RESPONSE.Decision of a plugin that has no verdict
+//
+
+#define AVF_DECISION_DEFER              2
+
+#define AVF_PLUGIN_INITIALIZE_NAME      "AvfPluginInitialize"
+#define AVF_PLUGIN_EVALUATE_NAME        "AvfPluginEvaluate"
+#define AVF_PLUGIN_EVALUATE_BATCH_NAME  "AvfPluginEvaluateBatch"
+#define AVF_PLUGIN_SHUTDOWN_NAME        "AvfPluginShutdown"
+
+//
+//  Called once, when avf.exe starts.  Arguments are the -pluginargs, or
+//  NULL.  Context is passed to the other functions.
+//
+
+typedef HRESULT
+(WINAPI AVF_PLUGIN_INITIALIZE)(
+    _In_ ULONG AbiVersion,
+    _In_opt_ PCWSTR Arguments,
+    _Outptr_result_maybenull_ PVOID *Context
+    );
+
+//
+//  Decides one request.  A failure is as good as AVF_DECISION_DEFER.
+//
+
+typedef HRESULT
+(WINAPI AVF_PLUGIN_EVALUATE)(
+    _In_opt_ PVOID Context,
+    _In_ const AVF_CONSULTANT_REQUEST *Request,
+    _Out_ PAVF_CONSULTANT_RESPONSE Response
+    );
+
+//
+//  Optional.  Decides Count requests, at most AVF_PLUGIN_MAX_BATCH, that
+//  came in together; Responses[i] is the response to Requests[i].  A
+//  failure defers them all.  Without it AvfPluginEvaluate is called for
+//  each.
+//
+
+typedef HRESULT
+(WINAPI AVF_PLUGIN_EVALUATE_BATCH)(
+    _In_opt_ PVOID Context,
+    _In_ ULONG Count,
+    _In_reads_(Count) const AVF_CONSULTANT_REQUEST *const *Requests,
+    _Out_writes_(Count) PAVF_CONSULTANT_RESPONSE Responses
+    );
+
+//
+//  Called once, when avf.exe stops, after the last evaluation returned
+//
+
+typedef VOID
+(WINAPI AVF_PLUGIN_SHUTDOWN)(
+    _In_opt_ PVOID Context
+    );
+
+#endif /* __AVFPLUGIN_H__ */
@@ -0,0 +1,468 @@
+/*++
+
+Copyright (c) 1989-2002  Microsoft Corporation
+Modified for AV Filter functionality
+
+Module Name:
+
+    avfRing.h
+
+Abstract:
+
+    Shared memory ring for the security consultant transport.
+
+    avf.exe and a consultant that accepts the ring (see "Ring transport"
+    in avf.h) share one AVF_RING.  Each slot carries a request and, once
+    the consultant has answered, its response, so a consultation is two
+    stores and two loads instead of a pipe write and read.
+
+    The worker threads of avf.exe claim slots and submit requests (many
+    producers); the consultant takes them in order (one consumer) and
+    completes them in any order.  The slot's owner reads the response and
+    frees the slot.  A slot's Sequence tells where it is, for the position
+    p it was claimed at:
+
+        p               Free; a producer at position p may claim it
+        p + 1           Request submitted, for the consultant
+        p + 2           Response completed, for the producer
+        p + SlotCount   Freed; free for position p + SlotCount
+
+    Each side only sleeps when it has nothing to do, and the other side
+    only signals it when it has said so in a doorbell, so a busy ring
+    makes no system calls.
+
+    The header is shared with consultants and builds on other systems:
+    there the ring lives in POSIX shared memory and doorbells are futexes
+    instead of events.
+
+Environment:
+
+    User mode
+
+--*/
+#ifndef __AVFRING_H__
+#define __AVFRING_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <limits.h>
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#endif
+
+#define AVF_RING_MAGIC              0x474E5241      // 'ARNG'
+#define AVF_RING_VERSION            1
+#define AVF_RING_SLOT_COUNT         64              // Power of two, more than 2
+#define AVF_RING_REQUEST_BYTES      1640            // Fills a slot to whole cache lines
+#define AVF_RING_RESPONSE_BYTES     64
+#define AVF_RING_SPIN_COUNT         2000            // Polls before sleeping
+
+//
+//  A side that is about to sleep sets Sleeping, then checks once more for
+//  work.  The other side, after publishing work, rings only if Sleeping is
+//  set: it clears it, bumps Sequence and wakes the sleeper.
+//
+
+typedef struct _AVF_RING_DOORBELL {
+    volatile uint32_t Sequence;        // Bumped on every wake; the futex word
+    volatile uint32_t Sleeping;        // The owner may be blocked
+} AVF_RING_DOORBELL, *PAVF_RING_DOORBELL;
+
+typedef struct _AVF_RING_SLOT {
+    volatile uint64_t Sequence;        // See above
+    AVF_RING_DOORBELL Doorbell;        // The producer sleeps here for the response
+    uint32_t RequestSize;              // In bytes
+    uint32_t ResponseSize;             // In bytes
+    uint8_t Request[AVF_RING_REQUEST_BYTES];
+    uint8_t Response[AVF_RING_RESPONSE_BYTES];
+} AVF_RING_SLOT, *PAVF_RING_SLOT;
+
+typedef struct _AVF_RING {
+    uint32_t Magic;                    // AVF_RING_MAGIC
+    uint32_t Version;                  // AVF_RING_VERSION
+    uint32_t SlotCount;                // AVF_RING_SLOT_COUNT
+    uint32_t SlotSize;                 // sizeof(AVF_RING_SLOT)
+    uint8_t Reserved0[48];
+
+    volatile uint64_t Tail;            // Next position to claim; producers
+    uint8_t Reserved1[56];
+
+    volatile uint64_t Head;            // Next position to take; the consultant
+    uint8_t Reserved2[56];
+
+    AVF_RING_DOORBELL Doorbell;        // The consultant sleeps here for requests
+    uint8_t Reserved3[56];
+
+    AVF_RING_SLOT Slots[AVF_RING_SLOT_COUNT];
+} AVF_RING, *PAVF_RING;
+
+//
+//  Keep slots and the hot fields on their own cache lines
+//
+
+typedef char AVF_RING_SLOT_SIZE_CHECK[(sizeof(AVF_RING_SLOT) % 64 == 0) ? 1 : -1];
+typedef char AVF_RING_SLOTS_OFFSET_CHECK[(offsetof(AVF_RING, Slots) % 64 == 0) ? 1 : -1];
+
+//
+//  Platform primitives.  Loads acquire, stores release, and exchanges and
+//  fences are full barriers.
+//
+
+#ifdef _WIN32
+
+typedef HANDLE AVF_RING_EVENT;         // Auto-reset event for a doorbell
+
+#define AvfRingLoad64(_p)           ((uint64_t)InterlockedOr64((volatile LONG64 *)(_p), 0))
+#define AvfRingStore64(_p, _v)      InterlockedExchange64((volatile LONG64 *)(_p), (LONG64)(_v))
+#define AvfRingCas64(_p, _old, _new) \
+    ((uint64_t)InterlockedCompareExchange64((volatile LONG64 *)(_p), (LONG64)(_new), (LONG64)(_old)) == (_old))
+#define AvfRingLoad32(_p)           ((uint32_t)InterlockedOr((volatile LONG *)(_p), 0))
+#define AvfRingExchange32(_p, _v)   ((uint32_t)InterlockedExchange((volatile LONG *)(_p), (LONG)(_v)))
+#define AvfRingIncrement32(_p)      InterlockedIncrement((volatile LONG *)(_p))
+#define AvfRingFence()              MemoryBarrier()
+#define AvfRingPause()              YieldProcessor()
+
+#else
+
+typedef int AVF_RING_EVENT;            // Unused; the doorbell's Sequence is a futex
+
+#define AvfRingLoad64(_p)           __atomic_load_n((_p), __ATOMIC_ACQUIRE)
+#define AvfRingStore64(_p, _v)      __atomic_store_n((_p), (_v), __ATOMIC_RELEASE)
+#define AvfRingCas64(_p, _old, _new) \
+    ({ uint64_t _expected = (_old); \
+       __atomic_compare_exchange_n((_p), &_expected, (_new), 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE); })
+#define AvfRingLoad32(_p)           __atomic_load_n((_p), __ATOMIC_ACQUIRE)
+#define AvfRingExchange32(_p, _v)   __atomic_exchange_n((_p), (_v), __ATOMIC_SEQ_CST)
+#define AvfRingIncrement32(_p)      __atomic_add_fetch((_p), 1, __ATOMIC_SEQ_CST)
+#define AvfRingFence()              __atomic_thread_fence(__ATOMIC_SEQ_CST)
+#define AvfRingPause()              sched_yield()
+
+#endif
+
+static __inline void
+AvfRingSleep(
+    PAVF_RING_DOORBELL Doorbell,
+    AVF_RING_EVENT Event,
+    uint32_t Sequence,
+    uint32_t TimeoutMs
+    )
+{
+#ifdef _WIN32
+    (void)Doorbell;
+    (void)Sequence;
+    WaitForSingleObject(Event, TimeoutMs);
+#else
+    struct timespec timeout;
+
+    (void)Event;
+    timeout.tv_sec = TimeoutMs / 1000;
+    timeout.tv_nsec = (long)(TimeoutMs % 1000) * 1000000;
+    syscall(SYS_futex, &Doorbell->Sequence, FUTEX_WAIT, Sequence, &timeout, NULL, 0);
+#endif
+}
+
+//
+//  Wakes the owner of a doorbell if it said it may be sleeping.  Called
+//  after publishing work with a release store.
+//
+
+static __inline void
+AvfRingRing(
+    PAVF_RING_DOORBELL Doorbell,
+    AVF_RING_EVENT Event
+    )
+{
+    AvfRingFence();
+
+    if (AvfRingLoad32(&Doorbell->Sleeping) == 0 ||
+        AvfRingExchange32(&Doorbell->Sleeping, 0) == 0) {
+        return;
+    }
+
+    AvfRingIncrement32(&Doorbell->Sequence);
+
+#ifdef _WIN32
+    SetEvent(Event);
+#else
+    (void)Event;
+    syscall(SYS_futex, &Doorbell->Sequence, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+#endif
+}
+
+//
+//  Sets up an empty ring in freshly mapped, zeroed memory
+//
+
+static __inline void
+AvfRingInitialize(
+    PAVF_RING Ring
+    )
+{
+    uint32_t i;
+
+    for (i = 0; i < AVF_RING_SLOT_COUNT; i++) {
+        Ring->Slots[i].Sequence = i;
+    }
+
+    Ring->Magic = AVF_RING_MAGIC;
+    Ring->Version = AVF_RING_VERSION;
+    Ring->SlotCount = AVF_RING_SLOT_COUNT;
+    Ring->SlotSize = sizeof(AVF_RING_SLOT);
+    AvfRingFence();
+}
+
+static __inline int
+AvfRingIsValid(
+    const AVF_RING *Ring
+    )
+{
+    return Ring->Magic == AVF_RING_MAGIC &&
+           Ring->Version == AVF_RING_VERSION &&
+           Ring->SlotCount == AVF_RING_SLOT_COUNT &&
+           Ring->SlotSize == sizeof(AVF_RING_SLOT);
+}
+
+//
+//  Producer: claims the slot for the next position, or returns NULL if
+//  every slot is still owned.
+//
+
+static __inline PAVF_RING_SLOT
+AvfRingClaim(
+    PAVF_RING Ring,
+    uint64_t *Position
+    )
+{
+    PAVF_RING_SLOT slot;
+    uint64_t position;
+    uint64_t sequence;
+
+    for (;;) {
+
+        position = AvfRingLoad64(&Ring->Tail);
+        slot = &Ring->Slots[position & (AVF_RING_SLOT_COUNT - 1)];
+        sequence = AvfRingLoad64(&slot->Sequence);
+
+        if (sequence == position) {
+
+            if (AvfRingCas64(&Ring->Tail, position, position + 1)) {
+                *Position = position;
+                return slot;
+            }
+
+        } else if (sequence < position) {
+
+            return NULL;
+        }
+    }
+}
+
+//
+//  Producer: hands a claimed slot, with its request filled in, to the
+//  consultant
+//
+
+static __inline void
+AvfRingSubmit(
+    PAVF_RING Ring,
+    PAVF_RING_SLOT Slot,
+    uint64_t Position,
+    AVF_RING_EVENT RequestEvent
+    )
+{
+    AvfRingStore64(&Slot->Sequence, Position + 1);
+    AvfRingRing(&Ring->Doorbell, RequestEvent);
+}
+
+//
+//  Producer: waits for the response to a submitted slot.  Returns nonzero
+//  once it is there, zero if TimeoutMs passed first.
+//
+
+static __inline int
+AvfRingWaitForResponse(
+    PAVF_RING_SLOT Slot,
+    uint64_t Position,
+    AVF_RING_EVENT SlotEvent,
+    uint32_t TimeoutMs
+    )
+{
+    uint32_t sequence;
+    int i;
+
+    for (i = 0; i < AVF_RING_SPIN_COUNT; i++) {
+
+        if (AvfRingLoad64(&Slot->Sequence) == Position + 2) {
+            return 1;
+        }
+
+        AvfRingPause();
+    }
+
+    sequence = AvfRingLoad32(&Slot->Doorbell.Sequence);
+    AvfRingExchange32(&Slot->Doorbell.Sleeping, 1);
+
+    if (AvfRingLoad64(&Slot->Sequence) != Position + 2) {
+        AvfRingSleep(&Slot->Doorbell, SlotEvent, sequence, TimeoutMs);
+    }
+
+    AvfRingExchange32(&Slot->Doorbell.Sleeping, 0);
+    return AvfRingLoad64(&Slot->Sequence) == Position + 2;
+}
+
+//
+//  Producer: frees a slot once its response has been read
+//
+
+static __inline void
+AvfRingRelease(
+    PAVF_RING_SLOT Slot,
+    uint64_t Position
+    )
+{
+    AvfRingStore64(&Slot->Sequence, Position + AVF_RING_SLOT_COUNT);
+}
+
+//
+//  Consumer: takes the next submitted request, or returns NULL if there
+//  is none
+//
+
+static __inline PAVF_RING_SLOT
+AvfRingTake(
+    PAVF_RING Ring,
+    uint64_t *Position
+    )
+{
+    PAVF_RING_SLOT slot;
+    uint64_t position = Ring->Head;
+
+    slot = &Ring->Slots[position & (AVF_RING_SLOT_COUNT - 1)];
+
+    if (AvfRingLoad64(&slot->Sequence) != position + 1) {
+        return NULL;
+    }
+
+    Ring->Head = position + 1;
+    *Position = position;
+    return slot;
+}
+
+//
+//  Consumer: waits for a request to be submitted.  Returns nonzero if one
+//  is there, zero if TimeoutMs passed first.
+//
+
+static __inline int
+AvfRingWaitForRequest(
+    PAVF_RING Ring,
+    AVF_RING_EVENT RequestEvent,
+    uint32_t TimeoutMs
+    )
+{
+    PAVF_RING_SLOT slot = &Ring->Slots[Ring->Head & (AVF_RING_SLOT_COUNT - 1)];
+    uint32_t sequence;
+    int i;
+
+    for (i = 0; i < AVF_RING_SPIN_COUNT; i++) {
+
+        if (AvfRingLoad64(&slot->Sequence) == Ring->Head + 1) {
+            return 1;
+        }
+
+        AvfRingPause();
+    }
+
+    sequence = AvfRingLoad32(&Ring->Doorbell.Sequence);
+    AvfRingExchange32(&Ring->Doorbell.Sleeping, 1);
+
+    if (AvfRingLoad64(&slot->Sequence) != Ring->Head + 1) {
+        AvfRingSleep(&Ring->Doorbell, RequestEvent, sequence, TimeoutMs);
+    }
+
+    AvfRingExchange32(&Ring->Doorbell.Sleeping, 0);
+    return AvfRingLoad64(&slot->Sequence) == Ring->Head + 1;
+}
+
+//
+//  Consumer: hands a taken slot, with its response filled in, back to its
+//  producer
+//
+
+static __inline void
+AvfRingComplete(
+    PAVF_RING_SLOT Slot,
+    uint64_t Position,
+    AVF_RING_EVENT SlotEvent
+    )
+{
+    AvfRingStore64(&Slot->Sequence, Position + 2);
+    AvfRingRing(&Slot->Doorbell, SlotEvent);
+}
+
+#ifndef _WIN32
+
+//
+//  Creates (Create nonzero) or opens a ring in POSIX shared memory.
+//  Name is a shm_open name, e.g. "/AvfConsultantRing".
+//
+
+static __inline PAVF_RING
+AvfRingMapShared(
+    const char *Name,
+    int Create
+    )
+{
+    PAVF_RING ring;
+    int fd;
+
+    fd = shm_open(Name, Create ? (O_RDWR | O_CREAT | O_EXCL) : O_RDWR, 0600);
+    if (fd < 0) {
+        return NULL;
+    }
+
+    if (Create && ftruncate(fd, sizeof(AVF_RING)) != 0) {
+        close(fd);
+        shm_unlink(Name);
+        return NULL;
+    }
+
+    ring = (PAVF_RING)mmap(NULL, sizeof(AVF_RING), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+
+    if (ring == (PAVF_RING)MAP_FAILED) {
+        return NULL;
+    }
+
+    if (Create) {
+        AvfRingInitialize(ring);
+    } else if (!AvfRingIsValid(ring)) {
+        munmap(ring, sizeof(AVF_RING));
+        return NULL;
+    }
+
+    return ring;
+}
+
+static __inline void
+AvfRingUnmapShared(
+    PAVF_RING Ring
+    )
+{
+    munmap(Ring, sizeof(AVF_RING));
+}
+
+#endif
+
+#endif /* __AVFRING_H__ */
@@ -0,0 +1,620 @@
+/*++
+
+Copyright (c) 1989-2002  Microsoft Corporation
+Modified for AV Filter functionality
+
+Module Name:
+
+    avfBench.c
+
+Abstract:
+
+    Compares the latency of a consultant plugin (see avfPlugin.h) called
+    in process, as avf.exe's engine does with -plugin, with the same
+    plugin behind a consultant pipe, as a consultant process would be.
+
+    The pipe is served from a thread of this process, so the difference
+    is the cost of the round trip alone.  -pipe measures a consultant
+    that is running instead.
+
+Environment:
+
+    User mode
+
+--*/
+
+#include <windows.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "avfPlugin.h"
+
+#define AVF_BENCH_DEFAULT_COUNT     100000
+#define AVF_BENCH_WARMUP            1000
+
+//
+//  The plugin under test
+//
+
+typedef struct _AVF_BENCH_PLUGIN {
+    HMODULE Module;
+    PVOID Context;
+    AVF_PLUGIN_EVALUATE *Evaluate;
+    AVF_PLUGIN_SHUTDOWN *Shutdown;
+} AVF_BENCH_PLUGIN, *PAVF_BENCH_PLUGIN;
+
+AVF_BENCH_PLUGIN gBenchPlugin;
+
+//
+//  Function prototypes
+//
+
+BOOL
+LoadBenchPlugin(
+    _In_ PCWSTR Path,
+    _In_opt_ PCWSTR Arguments
+    );
+
+DWORD WINAPI
+ServePipeThread(
+    _In_ LPVOID lpParameter
+    );
+
+HANDLE
+ConnectBenchPipe(
+    _In_ PCWSTR PipeName,
+    _Out_ PULONG Version
+    );
+
+BOOL
+TimePlugin(
+    _In_ const AVF_CONSULTANT_REQUEST *Request,
+    _Out_writes_(Count) PLONGLONG Ticks,
+    _In_ ULONG Count
+    );
+
+BOOL
+TimePipe(
+    _In_ HANDLE Pipe,
+    _In_ ULONG Version,
+    _Inout_ PAVF_CONSULTANT_REQUEST Request,
+    _Out_writes_(Count) PLONGLONG Ticks,
+    _In_ ULONG Count
+    );
+
+VOID
+PrintLatency(
+    _In_ PCWSTR Name,
+    _Inout_updates_(Count) PLONGLONG Ticks,
+    _In_ ULONG Count
+    );
+
+int __cdecl
+CompareTicks(
+    _In_ const void *Left,
+    _In_ const void *Right
+    );
+
+
+int
+wmain(
+    _In_ int argc,
+    _In_reads_(argc) WCHAR *argv[]
+    )
+/*++
+
+Routine Description:
+
+    Times the plugin in process and over a pipe and prints both.
+
+Arguments:
+
+    argc - Number of arguments.
+    argv - avfbench <plugin> [-pluginargs <text>] [-count <n>] [-pipe <name>]
+
+Return Value:
+
+    Exit code.
+
+--*/
+{
+    AVF_CONSULTANT_REQUEST request;
+    WCHAR pipeName[AVF_MAX_PATH];
+    PCWSTR arguments = NULL;
+    PCWSTR externalPipe = NULL;
+    ULONG count = AVF_BENCH_DEFAULT_COUNT;
+    PLONGLONG ticks;
+    HANDLE server = NULL;
+    HANDLE pipe;
+    ULONG version;
+    int i;
+
+    if (argc < 2) {
+        wprintf(L"Usage: %s <plugin.dll> [options]\n\n", argv[0]);
+        wprintf(L"  -pluginargs <text>   Passed to the plugin when it is loaded\n");
+        wprintf(L"  -count <n>           Requests to time each way (default %d)\n", AVF_BENCH_DEFAULT_COUNT);
+        wprintf(L"  -pipe <name>         Time a running consultant on <name> instead of\n");
+        wprintf(L"                       the plugin behind a pipe\n");
+        return 1;
+    }
+
+    for (i = 2; i < argc; i++) {
+
+        if (_wcsicmp(argv[i], L"-pluginargs") == 0 && i + 1 < argc) {
+            arguments = argv[++i];
+        } else if (_wcsicmp(argv[i], L"-count") == 0 && i + 1 < argc) {
+            count = max(wcstoul(argv[++i], NULL, 0), 1);
+        } else if (_wcsicmp(argv[i], L"-pipe") == 0 && i + 1 < argc) {
+            externalPipe = argv[++i];
+        }
+    }
+
+    if (!LoadBenchPlugin(argv[1], arguments)) {
+        return 1;
+    }
+
+    ticks = HeapAlloc(GetProcessHeap(), 0, (SIZE_T)count * sizeof(LONGLONG));
+    if (ticks == NULL) {
+        wprintf(L"ERROR: Out of memory\n");
+        return 1;
+    }
+
+    //
+    //  An open for reading by a process that is not blocked
+    //
+
+    RtlZeroMemory(&request, sizeof(request));
+    request.Version = AVF_CONSULTANT_PROTOCOL_VERSION;
+    request.ProcessId = GetCurrentProcessId();
+    request.Operation = IRP_MJ_CREATE;
+    wcscpy_s(request.ProcessName, AVF_MAX_PROCESS_NAME, L"\\Device\\HarddiskVolume3\\Windows\\System32\\notepad.exe");
+    wcscpy_s(request.FileName, AVF_MAX_PATH, L"\\Device\\HarddiskVolume3\\Users\\Public\\Documents\\report.docx");
+    request.DesiredAccess = FILE_READ_DATA | SYNCHRONIZE;
+    request.ShareAccess = FILE_SHARE_READ;
+    request.CreateDisposition = 1;            // FILE_OPEN
+
+    wprintf(L"Timing %lu requests each way...\n\n", count);
+
+    if (TimePlugin(&request, ticks, count)) {
+        PrintLatency(L"In process", ticks, count);
+    }
+
+    //
+    //  Serve the plugin on a pipe of our own, unless a consultant is given
+    //
+
+    if (externalPipe != NULL) {
+
+        if (wcsncmp(externalPipe, L"\\\\", 2) == 0) {
+            wcscpy_s(pipeName, AVF_MAX_PATH, externalPipe);
+        } else {
+            swprintf_s(pipeName, AVF_MAX_PATH, L"\\\\.\\pipe\\%s", externalPipe);
+        }
+
+    } else {
+
+        swprintf_s(pipeName, AVF_MAX_PATH, L"\\\\.\\pipe\\AvfBench.%lu", GetCurrentProcessId());
+
+        server = CreateThread(NULL, 0, ServePipeThread, pipeName, 0, NULL);
+        if (server == NULL) {
+            wprintf(L"ERROR: Failed to start the pipe server (error %lu)\n", GetLastError());
+            return 1;
+        }
+    }
+
+    pipe = ConnectBenchPipe(pipeName, &version);
+
+    if (pipe != INVALID_HANDLE_VALUE) {
+
+        if (TimePipe(pipe, version, &request, ticks, count)) {
+            PrintLatency(externalPipe != NULL ? L"Consultant" : L"Pipe", ticks, count);
+        }
+
+        CloseHandle(pipe);
+
+        //
+        //  The server stops when we disconnect
+        //
+
+        if (server != NULL) {
+            WaitForSingleObject(server, INFINITE);
+        }
+    }
+
+    if (server != NULL) {
+        CloseHandle(server);
+    }
+
+    if (gBenchPlugin.Shutdown != NULL) {
+        gBenchPlugin.Shutdown(gBenchPlugin.Context);
+    }
+
+    HeapFree(GetProcessHeap(), 0, ticks);
+    return 0;
+}
+
+
+BOOL
+LoadBenchPlugin(
+    _In_ PCWSTR Path,
+    _In_opt_ PCWSTR Arguments
+    )
+/*++
+
+Routine Description:
+
+    Loads and initializes the plugin under test.
+
+Arguments:
+
+    Path - The plugin DLL.
+    Arguments - Passed to its AvfPluginInitialize.
+
+Return Value:
+
+    TRUE if it is ready.
+
+--*/
+{
+    AVF_PLUGIN_INITIALIZE *initialize;
+    HRESULT hr;
+
+    gBenchPlugin.Module = LoadLibraryExW(Path, NULL, LOAD_WITH_ALTERED_SEARCH_PATH);
+
+    if (gBenchPlugin.Module == NULL) {
+        wprintf(L"ERROR: Failed to load plugin %s (error %lu)\n", Path, GetLastError());
+        return FALSE;
+    }
+
+    initialize = (AVF_PLUGIN_INITIALIZE *)GetProcAddress(gBenchPlugin.Module, AVF_PLUGIN_INITIALIZE_NAME);
+    gBenchPlugin.Evaluate = (AVF_PLUGIN_EVALUATE *)GetProcAddress(gBenchPlugin.Module, AVF_PLUGIN_EVALUATE_NAME);
+    gBenchPlugin.Shutdown = (AVF_PLUGIN_SHUTDOWN *)GetProcAddress(gBenchPlugin.Module, AVF_PLUGIN_SHUTDOWN_NAME);
+
+    if (initialize == NULL || gBenchPlugin.Evaluate == NULL) {
+        wprintf(L"ERROR: %s is not an AVF plugin\n", Path);
+        return FALSE;
+    }
+
+    hr = initialize(AVF_PLUGIN_ABI_VERSION, Arguments, &gBenchPlugin.Context);
+
+    if (FAILED(hr)) {
+        wprintf(L"ERROR: Plugin %s failed to initialize (0x%08X)\n", Path, hr);
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+
+DWORD WINAPI
+ServePipeThread(
+    _In_ LPVOID lpParameter
+    )
+/*++
+
+Routine Description:
+
+    Answers one client on a consultant pipe with the plugin, as a
+    consultant that speaks the newest protocol without batches or the
+    ring would, until it disconnects.  A request the plugin defers is
+    allowed.
+
+Arguments:
+
+    lpParameter - The pipe name.
+
+Return Value:
+
+    0.
+
+--*/
+{
+    AVF_CONSULTANT_REQUEST request;
+    AVF_CONSULTANT_RESPONSE response;
+    HANDLE pipe;
+    DWORD bytes;
+
+    pipe = CreateNamedPipeW(lpParameter,
+                            PIPE_ACCESS_DUPLEX,
+                            PIPE_TYPE_MESSAGE | PIPE_READMODE_MESSAGE | PIPE_WAIT | PIPE_REJECT_REMOTE_CLIENTS,
+                            1,
+                            sizeof(response),
+                            sizeof(request),
+                            0,
+                            NULL);
+
+    if (pipe == INVALID_HANDLE_VALUE) {
+        wprintf(L"ERROR: Failed to create pipe (error %lu)\n", GetLastError());
+        return 0;
+    }
+
+    if (!ConnectNamedPipe(pipe, NULL) && GetLastError() != ERROR_PIPE_CONNECTED) {
+        CloseHandle(pipe);
+        return 0;
+    }
+
+    RtlZeroMemory(&request, sizeof(request));
+
+    while (ReadFile(pipe, &request, sizeof(request), &bytes, NULL) && bytes >= AVF_CONSULTANT_REQUEST_V1_SIZE) {
+
+        RtlZeroMemory(&response, sizeof(response));
+
+        if (request.Operation == AVF_CONSULTANT_OP_HANDSHAKE) {
+            response.Version = min(request.Version, AVF_CONSULTANT_PROTOCOL_VERSION);
+        } else {
+            gBenchPlugin.Evaluate(gBenchPlugin.Context, &request, &response);
+            if (response.Decision == AVF_DECISION_DEFER) {
+                response.Decision = AVF_DECISION_ALLOW;
+            }
+            response.Version = request.Version;
+            response.RequestId = request.RequestId;
+        }
+
+        if (!WriteFile(pipe, &response, sizeof(response), &bytes, NULL)) {
+            break;
+        }
+    }
+
+    DisconnectNamedPipe(pipe);
+    CloseHandle(pipe);
+    return 0;
+}
+
+
+HANDLE
+ConnectBenchPipe(
+    _In_ PCWSTR PipeName,
+    _Out_ PULONG Version
+    )
+/*++
+
+Routine Description:
+
+    Connects to a consultant pipe and shakes hands.
+
+Arguments:
+
+    PipeName - The pipe.
+    Version - Receives the protocol version agreed.
+
+Return Value:
+
+    The pipe, or INVALID_HANDLE_VALUE.
+
+--*/
+{
+    AVF_CONSULTANT_REQUEST request;
+    AVF_CONSULTANT_RESPONSE response;
+    HANDLE pipe;
+    DWORD mode = PIPE_READMODE_MESSAGE;
+    DWORD bytes;
+
+    *Version = 0;
+
+    //
+    //  The server thread may not have created the pipe yet
+    //
+
+    for (;;) {
+
+        pipe = CreateFileW(PipeName, GENERIC_READ | GENERIC_WRITE, 0, NULL, OPEN_EXISTING, 0, NULL);
+
+        if (pipe != INVALID_HANDLE_VALUE || GetLastError() != ERROR_FILE_NOT_FOUND) {
+            break;
+        }
+
+        Sleep(10);
+    }
+
+    if (pipe == INVALID_HANDLE_VALUE) {
+        wprintf(L"ERROR: Failed to open %s (error %lu)\n", PipeName, GetLastError());
+        return INVALID_HANDLE_VALUE;
+    }
+
+    RtlZeroMemory(&request, sizeof(request));
+    request.Version = AVF_CONSULTANT_PROTOCOL_VERSION;
+    request.ProcessId = GetCurrentProcessId();
+    request.Operation = AVF_CONSULTANT_OP_HANDSHAKE;
+
+    if (!SetNamedPipeHandleState(pipe, &mode, NULL, NULL) ||
+        !TransactNamedPipe(pipe, &request, AVF_CONSULTANT_REQUEST_V1_SIZE, &response, sizeof(response), &bytes, NULL) ||
+        bytes < sizeof(response) ||
+        response.Version < AVF_CONSULTANT_PROTOCOL_VERSION_MIN ||
+        response.Version > AVF_CONSULTANT_PROTOCOL_VERSION) {
+
+        wprintf(L"ERROR: Handshake with %s failed (error %lu)\n", PipeName, GetLastError());
+        CloseHandle(pipe);
+        return INVALID_HANDLE_VALUE;
+    }
+
+    *Version = response.Version;
+    return pipe;
+}
+
+
+BOOL
+TimePlugin(
+    _In_ const AVF_CONSULTANT_REQUEST *Request,
+    _Out_writes_(Count) PLONGLONG Ticks,
+    _In_ ULONG Count
+    )
+/*++
+
+Routine Description:
+
+    Times calls to the plugin, as the engine makes them.
+
+Arguments:
+
+    Request - The request to decide.
+    Ticks - Receives the QueryPerformanceCounter ticks of each call.
+    Count - Number of calls.
+
+Return Value:
+
+    TRUE if every call succeeded.
+
+--*/
+{
+    AVF_CONSULTANT_RESPONSE response;
+    LARGE_INTEGER start;
+    LARGE_INTEGER end;
+    ULONG i;
+
+    for (i = 0; i < AVF_BENCH_WARMUP; i++) {
+        gBenchPlugin.Evaluate(gBenchPlugin.Context, Request, &response);
+    }
+
+    for (i = 0; i < Count; i++) {
+
+        QueryPerformanceCounter(&start);
+
+        if (FAILED(gBenchPlugin.Evaluate(gBenchPlugin.Context, Request, &response))) {
+            wprintf(L"ERROR: The plugin failed request %lu\n", i);
+            return FALSE;
+        }
+
+        QueryPerformanceCounter(&end);
+        Ticks[i] = end.QuadPart - start.QuadPart;
+    }
+
+    return TRUE;
+}
+
+
+BOOL
+TimePipe(
+    _In_ HANDLE Pipe,
+    _In_ ULONG Version,
+    _Inout_ PAVF_CONSULTANT_REQUEST Request,
+    _Out_writes_(Count) PLONGLONG Ticks,
+    _In_ ULONG Count
+    )
+/*++
+
+Routine Description:
+
+    Times round trips on a consultant pipe, one request at a time.
+
+Arguments:
+
+    Pipe - The pipe, after the handshake.
+    Version - The protocol version agreed.
+    Request - The request to send.
+    Ticks - Receives the QueryPerformanceCounter ticks of each round trip.
+    Count - Number of round trips.
+
+Return Value:
+
+    TRUE if every round trip succeeded.
+
+--*/
+{
+    AVF_CONSULTANT_RESPONSE response;
+    LARGE_INTEGER start;
+    LARGE_INTEGER end;
+    DWORD size;
+    DWORD bytes;
+    ULONG i;
+
+    Request->Version = Version;
+    size = (Version >= 2) ? sizeof(*Request) : AVF_CONSULTANT_REQUEST_V1_SIZE;
+
+    for (i = 0; i < AVF_BENCH_WARMUP + Count; i++) {
+
+        Request->RequestId = i + 1;
+
+        QueryPerformanceCounter(&start);
+
+        if (!TransactNamedPipe(Pipe, Request, size, &response, sizeof(response), &bytes, NULL) ||
+            response.RequestId != Request->RequestId) {
+
+            wprintf(L"ERROR: Round trip %lu failed (error %lu)\n", i, GetLastError());
+            return FALSE;
+        }
+
+        QueryPerformanceCounter(&end);
+
+        if (i >= AVF_BENCH_WARMUP) {
+            Ticks[i - AVF_BENCH_WARMUP] = end.QuadPart - start.QuadPart;
+        }
+    }
+
+    return TRUE;
+}
+
+
+VOID
+PrintLatency(
+    _In_ PCWSTR Name,
+    _Inout_updates_(Count) PLONGLONG Ticks,
+    _In_ ULONG Count
+    )
+/*++
+
+Routine Description:
+
+    Prints the mean and percentiles of the latencies, sorting them.
+
+Arguments:
+
+    Name - What was timed.
+    Ticks - The latencies, in QueryPerformanceCounter ticks.
+    Count - Number of latencies.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    LARGE_INTEGER frequency;
+    double scale;
+    double total = 0;
+    ULONG i;
+
+    QueryPerformanceFrequency(&frequency);
+    scale = 1000000.0 / (double)frequency.QuadPart;
+
+    qsort(Ticks, Count, sizeof(LONGLONG), CompareTicks);
+
+    for (i = 0; i < Count; i++) {
+        total += (double)Ticks[i];
+    }
+
+    wprintf(L"%-12s mean %8.2f us  p50 %8.2f us  p99 %8.2f us  max %8.2f us\n",
+            Name,
+            total * scale / Count,
+            Ticks[Count / 2] * scale,
+            Ticks[(ULONG)((ULONGLONG)Count * 99 / 100)] * scale,
+            Ticks[Count - 1] * scale);
+}
+
+
+int __cdecl
+CompareTicks(
+    _In_ const void *Left,
+    _In_ const void *Right
+    )
+/*++
+
+Routine Description:
+
+    qsort comparison of two latencies.
+
+Arguments:
+
+    Left - A latency.
+    Right - The other.
+
+Return Value:
+
+    Negative, zero or positive as Left is less than, equal to or greater
+    than Right.
+
+--*/
+{
+    LONGLONG left = *(const LONGLONG *)Left;
+    LONGLONG right = *(const LONGLONG *)Right;
+
+    return (left > right) - (left < right);
+}
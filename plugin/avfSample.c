@@ -0,0 +1,253 @@
+/*++
+
+Copyright (c) 1989-2002  Microsoft Corporation
+Modified for AV Filter functionality
+
+Module Name:
+
+    avfSample.c
+
+Abstract:
+
+    A sample security consultant plugin (see avfPlugin.h).
+
+    It blocks every access by the processes whose image names are listed
+    in its arguments, separated by semicolons, e.g.
+
+        avf -plugin avfSample.dll -pluginargs "mshta.exe;wscript.exe" ...
+
+    allows reads by anyone else, and defers the rest to the consultants
+    on the pipe.
+
+Environment:
+
+    User mode
+
+--*/
+
+#include <windows.h>
+#include <stdlib.h>
+#include <string.h>
+#include "avfPlugin.h"
+
+#define AVF_SAMPLE_MAX_IMAGES       64
+
+#define AVF_SAMPLE_REASON_IMAGE     1       // Reason code of a blocked image
+
+//
+//  Access that changes a file, for an open
+//
+
+#define AVF_SAMPLE_WRITE_ACCESS     (FILE_WRITE_DATA | FILE_APPEND_DATA | FILE_WRITE_EA | \
+                                     FILE_WRITE_ATTRIBUTES | DELETE | WRITE_DAC | WRITE_OWNER | \
+                                     GENERIC_WRITE | GENERIC_ALL | MAXIMUM_ALLOWED)
+
+//
+//  The plugin's context: the blocked image names
+//
+
+typedef struct _AVF_SAMPLE {
+    ULONG ImageCount;
+    WCHAR Images[AVF_SAMPLE_MAX_IMAGES][AVF_MAX_PROCESS_NAME];
+} AVF_SAMPLE, *PAVF_SAMPLE;
+
+AVF_PLUGIN_INITIALIZE AvfPluginInitialize;
+AVF_PLUGIN_EVALUATE AvfPluginEvaluate;
+AVF_PLUGIN_EVALUATE_BATCH AvfPluginEvaluateBatch;
+AVF_PLUGIN_SHUTDOWN AvfPluginShutdown;
+
+
+HRESULT
+WINAPI
+AvfPluginInitialize(
+    _In_ ULONG AbiVersion,
+    _In_opt_ PCWSTR Arguments,
+    _Outptr_result_maybenull_ PVOID *Context
+    )
+/*++
+
+Routine Description:
+
+    Reads the blocked image names from the arguments.
+
+Arguments:
+
+    AbiVersion - avf.exe's AVF_PLUGIN_ABI_VERSION.
+    Arguments - Image names separated by semicolons, or NULL.
+    Context - Receives the AVF_SAMPLE.
+
+Return Value:
+
+    S_OK, or an error.
+
+--*/
+{
+    PAVF_SAMPLE sample;
+    PCWSTR name;
+    PCWSTR end;
+    size_t length;
+
+    *Context = NULL;
+
+    if (AbiVersion != AVF_PLUGIN_ABI_VERSION) {
+        return HRESULT_FROM_WIN32(ERROR_REVISION_MISMATCH);
+    }
+
+    sample = HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, sizeof(*sample));
+    if (sample == NULL) {
+        return E_OUTOFMEMORY;
+    }
+
+    for (name = Arguments; name != NULL && *name != L'\0'; name = end) {
+
+        end = wcschr(name, L';');
+        if (end == NULL) {
+            end = name + wcslen(name);
+        }
+
+        length = end - name;
+
+        if (length != 0 && length < AVF_MAX_PROCESS_NAME && sample->ImageCount < AVF_SAMPLE_MAX_IMAGES) {
+            wcsncpy_s(sample->Images[sample->ImageCount], AVF_MAX_PROCESS_NAME, name, length);
+            sample->ImageCount++;
+        }
+
+        if (*end == L';') {
+            end++;
+        }
+    }
+
+    *Context = sample;
+    return S_OK;
+}
+
+
+HRESULT
+WINAPI
+AvfPluginEvaluate(
+    _In_opt_ PVOID Context,
+    _In_ const AVF_CONSULTANT_REQUEST *Request,
+    _Out_ PAVF_CONSULTANT_RESPONSE Response
+    )
+/*++
+
+Routine Description:
+
+    Decides one request.
+
+Arguments:
+
+    Context - The AVF_SAMPLE.
+    Request - The request.
+    Response - Receives the decision.
+
+Return Value:
+
+    S_OK.
+
+--*/
+{
+    PAVF_SAMPLE sample = Context;
+    PCWSTR image;
+    ULONG i;
+
+    RtlZeroMemory(Response, sizeof(*Response));
+
+    //
+    //  The image name is the last component of its path
+    //
+
+    image = wcsrchr(Request->ProcessName, L'\\');
+    image = (image != NULL) ? image + 1 : Request->ProcessName;
+
+    for (i = 0; i < sample->ImageCount; i++) {
+
+        if (_wcsicmp(image, sample->Images[i]) == 0) {
+            Response->Decision = AVF_DECISION_BLOCK;
+            Response->Reason = AVF_SAMPLE_REASON_IMAGE;
+            return S_OK;
+        }
+    }
+
+    //
+    //  The access of an open is in requests of version 2 and later
+    //
+
+    if (Request->Operation == IRP_MJ_READ ||
+        (Request->Operation == IRP_MJ_CREATE &&
+         Request->Version >= 2 &&
+         (Request->DesiredAccess & AVF_SAMPLE_WRITE_ACCESS) == 0)) {
+
+        Response->Decision = AVF_DECISION_ALLOW;
+        return S_OK;
+    }
+
+    Response->Decision = AVF_DECISION_DEFER;
+    return S_OK;
+}
+
+
+HRESULT
+WINAPI
+AvfPluginEvaluateBatch(
+    _In_opt_ PVOID Context,
+    _In_ ULONG Count,
+    _In_reads_(Count) const AVF_CONSULTANT_REQUEST *const *Requests,
+    _Out_writes_(Count) PAVF_CONSULTANT_RESPONSE Responses
+    )
+/*++
+
+Routine Description:
+
+    Decides requests that came in together.  There is nothing to share
+    between them here; a plugin that looks things up elsewhere would do
+    it once for the batch.
+
+Arguments:
+
+    Context - The AVF_SAMPLE.
+    Count - Number of requests.
+    Requests - The requests.
+    Responses - Receives the decisions.
+
+Return Value:
+
+    S_OK.
+
+--*/
+{
+    ULONG i;
+
+    for (i = 0; i < Count; i++) {
+        AvfPluginEvaluate(Context, Requests[i], &Responses[i]);
+    }
+
+    return S_OK;
+}
+
+
+VOID
+WINAPI
+AvfPluginShutdown(
+    _In_opt_ PVOID Context
+    )
+/*++
+
+Routine Description:
+
+    Frees the context.
+
+Arguments:
+
+    Context - The AVF_SAMPLE.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    if (Context != NULL) {
+        HeapFree(GetProcessHeap(), 0, Context);
+    }
+}
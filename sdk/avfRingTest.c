@@ -0,0 +1,472 @@
+/*++
+
+Copyright (c) 1989-2002  Microsoft Corporation
+Modified for AV Filter functionality
+
+Module Name:
+
+    avfRingTest.c
+
+Abstract:
+
+    A test of the shared memory ring (see avfRing.h) on Linux:
+
+        avfRingTest [-producers <n>] [-requests <n>]
+
+    It maps a ring with AvfRingMapShared and forks a consumer that opens
+    it by name, as a consultant would.  Several producer threads then
+    claim, submit and wait for n requests each, and check that every
+    response is the one to its own request.  The consumer takes requests
+    in batches and completes each batch in reverse order, and both sides
+    stop now and then so that the other goes to sleep on its doorbell: a
+    lost wakeup shows as a wait that times out.
+
+        cc -O2 -pthread -I../inc avfRingTest.c -o avfRingTest -lrt
+
+Environment:
+
+    User mode, Linux
+
+--*/
+
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include "avfRing.h"
+
+#define AVF_RING_TEST_NAME              "/AvfRingTest"
+#define AVF_RING_TEST_MAX_PRODUCERS     64
+#define AVF_RING_TEST_MAX_BATCH         8       // Requests the consumer holds at once
+#define AVF_RING_TEST_TIMEOUT           5000    // Milliseconds; longer is a lost wakeup
+#define AVF_RING_TEST_STALL_ONE_IN      257     // Requests between stalls, on each side
+
+//
+//  What a request and its response carry
+//
+
+typedef struct _AVF_RING_TEST_REQUEST {
+    uint32_t Producer;
+    uint32_t Serial;
+    uint32_t Length;
+    uint8_t Payload[AVF_RING_REQUEST_BYTES - 3 * sizeof(uint32_t)];
+} AVF_RING_TEST_REQUEST, *PAVF_RING_TEST_REQUEST;
+
+typedef struct _AVF_RING_TEST_RESPONSE {
+    uint32_t Producer;
+    uint32_t Serial;
+    uint32_t Checksum;                 // Of the payload
+} AVF_RING_TEST_RESPONSE, *PAVF_RING_TEST_RESPONSE;
+
+typedef char AVF_RING_TEST_RESPONSE_CHECK[(sizeof(AVF_RING_TEST_RESPONSE) <= AVF_RING_RESPONSE_BYTES) ? 1 : -1];
+
+typedef struct _AVF_RING_TEST_PRODUCER {
+    pthread_t Thread;
+    PAVF_RING Ring;
+    uint32_t Index;
+    uint32_t Requests;
+    uint32_t Mismatches;
+    uint32_t Timeouts;
+    uint32_t Full;                     // Claims that found every slot owned
+} AVF_RING_TEST_PRODUCER, *PAVF_RING_TEST_PRODUCER;
+
+//
+//  Function prototypes
+//
+
+static uint32_t
+RingTestChecksum(
+    const uint8_t *Buffer,
+    uint32_t Length
+    );
+
+static uint32_t
+RingTestRandom(
+    uint32_t *Seed
+    );
+
+static void *
+RingTestProduce(
+    void *Parameter
+    );
+
+static int
+RingTestConsume(
+    uint64_t Count
+    );
+
+
+int
+main(
+    int argc,
+    char *argv[]
+    )
+/*++
+
+Routine Description:
+
+    Maps the ring, forks the consumer, runs the producers and reports.
+
+Arguments:
+
+    argc - Number of arguments.
+    argv - The arguments.
+
+Return Value:
+
+    0 if every response matched its request and no wait timed out, 1
+    otherwise.
+
+--*/
+{
+    AVF_RING_TEST_PRODUCER producers[AVF_RING_TEST_MAX_PRODUCERS];
+    PAVF_RING ring;
+    unsigned producerCount = 8;
+    unsigned requests = 100000;
+    uint64_t mismatches = 0;
+    uint64_t timeouts = 0;
+    uint64_t full = 0;
+    pid_t consumer;
+    int status;
+    unsigned i;
+
+    for (i = 1; i < (unsigned)argc; i++) {
+
+        if (strcmp(argv[i], "-producers") == 0 && i + 1 < (unsigned)argc) {
+            producerCount = (unsigned)strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "-requests") == 0 && i + 1 < (unsigned)argc) {
+            requests = (unsigned)strtoul(argv[++i], NULL, 10);
+        } else {
+            printf("Usage: avfRingTest [-producers <n>] [-requests <n>]\n");
+            return 1;
+        }
+    }
+
+    if (producerCount == 0 || producerCount > AVF_RING_TEST_MAX_PRODUCERS || requests == 0) {
+        printf("avfRingTest: 1 to %d producers, and at least 1 request each\n",
+               AVF_RING_TEST_MAX_PRODUCERS);
+        return 1;
+    }
+
+    shm_unlink(AVF_RING_TEST_NAME);
+
+    ring = AvfRingMapShared(AVF_RING_TEST_NAME, 1);
+
+    if (ring == NULL) {
+        perror("avfRingTest: AvfRingMapShared");
+        return 1;
+    }
+
+    //
+    //  The consumer is a process of its own with a mapping of its own, so
+    //  the doorbells are woken across processes as a consultant's are
+    //
+
+    consumer = fork();
+
+    if (consumer < 0) {
+        perror("avfRingTest: fork");
+        AvfRingUnmapShared(ring);
+        shm_unlink(AVF_RING_TEST_NAME);
+        return 1;
+    }
+
+    if (consumer == 0) {
+        AvfRingUnmapShared(ring);
+        _exit(RingTestConsume((uint64_t)producerCount * requests));
+    }
+
+    for (i = 0; i < producerCount; i++) {
+
+        memset(&producers[i], 0, sizeof(producers[i]));
+        producers[i].Ring = ring;
+        producers[i].Index = i;
+        producers[i].Requests = requests;
+
+        if (pthread_create(&producers[i].Thread, NULL, RingTestProduce, &producers[i]) != 0) {
+            printf("avfRingTest: cannot start producer %u\n", i);
+            kill(consumer, SIGKILL);
+            _exit(1);
+        }
+    }
+
+    for (i = 0; i < producerCount; i++) {
+        pthread_join(producers[i].Thread, NULL);
+        mismatches += producers[i].Mismatches;
+        timeouts += producers[i].Timeouts;
+        full += producers[i].Full;
+    }
+
+    waitpid(consumer, &status, 0);
+
+    AvfRingUnmapShared(ring);
+    shm_unlink(AVF_RING_TEST_NAME);
+
+    printf("avfRingTest: %u producer(s), %llu request(s), %llu mismatched, %llu wait(s) timed out, ring full %llu time(s)\n",
+           producerCount,
+           (unsigned long long)producerCount * requests,
+           (unsigned long long)mismatches,
+           (unsigned long long)timeouts,
+           (unsigned long long)full);
+
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        printf("avfRingTest: the consumer failed\n");
+        return 1;
+    }
+
+    if (mismatches != 0 || timeouts != 0) {
+        printf("avfRingTest: FAILED\n");
+        return 1;
+    }
+
+    printf("avfRingTest: passed\n");
+    return 0;
+}
+
+
+static uint32_t
+RingTestChecksum(
+    const uint8_t *Buffer,
+    uint32_t Length
+    )
+/*++
+
+Routine Description:
+
+    FNV-1a hash of a payload.
+
+Arguments:
+
+    Buffer - The payload.
+    Length - Its length in bytes.
+
+Return Value:
+
+    The hash.
+
+--*/
+{
+    uint32_t hash = 2166136261u;
+    uint32_t i;
+
+    for (i = 0; i < Length; i++) {
+        hash ^= Buffer[i];
+        hash *= 16777619u;
+    }
+
+    return hash;
+}
+
+
+static uint32_t
+RingTestRandom(
+    uint32_t *Seed
+    )
+/*++
+
+Routine Description:
+
+    xorshift32, so that each thread has a generator of its own.
+
+Arguments:
+
+    Seed - The generator's state, not 0.
+
+Return Value:
+
+    The next number.
+
+--*/
+{
+    uint32_t x = *Seed;
+
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    *Seed = x;
+
+    return x;
+}
+
+
+static void *
+RingTestProduce(
+    void *Parameter
+    )
+/*++
+
+Routine Description:
+
+    A producer: sends its requests one at a time, as a worker of avf.exe
+    does, and checks each response.
+
+Arguments:
+
+    Parameter - The producer's AVF_RING_TEST_PRODUCER.
+
+Return Value:
+
+    NULL.
+
+--*/
+{
+    PAVF_RING_TEST_PRODUCER producer = Parameter;
+    PAVF_RING_TEST_REQUEST request;
+    AVF_RING_TEST_RESPONSE response;
+    PAVF_RING_SLOT slot;
+    uint64_t position;
+    uint32_t seed = 0x9E3779B9u * (producer->Index + 1);
+    uint32_t serial;
+    uint32_t checksum;
+    uint32_t i;
+
+    for (serial = 0; serial < producer->Requests; serial++) {
+
+        while ((slot = AvfRingClaim(producer->Ring, &position)) == NULL) {
+            producer->Full++;
+            sched_yield();
+        }
+
+        request = (PAVF_RING_TEST_REQUEST)slot->Request;
+        request->Producer = producer->Index;
+        request->Serial = serial;
+        request->Length = RingTestRandom(&seed) % sizeof(request->Payload);
+
+        for (i = 0; i < request->Length; i++) {
+            request->Payload[i] = (uint8_t)RingTestRandom(&seed);
+        }
+
+        checksum = RingTestChecksum(request->Payload, request->Length);
+        slot->RequestSize = sizeof(*request);
+
+        AvfRingSubmit(producer->Ring, slot, position, 0);
+
+        while (!AvfRingWaitForResponse(slot, position, 0, AVF_RING_TEST_TIMEOUT)) {
+            producer->Timeouts++;
+        }
+
+        memcpy(&response, slot->Response, sizeof(response));
+
+        if (slot->ResponseSize != sizeof(response) ||
+            response.Producer != producer->Index ||
+            response.Serial != serial ||
+            response.Checksum != checksum) {
+
+            if (producer->Mismatches++ == 0) {
+                printf("avfRingTest: producer %u request %u got the response of producer %u request %u\n",
+                       producer->Index, serial, response.Producer, response.Serial);
+            }
+        }
+
+        AvfRingRelease(slot, position);
+
+        //
+        //  Stop now and then so that the consumer runs dry and sleeps
+        //
+
+        if (RingTestRandom(&seed) % AVF_RING_TEST_STALL_ONE_IN == 0) {
+            usleep(RingTestRandom(&seed) % 2000);
+        }
+    }
+
+    return NULL;
+}
+
+
+static int
+RingTestConsume(
+    uint64_t Count
+    )
+/*++
+
+Routine Description:
+
+    The consumer: opens the ring by name and answers Count requests.  It
+    takes what is there, up to a batch, and completes the batch last
+    request first.
+
+Arguments:
+
+    Count - Requests to answer.
+
+Return Value:
+
+    0, or 1 on an error.
+
+--*/
+{
+    PAVF_RING_SLOT slots[AVF_RING_TEST_MAX_BATCH];
+    uint64_t positions[AVF_RING_TEST_MAX_BATCH];
+    PAVF_RING_TEST_REQUEST request;
+    AVF_RING_TEST_RESPONSE response;
+    PAVF_RING ring;
+    uint64_t served = 0;
+    uint64_t timeouts = 0;
+    uint32_t seed = 0x2545F491u;
+    uint32_t batch;
+    uint32_t limit;
+
+    ring = AvfRingMapShared(AVF_RING_TEST_NAME, 0);
+
+    if (ring == NULL) {
+        perror("avfRingTest: consumer AvfRingMapShared");
+        return 1;
+    }
+
+    while (served < Count) {
+
+        if (!AvfRingWaitForRequest(ring, 0, AVF_RING_TEST_TIMEOUT)) {
+            timeouts++;
+            continue;
+        }
+
+        limit = 1 + RingTestRandom(&seed) % AVF_RING_TEST_MAX_BATCH;
+
+        for (batch = 0; batch < limit; batch++) {
+
+            slots[batch] = AvfRingTake(ring, &positions[batch]);
+
+            if (slots[batch] == NULL) {
+                break;
+            }
+        }
+
+        while (batch != 0) {
+
+            batch--;
+            request = (PAVF_RING_TEST_REQUEST)slots[batch]->Request;
+
+            response.Producer = request->Producer;
+            response.Serial = request->Serial;
+            response.Checksum = RingTestChecksum(request->Payload,
+                                                 request->Length < sizeof(request->Payload) ?
+                                                     request->Length : sizeof(request->Payload));
+
+            memcpy(slots[batch]->Response, &response, sizeof(response));
+            slots[batch]->ResponseSize = sizeof(response);
+
+            AvfRingComplete(slots[batch], positions[batch], 0);
+            served++;
+        }
+
+        //
+        //  Stop now and then so that the producers sleep on their slots
+        //
+
+        if (RingTestRandom(&seed) % AVF_RING_TEST_STALL_ONE_IN == 0) {
+            usleep(RingTestRandom(&seed) % 2000);
+        }
+    }
+
+    AvfRingUnmapShared(ring);
+
+    if (timeouts != 0) {
+        printf("avfRingTest: the consumer's wait timed out %llu time(s)\n",
+               (unsigned long long)timeouts);
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,2129 @@
+/*++
+
+Copyright (c) 1989-2002  Microsoft Corporation
+Modified for AV Filter functionality
+
+Module Name:
+
+    avfSdk.c
+
+Abstract:
+
+    The security consultant SDK (see avfSdk.h).
+
+    A listener thread per connection served at once accepts a client,
+    shakes hands and then reads its messages, each into the next slot of
+    the connection's ring of AVF_SDK_CONFIG.Pipelined messages, which it
+    queues for the pool.  A pool thread decides the message's requests
+    and marks it done; whichever thread finds the oldest message of the
+    connection done writes the replies of every done message in a row, so
+    they go out in order however the pool finished them.  The listener
+    waits for a slot when the ring is full.
+
+    AvfSdkStop only sets a flag and wakes AvfSdkRun, which then breaks
+    the connections and joins the threads, so it is safe in a signal
+    handler.
+
+Environment:
+
+    User mode
+
+--*/
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include "avfSdk.h"
+
+#define AVF_SDK_DEFAULT_CONNECTIONS     4
+#define AVF_SDK_DEFAULT_PIPELINED       64
+#define AVF_SDK_STOP_POLL_MS            100
+
+#define SdkMin(_a, _b)                  (((_a) < (_b)) ? (_a) : (_b))
+
+#define AVF_SDK_MAX_REQUEST_MESSAGE     (sizeof(AVF_SDK_BATCH_HEADER) + AVF_SDK_MAX_BATCH * sizeof(AVF_SDK_REQUEST))
+#define AVF_SDK_MAX_REPLY_MESSAGE       (sizeof(AVF_SDK_BATCH_HEADER) + AVF_SDK_MAX_BATCH * sizeof(AVF_SDK_RESPONSE))
+
+//
+//  The wire layout is avf.h's
+//
+
+typedef char AVF_SDK_REQUEST_SIZE_CHECK[(sizeof(AVF_SDK_REQUEST) == 1592) ? 1 : -1];
+typedef char AVF_SDK_REQUEST_V1_SIZE_CHECK[(AVF_SDK_REQUEST_V1_SIZE == 1576) ? 1 : -1];
+typedef char AVF_SDK_RESPONSE_SIZE_CHECK[(sizeof(AVF_SDK_RESPONSE) == 16) ? 1 : -1];
+
+//
+//  Platform primitives
+//
+
+#ifdef _WIN32
+
+typedef SRWLOCK AVF_SDK_LOCK;
+typedef CONDITION_VARIABLE AVF_SDK_CONDITION;
+typedef HANDLE AVF_SDK_THREAD;
+typedef HANDLE AVF_SDK_CHANNEL;
+
+#define AVF_SDK_NO_CHANNEL          INVALID_HANDLE_VALUE
+
+#define SdkInitializeLock(_l)       InitializeSRWLock(_l)
+#define SdkDeleteLock(_l)
+#define SdkLock(_l)                 AcquireSRWLockExclusive(_l)
+#define SdkUnlock(_l)               ReleaseSRWLockExclusive(_l)
+#define SdkInitializeCondition(_c)  InitializeConditionVariable(_c)
+#define SdkDeleteCondition(_c)
+#define SdkWait(_c, _l)             SleepConditionVariableSRW((_c), (_l), INFINITE, 0)
+#define SdkWakeOne(_c)              WakeConditionVariable(_c)
+#define SdkWakeAll(_c)              WakeAllConditionVariable(_c)
+#define SdkAtomicAdd64(_p, _v)      InterlockedExchangeAdd64((volatile LONG64 *)(_p), (LONG64)(_v))
+#define SdkAtomicLoad64(_p)         ((uint64_t)InterlockedOr64((volatile LONG64 *)(_p), 0))
+#define SdkAtomicCas64(_p, _old, _new) \
+    ((uint64_t)InterlockedCompareExchange64((volatile LONG64 *)(_p), (LONG64)(_new), (LONG64)(_old)) == (_old))
+#define SdkSetFlag(_p)              InterlockedExchange((volatile LONG *)(_p), 1)
+#define SdkTestFlag(_p)             (*(volatile LONG *)(_p) != 0)
+
+#else
+
+typedef pthread_mutex_t AVF_SDK_LOCK;
+typedef pthread_cond_t AVF_SDK_CONDITION;
+typedef pthread_t AVF_SDK_THREAD;
+typedef int AVF_SDK_CHANNEL;
+
+#define AVF_SDK_NO_CHANNEL          (-1)
+
+#define SdkInitializeLock(_l)       pthread_mutex_init((_l), NULL)
+#define SdkDeleteLock(_l)           pthread_mutex_destroy(_l)
+#define SdkLock(_l)                 pthread_mutex_lock(_l)
+#define SdkUnlock(_l)               pthread_mutex_unlock(_l)
+#define SdkInitializeCondition(_c)  pthread_cond_init((_c), NULL)
+#define SdkDeleteCondition(_c)      pthread_cond_destroy(_c)
+#define SdkWait(_c, _l)             pthread_cond_wait((_c), (_l))
+#define SdkWakeOne(_c)              pthread_cond_signal(_c)
+#define SdkWakeAll(_c)              pthread_cond_broadcast(_c)
+#define SdkAtomicAdd64(_p, _v)      __atomic_fetch_add((_p), (_v), __ATOMIC_RELAXED)
+#define SdkAtomicLoad64(_p)         __atomic_load_n((_p), __ATOMIC_RELAXED)
+#define SdkAtomicCas64(_p, _old, _new) \
+    ({ uint64_t _expected = (_old); \
+       __atomic_compare_exchange_n((_p), &_expected, (_new), 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED); })
+#define SdkSetFlag(_p)              __atomic_store_n((_p), 1, __ATOMIC_SEQ_CST)
+#define SdkTestFlag(_p)             (__atomic_load_n((_p), __ATOMIC_SEQ_CST) != 0)
+
+#endif
+
+typedef struct _AVF_SDK_CONNECTION AVF_SDK_CONNECTION, *PAVF_SDK_CONNECTION;
+
+//
+//  A message of a connection, from when it is read until its reply is
+//  written
+//
+
+typedef struct _AVF_SDK_MESSAGE {
+    struct _AVF_SDK_MESSAGE *Next;         // In the server's queue
+    PAVF_SDK_CONNECTION Connection;
+    uint64_t Arrival;                      // SdkNow when it was read
+    uint32_t Size;                         // Bytes read
+    uint32_t ReplySize;                    // Bytes to write, 0 for none
+    int Done;                              // The reply is ready
+    uint32_t Reply[AVF_SDK_MAX_REPLY_MESSAGE / sizeof(uint32_t)];
+    uint32_t Buffer[AVF_SDK_MAX_REQUEST_MESSAGE / sizeof(uint32_t)];
+} AVF_SDK_MESSAGE, *PAVF_SDK_MESSAGE;
+
+//
+//  A connection, served by one listener thread.  Its messages are
+//  Messages[s % Pipelined] for the sequence numbers s from NextReply
+//  to NextRead; Lock protects those and Broken.
+//
+
+struct _AVF_SDK_CONNECTION {
+    PAVF_SDK_SERVER Server;
+    AVF_SDK_THREAD Listener;
+    AVF_SDK_CHANNEL Channel;               // Protected by the server's lock
+    uint32_t Version;                      // Agreed in the handshake
+    uint32_t RequestSize;
+    int Batches;
+    AVF_SDK_LOCK Lock;
+    AVF_SDK_CONDITION Room;                // A message was answered
+    uint64_t NextRead;
+    uint64_t NextReply;
+    int Broken;                            // Nothing more is written
+#ifdef _WIN32
+    HANDLE ReadEvent;
+    HANDLE WriteEvent;
+#endif
+    PAVF_SDK_MESSAGE Messages;
+};
+
+struct _AVF_SDK_SERVER {
+    AVF_SDK_CONFIG Config;
+    long Stopping;                         // AvfSdkStop was called
+    int Exiting;                           // The pool may exit
+    AVF_SDK_LOCK Lock;                     // Protects the queue, Exiting and the channels
+    AVF_SDK_CONDITION Work;
+    PAVF_SDK_MESSAGE QueueHead;
+    PAVF_SDK_MESSAGE *QueueTail;
+    AVF_SDK_THREAD *Threads;
+    PAVF_SDK_CONNECTION Connections;
+#ifdef _WIN32
+    HANDLE StopEvent;
+#else
+    int Listener;                          // The listening socket
+    int StopPipe[2];                       // AvfSdkStop writes to [1]
+#endif
+    AVF_SDK_METRICS Metrics;
+};
+
+//
+//  Function prototypes
+//
+
+static uint64_t
+SdkNow(
+    void
+    );
+
+static int
+SdkStartThread(
+    AVF_SDK_THREAD *Thread,
+    void *(*Routine)(void *),
+    void *Parameter
+    );
+
+static void
+SdkJoinThread(
+    AVF_SDK_THREAD Thread
+    );
+
+static void *
+SdkListenerThread(
+    void *Parameter
+    );
+
+static void *
+SdkPoolThread(
+    void *Parameter
+    );
+
+static int
+SdkAccept(
+    PAVF_SDK_CONNECTION Connection
+    );
+
+static void
+SdkClose(
+    PAVF_SDK_CONNECTION Connection
+    );
+
+static int
+SdkRead(
+    PAVF_SDK_CONNECTION Connection,
+    void *Buffer,
+    uint32_t Size,
+    uint32_t *BytesRead
+    );
+
+static int
+SdkWrite(
+    PAVF_SDK_CONNECTION Connection,
+    const void *Buffer,
+    uint32_t Size
+    );
+
+static void
+SdkBreakChannels(
+    PAVF_SDK_SERVER Server
+    );
+
+static int
+SdkHandshake(
+    PAVF_SDK_CONNECTION Connection
+    );
+
+static void
+SdkServeConnection(
+    PAVF_SDK_CONNECTION Connection
+    );
+
+static void
+SdkDecideMessage(
+    PAVF_SDK_MESSAGE Message
+    );
+
+static void
+SdkCompleteMessage(
+    PAVF_SDK_MESSAGE Message
+    );
+
+static void
+SdkRecordLatency(
+    PAVF_SDK_SERVER Server,
+    uint64_t Nanoseconds
+    );
+
+
+PAVF_SDK_SERVER
+AvfSdkCreate(
+    const AVF_SDK_CONFIG *Config
+    )
+/*++
+
+Routine Description:
+
+    Creates a server.
+
+Arguments:
+
+    Config - How to serve; Evaluate is required.
+
+Return Value:
+
+    The server, or NULL.
+
+--*/
+{
+    PAVF_SDK_SERVER server;
+    PAVF_SDK_CONNECTION connection;
+    uint32_t i;
+
+    if (Config == NULL || Config->Evaluate == NULL) {
+        return NULL;
+    }
+
+    server = calloc(1, sizeof(*server));
+    if (server == NULL) {
+        return NULL;
+    }
+
+    server->Config = *Config;
+
+    if (server->Config.Name == NULL) {
+        server->Config.Name = AVF_SDK_DEFAULT_NAME;
+    }
+
+    if (server->Config.Connections == 0) {
+        server->Config.Connections = AVF_SDK_DEFAULT_CONNECTIONS;
+    }
+
+    if (server->Config.Pipelined == 0) {
+        server->Config.Pipelined = AVF_SDK_DEFAULT_PIPELINED;
+    }
+
+    if (server->Config.Threads == 0) {
+#ifdef _WIN32
+        server->Config.Threads = GetActiveProcessorCount(ALL_PROCESSOR_GROUPS);
+#else
+        server->Config.Threads = (uint32_t)sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+        if (server->Config.Threads == 0) {
+            server->Config.Threads = 1;
+        }
+    }
+
+    SdkInitializeLock(&server->Lock);
+    SdkInitializeCondition(&server->Work);
+    server->QueueTail = &server->QueueHead;
+
+#ifdef _WIN32
+    server->StopEvent = CreateEventW(NULL, TRUE, FALSE, NULL);
+#else
+    server->Listener = -1;
+    server->StopPipe[0] = server->StopPipe[1] = -1;
+#endif
+
+    server->Threads = calloc(server->Config.Threads, sizeof(AVF_SDK_THREAD));
+    server->Connections = calloc(server->Config.Connections, sizeof(AVF_SDK_CONNECTION));
+
+    if (server->Threads == NULL || server->Connections == NULL) {
+        AvfSdkDestroy(server);
+        return NULL;
+    }
+
+    for (i = 0; i < server->Config.Connections; i++) {
+
+        connection = &server->Connections[i];
+        connection->Server = server;
+        connection->Channel = AVF_SDK_NO_CHANNEL;
+        SdkInitializeLock(&connection->Lock);
+        SdkInitializeCondition(&connection->Room);
+
+        connection->Messages = calloc(server->Config.Pipelined, sizeof(AVF_SDK_MESSAGE));
+
+#ifdef _WIN32
+        connection->ReadEvent = CreateEventW(NULL, TRUE, FALSE, NULL);
+        connection->WriteEvent = CreateEventW(NULL, TRUE, FALSE, NULL);
+
+        if (connection->ReadEvent == NULL || connection->WriteEvent == NULL) {
+            AvfSdkDestroy(server);
+            return NULL;
+        }
+#endif
+
+        if (connection->Messages == NULL) {
+            AvfSdkDestroy(server);
+            return NULL;
+        }
+    }
+
+    return server;
+}
+
+
+int
+AvfSdkRun(
+    PAVF_SDK_SERVER Server
+    )
+/*++
+
+Routine Description:
+
+    Starts the pool and the listeners, waits for AvfSdkStop, then breaks
+    the connections and joins every thread.
+
+Arguments:
+
+    Server - The server.
+
+Return Value:
+
+    0, or an error if the server could not listen.
+
+--*/
+{
+    uint32_t threads = 0;
+    uint32_t listeners = 0;
+    int error = 0;
+    uint32_t i;
+
+#ifdef _WIN32
+
+    if (Server->StopEvent == NULL) {
+        return ERROR_NOT_ENOUGH_MEMORY;
+    }
+
+#else
+
+    struct sockaddr_un address;
+
+    if (strlen(Server->Config.Name) >= sizeof(address.sun_path)) {
+        return ENAMETOOLONG;
+    }
+
+    if (pipe(Server->StopPipe) != 0) {
+        return errno;
+    }
+
+    Server->Listener = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+    if (Server->Listener < 0) {
+        return errno;
+    }
+
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strcpy(address.sun_path, Server->Config.Name);
+    unlink(Server->Config.Name);
+
+    if (bind(Server->Listener, (struct sockaddr *)&address, sizeof(address)) != 0 ||
+        listen(Server->Listener, (int)Server->Config.Connections) != 0) {
+
+        error = errno;
+        close(Server->Listener);
+        Server->Listener = -1;
+        return error;
+    }
+
+#endif
+
+    for (i = 0; i < Server->Config.Threads && error == 0; i++) {
+        error = SdkStartThread(&Server->Threads[i], SdkPoolThread, Server);
+        threads += (error == 0);
+    }
+
+    for (i = 0; i < Server->Config.Connections && error == 0; i++) {
+        error = SdkStartThread(&Server->Connections[i].Listener, SdkListenerThread, &Server->Connections[i]);
+        listeners += (error == 0);
+    }
+
+    //
+    //  Wait for AvfSdkStop
+    //
+
+    if (error == 0) {
+
+#ifdef _WIN32
+        WaitForSingleObject(Server->StopEvent, INFINITE);
+#else
+        {
+            struct pollfd stop;
+            char byte;
+
+            stop.fd = Server->StopPipe[0];
+            stop.events = POLLIN;
+
+            while (!SdkTestFlag(&Server->Stopping)) {
+                if (poll(&stop, 1, -1) > 0) {
+                    (void)read(Server->StopPipe[0], &byte, 1);
+                }
+            }
+        }
+#endif
+    }
+
+    SdkSetFlag(&Server->Stopping);
+
+    //
+    //  The listeners first, then the pool once it has answered what they
+    //  queued
+    //
+
+    for (i = 0; i < listeners; i++) {
+
+        for (;;) {
+
+            SdkBreakChannels(Server);
+
+#ifdef _WIN32
+            if (WaitForSingleObject(Server->Connections[i].Listener, AVF_SDK_STOP_POLL_MS) == WAIT_OBJECT_0) {
+                break;
+            }
+#else
+            break;
+#endif
+        }
+
+        SdkJoinThread(Server->Connections[i].Listener);
+    }
+
+    SdkLock(&Server->Lock);
+    Server->Exiting = 1;
+    SdkWakeAll(&Server->Work);
+    SdkUnlock(&Server->Lock);
+
+    for (i = 0; i < threads; i++) {
+        SdkJoinThread(Server->Threads[i]);
+    }
+
+#ifndef _WIN32
+    close(Server->Listener);
+    Server->Listener = -1;
+    unlink(Server->Config.Name);
+#endif
+
+    return error;
+}
+
+
+void
+AvfSdkStop(
+    PAVF_SDK_SERVER Server
+    )
+/*++
+
+Routine Description:
+
+    Makes AvfSdkRun return.
+
+Arguments:
+
+    Server - The server.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    SdkSetFlag(&Server->Stopping);
+
+#ifdef _WIN32
+    SetEvent(Server->StopEvent);
+#else
+    if (Server->StopPipe[1] >= 0) {
+        (void)write(Server->StopPipe[1], "", 1);
+    }
+#endif
+}
+
+
+void
+AvfSdkDestroy(
+    PAVF_SDK_SERVER Server
+    )
+/*++
+
+Routine Description:
+
+    Frees a server that is not running.
+
+Arguments:
+
+    Server - The server.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    PAVF_SDK_CONNECTION connection;
+    uint32_t i;
+
+    if (Server == NULL) {
+        return;
+    }
+
+    if (Server->Connections != NULL) {
+
+        for (i = 0; i < Server->Config.Connections; i++) {
+
+            connection = &Server->Connections[i];
+
+#ifdef _WIN32
+            if (connection->ReadEvent != NULL) {
+                CloseHandle(connection->ReadEvent);
+            }
+            if (connection->WriteEvent != NULL) {
+                CloseHandle(connection->WriteEvent);
+            }
+#endif
+            SdkDeleteCondition(&connection->Room);
+            SdkDeleteLock(&connection->Lock);
+            free(connection->Messages);
+        }
+
+        free(Server->Connections);
+    }
+
+#ifdef _WIN32
+    if (Server->StopEvent != NULL) {
+        CloseHandle(Server->StopEvent);
+    }
+#else
+    if (Server->StopPipe[0] >= 0) {
+        close(Server->StopPipe[0]);
+        close(Server->StopPipe[1]);
+    }
+#endif
+
+    SdkDeleteCondition(&Server->Work);
+    SdkDeleteLock(&Server->Lock);
+    free(Server->Threads);
+    free(Server);
+}
+
+
+void
+AvfSdkGetMetrics(
+    PAVF_SDK_SERVER Server,
+    AVF_SDK_METRICS *Metrics
+    )
+/*++
+
+Routine Description:
+
+    Takes a snapshot of the server's metrics.
+
+Arguments:
+
+    Server - The server.
+    Metrics - Receives them.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    const uint64_t *source = (const uint64_t *)&Server->Metrics;
+    uint64_t *destination = (uint64_t *)Metrics;
+    size_t i;
+
+    for (i = 0; i < sizeof(*Metrics) / sizeof(uint64_t); i++) {
+        destination[i] = SdkAtomicLoad64(&source[i]);
+    }
+}
+
+
+uint64_t
+AvfSdkLatencyPercentile(
+    const AVF_SDK_METRICS *Metrics,
+    uint32_t Percent
+    )
+/*++
+
+Routine Description:
+
+    Finds a percentile of the latency histogram.
+
+Arguments:
+
+    Metrics - A snapshot.
+    Percent - The percentile, 1 to 100.
+
+Return Value:
+
+    The bound of the bucket it falls in, in microseconds, or 0 if nothing
+    was answered.
+
+--*/
+{
+    uint64_t total = 0;
+    uint64_t seen = 0;
+    uint32_t i;
+
+    for (i = 0; i < AVF_SDK_LATENCY_BUCKETS; i++) {
+        total += Metrics->Latency[i];
+    }
+
+    if (total == 0) {
+        return 0;
+    }
+
+    for (i = 0; i < AVF_SDK_LATENCY_BUCKETS; i++) {
+
+        seen += Metrics->Latency[i];
+
+        if (seen * 100 >= total * Percent) {
+            break;
+        }
+    }
+
+    return (uint64_t)1 << SdkMin(i, AVF_SDK_LATENCY_BUCKETS - 1);
+}
+
+
+size_t
+AvfSdkNameToUtf8(
+    const uint16_t *Name,
+    size_t NameLength,
+    char *Utf8,
+    size_t Size
+    )
+/*++
+
+Routine Description:
+
+    Converts a UTF-16 name, up to its terminator, to UTF-8.  An unpaired
+    surrogate becomes U+FFFD.
+
+Arguments:
+
+    Name - The name.
+    NameLength - Most characters to convert, e.g. AVF_SDK_MAX_PATH.
+    Utf8 - Receives the result.
+    Size - Size of Utf8 in bytes, at least 1.
+
+Return Value:
+
+    The length of the result in bytes.
+
+--*/
+{
+    size_t length = 0;
+    size_t i;
+    uint32_t c;
+    uint32_t bytes;
+
+    for (i = 0; i < NameLength && Name[i] != 0; i++) {
+
+        c = Name[i];
+
+        if (c >= 0xD800 && c < 0xDC00 && i + 1 < NameLength && Name[i + 1] >= 0xDC00 && Name[i + 1] < 0xE000) {
+            c = 0x10000 + ((c - 0xD800) << 10) + (Name[++i] - 0xDC00);
+        } else if (c >= 0xD800 && c < 0xE000) {
+            c = 0xFFFD;
+        }
+
+        bytes = (c < 0x80) ? 1 : (c < 0x800) ? 2 : (c < 0x10000) ? 3 : 4;
+
+        if (length + bytes >= Size) {
+            break;
+        }
+
+        switch (bytes) {
+        case 1:
+            Utf8[length++] = (char)c;
+            break;
+        case 2:
+            Utf8[length++] = (char)(0xC0 | (c >> 6));
+            Utf8[length++] = (char)(0x80 | (c & 0x3F));
+            break;
+        case 3:
+            Utf8[length++] = (char)(0xE0 | (c >> 12));
+            Utf8[length++] = (char)(0x80 | ((c >> 6) & 0x3F));
+            Utf8[length++] = (char)(0x80 | (c & 0x3F));
+            break;
+        default:
+            Utf8[length++] = (char)(0xF0 | (c >> 18));
+            Utf8[length++] = (char)(0x80 | ((c >> 12) & 0x3F));
+            Utf8[length++] = (char)(0x80 | ((c >> 6) & 0x3F));
+            Utf8[length++] = (char)(0x80 | (c & 0x3F));
+            break;
+        }
+    }
+
+    Utf8[length] = '\0';
+    return length;
+}
+
+
+static void *
+SdkListenerThread(
+    void *Parameter
+    )
+/*++
+
+Routine Description:
+
+    Serves one client after another on a connection until the server
+    stops.
+
+Arguments:
+
+    Parameter - The connection.
+
+Return Value:
+
+    NULL.
+
+--*/
+{
+    PAVF_SDK_CONNECTION connection = Parameter;
+    PAVF_SDK_SERVER server = connection->Server;
+
+    while (!SdkTestFlag(&server->Stopping)) {
+
+        if (SdkAccept(connection) != 0) {
+            continue;
+        }
+
+        SdkAtomicAdd64(&server->Metrics.Connections, 1);
+
+        if (SdkHandshake(connection) == 0) {
+            SdkServeConnection(connection);
+        }
+
+        SdkClose(connection);
+    }
+
+    return NULL;
+}
+
+
+static int
+SdkHandshake(
+    PAVF_SDK_CONNECTION Connection
+    )
+/*++
+
+Routine Description:
+
+    Answers the client's handshake and agrees on the protocol version and
+    the batches.
+
+Arguments:
+
+    Connection - The connection, just accepted.
+
+Return Value:
+
+    0, or an error if the client did not shake hands.
+
+--*/
+{
+    PAVF_SDK_MESSAGE message = &Connection->Messages[0];
+    const AVF_SDK_REQUEST *request = (const AVF_SDK_REQUEST *)message->Buffer;
+    AVF_SDK_RESPONSE response;
+    uint32_t bytes;
+    int error;
+
+    error = SdkRead(Connection, message->Buffer, sizeof(message->Buffer), &bytes);
+    if (error != 0) {
+        return error;
+    }
+
+    if (bytes < AVF_SDK_REQUEST_V1_SIZE || request->Operation != AVF_SDK_OP_HANDSHAKE || request->Version == 0) {
+        return -1;
+    }
+
+    Connection->Version = SdkMin(request->Version, AVF_SDK_PROTOCOL_VERSION);
+    Connection->RequestSize = (Connection->Version >= 2) ? sizeof(AVF_SDK_REQUEST) : AVF_SDK_REQUEST_V1_SIZE;
+    Connection->Batches = Connection->Server->Config.Batches && Connection->Version >= 4;
+
+    memset(&response, 0, sizeof(response));
+    response.Version = Connection->Version;
+    response.RequestId = 0;
+    response.Decision = AVF_SDK_DECISION_ALLOW;
+    response.Reason = Connection->Batches ? AVF_SDK_CAP_BATCH : 0;
+
+    return SdkWrite(Connection, &response, sizeof(response));
+}
+
+
+static void
+SdkServeConnection(
+    PAVF_SDK_CONNECTION Connection
+    )
+/*++
+
+Routine Description:
+
+    Reads a client's messages and queues them for the pool until it goes
+    away, then waits for the pool to be done with them.
+
+Arguments:
+
+    Connection - The connection, after the handshake.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    PAVF_SDK_SERVER server = Connection->Server;
+    uint32_t pipelined = server->Config.Pipelined;
+    PAVF_SDK_MESSAGE message;
+    uint32_t bytes;
+
+    Connection->NextRead = 0;
+    Connection->NextReply = 0;
+    Connection->Broken = 0;
+
+    for (;;) {
+
+        //
+        //  Wait for a free slot
+        //
+
+        SdkLock(&Connection->Lock);
+
+        while (Connection->NextRead - Connection->NextReply == pipelined && !Connection->Broken) {
+            SdkWait(&Connection->Room, &Connection->Lock);
+        }
+
+        if (Connection->Broken) {
+            SdkUnlock(&Connection->Lock);
+            break;
+        }
+
+        SdkUnlock(&Connection->Lock);
+
+        message = &Connection->Messages[Connection->NextRead % pipelined];
+
+        if (SdkRead(Connection, message->Buffer, sizeof(message->Buffer), &bytes) != 0) {
+            break;
+        }
+
+        message->Connection = Connection;
+        message->Arrival = SdkNow();
+        message->Size = bytes;
+        message->ReplySize = 0;
+        message->Done = 0;
+        message->Next = NULL;
+
+        SdkLock(&Connection->Lock);
+        Connection->NextRead++;
+        SdkUnlock(&Connection->Lock);
+
+        SdkLock(&server->Lock);
+        *server->QueueTail = message;
+        server->QueueTail = &message->Next;
+        SdkWakeOne(&server->Work);
+        SdkUnlock(&server->Lock);
+    }
+
+    //
+    //  The pool still has the messages in flight
+    //
+
+    SdkLock(&Connection->Lock);
+
+    Connection->Broken = 1;
+
+    while (Connection->NextReply != Connection->NextRead) {
+        SdkWait(&Connection->Room, &Connection->Lock);
+    }
+
+    SdkUnlock(&Connection->Lock);
+}
+
+
+static void *
+SdkPoolThread(
+    void *Parameter
+    )
+/*++
+
+Routine Description:
+
+    Decides the messages the listeners queue, until the server exits.
+
+Arguments:
+
+    Parameter - The server.
+
+Return Value:
+
+    NULL.
+
+--*/
+{
+    PAVF_SDK_SERVER server = Parameter;
+    PAVF_SDK_MESSAGE message;
+
+    for (;;) {
+
+        SdkLock(&server->Lock);
+
+        while (server->QueueHead == NULL && !server->Exiting) {
+            SdkWait(&server->Work, &server->Lock);
+        }
+
+        message = server->QueueHead;
+
+        if (message == NULL) {
+            SdkUnlock(&server->Lock);
+            break;
+        }
+
+        server->QueueHead = message->Next;
+        if (server->QueueHead == NULL) {
+            server->QueueTail = &server->QueueHead;
+        }
+
+        SdkUnlock(&server->Lock);
+
+        SdkDecideMessage(message);
+        SdkCompleteMessage(message);
+    }
+
+    return NULL;
+}
+
+
+static void
+SdkDecideMessage(
+    PAVF_SDK_MESSAGE Message
+    )
+/*++
+
+Routine Description:
+
+    Builds the reply to a message: has its requests decided, or answers a
+    health check or a ring offer itself.  A message that makes no sense
+    gets no reply and breaks the connection.
+
+Arguments:
+
+    Message - The message.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    PAVF_SDK_CONNECTION connection = Message->Connection;
+    PAVF_SDK_SERVER server = connection->Server;
+    const AVF_SDK_CONFIG *config = &server->Config;
+    const AVF_SDK_BATCH_HEADER *header = (const AVF_SDK_BATCH_HEADER *)Message->Buffer;
+    const AVF_SDK_REQUEST *request = (const AVF_SDK_REQUEST *)Message->Buffer;
+    const AVF_SDK_REQUEST *requests[AVF_SDK_MAX_BATCH];
+    PAVF_SDK_BATCH_HEADER replyHeader = (PAVF_SDK_BATCH_HEADER)Message->Reply;
+    PAVF_SDK_RESPONSE responses;
+    uint64_t blocked = 0;
+    uint32_t count;
+    uint32_t i;
+
+    if (connection->Batches &&
+        Message->Size >= sizeof(*header) &&
+        header->Operation == AVF_SDK_OP_BATCH) {
+
+        //
+        //  The requests are decided where they were read
+        //
+
+        count = header->Count;
+
+        if (count == 0 || count > AVF_SDK_MAX_BATCH ||
+            Message->Size < sizeof(*header) + count * connection->RequestSize) {
+
+            return;
+        }
+
+        responses = (PAVF_SDK_RESPONSE)(replyHeader + 1);
+
+        for (i = 0; i < count; i++) {
+
+            requests[i] = (const AVF_SDK_REQUEST *)((const uint8_t *)(header + 1) + i * connection->RequestSize);
+
+            memset(&responses[i], 0, sizeof(responses[i]));
+            responses[i].Version = requests[i]->Version;
+            responses[i].RequestId = requests[i]->RequestId;
+            responses[i].Decision = AVF_SDK_DECISION_ALLOW;
+        }
+
+        if (config->EvaluateBatch != NULL) {
+            config->EvaluateBatch(config->Context, count, requests, responses);
+        } else {
+            for (i = 0; i < count; i++) {
+                config->Evaluate(config->Context, requests[i], &responses[i]);
+            }
+        }
+
+        for (i = 0; i < count; i++) {
+            blocked += (responses[i].Decision == AVF_SDK_DECISION_BLOCK);
+        }
+
+        *replyHeader = *header;
+        Message->ReplySize = (uint32_t)(sizeof(*replyHeader) + count * sizeof(AVF_SDK_RESPONSE));
+
+        SdkAtomicAdd64(&server->Metrics.Batches, 1);
+        SdkAtomicAdd64(&server->Metrics.Requests, count);
+        SdkAtomicAdd64(&server->Metrics.Blocked, blocked);
+        return;
+    }
+
+    if (Message->Size < connection->RequestSize) {
+        return;
+    }
+
+    responses = (PAVF_SDK_RESPONSE)Message->Reply;
+
+    memset(responses, 0, sizeof(*responses));
+    responses->Version = request->Version;
+    responses->RequestId = request->RequestId;
+    responses->Decision = AVF_SDK_DECISION_ALLOW;
+
+    Message->ReplySize = sizeof(*responses);
+
+    switch (request->Operation) {
+
+    case AVF_SDK_OP_PING:
+        SdkAtomicAdd64(&server->Metrics.Pings, 1);
+        break;
+
+    case AVF_SDK_OP_RING_OFFER:
+
+        //
+        //  The ring is declined; requests stay on this connection
+        //
+
+        responses->Decision = AVF_SDK_DECISION_BLOCK;
+        break;
+
+    default:
+        config->Evaluate(config->Context, request, responses);
+        SdkAtomicAdd64(&server->Metrics.Requests, 1);
+        SdkAtomicAdd64(&server->Metrics.Blocked, responses->Decision == AVF_SDK_DECISION_BLOCK);
+        break;
+    }
+}
+
+
+static void
+SdkCompleteMessage(
+    PAVF_SDK_MESSAGE Message
+    )
+/*++
+
+Routine Description:
+
+    Marks a message done and writes the replies of the connection's done
+    messages that are next in order.
+
+Arguments:
+
+    Message - The message, with its reply built.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    PAVF_SDK_CONNECTION connection = Message->Connection;
+    PAVF_SDK_SERVER server = connection->Server;
+    PAVF_SDK_MESSAGE next;
+
+    SdkLock(&connection->Lock);
+
+    Message->Done = 1;
+
+    while (connection->NextReply != connection->NextRead) {
+
+        next = &connection->Messages[connection->NextReply % server->Config.Pipelined];
+
+        if (!next->Done) {
+            break;
+        }
+
+        if (!connection->Broken) {
+
+            if (next->ReplySize == 0 || SdkWrite(connection, next->Reply, next->ReplySize) != 0) {
+
+                connection->Broken = 1;
+
+                SdkLock(&server->Lock);
+#ifdef _WIN32
+                CancelIoEx(connection->Channel, NULL);
+#else
+                shutdown(connection->Channel, SHUT_RDWR);
+#endif
+                SdkUnlock(&server->Lock);
+
+            } else {
+
+                SdkAtomicAdd64(&server->Metrics.Messages, 1);
+                SdkRecordLatency(server, SdkNow() - next->Arrival);
+            }
+        }
+
+        next->Done = 0;
+        connection->NextReply++;
+    }
+
+    SdkWakeAll(&connection->Room);
+    SdkUnlock(&connection->Lock);
+}
+
+
+static void
+SdkRecordLatency(
+    PAVF_SDK_SERVER Server,
+    uint64_t Nanoseconds
+    )
+/*++
+
+Routine Description:
+
+    Adds a message's latency to the metrics.
+
+Arguments:
+
+    Server - The server.
+    Nanoseconds - From its arrival to its reply.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    uint64_t microseconds = Nanoseconds / 1000;
+    uint64_t maximum;
+    uint32_t bucket = 0;
+
+    while (bucket < AVF_SDK_LATENCY_BUCKETS - 1 && ((uint64_t)1 << bucket) <= microseconds) {
+        bucket++;
+    }
+
+    SdkAtomicAdd64(&Server->Metrics.Latency[bucket], 1);
+    SdkAtomicAdd64(&Server->Metrics.TotalNs, Nanoseconds);
+
+    maximum = SdkAtomicLoad64(&Server->Metrics.MaxNs);
+
+    while (Nanoseconds > maximum && !SdkAtomicCas64(&Server->Metrics.MaxNs, maximum, Nanoseconds)) {
+        maximum = SdkAtomicLoad64(&Server->Metrics.MaxNs);
+    }
+}
+
+
+static void
+SdkBreakChannels(
+    PAVF_SDK_SERVER Server
+    )
+/*++
+
+Routine Description:
+
+    Wakes the listeners out of their I/O once the server is stopping.
+    A socket stays shut down; a pipe's I/O is cancelled, so this is
+    repeated until the listeners are gone.
+
+Arguments:
+
+    Server - The server.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    uint32_t i;
+
+    SdkLock(&Server->Lock);
+
+#ifndef _WIN32
+    shutdown(Server->Listener, SHUT_RDWR);
+#endif
+
+    for (i = 0; i < Server->Config.Connections; i++) {
+
+        if (Server->Connections[i].Channel != AVF_SDK_NO_CHANNEL) {
+#ifdef _WIN32
+            CancelIoEx(Server->Connections[i].Channel, NULL);
+#else
+            shutdown(Server->Connections[i].Channel, SHUT_RDWR);
+#endif
+        }
+    }
+
+    SdkUnlock(&Server->Lock);
+}
+
+
+#ifdef _WIN32
+
+static uint64_t
+SdkNow(
+    void
+    )
+/*++
+
+Routine Description:
+
+    Reads a monotonic clock.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    Nanoseconds since some point in the past.
+
+--*/
+{
+    static LARGE_INTEGER frequency;
+    LARGE_INTEGER now;
+
+    if (frequency.QuadPart == 0) {
+        QueryPerformanceFrequency(&frequency);
+    }
+
+    QueryPerformanceCounter(&now);
+
+    return (uint64_t)((double)now.QuadPart * 1000000000.0 / (double)frequency.QuadPart);
+}
+
+
+//
+//  What SdkThreadStart runs
+//
+
+typedef struct _AVF_SDK_THREAD_START {
+    void *(*Routine)(void *);
+    void *Parameter;
+} AVF_SDK_THREAD_START, *PAVF_SDK_THREAD_START;
+
+
+static DWORD WINAPI
+SdkThreadStart(
+    LPVOID Parameter
+    )
+/*++
+
+Routine Description:
+
+    Runs a routine given to SdkStartThread.
+
+Arguments:
+
+    Parameter - The AVF_SDK_THREAD_START, freed here.
+
+Return Value:
+
+    0.
+
+--*/
+{
+    AVF_SDK_THREAD_START start = *(PAVF_SDK_THREAD_START)Parameter;
+
+    free(Parameter);
+    start.Routine(start.Parameter);
+    return 0;
+}
+
+
+static int
+SdkStartThread(
+    AVF_SDK_THREAD *Thread,
+    void *(*Routine)(void *),
+    void *Parameter
+    )
+/*++
+
+Routine Description:
+
+    Starts a thread.
+
+Arguments:
+
+    Thread - Receives the thread.
+    Routine - What it runs.
+    Parameter - Passed to Routine.
+
+Return Value:
+
+    0, or an error.
+
+--*/
+{
+    PAVF_SDK_THREAD_START start = malloc(sizeof(*start));
+
+    if (start == NULL) {
+        return ERROR_NOT_ENOUGH_MEMORY;
+    }
+
+    start->Routine = Routine;
+    start->Parameter = Parameter;
+
+    *Thread = CreateThread(NULL, 0, SdkThreadStart, start, 0, NULL);
+
+    if (*Thread == NULL) {
+        free(start);
+        return (int)GetLastError();
+    }
+
+    return 0;
+}
+
+
+static void
+SdkJoinThread(
+    AVF_SDK_THREAD Thread
+    )
+/*++
+
+Routine Description:
+
+    Waits for a thread to exit.
+
+Arguments:
+
+    Thread - The thread.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    WaitForSingleObject(Thread, INFINITE);
+    CloseHandle(Thread);
+}
+
+
+static int
+SdkWaitIo(
+    PAVF_SDK_CONNECTION Connection,
+    HANDLE Pipe,
+    OVERLAPPED *Overlapped,
+    BOOL Started,
+    DWORD *Bytes
+    )
+/*++
+
+Routine Description:
+
+    Waits for an overlapped operation on the pipe, which AvfSdkRun
+    cancels when the server stops.
+
+Arguments:
+
+    Connection - The connection.
+    Pipe - Its pipe.
+    Overlapped - The operation.
+    Started - What starting the operation returned.
+    Bytes - Receives the bytes transferred.
+
+Return Value:
+
+    0, or an error.
+
+--*/
+{
+    UNREFERENCED_PARAMETER(Connection);
+
+    if (!Started && GetLastError() != ERROR_IO_PENDING) {
+        return (int)GetLastError();
+    }
+
+    if (!GetOverlappedResult(Pipe, Overlapped, Bytes, TRUE)) {
+        return (int)GetLastError();
+    }
+
+    return 0;
+}
+
+
+static int
+SdkAccept(
+    PAVF_SDK_CONNECTION Connection
+    )
+/*++
+
+Routine Description:
+
+    Creates a pipe instance and waits for a client on it.
+
+Arguments:
+
+    Connection - The connection, without a channel.
+
+Return Value:
+
+    0, or an error.
+
+--*/
+{
+    PAVF_SDK_SERVER server = Connection->Server;
+    OVERLAPPED overlapped;
+    HANDLE pipe;
+    DWORD bytes;
+    int error;
+
+    pipe = CreateNamedPipeA(server->Config.Name,
+                            PIPE_ACCESS_DUPLEX | FILE_FLAG_OVERLAPPED,
+                            PIPE_TYPE_MESSAGE | PIPE_READMODE_MESSAGE | PIPE_WAIT | PIPE_REJECT_REMOTE_CLIENTS,
+                            PIPE_UNLIMITED_INSTANCES,
+                            AVF_SDK_MAX_REPLY_MESSAGE,
+                            AVF_SDK_MAX_REQUEST_MESSAGE,
+                            0,
+                            NULL);
+
+    if (pipe == INVALID_HANDLE_VALUE) {
+        error = (int)GetLastError();
+        Sleep(AVF_SDK_STOP_POLL_MS);
+        return error;
+    }
+
+    SdkLock(&server->Lock);
+    Connection->Channel = pipe;
+    SdkUnlock(&server->Lock);
+
+    if (SdkTestFlag(&server->Stopping)) {
+        SdkClose(Connection);
+        return ERROR_OPERATION_ABORTED;
+    }
+
+    memset(&overlapped, 0, sizeof(overlapped));
+    overlapped.hEvent = Connection->ReadEvent;
+
+    if (ConnectNamedPipe(pipe, &overlapped) || GetLastError() == ERROR_PIPE_CONNECTED) {
+        return 0;
+    }
+
+    error = SdkWaitIo(Connection, pipe, &overlapped, FALSE, &bytes);
+
+    if (error != 0) {
+        SdkClose(Connection);
+    }
+
+    return error;
+}
+
+
+static void
+SdkClose(
+    PAVF_SDK_CONNECTION Connection
+    )
+/*++
+
+Routine Description:
+
+    Closes a connection's channel, if it has one.
+
+Arguments:
+
+    Connection - The connection.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    PAVF_SDK_SERVER server = Connection->Server;
+    HANDLE pipe;
+
+    SdkLock(&server->Lock);
+    pipe = Connection->Channel;
+    Connection->Channel = AVF_SDK_NO_CHANNEL;
+    SdkUnlock(&server->Lock);
+
+    if (pipe != AVF_SDK_NO_CHANNEL) {
+        DisconnectNamedPipe(pipe);
+        CloseHandle(pipe);
+    }
+}
+
+
+static int
+SdkRead(
+    PAVF_SDK_CONNECTION Connection,
+    void *Buffer,
+    uint32_t Size,
+    uint32_t *BytesRead
+    )
+/*++
+
+Routine Description:
+
+    Reads a message.  One larger than Size is an error.
+
+Arguments:
+
+    Connection - The connection.
+    Buffer - Receives the message.
+    Size - Size of Buffer in bytes.
+    BytesRead - Receives the size of the message.
+
+Return Value:
+
+    0, or an error.
+
+--*/
+{
+    OVERLAPPED overlapped;
+    DWORD bytes = 0;
+    BOOL started;
+    int error;
+
+    memset(&overlapped, 0, sizeof(overlapped));
+    overlapped.hEvent = Connection->ReadEvent;
+
+    started = ReadFile(Connection->Channel, Buffer, Size, &bytes, &overlapped);
+    error = SdkWaitIo(Connection, Connection->Channel, &overlapped, started, &bytes);
+
+    *BytesRead = bytes;
+    return error;
+}
+
+
+static int
+SdkWrite(
+    PAVF_SDK_CONNECTION Connection,
+    const void *Buffer,
+    uint32_t Size
+    )
+/*++
+
+Routine Description:
+
+    Writes a message.  Called with the connection's lock held.
+
+Arguments:
+
+    Connection - The connection.
+    Buffer - The message.
+    Size - Its size in bytes.
+
+Return Value:
+
+    0, or an error.
+
+--*/
+{
+    OVERLAPPED overlapped;
+    DWORD bytes = 0;
+    BOOL started;
+
+    memset(&overlapped, 0, sizeof(overlapped));
+    overlapped.hEvent = Connection->WriteEvent;
+
+    started = WriteFile(Connection->Channel, Buffer, Size, &bytes, &overlapped);
+    return SdkWaitIo(Connection, Connection->Channel, &overlapped, started, &bytes);
+}
+
+#else
+
+static uint64_t
+SdkNow(
+    void
+    )
+/*++
+
+Routine Description:
+
+    Reads a monotonic clock.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    Nanoseconds since some point in the past.
+
+--*/
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000 + (uint64_t)now.tv_nsec;
+}
+
+
+static int
+SdkStartThread(
+    AVF_SDK_THREAD *Thread,
+    void *(*Routine)(void *),
+    void *Parameter
+    )
+/*++
+
+Routine Description:
+
+    Starts a thread.
+
+Arguments:
+
+    Thread - Receives the thread.
+    Routine - What it runs.
+    Parameter - Passed to Routine.
+
+Return Value:
+
+    0, or an error.
+
+--*/
+{
+    return pthread_create(Thread, NULL, Routine, Parameter);
+}
+
+
+static void
+SdkJoinThread(
+    AVF_SDK_THREAD Thread
+    )
+/*++
+
+Routine Description:
+
+    Waits for a thread to exit.
+
+Arguments:
+
+    Thread - The thread.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    pthread_join(Thread, NULL);
+}
+
+
+static int
+SdkAccept(
+    PAVF_SDK_CONNECTION Connection
+    )
+/*++
+
+Routine Description:
+
+    Waits for a client on the listening socket, shared by the listeners.
+
+Arguments:
+
+    Connection - The connection, without a channel.
+
+Return Value:
+
+    0, or an error.
+
+--*/
+{
+    PAVF_SDK_SERVER server = Connection->Server;
+    int channel;
+
+    channel = accept(server->Listener, NULL, NULL);
+
+    if (channel < 0) {
+        return errno;
+    }
+
+    SdkLock(&server->Lock);
+    Connection->Channel = channel;
+    SdkUnlock(&server->Lock);
+
+    //
+    //  AvfSdkRun may have broken the channels just before
+    //
+
+    if (SdkTestFlag(&server->Stopping)) {
+        SdkClose(Connection);
+        return ECANCELED;
+    }
+
+    return 0;
+}
+
+
+static void
+SdkClose(
+    PAVF_SDK_CONNECTION Connection
+    )
+/*++
+
+Routine Description:
+
+    Closes a connection's channel, if it has one.
+
+Arguments:
+
+    Connection - The connection.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    PAVF_SDK_SERVER server = Connection->Server;
+    int channel;
+
+    SdkLock(&server->Lock);
+    channel = Connection->Channel;
+    Connection->Channel = AVF_SDK_NO_CHANNEL;
+    SdkUnlock(&server->Lock);
+
+    if (channel != AVF_SDK_NO_CHANNEL) {
+        close(channel);
+    }
+}
+
+
+static int
+SdkRead(
+    PAVF_SDK_CONNECTION Connection,
+    void *Buffer,
+    uint32_t Size,
+    uint32_t *BytesRead
+    )
+/*++
+
+Routine Description:
+
+    Reads a message.  One larger than Size is an error, as is the client
+    going away.
+
+Arguments:
+
+    Connection - The connection.
+    Buffer - Receives the message.
+    Size - Size of Buffer in bytes.
+    BytesRead - Receives the size of the message.
+
+Return Value:
+
+    0, or an error.
+
+--*/
+{
+    ssize_t bytes;
+
+    do {
+        bytes = recv(Connection->Channel, Buffer, Size, MSG_TRUNC);
+    } while (bytes < 0 && errno == EINTR);
+
+    if (bytes < 0) {
+        return errno;
+    }
+
+    if (bytes == 0 || (size_t)bytes > Size) {
+        return EPIPE;
+    }
+
+    *BytesRead = (uint32_t)bytes;
+    return 0;
+}
+
+
+static int
+SdkWrite(
+    PAVF_SDK_CONNECTION Connection,
+    const void *Buffer,
+    uint32_t Size
+    )
+/*++
+
+Routine Description:
+
+    Writes a message.  Called with the connection's lock held.
+
+Arguments:
+
+    Connection - The connection.
+    Buffer - The message.
+    Size - Its size in bytes.
+
+Return Value:
+
+    0, or an error.
+
+--*/
+{
+    ssize_t bytes;
+
+    do {
+        bytes = send(Connection->Channel, Buffer, Size, MSG_NOSIGNAL);
+    } while (bytes < 0 && errno == EINTR);
+
+    if (bytes < 0) {
+        return errno;
+    }
+
+    return ((uint32_t)bytes == Size) ? 0 : EPIPE;
+}
+
+#endif
+
+
+//
+//  The test client
+//
+
+struct _AVF_SDK_CLIENT {
+#ifdef _WIN32
+    HANDLE Pipe;
+#else
+    int Socket;
+#endif
+    uint32_t Version;
+    uint32_t NextRequestId;
+};
+
+
+static int
+SdkClientExchange(
+    PAVF_SDK_CLIENT Client,
+    const void *Request,
+    uint32_t RequestSize,
+    AVF_SDK_RESPONSE *Response
+    )
+/*++
+
+Routine Description:
+
+    Sends a message and reads the response to it.
+
+Arguments:
+
+    Client - The client.
+    Request - The message.
+    RequestSize - Its size in bytes.
+    Response - Receives the response.
+
+Return Value:
+
+    0, or an error.
+
+--*/
+{
+#ifdef _WIN32
+    DWORD bytes;
+
+    if (!TransactNamedPipe(Client->Pipe, (LPVOID)Request, RequestSize, Response, sizeof(*Response), &bytes, NULL)) {
+        return (int)GetLastError();
+    }
+#else
+    ssize_t bytes;
+
+    if (send(Client->Socket, Request, RequestSize, MSG_NOSIGNAL) != (ssize_t)RequestSize) {
+        return errno;
+    }
+
+    do {
+        bytes = recv(Client->Socket, Response, sizeof(*Response), 0);
+    } while (bytes < 0 && errno == EINTR);
+#endif
+
+    return ((size_t)bytes == sizeof(*Response)) ? 0 : -1;
+}
+
+
+PAVF_SDK_CLIENT
+AvfSdkConnect(
+    const char *Name,
+    uint32_t *Version
+    )
+/*++
+
+Routine Description:
+
+    Connects to a consultant and shakes hands with it.
+
+Arguments:
+
+    Name - Its pipe or socket path, or NULL for AVF_SDK_DEFAULT_NAME.
+    Version - Receives the protocol version agreed, if not NULL.
+
+Return Value:
+
+    The client, or NULL.
+
+--*/
+{
+    PAVF_SDK_CLIENT client;
+    AVF_SDK_REQUEST request;
+    AVF_SDK_RESPONSE response;
+
+    if (Name == NULL) {
+        Name = AVF_SDK_DEFAULT_NAME;
+    }
+
+    client = calloc(1, sizeof(*client));
+    if (client == NULL) {
+        return NULL;
+    }
+
+#ifdef _WIN32
+    {
+        DWORD mode = PIPE_READMODE_MESSAGE;
+
+        client->Pipe = CreateFileA(Name, GENERIC_READ | GENERIC_WRITE, 0, NULL, OPEN_EXISTING, 0, NULL);
+
+        if (client->Pipe == INVALID_HANDLE_VALUE) {
+            free(client);
+            return NULL;
+        }
+
+        if (!SetNamedPipeHandleState(client->Pipe, &mode, NULL, NULL)) {
+            AvfSdkDisconnect(client);
+            return NULL;
+        }
+    }
+#else
+    {
+        struct sockaddr_un address;
+
+        if (strlen(Name) >= sizeof(address.sun_path)) {
+            free(client);
+            return NULL;
+        }
+
+        memset(&address, 0, sizeof(address));
+        address.sun_family = AF_UNIX;
+        strcpy(address.sun_path, Name);
+
+        client->Socket = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+
+        if (client->Socket < 0) {
+            free(client);
+            return NULL;
+        }
+
+        if (connect(client->Socket, (struct sockaddr *)&address, sizeof(address)) != 0) {
+            AvfSdkDisconnect(client);
+            return NULL;
+        }
+    }
+#endif
+
+    memset(&request, 0, sizeof(request));
+    request.Version = AVF_SDK_PROTOCOL_VERSION;
+    request.Operation = AVF_SDK_OP_HANDSHAKE;
+
+    if (SdkClientExchange(client, &request, AVF_SDK_REQUEST_V1_SIZE, &response) != 0 ||
+        response.Version == 0 ||
+        response.Version > AVF_SDK_PROTOCOL_VERSION) {
+
+        AvfSdkDisconnect(client);
+        return NULL;
+    }
+
+    client->Version = response.Version;
+
+    if (Version != NULL) {
+        *Version = client->Version;
+    }
+
+    return client;
+}
+
+
+int
+AvfSdkTransact(
+    PAVF_SDK_CLIENT Client,
+    AVF_SDK_REQUEST *Request,
+    AVF_SDK_RESPONSE *Response
+    )
+/*++
+
+Routine Description:
+
+    Sends a request and reads its response.
+
+Arguments:
+
+    Client - The client.
+    Request - The request; Version and RequestId are set.
+    Response - Receives the response.
+
+Return Value:
+
+    0, or an error, including a response to some other request.
+
+--*/
+{
+    int error;
+
+    Request->Version = Client->Version;
+    Request->RequestId = ++Client->NextRequestId;
+
+    error = SdkClientExchange(Client,
+                              Request,
+                              (Client->Version >= 2) ? sizeof(*Request) : AVF_SDK_REQUEST_V1_SIZE,
+                              Response);
+
+    if (error == 0 && Response->RequestId != Request->RequestId) {
+        error = -1;
+    }
+
+    return error;
+}
+
+
+void
+AvfSdkDisconnect(
+    PAVF_SDK_CLIENT Client
+    )
+/*++
+
+Routine Description:
+
+    Closes a client.
+
+Arguments:
+
+    Client - The client.
+
+Return Value:
+
+    None.
+
+--*/
+{
+#ifdef _WIN32
+    CloseHandle(Client->Pipe);
+#else
+    close(Client->Socket);
+#endif
+    free(Client);
+}
@@ -0,0 +1,277 @@
+/*++
+
+Copyright (c) 1989-2002  Microsoft Corporation
+Modified for AV Filter functionality
+
+Module Name:
+
+    avfSdk.h
+
+Abstract:
+
+    The security consultant SDK: the server side of the consultant
+    protocol (see "Security consultant" in avf.h), so that a consultant
+    only implements a callback that decides a request.
+
+    The SDK serves several connections at once, shakes hands, answers
+    health checks, declines the ring, takes batches and pipelined
+    messages, and has the requests decided on a pool of threads while
+    each connection's replies go out in the order its messages came in.
+    A request is handed to the callback where it was received, without
+    being copied: fields of a newer protocol version than the request's
+    Version are not there.
+
+    On Windows the consultant listens on a named pipe.  Elsewhere it
+    listens on a Unix socket of type SOCK_SEQPACKET, which keeps message
+    boundaries as a message-mode pipe does, so a consultant can be built
+    and tested on Linux:
+
+        cc -O2 -pthread avfSdk.c myConsultant.c
+
+    The structures below are the ones of avf.h, in fixed-width types that
+    build anywhere; strings are UTF-16.
+
+Environment:
+
+    User mode
+
+--*/
+#ifndef __AVFSDK_H__
+#define __AVFSDK_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define AVF_SDK_PROTOCOL_VERSION        4       // AVF_CONSULTANT_PROTOCOL_VERSION
+#define AVF_SDK_MAX_PATH                520     // AVF_MAX_PATH
+#define AVF_SDK_MAX_PROCESS_NAME        260     // AVF_MAX_PROCESS_NAME
+#define AVF_SDK_MAX_BATCH               16      // AVF_CONSULTANT_MAX_BATCH
+
+#define AVF_SDK_OP_HANDSHAKE            0xFF
+#define AVF_SDK_OP_RING_OFFER           0xFE
+#define AVF_SDK_OP_BATCH                0xFD
+#define AVF_SDK_OP_PING                 0xFC
+
+#define AVF_SDK_CAP_BATCH               0x00000001
+
+#define AVF_SDK_DECISION_ALLOW          0
+#define AVF_SDK_DECISION_BLOCK          1
+
+#define AVF_SDK_LATENCY_BUCKETS         24      // Powers of two microseconds
+
+#ifdef _WIN32
+#define AVF_SDK_DEFAULT_NAME            "\\\\.\\pipe\\AvfSecurityConsultant"
+#else
+#define AVF_SDK_DEFAULT_NAME            "/tmp/AvfSecurityConsultant"
+#endif
+
+//
+//  AVF_CONSULTANT_REQUEST.  A version 1 request ends at DesiredAccess.
+//
+
+typedef struct _AVF_SDK_REQUEST {
+    uint32_t Version;
+    uint32_t RequestId;
+    uint32_t ProcessId;
+    uint32_t Operation;                // IRP_MJ_CREATE (0), IRP_MJ_READ (3) or IRP_MJ_WRITE (4)
+    uint16_t ProcessName[AVF_SDK_MAX_PROCESS_NAME];
+    uint16_t FileName[AVF_SDK_MAX_PATH];
+
+    //
+    //  Version 2 and later
+    //
+
+    uint32_t DesiredAccess;
+    uint32_t ShareAccess;
+    uint32_t CreateDisposition;
+    uint32_t CreateOptions;
+} AVF_SDK_REQUEST, *PAVF_SDK_REQUEST;
+
+#define AVF_SDK_REQUEST_V1_SIZE         offsetof(AVF_SDK_REQUEST, DesiredAccess)
+
+//
+//  AVF_CONSULTANT_RESPONSE
+//
+
+typedef struct _AVF_SDK_RESPONSE {
+    uint32_t Version;
+    uint32_t RequestId;
+    uint32_t Decision;                 // AVF_SDK_DECISION_*
+    uint32_t Reason;                   // The consultant's own reason code
+} AVF_SDK_RESPONSE, *PAVF_SDK_RESPONSE;
+
+//
+//  AVF_CONSULTANT_BATCH_HEADER
+//
+
+typedef struct _AVF_SDK_BATCH_HEADER {
+    uint32_t Version;
+    uint32_t BatchId;
+    uint32_t Count;
+    uint32_t Operation;                // AVF_SDK_OP_BATCH
+} AVF_SDK_BATCH_HEADER, *PAVF_SDK_BATCH_HEADER;
+
+//
+//  Decides a request.  Response comes with Version and RequestId set and
+//  Decision AVF_SDK_DECISION_ALLOW.  Called on any of the SDK's threads,
+//  several at once.
+//
+
+typedef void
+(*AVF_SDK_EVALUATE)(
+    void *Context,
+    const AVF_SDK_REQUEST *Request,
+    AVF_SDK_RESPONSE *Response
+    );
+
+//
+//  Optional.  Decides the Count requests of a batch at once; Responses[i]
+//  is the response to Requests[i], prepared as for AVF_SDK_EVALUATE.
+//
+
+typedef void
+(*AVF_SDK_EVALUATE_BATCH)(
+    void *Context,
+    uint32_t Count,
+    const AVF_SDK_REQUEST *const *Requests,
+    AVF_SDK_RESPONSE *Responses
+    );
+
+typedef struct _AVF_SDK_CONFIG {
+    const char *Name;                  // Pipe or socket path, or NULL for AVF_SDK_DEFAULT_NAME
+    uint32_t Connections;              // Served at once; 0 for 4
+    uint32_t Threads;                  // Deciding requests; 0 for one per processor
+    uint32_t Pipelined;                // Messages of a connection in the pool at once; 0 for 64
+    int Batches;                       // Take batches (AVF_SDK_CAP_BATCH)
+    AVF_SDK_EVALUATE Evaluate;
+    AVF_SDK_EVALUATE_BATCH EvaluateBatch;
+    void *Context;                     // Passed to the callbacks
+} AVF_SDK_CONFIG, *PAVF_SDK_CONFIG;
+
+//
+//  Counted from a message's arrival to its reply going out
+//
+
+typedef struct _AVF_SDK_METRICS {
+    uint64_t Connections;              // Accepted so far
+    uint64_t Messages;                 // Answered, not counting handshakes
+    uint64_t Batches;
+    uint64_t Requests;                 // Decided, in batches or not
+    uint64_t Blocked;
+    uint64_t Pings;
+    uint64_t TotalNs;
+    uint64_t MaxNs;
+    uint64_t Latency[AVF_SDK_LATENCY_BUCKETS];     // [i] took less than 2^i us
+} AVF_SDK_METRICS, *PAVF_SDK_METRICS;
+
+typedef struct _AVF_SDK_SERVER AVF_SDK_SERVER, *PAVF_SDK_SERVER;
+
+//
+//  Creates a server; nothing is listened on until AvfSdkRun.  Returns NULL
+//  if the configuration is not valid or memory ran out.
+//
+
+PAVF_SDK_SERVER
+AvfSdkCreate(
+    const AVF_SDK_CONFIG *Config
+    );
+
+//
+//  Serves until AvfSdkStop is called.  Returns 0, or an error if it could
+//  not listen.
+//
+
+int
+AvfSdkRun(
+    PAVF_SDK_SERVER Server
+    );
+
+//
+//  Makes AvfSdkRun return, dropping the connections.  May be called from
+//  any thread, and from a signal or console control handler.
+//
+
+void
+AvfSdkStop(
+    PAVF_SDK_SERVER Server
+    );
+
+//
+//  Frees a server whose AvfSdkRun returned, or that never ran
+//
+
+void
+AvfSdkDestroy(
+    PAVF_SDK_SERVER Server
+    );
+
+void
+AvfSdkGetMetrics(
+    PAVF_SDK_SERVER Server,
+    AVF_SDK_METRICS *Metrics
+    );
+
+//
+//  The latency below which Percent of the messages were answered, in
+//  microseconds, to the power of two
+//
+
+uint64_t
+AvfSdkLatencyPercentile(
+    const AVF_SDK_METRICS *Metrics,
+    uint32_t Percent
+    );
+
+//
+//  Converts a request's UTF-16 name to UTF-8.  Returns the length of the
+//  result, which is truncated to Size - 1 bytes and terminated.
+//
+
+size_t
+AvfSdkNameToUtf8(
+    const uint16_t *Name,
+    size_t NameLength,
+    char *Utf8,
+    size_t Size
+    );
+
+//
+//  A client, as avf.exe is, for testing a consultant: connects and shakes
+//  hands, and sends requests one at a time.  Returns NULL if it could not
+//  connect.
+//
+
+typedef struct _AVF_SDK_CLIENT AVF_SDK_CLIENT, *PAVF_SDK_CLIENT;
+
+PAVF_SDK_CLIENT
+AvfSdkConnect(
+    const char *Name,
+    uint32_t *Version
+    );
+
+//
+//  Sends a request and waits for its response.  The request's Version
+//  and RequestId are set.  Returns 0, or an error.
+//
+
+int
+AvfSdkTransact(
+    PAVF_SDK_CLIENT Client,
+    AVF_SDK_REQUEST *Request,
+    AVF_SDK_RESPONSE *Response
+    );
+
+void
+AvfSdkDisconnect(
+    PAVF_SDK_CLIENT Client
+    );
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __AVFSDK_H__ */
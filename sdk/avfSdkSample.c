@@ -0,0 +1,582 @@
+/*++
+
+Copyright (c) 1989-2002  Microsoft Corporation
+Modified for AV Filter functionality
+
+Module Name:
+
+    avfSdkSample.c
+
+Abstract:
+
+    A sample security consultant built on the SDK (see avfSdk.h).
+
+    It blocks writes to executables, and opens of them for writing, by
+    any process but the ones listed on its command line:
+
+        avfSdkSample [-name <pipe>] [-threads <n>] [-test <n>] [image ...]
+
+    With -test it serves on a thread of its own and sends itself n
+    requests with the SDK's client, then prints the metrics.
+
+Environment:
+
+    User mode
+
+--*/
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#include <signal.h>
+#include <strings.h>
+#include <unistd.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "avfSdk.h"
+
+#define AVF_SAMPLE_MAX_IMAGES           64
+
+#define AVF_SAMPLE_REASON_EXECUTABLE    1       // Reason code of a blocked write
+
+//
+//  Operations and access, as in wdm.h
+//
+
+#define AVF_SAMPLE_OP_CREATE            0
+#define AVF_SAMPLE_OP_WRITE             4
+
+#define AVF_SAMPLE_WRITE_ACCESS         (0x00000002 | 0x00000004 | 0x00000010 | 0x00000100 | \
+                                         0x00010000 | 0x00040000 | 0x00080000 | \
+                                         0x40000000 | 0x10000000 | 0x02000000)
+
+//
+//  The consultant's context: the images allowed to write executables
+//
+
+typedef struct _AVF_SAMPLE {
+    int ImageCount;
+    const char *Images[AVF_SAMPLE_MAX_IMAGES];
+} AVF_SAMPLE, *PAVF_SAMPLE;
+
+static PAVF_SDK_SERVER gServer;
+
+//
+//  Function prototypes
+//
+
+static void
+SampleEvaluate(
+    void *Context,
+    const AVF_SDK_REQUEST *Request,
+    AVF_SDK_RESPONSE *Response
+    );
+
+static int
+SampleIsExecutable(
+    const char *FileName
+    );
+
+static int
+SampleTest(
+    const char *Name,
+    unsigned Count
+    );
+
+static void
+SamplePrintMetrics(
+    void
+    );
+
+#ifdef _WIN32
+
+static BOOL WINAPI
+SampleStop(
+    DWORD ControlType
+    );
+
+static DWORD WINAPI
+SampleServe(
+    LPVOID Parameter
+    );
+
+#else
+
+static void
+SampleStop(
+    int Signal
+    );
+
+static void *
+SampleServe(
+    void *Parameter
+    );
+
+#endif
+
+
+int
+main(
+    int argc,
+    char *argv[]
+    )
+/*++
+
+Routine Description:
+
+    Parses the command line and serves until interrupted.
+
+Arguments:
+
+    argc - Number of arguments.
+    argv - The arguments.
+
+Return Value:
+
+    0, or 1 on an error.
+
+--*/
+{
+    AVF_SDK_CONFIG config;
+    AVF_SAMPLE sample;
+    unsigned test = 0;
+    int error;
+    int i;
+
+    memset(&config, 0, sizeof(config));
+    memset(&sample, 0, sizeof(sample));
+
+    config.Name = AVF_SDK_DEFAULT_NAME;
+    config.Batches = 1;
+    config.Evaluate = SampleEvaluate;
+    config.Context = &sample;
+
+    for (i = 1; i < argc; i++) {
+
+        if (strcmp(argv[i], "-name") == 0 && i + 1 < argc) {
+            config.Name = argv[++i];
+        } else if (strcmp(argv[i], "-threads") == 0 && i + 1 < argc) {
+            config.Threads = (uint32_t)strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "-test") == 0 && i + 1 < argc) {
+            test = (unsigned)strtoul(argv[++i], NULL, 10);
+        } else if (argv[i][0] == '-') {
+            printf("Usage: avfSdkSample [-name <pipe>] [-threads <n>] [-test <n>] [image ...]\n");
+            return 1;
+        } else if (sample.ImageCount < AVF_SAMPLE_MAX_IMAGES) {
+            sample.Images[sample.ImageCount++] = argv[i];
+        }
+    }
+
+    gServer = AvfSdkCreate(&config);
+    if (gServer == NULL) {
+        printf("Could not create the server\n");
+        return 1;
+    }
+
+    if (test != 0) {
+        error = SampleTest(config.Name, test);
+    } else {
+
+#ifdef _WIN32
+        SetConsoleCtrlHandler(SampleStop, TRUE);
+#else
+        signal(SIGINT, SampleStop);
+        signal(SIGTERM, SampleStop);
+#endif
+
+        printf("Serving on %s\n", config.Name);
+
+        error = AvfSdkRun(gServer);
+        if (error != 0) {
+            printf("Could not serve on %s: %d\n", config.Name, error);
+        }
+    }
+
+    SamplePrintMetrics();
+    AvfSdkDestroy(gServer);
+
+    return (error != 0);
+}
+
+
+static void
+SampleEvaluate(
+    void *Context,
+    const AVF_SDK_REQUEST *Request,
+    AVF_SDK_RESPONSE *Response
+    )
+/*++
+
+Routine Description:
+
+    Decides a request: a write to an executable, or an open of one for
+    writing, is blocked unless the process is one of the allowed images.
+
+Arguments:
+
+    Context - The AVF_SAMPLE.
+    Request - The request.
+    Response - Receives the decision.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    PAVF_SAMPLE sample = Context;
+    char fileName[AVF_SDK_MAX_PATH * 3];
+    char processName[AVF_SDK_MAX_PROCESS_NAME * 3];
+    const char *image;
+    int writes;
+    int i;
+
+    //
+    //  The access of an open is in requests of version 2 and later
+    //
+
+    writes = (Request->Operation == AVF_SAMPLE_OP_WRITE) ||
+             (Request->Operation == AVF_SAMPLE_OP_CREATE &&
+              (Request->Version < 2 || (Request->DesiredAccess & AVF_SAMPLE_WRITE_ACCESS) != 0));
+
+    if (!writes) {
+        return;
+    }
+
+    AvfSdkNameToUtf8(Request->FileName, AVF_SDK_MAX_PATH, fileName, sizeof(fileName));
+
+    if (!SampleIsExecutable(fileName)) {
+        return;
+    }
+
+    AvfSdkNameToUtf8(Request->ProcessName, AVF_SDK_MAX_PROCESS_NAME, processName, sizeof(processName));
+
+    image = strrchr(processName, '\\');
+    image = (image != NULL) ? image + 1 : processName;
+
+    for (i = 0; i < sample->ImageCount; i++) {
+
+#ifdef _WIN32
+        if (_stricmp(image, sample->Images[i]) == 0) {
+#else
+        if (strcasecmp(image, sample->Images[i]) == 0) {
+#endif
+            return;
+        }
+    }
+
+    Response->Decision = AVF_SDK_DECISION_BLOCK;
+    Response->Reason = AVF_SAMPLE_REASON_EXECUTABLE;
+}
+
+
+static int
+SampleIsExecutable(
+    const char *FileName
+    )
+/*++
+
+Routine Description:
+
+    Tells whether a file name has the extension of an executable.
+
+Arguments:
+
+    FileName - The name.
+
+Return Value:
+
+    Nonzero if it does.
+
+--*/
+{
+    static const char *extensions[] = { ".exe", ".dll", ".sys", ".scr" };
+    size_t length = strlen(FileName);
+    size_t i;
+
+    for (i = 0; i < sizeof(extensions) / sizeof(extensions[0]); i++) {
+
+#ifdef _WIN32
+        if (length >= 4 && _stricmp(FileName + length - 4, extensions[i]) == 0) {
+#else
+        if (length >= 4 && strcasecmp(FileName + length - 4, extensions[i]) == 0) {
+#endif
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+
+static int
+SampleTest(
+    const char *Name,
+    unsigned Count
+    )
+/*++
+
+Routine Description:
+
+    Serves on another thread and sends the server Count requests, every
+    other one a write to an executable, checking the decisions.
+
+Arguments:
+
+    Name - The pipe or socket path.
+    Count - Number of requests.
+
+Return Value:
+
+    0, or nonzero if a request failed or was decided wrongly.
+
+--*/
+{
+    static const char fileNames[2][32] = { "\\Device\\HarddiskVolume1\\a.txt",
+                                           "\\Device\\HarddiskVolume1\\a.exe" };
+    static const char processName[] = "\\Device\\HarddiskVolume1\\cmd.exe";
+    PAVF_SDK_CLIENT client = NULL;
+    AVF_SDK_REQUEST request;
+    AVF_SDK_RESPONSE response;
+    uint32_t version = 0;
+    unsigned failed = 0;
+    unsigned attempt;
+    unsigned i;
+    size_t j;
+#ifdef _WIN32
+    HANDLE thread;
+
+    thread = CreateThread(NULL, 0, SampleServe, NULL, 0, NULL);
+    if (thread == NULL) {
+        return 1;
+    }
+#else
+    pthread_t thread;
+
+    if (pthread_create(&thread, NULL, SampleServe, NULL) != 0) {
+        return 1;
+    }
+#endif
+
+    //
+    //  Give the server a moment to listen
+    //
+
+    for (attempt = 0; attempt < 50 && client == NULL; attempt++) {
+
+        client = AvfSdkConnect(Name, &version);
+
+        if (client == NULL) {
+#ifdef _WIN32
+            Sleep(20);
+#else
+            usleep(20000);
+#endif
+        }
+    }
+
+    if (client == NULL) {
+        printf("Could not connect to %s\n", Name);
+        failed = Count;
+    } else {
+
+        printf("Connected to %s, protocol version %u\n", Name, version);
+
+        memset(&request, 0, sizeof(request));
+
+        for (j = 0; processName[j] != '\0'; j++) {
+            request.ProcessName[j] = (uint16_t)processName[j];
+        }
+
+        for (i = 0; i < Count; i++) {
+
+            for (j = 0; fileNames[i % 2][j] != '\0'; j++) {
+                request.FileName[j] = (uint16_t)fileNames[i % 2][j];
+            }
+            request.FileName[j] = 0;
+
+            request.ProcessId = 4 + i;
+            request.Operation = AVF_SAMPLE_OP_WRITE;
+
+            if (AvfSdkTransact(client, &request, &response) != 0 ||
+                response.Decision != ((i % 2) ? AVF_SDK_DECISION_BLOCK : AVF_SDK_DECISION_ALLOW)) {
+
+                failed++;
+            }
+        }
+
+        AvfSdkDisconnect(client);
+        printf("%u of %u requests failed\n", failed, Count);
+    }
+
+    AvfSdkStop(gServer);
+
+#ifdef _WIN32
+    WaitForSingleObject(thread, INFINITE);
+    CloseHandle(thread);
+#else
+    pthread_join(thread, NULL);
+#endif
+
+    return (failed != 0);
+}
+
+
+static void
+SamplePrintMetrics(
+    void
+    )
+/*++
+
+Routine Description:
+
+    Prints the server's metrics.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    AVF_SDK_METRICS metrics;
+
+    AvfSdkGetMetrics(gServer, &metrics);
+
+    printf("Connections: %llu\n", (unsigned long long)metrics.Connections);
+    printf("Messages:    %llu (%llu batches, %llu pings)\n",
+           (unsigned long long)metrics.Messages,
+           (unsigned long long)metrics.Batches,
+           (unsigned long long)metrics.Pings);
+    printf("Requests:    %llu (%llu blocked)\n",
+           (unsigned long long)metrics.Requests,
+           (unsigned long long)metrics.Blocked);
+
+    if (metrics.Messages != 0) {
+        printf("Latency:     mean %llu us, p50 < %llu us, p99 < %llu us, max %llu us\n",
+               (unsigned long long)(metrics.TotalNs / metrics.Messages / 1000),
+               (unsigned long long)AvfSdkLatencyPercentile(&metrics, 50),
+               (unsigned long long)AvfSdkLatencyPercentile(&metrics, 99),
+               (unsigned long long)(metrics.MaxNs / 1000));
+    }
+}
+
+#ifdef _WIN32
+
+static BOOL WINAPI
+SampleStop(
+    DWORD ControlType
+    )
+/*++
+
+Routine Description:
+
+    Stops the server on Ctrl+C.
+
+Arguments:
+
+    ControlType - The console event.
+
+Return Value:
+
+    TRUE.
+
+--*/
+{
+    UNREFERENCED_PARAMETER(ControlType);
+
+    AvfSdkStop(gServer);
+    return TRUE;
+}
+
+
+static DWORD WINAPI
+SampleServe(
+    LPVOID Parameter
+    )
+/*++
+
+Routine Description:
+
+    Runs the server, for SampleTest.
+
+Arguments:
+
+    Parameter - Unused.
+
+Return Value:
+
+    AvfSdkRun's result.
+
+--*/
+{
+    UNREFERENCED_PARAMETER(Parameter);
+
+    return (DWORD)AvfSdkRun(gServer);
+}
+
+#else
+
+static void
+SampleStop(
+    int Signal
+    )
+/*++
+
+Routine Description:
+
+    Stops the server on SIGINT or SIGTERM.
+
+Arguments:
+
+    Signal - The signal.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    (void)Signal;
+
+    AvfSdkStop(gServer);
+}
+
+
+static void *
+SampleServe(
+    void *Parameter
+    )
+/*++
+
+Routine Description:
+
+    Runs the server, for SampleTest.
+
+Arguments:
+
+    Parameter - Unused.
+
+Return Value:
+
+    NULL.
+
+--*/
+{
+    (void)Parameter;
+
+    if (AvfSdkRun(gServer) != 0) {
+        printf("Could not serve\n");
+    }
+
+    return NULL;
+}
+
+#endif
@@ -0,0 +1,523 @@
+/*++
+
+Copyright (c) 1989-2002  Microsoft Corporation
+Modified for AV Filter functionality
+
+Module Name:
+
+    avfAggregate.c
+
+Abstract:
+
+    Aggregation of repeated events (-aggregate).  A process reading a file
+    in small pieces is reported thousands of times a second, and printing
+    each event costs more than deciding on it.
+
+    Once the verdict on an event is known it is added to a record of the
+    same process, file, operation and verdict, which is made when the
+    first such event comes in and written out a window later, with how
+    many events it stands for, when the first and last of them came in
+    and how many bytes they read or wrote.  Records are written to the
+    console, and to the -log file if there is one.
+
+    Records are found through a hash table whose buckets share a few
+    locks, so that workers adding to different records seldom wait on each
+    other.  Records come from a pool allocated up front; when it is used
+    up, an event is written out at once as a record of its own.
+
+Environment:
+
+    User mode
+
+--*/
+
+#include <windows.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "avfUser.h"
+
+#define AVF_AGGREGATE_BUCKETS       1024    // Must be a power of 2
+#define AVF_AGGREGATE_LOCKS         64      // Must be a power of 2, at most AVF_AGGREGATE_BUCKETS
+#define AVF_AGGREGATE_MAX_RECORDS   4096    // Records open at once
+
+ULONG gAggregateWindowMs = 0;
+
+typedef struct DECLSPEC_ALIGN(MEMORY_ALLOCATION_ALIGNMENT) _AVF_AGGREGATE {
+    SLIST_ENTRY Entry;                     // In gAggregateFree while not open
+    struct _AVF_AGGREGATE *Next;
+    ULONG Hash;
+    ULONG ProcessKey;
+    ULONG ProcessId;
+    UCHAR MajorFunction;
+    AVF_EVENT_VERDICT Verdict;
+    ULONG Detail;                          // Rule line or reason code
+    ULONGLONG WriteTime;                   // GetTickCount64 at which it is written
+    LONG64 Count;
+    LONG64 Bytes;
+    FILETIME FirstSeen;
+    FILETIME LastSeen;
+    WCHAR ProcessName[AVF_MAX_PROCESS_NAME];
+    WCHAR FileName[AVF_MAX_PATH];
+} AVF_AGGREGATE, *PAVF_AGGREGATE;
+
+//
+//  Bucket locks, one cache line each.  Bucket i is protected by lock
+//  i & (AVF_AGGREGATE_LOCKS - 1).
+//
+
+typedef struct DECLSPEC_CACHEALIGN _AVF_AGGREGATE_LOCK {
+    SRWLOCK Lock;
+} AVF_AGGREGATE_LOCK, *PAVF_AGGREGATE_LOCK;
+
+//
+//  Open records by hash, and the pool they come from
+//
+
+AVF_AGGREGATE_LOCK gAggregateLocks[AVF_AGGREGATE_LOCKS];
+PAVF_AGGREGATE gAggregateBuckets[AVF_AGGREGATE_BUCKETS];
+PAVF_AGGREGATE gAggregateRecords = NULL;
+SLIST_HEADER gAggregateFree;
+
+volatile LONG64 gAggregatedEvents = 0;
+volatile LONG64 gAggregateRecordsWritten = 0;
+volatile LONG64 gAggregateOverflows = 0;
+
+static const PCWSTR gEventVerdictNames[] = {
+    L"ALLOWED by rule",
+    L"BLOCKED by rule",
+    L"ALLOWED, over the process's consultation rate",
+    L"ALLOWED speculatively, audited",
+    L"ALLOWED by consultant",
+    L"BLOCKED by consultant",
+    L"Overdue before the consultant could see it",
+    L"Consultant disconnected, allowed"
+};
+
+C_ASSERT(RTL_NUMBER_OF(gEventVerdictNames) == EventVerdictCount);
+
+//
+//  Function prototypes
+//
+
+ULONG
+HashEvent(
+    _In_ PAVF_FILE_NOTIFICATION pNotification,
+    _In_ AVF_EVENT_VERDICT Verdict,
+    _In_ ULONG Detail
+    );
+
+VOID
+WriteAggregate(
+    _In_ PAVF_AGGREGATE Aggregate
+    );
+
+
+VOID
+InitializeAggregation(
+    VOID
+    )
+/*++
+
+Routine Description:
+
+    Allocates the record pool.  Called before the engine starts; if the
+    pool cannot be had, events are printed one by one.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    ULONG i;
+
+    if (gAggregateWindowMs == 0) {
+        return;
+    }
+
+    gAggregateRecords = HeapAlloc(GetProcessHeap(), 0, AVF_AGGREGATE_MAX_RECORDS * sizeof(AVF_AGGREGATE));
+
+    if (gAggregateRecords == NULL) {
+        wprintf(L"WARNING: Out of memory for -aggregate, printing every event\n");
+        gAggregateWindowMs = 0;
+        return;
+    }
+
+    for (i = 0; i < AVF_AGGREGATE_LOCKS; i++) {
+        InitializeSRWLock(&gAggregateLocks[i].Lock);
+    }
+
+    InitializeSListHead(&gAggregateFree);
+
+    for (i = 0; i < AVF_AGGREGATE_MAX_RECORDS; i++) {
+        InterlockedPushEntrySList(&gAggregateFree, &gAggregateRecords[i].Entry);
+    }
+}
+
+
+VOID
+UninitializeAggregation(
+    VOID
+    )
+/*++
+
+Routine Description:
+
+    Frees the record pool.  Called once the engine has stopped and the
+    open records are written out.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    if (gAggregateRecords == NULL) {
+        return;
+    }
+
+    HeapFree(GetProcessHeap(), 0, gAggregateRecords);
+    gAggregateRecords = NULL;
+}
+
+
+ULONG
+HashEvent(
+    _In_ PAVF_FILE_NOTIFICATION pNotification,
+    _In_ AVF_EVENT_VERDICT Verdict,
+    _In_ ULONG Detail
+    )
+/*++
+
+Routine Description:
+
+    FNV-1a hash of what makes two events the same.
+
+Arguments:
+
+    pNotification - The event's notification.
+    Verdict - What became of it.
+    Detail - The rule line or reason code of the verdict.
+
+Return Value:
+
+    The hash.
+
+--*/
+{
+    ULONG hash = 2166136261;
+    PCWSTR c;
+
+    for (c = pNotification->FileName; *c != L'\0'; c++) {
+        hash ^= *c;
+        hash *= 16777619;
+    }
+
+    hash ^= pNotification->ProcessKey;
+    hash *= 16777619;
+    hash ^= pNotification->MajorFunction;
+    hash *= 16777619;
+    hash ^= Verdict;
+    hash *= 16777619;
+    hash ^= Detail;
+    hash *= 16777619;
+
+    return hash;
+}
+
+
+BOOLEAN
+AggregateEvent(
+    _In_ PAVF_FILE_NOTIFICATION pNotification,
+    _In_ AVF_EVENT_VERDICT Verdict,
+    _In_ ULONG Detail
+    )
+/*++
+
+Routine Description:
+
+    Adds an event whose verdict is known to the open record of the same
+    process, file, operation and verdict, opening one if there is none.
+
+Arguments:
+
+    pNotification - The event's notification.
+    Verdict - What became of it.
+    Detail - The rule line or reason code of the verdict, or 0.
+
+Return Value:
+
+    FALSE if events are not aggregated and the caller prints the event
+    itself, TRUE otherwise.
+
+--*/
+{
+    PAVF_AGGREGATE aggregate;
+    PAVF_AGGREGATE *bucket;
+    PSRWLOCK lock;
+    AVF_AGGREGATE alone;
+    FILETIME now;
+    ULONG hash;
+    ULONG index;
+
+    if (gAggregateWindowMs == 0) {
+        return FALSE;
+    }
+
+    hash = HashEvent(pNotification, Verdict, Detail);
+    index = hash & (AVF_AGGREGATE_BUCKETS - 1);
+    bucket = &gAggregateBuckets[index];
+    lock = &gAggregateLocks[index & (AVF_AGGREGATE_LOCKS - 1)].Lock;
+
+    GetSystemTimeAsFileTime(&now);
+
+    InterlockedIncrement64(&gAggregatedEvents);
+
+    AcquireSRWLockExclusive(lock);
+
+    for (aggregate = *bucket; aggregate != NULL; aggregate = aggregate->Next) {
+
+        if (aggregate->Hash == hash &&
+            aggregate->ProcessKey == pNotification->ProcessKey &&
+            aggregate->MajorFunction == pNotification->MajorFunction &&
+            aggregate->Verdict == Verdict &&
+            aggregate->Detail == Detail &&
+            wcscmp(aggregate->FileName, pNotification->FileName) == 0) {
+
+            aggregate->Count++;
+            aggregate->Bytes += pNotification->Length;
+            aggregate->LastSeen = now;
+
+            ReleaseSRWLockExclusive(lock);
+            return TRUE;
+        }
+    }
+
+    //
+    //  A new record.  If the pool is used up, the event is written out as
+    //  a record of its own.
+    //
+
+    aggregate = (PAVF_AGGREGATE)InterlockedPopEntrySList(&gAggregateFree);
+
+    if (aggregate == NULL) {
+
+        ReleaseSRWLockExclusive(lock);
+        InterlockedIncrement64(&gAggregateOverflows);
+
+        aggregate = &alone;
+
+    } else {
+
+        aggregate->Next = *bucket;
+        *bucket = aggregate;
+    }
+
+    aggregate->Hash = hash;
+    aggregate->ProcessKey = pNotification->ProcessKey;
+    aggregate->ProcessId = pNotification->ProcessId;
+    aggregate->MajorFunction = pNotification->MajorFunction;
+    aggregate->Verdict = Verdict;
+    aggregate->Detail = Detail;
+    aggregate->WriteTime = GetTickCount64() + gAggregateWindowMs;
+    aggregate->Count = 1;
+    aggregate->Bytes = pNotification->Length;
+    aggregate->FirstSeen = now;
+    aggregate->LastSeen = now;
+    wcscpy_s(aggregate->ProcessName, AVF_MAX_PROCESS_NAME, pNotification->ProcessName);
+    wcscpy_s(aggregate->FileName, AVF_MAX_PATH, pNotification->FileName);
+
+    if (aggregate == &alone) {
+        WriteAggregate(aggregate);
+    } else {
+        ReleaseSRWLockExclusive(lock);
+    }
+
+    return TRUE;
+}
+
+
+VOID
+FlushAggregatedEvents(
+    _In_ BOOLEAN All
+    )
+/*++
+
+Routine Description:
+
+    Writes out and closes the records whose window is over.
+
+Arguments:
+
+    All - Write out every open record, as at exit.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    PAVF_AGGREGATE *link;
+    PAVF_AGGREGATE aggregate;
+    PAVF_AGGREGATE expired = NULL;
+    ULONGLONG now = GetTickCount64();
+    ULONG lock;
+    ULONG i;
+
+    if (gAggregateWindowMs == 0) {
+        return;
+    }
+
+    //
+    //  One lock at a time, so that the workers only wait on the buckets
+    //  being swept
+    //
+
+    for (lock = 0; lock < AVF_AGGREGATE_LOCKS; lock++) {
+
+        AcquireSRWLockExclusive(&gAggregateLocks[lock].Lock);
+
+        for (i = lock; i < AVF_AGGREGATE_BUCKETS; i += AVF_AGGREGATE_LOCKS) {
+
+            link = &gAggregateBuckets[i];
+
+            while (*link != NULL) {
+
+                aggregate = *link;
+
+                if (All || aggregate->WriteTime <= now) {
+                    *link = aggregate->Next;
+                    aggregate->Next = expired;
+                    expired = aggregate;
+                } else {
+                    link = &aggregate->Next;
+                }
+            }
+        }
+
+        ReleaseSRWLockExclusive(&gAggregateLocks[lock].Lock);
+    }
+
+    //
+    //  Written outside the locks, so that the workers do not wait on the
+    //  console
+    //
+
+    while (expired != NULL) {
+        aggregate = expired;
+        expired = aggregate->Next;
+        WriteAggregate(aggregate);
+        InterlockedPushEntrySList(&gAggregateFree, &aggregate->Entry);
+    }
+}
+
+
+VOID
+WriteAggregate(
+    _In_ PAVF_AGGREGATE Aggregate
+    )
+/*++
+
+Routine Description:
+
+    Writes a record out to the console and the log file.
+
+Arguments:
+
+    Aggregate - The record.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    WCHAR displayName[AVF_MAX_PATH];
+    WCHAR detail[32];
+    WCHAR bytes[48];
+    FILETIME localTime;
+    SYSTEMTIME first;
+    SYSTEMTIME last;
+
+    if (!ConvertToWin32Path(Aggregate->FileName, displayName, AVF_MAX_PATH)) {
+        wcscpy_s(displayName, AVF_MAX_PATH, Aggregate->FileName);
+    }
+
+    FileTimeToLocalFileTime(&Aggregate->FirstSeen, &localTime);
+    FileTimeToSystemTime(&localTime, &first);
+    FileTimeToLocalFileTime(&Aggregate->LastSeen, &localTime);
+    FileTimeToSystemTime(&localTime, &last);
+
+    detail[0] = L'\0';
+    bytes[0] = L'\0';
+
+    if (Aggregate->Verdict == EventAllowedByRule || Aggregate->Verdict == EventBlockedByRule) {
+        swprintf_s(detail, ARRAYSIZE(detail), L" (line %lu)", Aggregate->Detail);
+    } else if (Aggregate->Verdict == EventBlockedByConsultant) {
+        swprintf_s(detail, ARRAYSIZE(detail), L" (reason code: %lu)", Aggregate->Detail);
+    }
+
+    if (Aggregate->MajorFunction != IRP_MJ_CREATE) {
+        swprintf_s(bytes, ARRAYSIZE(bytes), L", %lld bytes", Aggregate->Bytes);
+    }
+
+    LogMessage(L"[%04d-%02d-%02d %02d:%02d:%02d.%03d - %02d:%02d:%02d.%03d] [%s] PID: %5lu  Process: %-20s  File: %s -> %s%s  x%lld%s\r\n",
+               first.wYear, first.wMonth, first.wDay,
+               first.wHour, first.wMinute, first.wSecond, first.wMilliseconds,
+               last.wHour, last.wMinute, last.wSecond, last.wMilliseconds,
+               Aggregate->MajorFunction == IRP_MJ_CREATE ? L"OPEN " :
+               Aggregate->MajorFunction == IRP_MJ_READ ? L"READ " : L"WRITE",
+               Aggregate->ProcessId,
+               Aggregate->ProcessName,
+               displayName,
+               gEventVerdictNames[Aggregate->Verdict],
+               detail,
+               Aggregate->Count,
+               bytes);
+
+    InterlockedIncrement64(&gAggregateRecordsWritten);
+}
+
+
+VOID
+PrintAggregateStatistics(
+    VOID
+    )
+/*++
+
+Routine Description:
+
+    Prints how many events were written out as how many records.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    if (gAggregatedEvents == 0) {
+        return;
+    }
+
+    wprintf(L"  Aggregated: %lld event(s) written as %lld record(s)",
+            gAggregatedEvents,
+            gAggregateRecordsWritten);
+
+    if (gAggregateOverflows != 0) {
+        wprintf(L", %lld of them alone for want of room", gAggregateOverflows);
+    }
+
+    wprintf(L"\n");
+}
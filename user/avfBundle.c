@@ -0,0 +1,616 @@
+/*++
+
+Copyright (c) 1989-2002  Microsoft Corporation
+Modified for AV Filter functionality
+
+Module Name:
+
+    avfBundle.c
+
+Abstract:
+
+    This module compiles the protected files list into a policy bundle and
+    maps compiled bundles for use in place.  See avfUser.h for the bundle
+    layout.
+
+Environment:
+
+    User mode
+
+--*/
+
+#include <windows.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "avfUser.h"
+
+//
+//  Function prototypes
+//
+
+ULONGLONG
+AvfHashPath(
+    _In_reads_(Length) PCWSTR Path,
+    _In_ ULONG Length
+    );
+
+BOOL
+FindBundlePath(
+    _In_ const AVF_BUNDLE_HEADER *Bundle,
+    _In_reads_(Length) PCWSTR Path,
+    _In_ ULONG Length,
+    _In_ USHORT Flags
+    );
+
+BOOL
+IsBundleSectionValid(
+    _In_ const AVF_BUNDLE_HEADER *Bundle,
+    _In_ const AVF_BUNDLE_SECTION *Section,
+    _In_ ULONGLONG ElementSize
+    );
+
+BOOL
+IsPolicyBundleValid(
+    _In_ const AVF_BUNDLE_HEADER *Bundle,
+    _In_ ULONGLONG Size
+    );
+
+
+ULONGLONG
+AvfHashPath(
+    _In_reads_(Length) PCWSTR Path,
+    _In_ ULONG Length
+    )
+/*++
+
+Routine Description:
+
+    64-bit FNV-1a hash of an upper-case path.
+
+Arguments:
+
+    Path - The path, not necessarily null-terminated.
+    Length - Length of Path in characters.
+
+Return Value:
+
+    The hash.
+
+--*/
+{
+    const UCHAR *bytes = (const UCHAR *)Path;
+    ULONGLONG hash = 0xCBF29CE484222325ULL;
+    ULONG i;
+
+    for (i = 0; i < Length * sizeof(WCHAR); i++) {
+        hash ^= bytes[i];
+        hash *= 0x100000001B3ULL;
+    }
+
+    return hash;
+}
+
+
+BOOL
+CompilePolicyBundle(
+    _In_ PCWSTR BundlePath
+    )
+/*++
+
+Routine Description:
+
+    Compiles the protected files list into a policy bundle.  Every path has
+    already been converted and every file ID resolved, so this is where the
+    cost of a large list is paid, once, instead of at each startup.
+
+Arguments:
+
+    BundlePath - Path of the bundle file to write.
+
+Return Value:
+
+    TRUE if the bundle was written, FALSE otherwise.
+
+--*/
+{
+    PAVF_POLICY_HEADER policy;
+    AVF_BUNDLE_HEADER layout;
+    PAVF_BUNDLE_HEADER bundle = NULL;
+    PAVF_BUNDLE_PATH_ENTRY paths;
+    PAVF_BUNDLE_PATH_ENTRY entry;
+    PWCHAR strings;
+    PCWSTR path;
+    WCHAR tempPath[MAX_PATH];
+    ULONG pathCount = 0;
+    ULONG stringLength = 0;
+    ULONG stringOffset = 0;
+    ULONG length;
+    ULONG slot;
+    USHORT flags;
+    ULONGLONG hash;
+    ULONGLONG size;
+    HANDLE file;
+    DWORD written;
+    BOOL result = FALSE;
+    ULONG i;
+
+    //
+    //  The filter policy, which also sorts the file ID set
+    //
+
+    policy = BuildFilterPolicy();
+    if (policy == NULL) {
+        return FALSE;
+    }
+
+    //
+    //  Size the path table for a load factor of at most one half
+    //
+
+    if (gProtectedFileCount != 0) {
+        pathCount = 1;
+        while (pathCount < gProtectedFileCount * 2) {
+            pathCount <<= 1;
+        }
+    }
+
+    for (i = 0; i < gProtectedFileCount; i++) {
+        stringLength += (ULONG)wcslen(gProtectedFiles[i].Path);
+    }
+
+    //
+    //  Lay out the sections
+    //
+
+    RtlZeroMemory(&layout, sizeof(layout));
+    layout.Magic = AVF_BUNDLE_MAGIC;
+    layout.Version = AVF_BUNDLE_VERSION;
+    layout.HeaderSize = sizeof(AVF_BUNDLE_HEADER);
+    layout.FileCount = gProtectedFileCount;
+
+    size = ROUND_TO_SIZE(sizeof(AVF_BUNDLE_HEADER), AVF_BUNDLE_ALIGNMENT);
+
+    layout.Policy.Offset = size;
+    layout.Policy.Size = policy->Size;
+    size = ROUND_TO_SIZE(size + layout.Policy.Size, AVF_BUNDLE_ALIGNMENT);
+
+    layout.FileIds.Offset = size;
+    layout.FileIds.Size = (ULONGLONG)gProtectedIdCount * sizeof(FILE_ID_128);
+    size = ROUND_TO_SIZE(size + layout.FileIds.Size, AVF_BUNDLE_ALIGNMENT);
+
+    layout.PathTable.Offset = size;
+    layout.PathTable.Size = (ULONGLONG)pathCount * sizeof(AVF_BUNDLE_PATH_ENTRY);
+    size = ROUND_TO_SIZE(size + layout.PathTable.Size, AVF_BUNDLE_ALIGNMENT);
+
+    layout.StringPool.Offset = size;
+    layout.StringPool.Size = (ULONGLONG)stringLength * sizeof(WCHAR);
+    size = ROUND_TO_SIZE(size + layout.StringPool.Size, AVF_BUNDLE_ALIGNMENT);
+
+    layout.Size = size;
+
+    if (size > MAXDWORD) {
+        wprintf(L"ERROR: Policy bundle would be too large (%llu bytes)\n", size);
+        goto Cleanup;
+    }
+
+    bundle = HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, (SIZE_T)size);
+
+    if (bundle == NULL) {
+        wprintf(L"ERROR: Out of memory compiling policy bundle\n");
+        goto Cleanup;
+    }
+
+    *bundle = layout;
+
+    RtlCopyMemory(AvfBundleSection(bundle, Policy), policy, policy->Size);
+    RtlCopyMemory(AvfBundleSection(bundle, FileIds), gProtectedIds, (SIZE_T)bundle->FileIds.Size);
+
+    //
+    //  Hash every path into the path table.  Directories are stored
+    //  without a trailing backslash, the volume root included, so that a
+    //  lookup can try each ancestor of a name as it finds its backslashes.
+    //
+
+    paths = AvfBundleSection(bundle, PathTable);
+    strings = AvfBundleSection(bundle, StringPool);
+
+    for (i = 0; i < gProtectedFileCount; i++) {
+
+        path = gProtectedFiles[i].Path;
+        length = (ULONG)wcslen(path);
+        flags = AVF_BUNDLE_PATH_USED;
+
+        if (gProtectedFiles[i].Directory) {
+            SetFlag(flags, AVF_BUNDLE_PATH_DIRECTORY);
+            if (length > 1 && path[length - 1] == L'\\') {
+                length--;
+            }
+        }
+
+        hash = AvfHashPath(path, length);
+
+        for (slot = (ULONG)(hash >> 32) & (pathCount - 1); ; slot = (slot + 1) & (pathCount - 1)) {
+
+            entry = &paths[slot];
+
+            if (!FlagOn(entry->Flags, AVF_BUNDLE_PATH_USED)) {
+
+                entry->Hash = (ULONG)hash;
+                entry->Flags = flags;
+                entry->PathLength = (USHORT)length;
+                entry->PathOffset = stringOffset;
+
+                RtlCopyMemory(&strings[stringOffset], path, length * sizeof(WCHAR));
+                stringOffset += length;
+                break;
+            }
+
+            //
+            //  The same path listed twice keeps one entry
+            //
+
+            if (entry->Hash == (ULONG)hash &&
+                entry->PathLength == length &&
+                wmemcmp(&strings[entry->PathOffset], path, length) == 0) {
+
+                SetFlag(entry->Flags, flags);
+                break;
+            }
+        }
+    }
+
+    //
+    //  Write it out next to the bundle and move it into place, so that a
+    //  running avf.exe never maps a partly written bundle.  avf.exe maps
+    //  its bundle with FILE_SHARE_DELETE, which lets the move replace it.
+    //
+
+    if (swprintf_s(tempPath, MAX_PATH, L"%s.tmp", BundlePath) < 0) {
+        wprintf(L"ERROR: Policy bundle path is too long: %s\n", BundlePath);
+        goto Cleanup;
+    }
+
+    file = CreateFileW(tempPath,
+                       GENERIC_WRITE,
+                       0,
+                       NULL,
+                       CREATE_ALWAYS,
+                       FILE_ATTRIBUTE_NORMAL,
+                       NULL);
+
+    if (file == INVALID_HANDLE_VALUE) {
+        wprintf(L"ERROR: Failed to create policy bundle %s (error %lu)\n", tempPath, GetLastError());
+        goto Cleanup;
+    }
+
+    result = WriteFile(file, bundle, (DWORD)bundle->Size, &written, NULL) &&
+             written == bundle->Size &&
+             FlushFileBuffers(file);
+
+    CloseHandle(file);
+
+    if (result) {
+        result = MoveFileExW(tempPath, BundlePath, MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH);
+    }
+
+    if (!result) {
+        wprintf(L"ERROR: Failed to write policy bundle %s (error %lu)\n", BundlePath, GetLastError());
+    }
+
+    if (result) {
+        wprintf(L"Compiled %lu file(s), %lu file ID(s) and %lu volume(s) into %s (%llu KB)\n",
+                gProtectedFileCount,
+                gProtectedIdCount,
+                policy->VolumeCount,
+                BundlePath,
+                bundle->Size / 1024);
+    } else {
+        DeleteFileW(tempPath);
+    }
+
+Cleanup:
+
+    if (bundle != NULL) {
+        HeapFree(GetProcessHeap(), 0, bundle);
+    }
+
+    HeapFree(GetProcessHeap(), 0, policy);
+    return result;
+}
+
+
+BOOL
+IsBundleSectionValid(
+    _In_ const AVF_BUNDLE_HEADER *Bundle,
+    _In_ const AVF_BUNDLE_SECTION *Section,
+    _In_ ULONGLONG ElementSize
+    )
+/*++
+
+Routine Description:
+
+    Checks that a bundle section is aligned, lies within the bundle and
+    holds a whole number of elements.
+
+Arguments:
+
+    Bundle - The bundle header.  Bundle->Size has been checked against the
+             size of the file.
+    Section - The section to check.
+    ElementSize - Size of the section's elements in bytes.
+
+Return Value:
+
+    TRUE if the section is valid, FALSE otherwise.
+
+--*/
+{
+    return (Section->Offset % AVF_BUNDLE_ALIGNMENT) == 0 &&
+           Section->Offset >= Bundle->HeaderSize &&
+           Section->Offset <= Bundle->Size &&
+           Section->Size <= Bundle->Size - Section->Offset &&
+           (Section->Size % ElementSize) == 0 &&
+           Section->Size / ElementSize <= MAXULONG;
+}
+
+
+BOOL
+IsPolicyBundleValid(
+    _In_ const AVF_BUNDLE_HEADER *Bundle,
+    _In_ ULONGLONG Size
+    )
+/*++
+
+Routine Description:
+
+    Validates the header and section bounds of a mapped policy bundle.
+    This does not look at the contents of the sections, so it costs the
+    same for any bundle; the filter validates the policy itself when it is
+    sent, and path lookups check the string pool bounds as they go.
+
+Arguments:
+
+    Bundle - The mapped bundle.
+    Size - Size of the mapping in bytes.
+
+Return Value:
+
+    TRUE if the bundle can be used, FALSE otherwise.
+
+--*/
+{
+    const AVF_POLICY_HEADER *policy;
+    ULONGLONG pathCount;
+
+    if (Size < sizeof(AVF_BUNDLE_HEADER) ||
+        Bundle->Magic != AVF_BUNDLE_MAGIC ||
+        Bundle->Version != AVF_BUNDLE_VERSION ||
+        Bundle->HeaderSize != sizeof(AVF_BUNDLE_HEADER) ||
+        Bundle->Size != Size) {
+
+        return FALSE;
+    }
+
+    if (!IsBundleSectionValid(Bundle, &Bundle->Policy, 1) ||
+        !IsBundleSectionValid(Bundle, &Bundle->FileIds, sizeof(FILE_ID_128)) ||
+        !IsBundleSectionValid(Bundle, &Bundle->PathTable, sizeof(AVF_BUNDLE_PATH_ENTRY)) ||
+        !IsBundleSectionValid(Bundle, &Bundle->StringPool, sizeof(WCHAR))) {
+
+        return FALSE;
+    }
+
+    //
+    //  The path table is addressed with a mask
+    //
+
+    pathCount = Bundle->PathTable.Size / sizeof(AVF_BUNDLE_PATH_ENTRY);
+
+    if ((pathCount & (pathCount - 1)) != 0) {
+        return FALSE;
+    }
+
+    //
+    //  The policy is sent as one message
+    //
+
+    if (Bundle->Policy.Size < sizeof(AVF_POLICY_HEADER) ||
+        Bundle->Policy.Size > MAXULONG - FIELD_OFFSET(COMMAND_MESSAGE, Data)) {
+
+        return FALSE;
+    }
+
+    policy = AvfBundleSection(Bundle, Policy);
+
+    return policy->Size == Bundle->Policy.Size;
+}
+
+
+BOOL
+LoadPolicyBundle(
+    _In_ PCWSTR BundlePath,
+    _Out_ PAVF_USER_POLICY Policy
+    )
+/*++
+
+Routine Description:
+
+    Maps a compiled policy bundle as a protected set.  The file ID set and
+    the filter policy are used where they lie in the mapping, which lasts
+    until the policy is freed.
+
+Arguments:
+
+    BundlePath - Path of the bundle file.
+    Policy - Receives the protected set.
+
+Return Value:
+
+    TRUE if the bundle was loaded, FALSE otherwise.
+
+--*/
+{
+    HANDLE file;
+    HANDLE mapping;
+    LARGE_INTEGER size;
+    const AVF_BUNDLE_HEADER *bundle = NULL;
+
+    RtlZeroMemory(Policy, sizeof(AVF_USER_POLICY));
+
+    //
+    //  FILE_SHARE_DELETE lets a new bundle be moved over this one while it
+    //  is mapped
+    //
+
+    file = CreateFileW(BundlePath,
+                       GENERIC_READ,
+                       FILE_SHARE_READ | FILE_SHARE_DELETE,
+                       NULL,
+                       OPEN_EXISTING,
+                       FILE_ATTRIBUTE_NORMAL,
+                       NULL);
+
+    if (file == INVALID_HANDLE_VALUE) {
+        wprintf(L"ERROR: Failed to open policy bundle %s (error %lu)\n", BundlePath, GetLastError());
+        return FALSE;
+    }
+
+    if (GetFileSizeEx(file, &size) && size.QuadPart >= sizeof(AVF_BUNDLE_HEADER)) {
+
+        mapping = CreateFileMappingW(file, NULL, PAGE_READONLY, 0, 0, NULL);
+
+        if (mapping != NULL) {
+            bundle = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+            CloseHandle(mapping);
+        }
+    }
+
+    CloseHandle(file);
+
+    if (bundle == NULL || !IsPolicyBundleValid(bundle, (ULONGLONG)size.QuadPart)) {
+
+        wprintf(L"ERROR: %s is not a valid policy bundle\n", BundlePath);
+
+        if (bundle != NULL) {
+            UnmapViewOfFile(bundle);
+        }
+
+        return FALSE;
+    }
+
+    Policy->Bundle = bundle;
+    Policy->FileIds = AvfBundleSection(bundle, FileIds);
+    Policy->FileIdCount = (ULONG)(bundle->FileIds.Size / sizeof(FILE_ID_128));
+    Policy->FilterPolicy = AvfBundleSection(bundle, Policy);
+    Policy->MonitorAll = (bundle->FileCount == 0);
+
+    return TRUE;
+}
+
+
+BOOL
+FindBundlePath(
+    _In_ const AVF_BUNDLE_HEADER *Bundle,
+    _In_reads_(Length) PCWSTR Path,
+    _In_ ULONG Length,
+    _In_ USHORT Flags
+    )
+/*++
+
+Routine Description:
+
+    Looks up a path in a bundle's path table.
+
+Arguments:
+
+    Bundle - The mapped bundle.
+    Path - Upper-case path, not necessarily null-terminated.
+    Length - Length of Path in characters.
+    Flags - AVF_BUNDLE_PATH_* flags the entry must have.
+
+Return Value:
+
+    TRUE if the path is in the table with the given flags, FALSE otherwise.
+
+--*/
+{
+    const AVF_BUNDLE_PATH_ENTRY *paths = AvfBundleSection(Bundle, PathTable);
+    const WCHAR *strings = AvfBundleSection(Bundle, StringPool);
+    ULONG pathCount = (ULONG)(Bundle->PathTable.Size / sizeof(AVF_BUNDLE_PATH_ENTRY));
+    ULONG stringLength = (ULONG)(Bundle->StringPool.Size / sizeof(WCHAR));
+    const AVF_BUNDLE_PATH_ENTRY *entry;
+    ULONGLONG hash;
+    ULONG slot;
+    ULONG probe;
+
+    if (pathCount == 0) {
+        return FALSE;
+    }
+
+    hash = AvfHashPath(Path, Length);
+    slot = (ULONG)(hash >> 32) & (pathCount - 1);
+
+    for (probe = 0; probe < pathCount; probe++) {
+
+        entry = &paths[slot];
+
+        if (!FlagOn(entry->Flags, AVF_BUNDLE_PATH_USED)) {
+            break;
+        }
+
+        if (entry->Hash == (ULONG)hash &&
+            entry->PathLength == Length &&
+            FlagOn(entry->Flags, Flags) == Flags &&
+            entry->PathOffset <= stringLength &&
+            Length <= stringLength - entry->PathOffset &&
+            wmemcmp(&strings[entry->PathOffset], Path, Length) == 0) {
+
+            return TRUE;
+        }
+
+        slot = (slot + 1) & (pathCount - 1);
+    }
+
+    return FALSE;
+}
+
+
+BOOL
+IsPathInPolicyBundle(
+    _In_ const AVF_BUNDLE_HEADER *Bundle,
+    _In_ PCWSTR UpperPath
+    )
+/*++
+
+Routine Description:
+
+    Checks if a path is protected by a policy bundle: either it is in the
+    bundle itself, or one of its ancestors is a protected directory.
+    Costs one lookup per path component.
+
+Arguments:
+
+    Bundle - The mapped bundle.
+    UpperPath - Upper-case NT device path (from kernel notification).
+
+Return Value:
+
+    TRUE if the path is protected, FALSE otherwise.
+
+--*/
+{
+    ULONG length = (ULONG)wcslen(UpperPath);
+    ULONG i;
+
+    if (FindBundlePath(Bundle, UpperPath, length, 0)) {
+        return TRUE;
+    }
+
+    for (i = length; i > 1; i--) {
+        if (UpperPath[i - 1] == L'\\' &&
+            FindBundlePath(Bundle, UpperPath, i - 1, AVF_BUNDLE_PATH_DIRECTORY)) {
+            return TRUE;
+        }
+    }
+
+    return FALSE;
+}
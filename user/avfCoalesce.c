@@ -0,0 +1,328 @@
+/*++
+
+Copyright (c) 1989-2002  Microsoft Corporation
+Modified for AV Filter functionality
+
+Module Name:
+
+    avfCoalesce.c
+
+Abstract:
+
+    Coalescing of identical consultations.  When a build starts a few
+    hundred compilers that all open the same header, the consultant would
+    be asked the same question a few hundred times at once.  Instead, the
+    first consultation for a question is sent (the leader) and the ones
+    that ask it while it is in flight wait on it (its followers); when it
+    is over, every follower gets its response.
+
+    Consultations in flight are found through a hash table of leaders.
+    What makes two consultations the same question is set by -coalesce
+    (see AVF_COALESCE_SCOPE).  An audit is only coalesced with audits, so
+    that an operation that waits is never behind one that does not, and a
+    leader still waiting for the window is raised to the priority and the
+    deadline of its most pressing follower.
+
+Environment:
+
+    User mode
+
+--*/
+
+#include <windows.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "avfUser.h"
+
+#define AVF_COALESCE_BUCKETS        256     // Must be a power of 2
+
+AVF_COALESCE_SCOPE gCoalesceScope = CoalesceImage;
+
+//
+//  Leaders by CoalesceHash, and the counters, protected by gCoalesceLock
+//
+
+SRWLOCK gCoalesceLock = SRWLOCK_INIT;
+PAVF_CONSULTATION gCoalesceBuckets[AVF_COALESCE_BUCKETS];
+
+LONGLONG gCoalesceLeaders = 0;
+LONGLONG gCoalesced = 0;
+
+//
+//  Function prototypes
+//
+
+ULONG
+HashConsultation(
+    _In_ PAVF_CONSULTATION Consultation
+    );
+
+BOOLEAN
+IsSameConsultation(
+    _In_ PAVF_CONSULTATION Left,
+    _In_ PAVF_CONSULTATION Right
+    );
+
+
+ULONG
+HashConsultation(
+    _In_ PAVF_CONSULTATION Consultation
+    )
+/*++
+
+Routine Description:
+
+    FNV-1a hash of what IsSameConsultation compares.
+
+Arguments:
+
+    Consultation - The consultation, with its request built.
+
+Return Value:
+
+    The hash.
+
+--*/
+{
+    const AVF_CONSULTANT_REQUEST *request = &Consultation->Request;
+    ULONG hash = 2166136261;
+    PCWSTR c;
+
+    for (c = request->FileName; *c != L'\0'; c++) {
+        hash ^= *c;
+        hash *= 16777619;
+    }
+
+    if (gCoalesceScope == CoalesceImage) {
+        for (c = request->ProcessName; *c != L'\0'; c++) {
+            hash ^= *c;
+            hash *= 16777619;
+        }
+    } else if (gCoalesceScope == CoalesceProcess) {
+        hash ^= request->ProcessId;
+        hash *= 16777619;
+    }
+
+    hash ^= request->Operation;
+    hash *= 16777619;
+    hash ^= request->DesiredAccess;
+    hash *= 16777619;
+
+    return hash;
+}
+
+
+BOOLEAN
+IsSameConsultation(
+    _In_ PAVF_CONSULTATION Left,
+    _In_ PAVF_CONSULTATION Right
+    )
+/*++
+
+Routine Description:
+
+    Checks if two consultations ask the consultant the same question in
+    the coalescing scope.
+
+Arguments:
+
+    Left - A consultation.
+    Right - The other.
+
+Return Value:
+
+    TRUE if one can take the other's response.
+
+--*/
+{
+    const AVF_CONSULTANT_REQUEST *left = &Left->Request;
+    const AVF_CONSULTANT_REQUEST *right = &Right->Request;
+
+    if (Left->CoalesceHash != Right->CoalesceHash ||
+        Left->Audit != Right->Audit ||
+        left->Operation != right->Operation ||
+        left->DesiredAccess != right->DesiredAccess ||
+        left->ShareAccess != right->ShareAccess ||
+        left->CreateDisposition != right->CreateDisposition ||
+        left->CreateOptions != right->CreateOptions) {
+
+        return FALSE;
+    }
+
+    if (gCoalesceScope == CoalesceProcess && left->ProcessId != right->ProcessId) {
+        return FALSE;
+    }
+
+    if (gCoalesceScope == CoalesceImage && wcscmp(left->ProcessName, right->ProcessName) != 0) {
+        return FALSE;
+    }
+
+    return wcscmp(left->FileName, right->FileName) == 0;
+}
+
+
+BOOLEAN
+CoalesceConsultation(
+    _Inout_ PAVF_CONSULTATION Consultation
+    )
+/*++
+
+Routine Description:
+
+    Makes a consultation a follower of the same one in flight, or, if
+    there is none, the leader others can follow.  A follower that is more
+    pressing than its leader raises it (see RaiseConsultation); the leader
+    cannot complete meanwhile, as that takes gCoalesceLock.
+
+Arguments:
+
+    Consultation - The consultation, with its request built and its
+        priority set.
+
+Return Value:
+
+    TRUE if it follows another one and is not to be sent; it completes
+    with the other one.  FALSE if it is to be sent.
+
+--*/
+{
+    PAVF_CONSULTATION *bucket;
+    PAVF_CONSULTATION leader;
+
+    Consultation->Followers = NULL;
+    Consultation->CoalesceNext = NULL;
+    Consultation->Coalescing = FALSE;
+
+    if (gCoalesceScope == CoalesceNone) {
+        return FALSE;
+    }
+
+    Consultation->CoalesceHash = HashConsultation(Consultation);
+    bucket = &gCoalesceBuckets[Consultation->CoalesceHash & (AVF_COALESCE_BUCKETS - 1)];
+
+    AcquireSRWLockExclusive(&gCoalesceLock);
+
+    for (leader = *bucket; leader != NULL; leader = leader->CoalesceNext) {
+
+        if (IsSameConsultation(leader, Consultation)) {
+
+            Consultation->CoalesceNext = leader->Followers;
+            leader->Followers = Consultation;
+            gCoalesced++;
+
+            if (Consultation->Priority < leader->Priority ||
+                Consultation->Deadline < leader->Deadline) {
+
+                RaiseConsultation(leader, Consultation);
+            }
+
+            ReleaseSRWLockExclusive(&gCoalesceLock);
+            return TRUE;
+        }
+    }
+
+    Consultation->CoalesceNext = *bucket;
+    Consultation->Coalescing = TRUE;
+    *bucket = Consultation;
+    gCoalesceLeaders++;
+
+    ReleaseSRWLockExclusive(&gCoalesceLock);
+
+    return FALSE;
+}
+
+
+VOID
+CompleteCoalesced(
+    _Inout_ PAVF_CONSULTATION Consultation
+    )
+/*++
+
+Routine Description:
+
+    Hands a consultation that is over back to the engine, with the
+    followers that waited on it, which get its outcome.
+
+Arguments:
+
+    Consultation - The consultation.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    PAVF_CONSULTATION *link;
+    PAVF_CONSULTATION follower;
+    PAVF_CONSULTATION next;
+
+    if (Consultation->Coalescing) {
+
+        AcquireSRWLockExclusive(&gCoalesceLock);
+
+        link = &gCoalesceBuckets[Consultation->CoalesceHash & (AVF_COALESCE_BUCKETS - 1)];
+
+        while (*link != Consultation) {
+            link = &(*link)->CoalesceNext;
+        }
+
+        *link = Consultation->CoalesceNext;
+        Consultation->CoalesceNext = NULL;
+        Consultation->Coalescing = FALSE;
+
+        follower = Consultation->Followers;
+        Consultation->Followers = NULL;
+
+        ReleaseSRWLockExclusive(&gCoalesceLock);
+
+        //
+        //  The followers go first: the engine may reuse the leader as soon
+        //  as it has it
+        //
+
+        for (; follower != NULL; follower = next) {
+
+            next = follower->CoalesceNext;
+            follower->CoalesceNext = NULL;
+
+            follower->Result = Consultation->Result;
+            follower->Expired = Consultation->Expired;
+            follower->Response = Consultation->Response;
+
+            ConsultationCompleted(follower);
+        }
+    }
+
+    ConsultationCompleted(Consultation);
+}
+
+
+VOID
+PrintCoalesceStatistics(
+    VOID
+    )
+/*++
+
+Routine Description:
+
+    Prints how many consultations were coalesced, and so never sent.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    if (gCoalesced == 0) {
+        return;
+    }
+
+    wprintf(L"  Coalesced onto one in flight: %lld (of %lld sent)\n",
+            gCoalesced,
+            gCoalesceLeaders);
+}
@@ -0,0 +1,1501 @@
+/*++
+
+Copyright (c) 1989-2002  Microsoft Corporation
+Modified for AV Filter functionality
+
+Module Name:
+
+    avfConsultant.c
+
+Abstract:
+
+    This module manages the connections to the security consultants and
+    starts consultations on them.
+
+    There is one consultant unless several are listed with -consultant;
+    a consultation then goes to all of them and their verdicts are
+    combined (avfFanOut.c).
+
+    A manager thread per consultant owns its connection: it reconnects,
+    backing off exponentially while the consultant is away, and pings the
+    consultant every AVF_CONSULTANT_PING_MS.  Healthy is a circuit breaker
+    in front of it: while the consultant is gone or misses a ping, file
+    accesses are not sent to it.  With none healthy they get the default
+    verdict at once.  The decision path only ever looks at the breakers
+    and the current connections; it never connects.
+
+    A connection is reference counted.  The current one is held by its
+    consultant; every consultation in flight and every I/O a transport
+    has outstanding holds a reference too, so a connection that breaks is
+    torn down when the last of them lets go, without anyone waiting.
+
+    A consultation is asynchronous.  StartConsultation hands it to the
+    transport and returns; CompleteConsultation, called by the transport
+    once the response is there or the connection broke, hands it back to
+    the engine (ConsultationCompleted), along with the ones coalesced onto
+    it (avfCoalesce.c).  Synchronous transports are run on the thread
+    pool and post their completion back to the completion port.
+
+    With a plugin (avfPlugin.c) a consultation goes to it first, and only
+    what it defers is forwarded to the consultants.
+
+Environment:
+
+    User mode
+
+--*/
+
+#include <windows.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "avfUser.h"
+
+#define AVF_CONSULTANT_RETRY_MIN_MS     250     // First reconnect delay
+#define AVF_CONSULTANT_RETRY_MAX_MS     30000   // Longest reconnect delay
+#define AVF_CONSULTANT_PING_MS          5000    // Between health checks
+#define AVF_CONSULTANT_PING_TIMEOUT_MS  2000    // For the answer to one
+#define AVF_CONSULTANT_PING_FAILURES    3       // Missed in a row that drop the connection
+#define AVF_CONSULTANT_STOP_MS          5000
+
+typedef struct _AVF_CONSULTANT AVF_CONSULTANT, *PAVF_CONSULTANT;
+
+struct _AVF_CONSULTANT_CONNECTION {
+    volatile LONG References;
+    PAVF_CONSULTANT Consultant;            // Whose connection it is
+    HANDLE Pipe;
+    ULONG Version;                         // Agreed in the handshake
+    ULONG Capabilities;                    // AVF_CONSULTANT_CAP_*
+    const AVF_CONSULTANT_TRANSPORT *Transport;
+    PVOID Context;                         // The transport's
+};
+
+//
+//  A security consultant.  Connection is the current connection, or NULL,
+//  protected by gConsultantLock.  Event wakes its manager when the
+//  connection drops or StopConsultant is called.  Ping is the manager's
+//  health check, in flight while PingPending is set.
+//
+
+struct _AVF_CONSULTANT {
+    WCHAR PipeName[AVF_MAX_PATH];
+    ULONG DeadlineMs;                      // For its verdict; 0 for the filter's
+    PAVF_CONSULTANT_CONNECTION Connection;
+    volatile BOOLEAN Healthy;              // The circuit breaker is closed
+    HANDLE Manager;
+    HANDLE Event;
+    AVF_CONSULTATION Ping;
+    HANDLE PingDone;
+    volatile BOOLEAN PingPending;
+};
+
+//
+//  The consultants, in the order they were listed, and whether to connect
+//  again when one has no connection.  Protected by gConsultantLock.
+//
+
+CRITICAL_SECTION gConsultantLock;
+AVF_CONSULTANT gConsultants[AVF_MAX_CONSULTANTS];
+ULONG gConsultantCount = 0;
+BOOLEAN gConsultantStopped = FALSE;
+
+//
+//  Function prototypes
+//
+
+DWORD WINAPI
+ConsultantManagerThread(
+    _In_ LPVOID lpParameter
+    );
+
+BOOLEAN
+PublishConsultant(
+    _In_ PAVF_CONSULTANT Consultant,
+    _In_ PAVF_CONSULTANT_CONNECTION Connection
+    );
+
+BOOLEAN
+PingConsultant(
+    _In_ PAVF_CONSULTANT_CONNECTION Connection
+    );
+
+BOOLEAN
+IsConsultantAvailable(
+    VOID
+    );
+
+PAVF_CONSULTANT_CONNECTION
+ConnectToConsultant(
+    _In_ PAVF_CONSULTANT Consultant,
+    _In_ BOOLEAN Verbose
+    );
+
+VOID CALLBACK
+QueryConsultantCallback(
+    _Inout_ PTP_CALLBACK_INSTANCE Instance,
+    _Inout_opt_ PVOID Context
+    );
+
+VOID
+QueryConsultantComplete(
+    _In_ PAVF_IO Io,
+    _In_ DWORD BytesTransferred,
+    _In_ BOOL Success
+    );
+
+
+BOOL
+AddConsultant(
+    _In_ PCWSTR PipeName,
+    _In_ ULONG DeadlineMs
+    )
+/*++
+
+Routine Description:
+
+    Adds a consultant to the ones consulted (-consultant).
+
+Arguments:
+
+    PipeName - Its pipe, a full path or a name under \\.\pipe\.
+    DeadlineMs - How long a consultation waits for its verdict, or 0 for
+        as long as the filter does.
+
+Return Value:
+
+    TRUE if it was added, FALSE if there are AVF_MAX_CONSULTANTS already.
+
+--*/
+{
+    PAVF_CONSULTANT consultant;
+
+    if (gConsultantCount == AVF_MAX_CONSULTANTS) {
+        wprintf(L"WARNING: At most %d consultants, ignoring %s\n", AVF_MAX_CONSULTANTS, PipeName);
+        return FALSE;
+    }
+
+    consultant = &gConsultants[gConsultantCount];
+    RtlZeroMemory(consultant, sizeof(*consultant));
+
+    if (wcsncmp(PipeName, L"\\\\", 2) == 0) {
+        wcscpy_s(consultant->PipeName, AVF_MAX_PATH, PipeName);
+    } else {
+        swprintf_s(consultant->PipeName, AVF_MAX_PATH, L"\\\\.\\pipe\\%s", PipeName);
+    }
+
+    consultant->DeadlineMs = DeadlineMs;
+
+    gConsultantCount++;
+    return TRUE;
+}
+
+
+VOID
+StartConsultant(
+    VOID
+    )
+/*++
+
+Routine Description:
+
+    Tries to connect to each consultant, then starts its manager thread,
+    which keeps trying if that failed.  Without -consultant there is one,
+    at AVF_CONSULTANT_PIPE_NAME.  gConsultantLock and the engine must
+    exist.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    PAVF_CONSULTANT consultant;
+    PAVF_CONSULTANT_CONNECTION connection;
+    ULONG i;
+
+    if (gConsultantCount == 0) {
+        AddConsultant(AVF_CONSULTANT_PIPE_NAME, 0);
+    }
+
+    for (i = 0; i < gConsultantCount; i++) {
+
+        consultant = &gConsultants[i];
+
+        if (gConsultantCount > 1) {
+            wprintf(L"Consultant %lu: %s\n", i + 1, consultant->PipeName);
+        }
+
+        consultant->Event = CreateEventW(NULL, FALSE, FALSE, NULL);
+        consultant->PingDone = CreateEventW(NULL, TRUE, FALSE, NULL);
+
+        if (consultant->Event == NULL || consultant->PingDone == NULL) {
+            wprintf(L"ERROR: Failed to create consultant events (error %lu)\n", GetLastError());
+            continue;
+        }
+
+        connection = ConnectToConsultant(consultant, TRUE);
+
+        if (connection != NULL && PublishConsultant(consultant, connection)) {
+            wprintf(L"Connected to security consultant.\n");
+        } else {
+            wprintf(L"Security consultant not available - will allow all operations.\n");
+            wprintf(L"Start consultant to enable security decisions.\n");
+        }
+
+        consultant->Manager = CreateThread(NULL, 0, ConsultantManagerThread, consultant, 0, NULL);
+
+        if (consultant->Manager == NULL) {
+            wprintf(L"WARNING: Failed to start the consultant manager (error %lu)\n", GetLastError());
+        }
+    }
+}
+
+
+VOID
+StopConsultant(
+    VOID
+    )
+/*++
+
+Routine Description:
+
+    Disconnects from the consultants for good and stops the managers.
+    Consultations in flight fail; their completions still have to be
+    handled by the engine.  The events stay, since a health check may
+    still complete after this returns.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    PAVF_CONSULTANT consultant;
+    PAVF_CONSULTANT_CONNECTION connection;
+    ULONG i;
+
+    EnterCriticalSection(&gConsultantLock);
+    gConsultantStopped = TRUE;
+    LeaveCriticalSection(&gConsultantLock);
+
+    for (i = 0; i < gConsultantCount; i++) {
+
+        consultant = &gConsultants[i];
+
+        EnterCriticalSection(&gConsultantLock);
+        consultant->Healthy = FALSE;
+        connection = consultant->Connection;
+        if (connection != NULL) {
+            ReferenceConsultant(connection);
+        }
+        LeaveCriticalSection(&gConsultantLock);
+
+        if (connection != NULL) {
+            DisconnectConsultant(connection);
+            ReleaseConsultant(connection);
+        }
+
+        if (consultant->Manager != NULL) {
+            SetEvent(consultant->Event);
+            WaitForSingleObject(consultant->Manager, AVF_CONSULTANT_STOP_MS);
+            CloseHandle(consultant->Manager);
+            consultant->Manager = NULL;
+        }
+    }
+}
+
+
+DWORD WINAPI
+ConsultantManagerThread(
+    _In_ LPVOID lpParameter
+    )
+/*++
+
+Routine Description:
+
+    Connection manager thread of a consultant.  Reconnects to it with
+    exponential backoff while there is no connection, and pings it while
+    there is one, opening the circuit breaker while it does not answer and
+    dropping the connection after AVF_CONSULTANT_PING_FAILURES misses.
+
+Arguments:
+
+    lpParameter - The consultant.
+
+Return Value:
+
+    Thread exit code.
+
+--*/
+{
+    PAVF_CONSULTANT consultant = lpParameter;
+    PAVF_CONSULTANT_CONNECTION connection;
+    ULONG backoff = AVF_CONSULTANT_RETRY_MIN_MS;
+    ULONG attempts = 0;
+    ULONG missed = 0;
+    DWORD wait;
+
+    for (;;) {
+
+        EnterCriticalSection(&gConsultantLock);
+
+        if (gConsultantStopped) {
+            LeaveCriticalSection(&gConsultantLock);
+            break;
+        }
+
+        connection = consultant->Connection;
+        if (connection != NULL) {
+            ReferenceConsultant(connection);
+        }
+
+        LeaveCriticalSection(&gConsultantLock);
+
+        if (connection == NULL) {
+
+            //
+            //  Only the first attempt after losing the consultant says
+            //  what it does
+            //
+
+            connection = ConnectToConsultant(consultant, attempts == 0);
+
+            if (connection != NULL && PublishConsultant(consultant, connection)) {
+
+                wprintf(L"  -> Connected to security consultant %s\n", consultant->PipeName);
+                backoff = AVF_CONSULTANT_RETRY_MIN_MS;
+                attempts = 0;
+                missed = 0;
+                wait = AVF_CONSULTANT_PING_MS;
+
+            } else {
+
+                if (attempts++ == 0) {
+                    wprintf(L"  -> Security consultant %s not available, retrying in the background\n",
+                            consultant->PipeName);
+                }
+
+                wait = backoff;
+                backoff = min(backoff * 2, AVF_CONSULTANT_RETRY_MAX_MS);
+            }
+
+        } else {
+
+            if (PingConsultant(connection)) {
+
+                if (!consultant->Healthy) {
+                    wprintf(L"  -> Security consultant %s is answering again\n", consultant->PipeName);
+                }
+
+                consultant->Healthy = TRUE;
+                backoff = AVF_CONSULTANT_RETRY_MIN_MS;
+                missed = 0;
+                wait = AVF_CONSULTANT_PING_MS;
+
+            } else {
+
+                if (consultant->Healthy) {
+                    wprintf(L"  -> Security consultant %s is not answering, leaving it out until it does\n",
+                            consultant->PipeName);
+                }
+
+                consultant->Healthy = FALSE;
+
+                if (++missed >= AVF_CONSULTANT_PING_FAILURES) {
+                    wprintf(L"  -> Dropping the connection to security consultant %s\n", consultant->PipeName);
+                    DisconnectConsultant(connection);
+                    attempts = 0;
+                }
+
+                wait = backoff;
+                backoff = min(backoff * 2, AVF_CONSULTANT_RETRY_MAX_MS);
+            }
+
+            ReleaseConsultant(connection);
+        }
+
+        WaitForSingleObject(consultant->Event, wait);
+    }
+
+    return 0;
+}
+
+
+BOOLEAN
+PublishConsultant(
+    _In_ PAVF_CONSULTANT Consultant,
+    _In_ PAVF_CONSULTANT_CONNECTION Connection
+    )
+/*++
+
+Routine Description:
+
+    Makes a new connection a consultant's current one and closes its
+    circuit breaker.
+
+Arguments:
+
+    Consultant - The consultant.
+    Connection - The new connection, holding the reference for the
+                 consultant.
+
+Return Value:
+
+    TRUE if it is the current connection, FALSE if StopConsultant was
+    called; the connection is then torn down.
+
+--*/
+{
+    EnterCriticalSection(&gConsultantLock);
+
+    if (gConsultantStopped) {
+        LeaveCriticalSection(&gConsultantLock);
+        ReleaseConsultant(Connection);
+        return FALSE;
+    }
+
+    Consultant->Connection = Connection;
+    Consultant->Healthy = TRUE;
+
+    LeaveCriticalSection(&gConsultantLock);
+
+    return TRUE;
+}
+
+
+BOOLEAN
+PingConsultant(
+    _In_ PAVF_CONSULTANT_CONNECTION Connection
+    )
+/*++
+
+Routine Description:
+
+    Sends a health check on a connection and waits for the answer.  A
+    health check goes through the transport like a consultation, but not
+    through the scheduler, so that it measures the way there and back
+    rather than the queue.
+
+Arguments:
+
+    Connection - The connection, referenced by the caller.
+
+Return Value:
+
+    TRUE if the consultant answered within AVF_CONSULTANT_PING_TIMEOUT_MS.
+
+--*/
+{
+    PAVF_CONSULTANT consultant = Connection->Consultant;
+    PAVF_CONSULTATION ping = &consultant->Ping;
+
+    //
+    //  The last one is still out
+    //
+
+    if (consultant->PingPending) {
+        return FALSE;
+    }
+
+    RtlZeroMemory(ping, sizeof(*ping));
+
+    ping->Request.ProcessId = GetCurrentProcessId();
+    ping->Request.Operation = AVF_CONSULTANT_OP_PING;
+    wcscpy_s(ping->Request.ProcessName, AVF_MAX_PROCESS_NAME, L"AVF_PING");
+    ping->Port = gCompletionPort;
+
+    consultant->PingPending = TRUE;
+    ResetEvent(consultant->PingDone);
+
+    ReferenceConsultant(Connection);
+    SubmitConsultation(ping, Connection);
+
+    FlushConsultations();
+
+    if (WaitForSingleObject(consultant->PingDone, AVF_CONSULTANT_PING_TIMEOUT_MS) != WAIT_OBJECT_0) {
+        return FALSE;
+    }
+
+    return (BOOLEAN)ping->Result;
+}
+
+
+PAVF_CONSULTANT_CONNECTION
+AcquireConsultant(
+    _In_ ULONG Index
+    )
+/*++
+
+Routine Description:
+
+    Returns a reference to the current connection of a consultant if it
+    is healthy.  Never connects; its manager thread does.
+
+Arguments:
+
+    Index - The consultant, in the order they were listed.
+
+Return Value:
+
+    The connection, referenced; ReleaseConsultant when done.  NULL if the
+    consultant is not available, its circuit breaker is open or
+    StopConsultant was called.
+
+--*/
+{
+    PAVF_CONSULTANT_CONNECTION connection = NULL;
+
+    EnterCriticalSection(&gConsultantLock);
+
+    if (gConsultants[Index].Healthy) {
+        connection = gConsultants[Index].Connection;
+    }
+
+    if (connection != NULL) {
+        ReferenceConsultant(connection);
+    }
+
+    LeaveCriticalSection(&gConsultantLock);
+
+    return connection;
+}
+
+
+PCWSTR
+GetConsultantName(
+    _In_ ULONG Index
+    )
+/*++
+
+Routine Description:
+
+    Returns the pipe of a consultant, to name it by.
+
+Arguments:
+
+    Index - The consultant, in the order they were listed.
+
+Return Value:
+
+    Its pipe name.
+
+--*/
+{
+    return gConsultants[Index].PipeName;
+}
+
+
+ULONG
+GetConsultantDeadline(
+    _In_ ULONG Index
+    )
+/*++
+
+Routine Description:
+
+    Returns how long a consultation waits for a consultant's verdict.
+
+Arguments:
+
+    Index - The consultant, in the order they were listed.
+
+Return Value:
+
+    The deadline in milliseconds, or 0 for as long as the filter waits.
+
+--*/
+{
+    return gConsultants[Index].DeadlineMs;
+}
+
+
+VOID
+ReferenceConsultant(
+    _In_ PAVF_CONSULTANT_CONNECTION Connection
+    )
+/*++
+
+Routine Description:
+
+    Takes another reference to a consultant connection.
+
+Arguments:
+
+    Connection - A connection the caller holds a reference to.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    InterlockedIncrement(&Connection->References);
+}
+
+
+VOID
+ReleaseConsultant(
+    _In_ PAVF_CONSULTANT_CONNECTION Connection
+    )
+/*++
+
+Routine Description:
+
+    Drops a reference to a consultant connection, tearing it down with the
+    last one.
+
+Arguments:
+
+    Connection - The connection.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    if (InterlockedDecrement(&Connection->References) != 0) {
+        return;
+    }
+
+    if (Connection->Transport != NULL && Connection->Transport->Close != NULL) {
+        Connection->Transport->Close(Connection->Context);
+    }
+
+    if (Connection->Pipe != INVALID_HANDLE_VALUE) {
+        CloseHandle(Connection->Pipe);
+    }
+
+    HeapFree(GetProcessHeap(), 0, Connection);
+}
+
+
+VOID
+DisconnectConsultant(
+    _In_ PAVF_CONSULTANT_CONNECTION Connection
+    )
+/*++
+
+Routine Description:
+
+    Stops using a consultant connection, unless another thread already
+    did.  Consultations in flight on it fail; it is torn down once they
+    have let go of it.
+
+Arguments:
+
+    Connection - A connection the caller holds a reference to.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    PAVF_CONSULTANT consultant = Connection->Consultant;
+
+    EnterCriticalSection(&gConsultantLock);
+
+    if (consultant->Connection != Connection) {
+        LeaveCriticalSection(&gConsultantLock);
+        return;
+    }
+
+    consultant->Connection = NULL;
+    consultant->Healthy = FALSE;
+
+    LeaveCriticalSection(&gConsultantLock);
+
+    //
+    //  Have the manager connect again
+    //
+
+    if (consultant->Event != NULL) {
+        SetEvent(consultant->Event);
+    }
+
+    if (Connection->Transport->Cancel != NULL) {
+        Connection->Transport->Cancel(Connection->Context);
+    }
+
+    //
+    //  Drop the reference the consultant held
+    //
+
+    ReleaseConsultant(Connection);
+}
+
+
+PAVF_CONSULTANT_CONNECTION
+ConnectToConsultant(
+    _In_ PAVF_CONSULTANT Consultant,
+    _In_ BOOLEAN Verbose
+    )
+/*++
+
+Routine Description:
+
+    Connects to a security consultant process via named pipe and performs handshake.
+
+Arguments:
+
+    Consultant - The consultant.
+    Verbose - Whether to report each step, and a consultant that is not
+              running.
+
+Return Value:
+
+    The new connection, holding the reference for the consultant, or NULL if
+    the connection or handshake failed.
+
+--*/
+{
+    PAVF_CONSULTANT_CONNECTION connection;
+    AVF_CONSULTANT_REQUEST handshakeRequest;
+    AVF_CONSULTANT_RESPONSE handshakeResponse;
+    DWORD bytesRead;
+    DWORD mode;
+
+    connection = HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, sizeof(*connection));
+    if (connection == NULL) {
+        return NULL;
+    }
+
+    connection->References = 1;
+    connection->Consultant = Consultant;
+
+    //
+    //  Try to connect to the consultant's named pipe.  It is opened for
+    //  overlapped I/O, whose completions go to the engine's completion
+    //  port.
+    //
+
+    if (Verbose) {
+        wprintf(L"  [Handshake] Connecting to consultant pipe...\n");
+    }
+
+    connection->Pipe = CreateFileW(
+                        Consultant->PipeName,
+                        GENERIC_READ | GENERIC_WRITE,
+                        0,
+                        NULL,
+                        OPEN_EXISTING,
+                        FILE_FLAG_OVERLAPPED,
+                        NULL);
+
+    if (connection->Pipe == INVALID_HANDLE_VALUE) {
+        if (Verbose || GetLastError() != ERROR_FILE_NOT_FOUND) {
+            wprintf(L"  [Handshake] Failed to open pipe (error %lu)\n", GetLastError());
+        }
+        goto Error;
+    }
+
+    if (CreateIoCompletionPort(connection->Pipe, gCompletionPort, AVF_KEY_IO, 0) == NULL) {
+        wprintf(L"  [Handshake] Failed to associate pipe (error %lu)\n", GetLastError());
+        goto Error;
+    }
+
+    if (Verbose) {
+        wprintf(L"  [Handshake] Pipe opened, setting message mode...\n");
+    }
+
+    //
+    //  Set pipe to message mode
+    //
+
+    mode = PIPE_READMODE_MESSAGE;
+    if (!SetNamedPipeHandleState(connection->Pipe, &mode, NULL, NULL)) {
+        wprintf(L"  [Handshake] Failed to set message mode (error %lu)\n", GetLastError());
+        goto Error;
+    }
+
+    //
+    //  Send handshake request (RequestId = 0, Operation = AVF_CONSULTANT_OP_HANDSHAKE).
+    //  It is always sent at the version 1 size so older consultants can read
+    //  it; Version advertises the newest protocol we speak.
+    //
+
+    if (Verbose) {
+        wprintf(L"  [Handshake] Sending handshake request...\n");
+    }
+
+    RtlZeroMemory(&handshakeRequest, sizeof(handshakeRequest));
+    handshakeRequest.Version = AVF_CONSULTANT_PROTOCOL_VERSION;
+    handshakeRequest.RequestId = 0;  // Special ID for handshake
+    handshakeRequest.ProcessId = GetCurrentProcessId();
+    handshakeRequest.Operation = AVF_CONSULTANT_OP_HANDSHAKE;
+    wcscpy_s(handshakeRequest.ProcessName, AVF_MAX_PROCESS_NAME, L"AVF_HANDSHAKE");
+    wcscpy_s(handshakeRequest.FileName, AVF_MAX_PATH, L"HANDSHAKE_TEST");
+
+    if (!TransactConsultantPipe(connection->Pipe,
+                                &handshakeRequest,
+                                AVF_CONSULTANT_REQUEST_V1_SIZE,
+                                &handshakeResponse,
+                                sizeof(handshakeResponse),
+                                &bytesRead)) {
+        wprintf(L"  [Handshake] Failed to exchange handshake (error %lu)\n", GetLastError());
+        goto Error;
+    }
+
+    if (Verbose) {
+        wprintf(L"  [Handshake] Response received (%lu bytes)\n", bytesRead);
+    }
+
+    //
+    //  Verify handshake response
+    //
+
+    if (bytesRead < sizeof(handshakeResponse)) {
+        wprintf(L"  [Handshake] Response too small (%lu < %zu)\n", bytesRead, sizeof(handshakeResponse));
+        goto Error;
+    }
+
+    if (handshakeResponse.Version < AVF_CONSULTANT_PROTOCOL_VERSION_MIN ||
+        handshakeResponse.Version > AVF_CONSULTANT_PROTOCOL_VERSION) {
+        wprintf(L"  [Handshake] Version mismatch (got %lu, expected %d-%d)\n",
+                handshakeResponse.Version,
+                AVF_CONSULTANT_PROTOCOL_VERSION_MIN,
+                AVF_CONSULTANT_PROTOCOL_VERSION);
+        goto Error;
+    }
+
+    if (handshakeResponse.RequestId != 0) {
+        wprintf(L"  [Handshake] RequestId mismatch (got %lu, expected 0)\n", handshakeResponse.RequestId);
+        goto Error;
+    }
+
+    if (Verbose) {
+        wprintf(L"  [Handshake] SUCCESS - Consultant ready (Version=%lu, Decision=%lu, Reason=%lu)\n",
+                handshakeResponse.Version, handshakeResponse.Decision, handshakeResponse.Reason);
+    }
+
+    connection->Version = handshakeResponse.Version;
+    connection->Capabilities = (connection->Version >= 4) ? handshakeResponse.Reason : 0;
+
+    //
+    //  Move requests to a shared memory ring if the consultant takes one,
+    //  else keep them on the pipe
+    //
+
+    connection->Context = OfferRingTransport(connection->Pipe, connection->Version);
+
+    if (connection->Context != NULL) {
+        connection->Transport = &gRingTransport;
+    } else {
+        connection->Context = CreatePipeTransport(connection);
+        connection->Transport = &gPipeTransport;
+    }
+
+    if (connection->Context == NULL) {
+        connection->Transport = NULL;
+        goto Error;
+    }
+
+    if (Verbose) {
+        wprintf(L"  [Handshake] Requests go over the %s\n", connection->Transport->Name);
+    }
+
+    return connection;
+
+Error:
+
+    ReleaseConsultant(connection);
+    return NULL;
+}
+
+
+HANDLE
+GetConsultantPipe(
+    _In_ PAVF_CONSULTANT_CONNECTION Connection
+    )
+/*++
+
+Routine Description:
+
+    Returns the pipe of a consultant connection, for its transport.
+
+Arguments:
+
+    Connection - The connection.
+
+Return Value:
+
+    The pipe, overlapped and associated with the completion port under
+    AVF_KEY_IO.
+
+--*/
+{
+    return Connection->Pipe;
+}
+
+
+ULONG
+GetConsultantVersion(
+    _In_ PAVF_CONSULTANT_CONNECTION Connection
+    )
+/*++
+
+Routine Description:
+
+    Returns the protocol version agreed in the handshake.
+
+Arguments:
+
+    Connection - The connection.
+
+Return Value:
+
+    The protocol version.
+
+--*/
+{
+    return Connection->Version;
+}
+
+
+ULONG
+GetConsultantCapabilities(
+    _In_ PAVF_CONSULTANT_CONNECTION Connection
+    )
+/*++
+
+Routine Description:
+
+    Returns the capabilities the consultant advertised in the handshake.
+
+Arguments:
+
+    Connection - The connection.
+
+Return Value:
+
+    AVF_CONSULTANT_CAP_* bits.
+
+--*/
+{
+    return Connection->Capabilities;
+}
+
+
+BOOL
+TransactConsultantPipe(
+    _In_ HANDLE Pipe,
+    _In_reads_bytes_(InputSize) PVOID Input,
+    _In_ ULONG InputSize,
+    _Out_writes_bytes_to_(OutputSize, *BytesRead) PVOID Output,
+    _In_ ULONG OutputSize,
+    _Out_ PDWORD BytesRead
+    )
+/*++
+
+Routine Description:
+
+    Writes a message to the consultant pipe and waits for the reply, for
+    the exchanges made while connecting.  The pipe is opened for overlapped
+    I/O and associated with the completion port; setting the low bit of
+    the event keeps these completions off it.
+
+Arguments:
+
+    Pipe - Consultant pipe.
+    Input - Message to write.
+    InputSize - Size of the message in bytes.
+    Output - Buffer for the reply.
+    OutputSize - Size of the buffer in bytes.
+    BytesRead - Receives the size of the reply.
+
+Return Value:
+
+    TRUE if successful, FALSE otherwise.
+
+--*/
+{
+    OVERLAPPED overlapped;
+    HANDLE event;
+    DWORD bytesWritten;
+    BOOL result = FALSE;
+
+    *BytesRead = 0;
+
+    event = CreateEventW(NULL, TRUE, FALSE, NULL);
+    if (event == NULL) {
+        return FALSE;
+    }
+
+    RtlZeroMemory(&overlapped, sizeof(overlapped));
+    overlapped.hEvent = (HANDLE)((ULONG_PTR)event | 1);
+
+    if ((WriteFile(Pipe, Input, InputSize, NULL, &overlapped) || GetLastError() == ERROR_IO_PENDING) &&
+        GetOverlappedResult(Pipe, &overlapped, &bytesWritten, TRUE)) {
+
+        RtlZeroMemory(&overlapped, sizeof(overlapped));
+        overlapped.hEvent = (HANDLE)((ULONG_PTR)event | 1);
+
+        //
+        //  Do not wait forever for a consultant that does not answer
+        //
+
+        if ((ReadFile(Pipe, Output, OutputSize, NULL, &overlapped) || GetLastError() == ERROR_IO_PENDING)) {
+
+            if (WaitForSingleObject(event, AVF_CONSULTANT_TIMEOUT_MS) != WAIT_OBJECT_0) {
+                CancelIoEx(Pipe, &overlapped);
+            }
+
+            result = GetOverlappedResult(Pipe, &overlapped, BytesRead, TRUE);
+        }
+    }
+
+    CloseHandle(event);
+    return result;
+}
+
+
+BOOL
+StartConsultation(
+    _Inout_ PAVF_CONSULTATION Consultation,
+    _In_ PAVF_FILE_NOTIFICATION pNotification
+    )
+/*++
+
+Routine Description:
+
+    Builds a request for a file access and hands it to the plugin, if
+    there is one, or schedules it for the consultant.  The engine's
+    ConsultationCompleted is called once the verdict is there.
+
+Arguments:
+
+    Consultation - The consultation; its Io must be unused.
+    pNotification - File access notification to query; it must stay valid
+                    until the consultation is over.
+
+Return Value:
+
+    TRUE if the consultation is under way, FALSE if there is no plugin and
+    no consultant is available with its circuit breaker closed
+    (ConsultationCompleted will not be called).
+
+--*/
+{
+    PAVF_CONSULTANT_REQUEST request = &Consultation->Request;
+
+    if (gPluginPath == NULL && !IsConsultantAvailable()) {
+        return FALSE;
+    }
+
+    //
+    //  Build request.  Version, RequestId and the size are set when it is
+    //  sent, for the connection it goes out on.
+    //
+
+    RtlZeroMemory(request, sizeof(*request));
+
+    request->ProcessId = pNotification->ProcessId;
+    request->Operation = pNotification->MajorFunction;
+    wcscpy_s(request->FileName, AVF_MAX_PATH, pNotification->FileName);
+    wcscpy_s(request->ProcessName, AVF_MAX_PROCESS_NAME, pNotification->ProcessName);
+    request->DesiredAccess = pNotification->DesiredAccess;
+    request->ShareAccess = pNotification->ShareAccess;
+    request->CreateDisposition = pNotification->CreateDisposition;
+    request->CreateOptions = pNotification->CreateOptions;
+
+    Consultation->Connection = NULL;
+    Consultation->Result = FALSE;
+    Consultation->Expired = FALSE;
+
+    //
+    //  The plugin answers in this worker; what it leaves to the
+    //  consultants is forwarded to them
+    //
+
+    if (PluginConsultation(Consultation, pNotification)) {
+        return TRUE;
+    }
+
+    ForwardConsultation(Consultation, pNotification);
+
+    return TRUE;
+}
+
+
+VOID
+ForwardConsultation(
+    _Inout_ PAVF_CONSULTATION Consultation,
+    _In_ PAVF_FILE_NOTIFICATION pNotification
+    )
+/*++
+
+Routine Description:
+
+    Schedules a consultation for the consultant, unless the same question
+    is with it already.  If no consultant is available the consultation is
+    handed back without a result.
+
+Arguments:
+
+    Consultation - The consultation, with its request built.
+    pNotification - File access notification it is for.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    if (!IsConsultantAvailable()) {
+        ConsultationCompleted(Consultation);
+        return;
+    }
+
+    //
+    //  The same question may be with the consultant already; its priority
+    //  is known first, as a leader is raised to that of its followers
+    //
+
+    PrioritizeConsultation(Consultation, pNotification);
+
+    if (CoalesceConsultation(Consultation)) {
+        return;
+    }
+
+    ScheduleConsultation(Consultation);
+}
+
+
+BOOLEAN
+IsConsultantAvailable(
+    VOID
+    )
+/*++
+
+Routine Description:
+
+    Checks if a consultant has its circuit breaker closed.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    TRUE if file accesses may be sent to a consultant.
+
+--*/
+{
+    ULONG i;
+
+    for (i = 0; i < gConsultantCount; i++) {
+        if (gConsultants[i].Healthy) {
+            return TRUE;
+        }
+    }
+
+    return FALSE;
+}
+
+
+VOID
+SendConsultation(
+    _Inout_ PAVF_CONSULTATION Consultation
+    )
+/*++
+
+Routine Description:
+
+    Hands a consultation whose turn came to the consultant, or to every
+    consultant if there are several or the one has a deadline.  Called by
+    the scheduler, which holds a slot for it.
+
+Arguments:
+
+    Consultation - The consultation, with its request built.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    PAVF_CONSULTANT_CONNECTION connection;
+
+    Consultation->FanOut = NULL;
+
+    if (gConsultantCount > 1 || gConsultants[0].DeadlineMs != 0) {
+        FanOutConsultation(Consultation);
+        return;
+    }
+
+    connection = AcquireConsultant(0);
+    if (connection == NULL) {
+        CompleteConsultation(Consultation, FALSE);
+        return;
+    }
+
+    SubmitConsultation(Consultation, connection);
+}
+
+
+VOID
+SubmitConsultation(
+    _Inout_ PAVF_CONSULTATION Consultation,
+    _In_ PAVF_CONSULTANT_CONNECTION Connection
+    )
+/*++
+
+Routine Description:
+
+    Sends a consultation, or a health check, on a connection.
+
+Arguments:
+
+    Consultation - The consultation, with its request built.
+    Connection - The connection; the consultation takes over the caller's
+                 reference.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    static volatile LONG requestId = 0;
+    PAVF_CONSULTANT_CONNECTION connection = Connection;
+    PAVF_CONSULTANT_REQUEST request = &Consultation->Request;
+
+    //
+    //  RequestId 0 is the handshake's
+    //
+
+    do {
+        request->RequestId = (ULONG)InterlockedIncrement(&requestId);
+    } while (request->RequestId == 0);
+
+    request->Version = connection->Version;
+
+    if (connection->Version >= 2) {
+        Consultation->RequestSize = sizeof(*request);
+    } else {
+        Consultation->RequestSize = AVF_CONSULTANT_REQUEST_V1_SIZE;
+    }
+
+    Consultation->Connection = connection;
+
+    //
+    //  Send it
+    //
+
+    if (connection->Transport->Submit != NULL) {
+
+        connection->Transport->Submit(connection->Context, Consultation);
+
+    } else if (!TrySubmitThreadpoolCallback(QueryConsultantCallback, Consultation, NULL)) {
+
+        CompleteConsultation(Consultation, FALSE);
+    }
+}
+
+
+BOOLEAN
+FlushConsultations(
+    VOID
+    )
+/*++
+
+Routine Description:
+
+    Gives the plugin this worker's batch and lets the transports send
+    the requests they are holding back.  Called by the engine after each
+    round of completion packets.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    TRUE if a transport still holds requests back.
+
+--*/
+{
+    PAVF_CONSULTANT_CONNECTION connection;
+    BOOLEAN held = FALSE;
+    ULONG i;
+
+    FlushPluginConsultations();
+
+    for (i = 0; i < gConsultantCount; i++) {
+
+        EnterCriticalSection(&gConsultantLock);
+        connection = gConsultants[i].Connection;
+        if (connection != NULL) {
+            ReferenceConsultant(connection);
+        }
+        LeaveCriticalSection(&gConsultantLock);
+
+        if (connection == NULL) {
+            continue;
+        }
+
+        if (connection->Transport->Flush != NULL &&
+            connection->Transport->Flush(connection->Context)) {
+
+            held = TRUE;
+        }
+
+        ReleaseConsultant(connection);
+    }
+
+    return held;
+}
+
+
+VOID
+CompleteConsultation(
+    _Inout_ PAVF_CONSULTATION Consultation,
+    _In_ BOOL Result
+    )
+/*++
+
+Routine Description:
+
+    Called by the transport when a consultation is over.  A failure takes
+    the connection down.  Frees its scheduler slot and hands it back to
+    the engine; a health check goes back to its manager instead, and one
+    consultant's part of a fan-out to avfFanOut.c.
+
+Arguments:
+
+    Consultation - The consultation; Response is valid if Result is TRUE.
+    Result - TRUE if a response arrived, FALSE if the connection failed.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    PAVF_CONSULTANT_CONNECTION connection = Consultation->Connection;
+    PAVF_CONSULTANT consultant;
+
+    //
+    //  Verify response matches request
+    //
+
+    Consultation->Result = Result &&
+                           Consultation->Response.Version == Consultation->Request.Version &&
+                           Consultation->Response.RequestId == Consultation->Request.RequestId;
+
+    if (connection != NULL) {
+
+        if (!Result) {
+            DisconnectConsultant(connection);
+        }
+
+        Consultation->Connection = NULL;
+        ReleaseConsultant(connection);
+    }
+
+    //
+    //  A health check is the manager's
+    //
+
+    if (Consultation->Request.Operation == AVF_CONSULTANT_OP_PING) {
+        consultant = CONTAINING_RECORD(Consultation, AVF_CONSULTANT, Ping);
+        consultant->PingPending = FALSE;
+        SetEvent(consultant->PingDone);
+        return;
+    }
+
+    if (Consultation->FanOut != NULL) {
+        FanOutLegCompleted(Consultation);
+        return;
+    }
+
+    //
+    //  Give the slot to the next consultation before the verdict goes out
+    //
+
+    ReleaseConsultationSlot();
+
+    CompleteCoalesced(Consultation);
+}
+
+
+VOID CALLBACK
+QueryConsultantCallback(
+    _Inout_ PTP_CALLBACK_INSTANCE Instance,
+    _Inout_opt_ PVOID Context
+    )
+/*++
+
+Routine Description:
+
+    Runs a consultation on a synchronous transport, on a thread pool
+    thread, and posts its completion to the completion port.
+
+Arguments:
+
+    Instance - Unused.
+    Context - The consultation.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    PAVF_CONSULTATION consultation = Context;
+    PAVF_CONSULTANT_CONNECTION connection = consultation->Connection;
+
+    UNREFERENCED_PARAMETER(Instance);
+
+    consultation->Result = connection->Transport->Query(connection->Context,
+                                                        &consultation->Request,
+                                                        consultation->RequestSize,
+                                                        &consultation->Response);
+
+    RtlZeroMemory(&consultation->Io.Overlapped, sizeof(OVERLAPPED));
+    consultation->Io.Complete = QueryConsultantComplete;
+
+    PostQueuedCompletionStatus(consultation->Port, 0, AVF_KEY_IO, &consultation->Io.Overlapped);
+}
+
+
+VOID
+QueryConsultantComplete(
+    _In_ PAVF_IO Io,
+    _In_ DWORD BytesTransferred,
+    _In_ BOOL Success
+    )
+/*++
+
+Routine Description:
+
+    Completion packet of a consultation run by QueryConsultantCallback.
+
+Arguments:
+
+    Io - The consultation's Io.
+    BytesTransferred - Unused.
+    Success - Unused; the result is in the consultation.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    PAVF_CONSULTATION consultation = CONTAINING_RECORD(Io, AVF_CONSULTATION, Io);
+
+    UNREFERENCED_PARAMETER(BytesTransferred);
+    UNREFERENCED_PARAMETER(Success);
+
+    CompleteConsultation(consultation, consultation->Result);
+}
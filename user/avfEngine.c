@@ -0,0 +1,1685 @@
+/*++
+
+Copyright (c) 1989-2002  Microsoft Corporation
+Modified for AV Filter functionality
+
+Module Name:
+
+    avfEngine.c
+
+Abstract:
+
+    The engine that decides on file access notifications from the filter.
+
+    Everything an engine worker waits for arrives as a packet on its own
+    completion port: notifications (FilterGetMessage on its own connection
+    to the filter, AVF_KEY_FILTER) and I/O (AVF_KEY_IO), such as the
+    consultant transport's, which is the first worker's.  Workers dequeue
+    them in batches and never block on a consultation: a notification that
+    needs the consultant starts one and is left until its response packet
+    comes in, and only then is the verdict sent and the message buffer
+    queued for the next notification.  AVF_ENGINE_MESSAGE_COUNT decisions
+    can so be in flight at once.
+
+    The filter sends each notification to the worker that takes the
+    operations of the processor it was raised on (see AVF_ENGINE_CONNECT),
+    and a response is handed back to the worker that owns the message, so
+    that a message stays with one worker.  With -affinity the workers are
+    pinned to their processors or NUMA nodes, and everything a worker owns
+    is allocated on its node.  A worker that runs dry takes packets from
+    the port of one that is behind.
+
+    An audited file's operations are allowed as soon as they arrive
+    (AVF_VERDICT_FLAG_SPECULATIVE), and the consultation goes on with the
+    message held until it is over; the consultant's verdict is then sent
+    with AVF_VERDICT_FLAG_AUDITED for the filter to cache, and a block is
+    reported as an alert.
+
+    With -rules, a protected file's operation is first run through the
+    compiled rules (avfRules.c), which allow or block it right away, audit
+    it or leave it to the consultant.  A verdict on an operation whose
+    rules looked at the time is sent with AVF_VERDICT_FLAG_NO_CACHE.  One
+    whose rules test a signer that is still being verified is held on
+    gDeferredMessages and decided again, from the start, once it is known.
+
+    With -shadow, a copy of each notification and the active policy's
+    decision on it is queued for the shadow thread (avfShadow.c) to try the
+    candidate policy on; the verdict does not wait for it.
+
+Environment:
+
+    User mode
+
+--*/
+
+#include <windows.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <fltUser.h>
+#include "avfUser.h"
+
+#define AVF_ENGINE_MESSAGE_COUNT    1024    // Notifications in flight, over all workers
+#define AVF_ENGINE_MIN_MESSAGES     32      // Notifications in flight, per worker
+#define AVF_ENGINE_ENTRY_COUNT      64      // Packets dequeued at once
+#define AVF_ENGINE_STEAL_COUNT      16      // Packets taken from another worker at once
+#define AVF_ENGINE_IDLE_MS          1000
+#define AVF_ENGINE_STOP_MS          5000
+
+typedef struct _AVF_ENGINE_WORKER AVF_ENGINE_WORKER, *PAVF_ENGINE_WORKER;
+
+//
+//  A notification buffer, and the consultation it may need.  FilterGetMessage
+//  fills the part before Overlapped.
+//
+
+typedef struct _AVF_MESSAGE {
+    FILTER_MESSAGE_HEADER Header;
+    AVF_FILE_NOTIFICATION Notification;
+    OVERLAPPED Overlapped;
+    PAVF_ENGINE_WORKER Worker;             // Owner, whose connection it is queued on
+    AVF_IO Finish;                         // Hands a finished consultation to the owner
+    BOOLEAN Speculative;                   // Allowed already; the consultation audits it
+    ULONG VerdictFlags;                    // AVF_VERDICT_FLAG_* for every verdict sent
+    struct _AVF_MESSAGE *DeferredNext;     // On gDeferredMessages
+    AVF_CONSULTATION Consultation;
+} AVF_MESSAGE, *PAVF_MESSAGE;
+
+//
+//  An engine worker.  The worker and its message buffers are one
+//  allocation on its NUMA node.  Queued and Busy are the worker's messages
+//  waiting in FilterGetMessage and holding a notification whose verdict
+//  was not sent yet; the engine stops once both are 0 for every worker.
+//
+
+typedef struct DECLSPEC_CACHEALIGN _AVF_ENGINE_WORKER {
+    ULONG Index;
+    HANDLE Thread;
+    DWORD ThreadId;
+    HANDLE Filter;                         // Engine connection to the filter
+    HANDLE Port;                           // Completion port
+    ULONG Node;                            // NUMA node, or NUMA_NO_PREFERRED_NODE
+    GROUP_AFFINITY Affinity;               // Where it runs; Mask is 0 if anywhere
+    GROUP_AFFINITY Home;                   // Processors whose notifications it takes
+    volatile BOOLEAN Loaded;               // Its last round dequeued a full batch
+    volatile BOOLEAN Idle;                 // Waiting long; wake it to help
+    volatile LONG Queued;
+    volatile LONG Busy;
+    LONGLONG Packets;                      // Dequeued from its own port
+    LONGLONG Stolen;                       // Taken from other workers' ports
+    ULONG MessageCount;
+    PAVF_MESSAGE Messages;                 // Follow the worker
+} AVF_ENGINE_WORKER;
+
+//
+//  ReplyVerdict command.  Same layout as a COMMAND_MESSAGE whose Data is an
+//  AVF_VERDICT.
+//
+
+typedef struct _AVF_VERDICT_MESSAGE {
+    AVF_COMMAND Command;
+    ULONG Reserved;
+    AVF_VERDICT Verdict;
+} AVF_VERDICT_MESSAGE, *PAVF_VERDICT_MESSAGE;
+
+C_ASSERT(FIELD_OFFSET(AVF_VERDICT_MESSAGE, Verdict) == FIELD_OFFSET(COMMAND_MESSAGE, Data));
+
+//
+//  -workers and -affinity.  0 workers is the default: AVF_WORKER_THREAD_COUNT
+//  without affinity, else one per processor.
+//
+
+ULONG gEngineWorkerCount = 0;
+AVF_AFFINITY gEngineAffinity = AffinityNone;
+
+PAVF_ENGINE_WORKER gEngineWorkers[AVF_MAX_WORKERS];
+ULONG gEngineWorkersStarted = 0;
+volatile LONG gEngineLoaded = 0;           // Workers that are Loaded
+volatile BOOLEAN gEngineStopping = FALSE;
+
+volatile LONG gAudited = 0;                // Operations allowed speculatively
+volatile LONG gAuditBlocked = 0;           // Of those, blocked by the consultant
+
+//
+//  The worker running on this thread, or NULL, and its policy reader slot
+//
+
+DECLSPEC_THREAD PAVF_ENGINE_WORKER gCurrentWorker = NULL;
+DECLSPEC_THREAD ULONG gCurrentReader = 0;
+
+//
+//  Messages whose rules wait for an image's signer, protected by
+//  gDeferredLock
+//
+
+SRWLOCK gDeferredLock = SRWLOCK_INIT;
+PAVF_MESSAGE gDeferredMessages = NULL;
+
+//
+//  Function prototypes
+//
+
+ULONG
+PlaceWorkers(
+    _Out_writes_(AVF_MAX_WORKERS) PAVF_ENGINE_WORKER Placements
+    );
+
+VOID
+GetProcessorByIndex(
+    _In_ ULONG Index,
+    _Out_ PPROCESSOR_NUMBER Processor
+    );
+
+PAVF_ENGINE_WORKER
+CreateWorker(
+    _In_ PAVF_ENGINE_WORKER Placement,
+    _In_ ULONG MessageCount
+    );
+
+VOID
+FreeWorker(
+    _In_ PAVF_ENGINE_WORKER Worker
+    );
+
+DWORD WINAPI
+EngineThread(
+    _In_ LPVOID lpParameter
+    );
+
+ULONG
+StealPackets(
+    _In_ PAVF_ENGINE_WORKER Worker,
+    _Out_writes_(AVF_ENGINE_STEAL_COUNT) LPOVERLAPPED_ENTRY Entries
+    );
+
+VOID
+SetWorkerLoaded(
+    _Inout_ PAVF_ENGINE_WORKER Worker,
+    _In_ BOOLEAN Loaded
+    );
+
+BOOLEAN
+IsEngineDrained(
+    VOID
+    );
+
+VOID
+QueueMessage(
+    _Inout_ PAVF_MESSAGE Message
+    );
+
+VOID
+ProcessNotification(
+    _Inout_ PAVF_MESSAGE Message,
+    _In_ ULONG Reader
+    );
+
+VOID
+DeferNotification(
+    _Inout_ PAVF_MESSAGE Message
+    );
+
+VOID
+ResumeNotification(
+    _In_ PAVF_IO Io,
+    _In_ DWORD BytesTransferred,
+    _In_ BOOL Success
+    );
+
+VOID
+FinishConsultation(
+    _In_ PAVF_IO Io,
+    _In_ DWORD BytesTransferred,
+    _In_ BOOL Success
+    );
+
+VOID
+FinishMessage(
+    _Inout_ PAVF_MESSAGE Message,
+    _In_ BOOLEAN Block
+    );
+
+VOID
+SendVerdict(
+    _In_ PAVF_MESSAGE Message,
+    _In_ BOOLEAN Block,
+    _In_ ULONG Flags
+    );
+
+
+BOOL
+StartEngine(
+    VOID
+    )
+/*++
+
+Routine Description:
+
+    Places the engine workers, connects each to the filter, starts them
+    and queues every message buffer for a notification.  Sets
+    gCompletionPort to the first worker's port.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    TRUE if the engine is running.
+
+--*/
+{
+    AVF_ENGINE_WORKER placements[AVF_MAX_WORKERS];
+    PAVF_ENGINE_WORKER worker;
+    ULONG count;
+    ULONG i;
+    ULONG j;
+
+    count = PlaceWorkers(placements);
+
+    for (i = 0; i < count; i++) {
+
+        gEngineWorkers[i] = CreateWorker(&placements[i],
+                                         max(AVF_ENGINE_MESSAGE_COUNT / count, AVF_ENGINE_MIN_MESSAGES));
+
+        if (gEngineWorkers[i] == NULL) {
+
+            while (i-- > 0) {
+                FreeWorker(gEngineWorkers[i]);
+                gEngineWorkers[i] = NULL;
+            }
+
+            return FALSE;
+        }
+    }
+
+    gEngineWorkersStarted = count;
+    gCompletionPort = gEngineWorkers[0]->Port;
+
+    wprintf(L"\nStarting %lu engine workers...\n", count);
+
+    for (i = 0; i < count; i++) {
+
+        worker = gEngineWorkers[i];
+
+        worker->Thread = CreateThread(NULL,
+                                      0,
+                                      EngineThread,
+                                      worker,
+                                      CREATE_SUSPENDED,
+                                      &worker->ThreadId);
+
+        if (worker->Thread == NULL) {
+            wprintf(L"ERROR: Failed to create engine thread %lu (error %lu)\n", i, GetLastError());
+            continue;
+        }
+
+        if (worker->Affinity.Mask != 0 &&
+            !SetThreadGroupAffinity(worker->Thread, &worker->Affinity, NULL)) {
+
+            wprintf(L"WARNING: Failed to set the affinity of engine thread %lu (error %lu)\n", i, GetLastError());
+        }
+
+        ResumeThread(worker->Thread);
+
+        if (worker->Affinity.Mask != 0) {
+            wprintf(L"  Engine thread %lu started (TID %lu, group %u, processors 0x%I64X, node %lu)\n",
+                    i,
+                    worker->ThreadId,
+                    worker->Affinity.Group,
+                    (ULONGLONG)worker->Affinity.Mask,
+                    worker->Node);
+        } else {
+            wprintf(L"  Engine thread %lu started (TID %lu)\n", i, worker->ThreadId);
+        }
+    }
+
+    for (i = 0; i < count; i++) {
+        for (j = 0; j < gEngineWorkers[i]->MessageCount; j++) {
+            QueueMessage(&gEngineWorkers[i]->Messages[j]);
+        }
+    }
+
+    return TRUE;
+}
+
+
+VOID
+StopEngine(
+    VOID
+    )
+/*++
+
+Routine Description:
+
+    Stops the engine once every notification it holds has its verdict,
+    and frees the workers.  gRunning must be FALSE, so that no buffer is
+    queued again.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    HANDLE threads[AVF_MAX_WORKERS];
+    ULONG count = 0;
+    DWORD result = WAIT_OBJECT_0;
+    LONG inFlight = 0;
+    ULONG i;
+
+    if (gEngineWorkersStarted == 0) {
+        return;
+    }
+
+    gEngineStopping = TRUE;
+
+    for (i = 0; i < gEngineWorkersStarted; i++) {
+
+        CancelIoEx(gEngineWorkers[i]->Filter, NULL);
+        PostQueuedCompletionStatus(gEngineWorkers[i]->Port, 0, AVF_KEY_FILTER, NULL);
+
+        if (gEngineWorkers[i]->Thread != NULL) {
+            threads[count++] = gEngineWorkers[i]->Thread;
+        }
+    }
+
+    if (count != 0) {
+        result = WaitForMultipleObjects(count, threads, TRUE, AVF_ENGINE_STOP_MS);
+    }
+
+    for (i = 0; i < count; i++) {
+        CloseHandle(threads[i]);
+    }
+
+    //
+    //  Workers whose buffers the filter or a consultation may still write
+    //  to are left alone
+    //
+
+    if (result != WAIT_OBJECT_0) {
+
+        for (i = 0; i < gEngineWorkersStarted; i++) {
+            inFlight += gEngineWorkers[i]->Busy + gEngineWorkers[i]->Queued;
+        }
+
+        wprintf(L"WARNING: %ld notification(s) still in flight at exit\n", inFlight);
+
+    } else {
+
+        if (gEngineWorkersStarted > 1) {
+
+            wprintf(L"\nEngine workers (packets, stolen):");
+
+            for (i = 0; i < gEngineWorkersStarted; i++) {
+                wprintf(L"%s %lld/%lld",
+                        i % 8 == 0 ? L"\n " : L"",
+                        gEngineWorkers[i]->Packets,
+                        gEngineWorkers[i]->Stolen);
+            }
+
+            wprintf(L"\n");
+        }
+
+        for (i = 0; i < gEngineWorkersStarted; i++) {
+            FreeWorker(gEngineWorkers[i]);
+            gEngineWorkers[i] = NULL;
+        }
+
+        gCompletionPort = INVALID_HANDLE_VALUE;
+    }
+
+    gEngineWorkersStarted = 0;
+}
+
+
+ULONG
+PlaceWorkers(
+    _Out_writes_(AVF_MAX_WORKERS) PAVF_ENGINE_WORKER Placements
+    )
+/*++
+
+Routine Description:
+
+    Decides how many workers there are, where each runs and which
+    processors' notifications it takes.
+
+    Pinned to processors, a worker runs on the first of an even share of
+    the processors and takes the notifications of the share.  Pinned to
+    nodes, the workers go to the nodes in turn and run on any processor of
+    theirs; a node's processors' notifications are split among its
+    workers.  Unpinned, a worker takes whatever the filter hands it.
+
+Arguments:
+
+    Placements - Receives the Node, Affinity and Home of each worker.
+
+Return Value:
+
+    The number of workers.
+
+--*/
+{
+    PROCESSOR_NUMBER processor;
+    PROCESSOR_NUMBER other;
+    GROUP_AFFINITY nodeMask;
+    USHORT nodes[AVF_MAX_WORKERS];
+    USHORT node;
+    ULONG highestNode;
+    ULONG nodeCount = 0;
+    ULONG total = GetActiveProcessorCount(ALL_PROCESSOR_GROUPS);
+    ULONG count = gEngineWorkerCount;
+    ULONG sharing;
+    ULONG rank;
+    ULONG bit;
+    ULONG i;
+    ULONG j;
+
+    RtlZeroMemory(Placements, AVF_MAX_WORKERS * sizeof(AVF_ENGINE_WORKER));
+
+    if (count == 0) {
+        count = (gEngineAffinity == AffinityNone) ? AVF_WORKER_THREAD_COUNT : total;
+    }
+
+    count = min(count, AVF_MAX_WORKERS);
+
+    for (i = 0; i < count; i++) {
+        Placements[i].Index = i;
+        Placements[i].Node = NUMA_NO_PREFERRED_NODE;
+    }
+
+    if (gEngineAffinity == AffinityProcessor) {
+
+        count = min(count, total);
+
+        for (i = 0; i < count; i++) {
+
+            GetProcessorByIndex(i * total / count, &processor);
+
+            Placements[i].Affinity.Group = processor.Group;
+            Placements[i].Affinity.Mask = (KAFFINITY)1 << processor.Number;
+            Placements[i].Home.Group = processor.Group;
+
+            //
+            //  A share that runs into the next group leaves those
+            //  processors to the filter to hand out
+            //
+
+            for (j = i * total / count; j < (i + 1) * total / count; j++) {
+
+                GetProcessorByIndex(j, &other);
+
+                if (other.Group == processor.Group) {
+                    Placements[i].Home.Mask |= (KAFFINITY)1 << other.Number;
+                }
+            }
+
+            if (GetNumaProcessorNodeEx(&processor, &node)) {
+                Placements[i].Node = node;
+            }
+        }
+
+    } else if (gEngineAffinity == AffinityNode && GetNumaHighestNodeNumber(&highestNode)) {
+
+        for (i = 0; i <= highestNode && nodeCount < AVF_MAX_WORKERS; i++) {
+
+            if (GetNumaNodeProcessorMaskEx((USHORT)i, &nodeMask) && nodeMask.Mask != 0) {
+                nodes[nodeCount++] = (USHORT)i;
+            }
+        }
+
+        for (i = 0; i < count && nodeCount != 0; i++) {
+
+            GetNumaNodeProcessorMaskEx(nodes[i % nodeCount], &nodeMask);
+
+            Placements[i].Node = nodes[i % nodeCount];
+            Placements[i].Affinity = nodeMask;
+            Placements[i].Home.Group = nodeMask.Group;
+
+            //
+            //  The node's workers take every sharing-th of its processors
+            //
+
+            rank = i / nodeCount;
+            sharing = (count - i % nodeCount + nodeCount - 1) / nodeCount;
+
+            for (bit = 0, j = 0; bit < sizeof(KAFFINITY) * 8; bit++) {
+
+                if (FlagOn(nodeMask.Mask, (KAFFINITY)1 << bit)) {
+
+                    if (j % sharing == rank) {
+                        Placements[i].Home.Mask |= (KAFFINITY)1 << bit;
+                    }
+
+                    j++;
+                }
+            }
+        }
+    }
+
+    return count;
+}
+
+
+VOID
+GetProcessorByIndex(
+    _In_ ULONG Index,
+    _Out_ PPROCESSOR_NUMBER Processor
+    )
+/*++
+
+Routine Description:
+
+    Finds an active processor by its place among all of them, counting
+    through the processor groups in order.
+
+Arguments:
+
+    Index - Less than GetActiveProcessorCount(ALL_PROCESSOR_GROUPS).
+    Processor - Receives its group and number.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    WORD groupCount = GetActiveProcessorGroupCount();
+    WORD group;
+    DWORD active;
+
+    RtlZeroMemory(Processor, sizeof(PROCESSOR_NUMBER));
+
+    for (group = 0; group < groupCount; group++) {
+
+        active = GetActiveProcessorCount(group);
+
+        if (Index < active) {
+            Processor->Group = group;
+            Processor->Number = (BYTE)Index;
+            return;
+        }
+
+        Index -= active;
+    }
+}
+
+
+PAVF_ENGINE_WORKER
+CreateWorker(
+    _In_ PAVF_ENGINE_WORKER Placement,
+    _In_ ULONG MessageCount
+    )
+/*++
+
+Routine Description:
+
+    Allocates a worker and its message buffers on its node, connects it
+    to the filter and creates its completion port.  Its thread is not
+    started.
+
+Arguments:
+
+    Placement - The worker's Index, Node, Affinity and Home.
+    MessageCount - Number of message buffers.
+
+Return Value:
+
+    The worker, or NULL.
+
+--*/
+{
+    PAVF_ENGINE_WORKER worker;
+    AVF_ENGINE_CONNECT connect;
+    SIZE_T size = sizeof(AVF_ENGINE_WORKER) + MessageCount * sizeof(AVF_MESSAGE);
+    HRESULT hr;
+    ULONG i;
+
+    if (Placement->Node != NUMA_NO_PREFERRED_NODE) {
+        worker = VirtualAllocExNuma(GetCurrentProcess(),
+                                    NULL,
+                                    size,
+                                    MEM_RESERVE | MEM_COMMIT,
+                                    PAGE_READWRITE,
+                                    Placement->Node);
+    } else {
+        worker = VirtualAlloc(NULL, size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+    }
+
+    if (worker == NULL) {
+        wprintf(L"ERROR: Failed to allocate engine worker %lu\n", Placement->Index);
+        return NULL;
+    }
+
+    *worker = *Placement;
+    worker->Filter = INVALID_HANDLE_VALUE;
+    worker->MessageCount = MessageCount;
+    worker->Messages = (PAVF_MESSAGE)(worker + 1);
+
+    connect.Size = sizeof(connect);
+    connect.Group = worker->Home.Group;
+    connect.Reserved = 0;
+    connect.Mask = worker->Home.Mask;
+
+    hr = FilterConnectCommunicationPort(AVF_PORT_NAME,
+                                        0,
+                                        &connect,
+                                        sizeof(connect),
+                                        NULL,
+                                        &worker->Filter);
+
+    if (FAILED(hr)) {
+        wprintf(L"ERROR: Failed to connect engine worker %lu to the filter (0x%08X)\n", Placement->Index, hr);
+        worker->Filter = INVALID_HANDLE_VALUE;
+        FreeWorker(worker);
+        return NULL;
+    }
+
+    worker->Port = CreateIoCompletionPort(worker->Filter, NULL, AVF_KEY_FILTER, 1);
+
+    if (worker->Port == NULL) {
+        wprintf(L"ERROR: Failed to create completion port (error %lu)\n", GetLastError());
+        FreeWorker(worker);
+        return NULL;
+    }
+
+    for (i = 0; i < MessageCount; i++) {
+        worker->Messages[i].Worker = worker;
+        worker->Messages[i].Consultation.Port = worker->Port;
+    }
+
+    return worker;
+}
+
+
+VOID
+FreeWorker(
+    _In_ PAVF_ENGINE_WORKER Worker
+    )
+/*++
+
+Routine Description:
+
+    Disconnects a worker from the filter and frees it.  Its thread must be
+    gone and nothing may be queued on its connection.
+
+Arguments:
+
+    Worker - The worker.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    if (Worker->Port != NULL) {
+        CloseHandle(Worker->Port);
+    }
+
+    if (Worker->Filter != INVALID_HANDLE_VALUE) {
+        CloseHandle(Worker->Filter);
+    }
+
+    VirtualFree(Worker, 0, MEM_RELEASE);
+}
+
+
+DWORD WINAPI
+EngineThread(
+    _In_ LPVOID lpParameter
+    )
+/*++
+
+Routine Description:
+
+    Engine thread.  Dequeues completion packets in batches, from its own
+    port, or else from that of a worker that is behind, and handles each
+    without blocking, then lets the consultant transport send what the
+    batch asked of it.
+
+Arguments:
+
+    lpParameter - The worker.
+
+Return Value:
+
+    Thread exit code.
+
+--*/
+{
+    PAVF_ENGINE_WORKER worker = lpParameter;
+    OVERLAPPED_ENTRY entries[AVF_ENGINE_ENTRY_COUNT];
+    PAVF_MESSAGE message;
+    ULONG count;
+    ULONG i;
+    PAVF_IO io;
+    BOOL success;
+    BOOLEAN held = FALSE;
+    DWORD timeout;
+    ULONG reader = RegisterPolicyReader();
+
+    gCurrentWorker = worker;
+    gCurrentReader = reader;
+
+    for (;;) {
+
+        //
+        //  Its own packets first, then a share of a loaded worker's.  Only
+        //  with neither does it wait, and only for a moment while another
+        //  worker may need help, or while a transport holds requests with
+        //  no timer of its own to send them.  That moment is a timer tick,
+        //  not the microseconds of -batchwait, which the pipe transport
+        //  runs out on its batch timer.
+        //
+
+        if (!GetQueuedCompletionStatusEx(worker->Port, entries, AVF_ENGINE_ENTRY_COUNT, &count, 0, FALSE)) {
+            count = 0;
+        }
+
+        worker->Packets += count;
+
+        if (count == 0) {
+            count = StealPackets(worker, entries);
+        }
+
+        if (count == 0) {
+
+            timeout = (held || gEngineLoaded != 0) ? 1 : AVF_ENGINE_IDLE_MS;
+            worker->Idle = (timeout == AVF_ENGINE_IDLE_MS);
+
+            if (!GetQueuedCompletionStatusEx(worker->Port, entries, AVF_ENGINE_ENTRY_COUNT, &count, timeout, FALSE)) {
+
+                if (GetLastError() != WAIT_TIMEOUT) {
+                    worker->Idle = FALSE;
+                    break;
+                }
+
+                count = 0;
+            }
+
+            worker->Idle = FALSE;
+            worker->Packets += count;
+        }
+
+        SetWorkerLoaded(worker, count == AVF_ENGINE_ENTRY_COUNT);
+
+        for (i = 0; i < count; i++) {
+
+            //
+            //  A packet without an OVERLAPPED only wakes us up
+            //
+
+            if (entries[i].lpOverlapped == NULL) {
+                continue;
+            }
+
+            success = ((LONG)entries[i].lpOverlapped->Internal >= 0);
+
+            if (entries[i].lpCompletionKey == AVF_KEY_FILTER) {
+
+                message = CONTAINING_RECORD(entries[i].lpOverlapped, AVF_MESSAGE, Overlapped);
+
+                InterlockedDecrement(&message->Worker->Queued);
+
+                //
+                //  A failed FilterGetMessage was cancelled at shutdown
+                //
+
+                if (success) {
+                    ProcessNotification(message, reader);
+                }
+
+            } else {
+
+                io = CONTAINING_RECORD(entries[i].lpOverlapped, AVF_IO, Overlapped);
+                io->Complete(io, entries[i].dwNumberOfBytesTransferred, success);
+            }
+        }
+
+        held = FlushConsultations();
+
+        if (gEngineStopping) {
+
+            if (IsEngineDrained()) {
+                break;
+            }
+
+            //
+            //  A buffer may have been queued again just as shutdown began
+            //
+
+            if (count == 0) {
+                CancelIoEx(worker->Filter, NULL);
+            }
+        }
+    }
+
+    SetWorkerLoaded(worker, FALSE);
+
+    wprintf(L"  [T%lu] Engine thread exiting\n", worker->ThreadId);
+    return 0;
+}
+
+
+ULONG
+StealPackets(
+    _In_ PAVF_ENGINE_WORKER Worker,
+    _Out_writes_(AVF_ENGINE_STEAL_COUNT) LPOVERLAPPED_ENTRY Entries
+    )
+/*++
+
+Routine Description:
+
+    Takes a few packets off the port of a loaded worker, one on the same
+    node first.
+
+Arguments:
+
+    Worker - The worker with nothing to do.
+    Entries - Receive the packets.
+
+Return Value:
+
+    The number of packets taken.
+
+--*/
+{
+    PAVF_ENGINE_WORKER victim;
+    ULONG count;
+    ULONG pass;
+    ULONG i;
+
+    if (gEngineLoaded == 0) {
+        return 0;
+    }
+
+    for (pass = 0; pass < 2; pass++) {
+
+        for (i = 1; i < gEngineWorkersStarted; i++) {
+
+            victim = gEngineWorkers[(Worker->Index + i) % gEngineWorkersStarted];
+
+            if (!victim->Loaded || (pass == 0) != (victim->Node == Worker->Node)) {
+                continue;
+            }
+
+            if (GetQueuedCompletionStatusEx(victim->Port, Entries, AVF_ENGINE_STEAL_COUNT, &count, 0, FALSE) &&
+                count != 0) {
+
+                Worker->Stolen += count;
+                return count;
+            }
+        }
+    }
+
+    return 0;
+}
+
+
+VOID
+SetWorkerLoaded(
+    _Inout_ PAVF_ENGINE_WORKER Worker,
+    _In_ BOOLEAN Loaded
+    )
+/*++
+
+Routine Description:
+
+    Notes whether a worker is behind.  A worker that falls behind wakes an
+    idle one, on the same node if it can, to help.
+
+Arguments:
+
+    Worker - The worker, on its own thread.
+    Loaded - Whether its last round dequeued a full batch.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    PAVF_ENGINE_WORKER helper;
+    ULONG pass;
+    ULONG i;
+
+    if (Worker->Loaded == Loaded) {
+        return;
+    }
+
+    Worker->Loaded = Loaded;
+
+    if (!Loaded) {
+        InterlockedDecrement(&gEngineLoaded);
+        return;
+    }
+
+    InterlockedIncrement(&gEngineLoaded);
+
+    for (pass = 0; pass < 2; pass++) {
+
+        for (i = 1; i < gEngineWorkersStarted; i++) {
+
+            helper = gEngineWorkers[(Worker->Index + i) % gEngineWorkersStarted];
+
+            if (helper->Idle && (pass == 1 || helper->Node == Worker->Node)) {
+                helper->Idle = FALSE;
+                PostQueuedCompletionStatus(helper->Port, 0, AVF_KEY_FILTER, NULL);
+                return;
+            }
+        }
+    }
+}
+
+
+BOOLEAN
+IsEngineDrained(
+    VOID
+    )
+/*++
+
+Routine Description:
+
+    Tells whether every notification has its verdict and no buffer is
+    queued.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    TRUE if the engine holds nothing.
+
+--*/
+{
+    ULONG i;
+
+    for (i = 0; i < gEngineWorkersStarted; i++) {
+
+        if (gEngineWorkers[i]->Queued != 0 || gEngineWorkers[i]->Busy != 0) {
+            return FALSE;
+        }
+    }
+
+    return TRUE;
+}
+
+
+VOID
+QueueMessage(
+    _Inout_ PAVF_MESSAGE Message
+    )
+/*++
+
+Routine Description:
+
+    Queues a message buffer for the next notification on its worker's
+    connection.
+
+Arguments:
+
+    Message - The message buffer, not in use.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    HRESULT hr;
+
+    RtlZeroMemory(&Message->Overlapped, sizeof(OVERLAPPED));
+    InterlockedIncrement(&Message->Worker->Queued);
+
+    hr = FilterGetMessage(Message->Worker->Filter,
+                          &Message->Header,
+                          FIELD_OFFSET(AVF_MESSAGE, Overlapped),
+                          &Message->Overlapped);
+
+    if (hr != HRESULT_FROM_WIN32(ERROR_IO_PENDING) && FAILED(hr)) {
+
+        InterlockedDecrement(&Message->Worker->Queued);
+
+        if (hr != HRESULT_FROM_WIN32(ERROR_OPERATION_ABORTED)) {
+            wprintf(L"  [T%lu] WARNING: FilterGetMessage failed (0x%08X)\n", GetCurrentThreadId(), hr);
+        }
+    }
+}
+
+
+VOID
+ProcessNotification(
+    _Inout_ PAVF_MESSAGE Message,
+    _In_ ULONG Reader
+    )
+/*++
+
+Routine Description:
+
+    Decides on a notification from the filter, by the rules or by starting
+    a consultation if the file is protected.
+
+Arguments:
+
+    Message - The message buffer holding the notification.
+    Reader - The engine thread's policy reader slot.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    PAVF_FILE_NOTIFICATION pNotification = &Message->Notification;
+    PAVF_USER_POLICY policy;
+    AVF_POLICY_DECISION decision;
+    ULONG ruleLine;
+    BOOLEAN timed;
+    BOOLEAN monitorAll;
+    BOOLEAN admitted = TRUE;
+    BOOLEAN shadow = gShadowRunning;
+    LARGE_INTEGER start;
+    LARGE_INTEGER end;
+    WCHAR displayName[AVF_MAX_PATH];
+    DWORD threadId = GetCurrentThreadId();
+
+    InterlockedIncrement(&Message->Worker->Busy);
+
+    //
+    //  Check the current policy.  This takes no lock; a reload waits
+    //  for ReleaseUserPolicy before it frees the policy we read.
+    //
+
+    if (shadow) {
+        QueryPerformanceCounter(&start);
+    }
+
+    policy = AcquireUserPolicy(Reader);
+    decision = DecideByPolicy(policy, pNotification, FALSE, &ruleLine, &timed);
+    monitorAll = policy->MonitorAll;
+    ReleaseUserPolicy(Reader);
+
+    //
+    //  Decided again, from the start, once the signer is known.  The
+    //  message stays busy meanwhile.
+    //
+
+    if (decision == PolicyDecisionDefer) {
+        DeferNotification(Message);
+        return;
+    }
+
+    //
+    //  The candidate policy decides on the same event in the background
+    //
+
+    if (shadow) {
+        QueryPerformanceCounter(&end);
+        QueueShadowEvaluation(pNotification, decision, end.QuadPart - start.QuadPart);
+    }
+
+    Message->Speculative = FALSE;
+    Message->VerdictFlags = timed ? AVF_VERDICT_FLAG_NO_CACHE : 0;
+
+    if (decision == PolicyDecisionUnprotected) {
+
+        //
+        //  Not a protected file - allow
+        //
+
+        FinishMessage(Message, FALSE);
+        return;
+    }
+
+    //
+    //  When every file is monitored the filter only reports a sample of the
+    //  operations, and a process may only have so many consultations a
+    //  second (see avfSample.c)
+    //
+
+    if (monitorAll) {
+        admitted = SampleNotification(pNotification,
+                                      decision == PolicyDecisionConsult ||
+                                          decision == PolicyDecisionAudit);
+    }
+
+    //
+    //  Print the file access information.  With -aggregate the event is
+    //  written out with its repeats once its verdict is known instead.
+    //
+
+    if (gAggregateWindowMs == 0) {
+
+        if (!ConvertToWin32Path(pNotification->FileName, displayName, AVF_MAX_PATH)) {
+            wcscpy_s(displayName, AVF_MAX_PATH, pNotification->FileName);
+        }
+
+        wprintf(L"[T%lu] [%s] PID: %5lu  Process: %-20s  File: %s\n",
+                threadId,
+                pNotification->MajorFunction == IRP_MJ_CREATE ? L"OPEN " :
+                pNotification->MajorFunction == IRP_MJ_READ ? L"READ " : L"WRITE",
+                pNotification->ProcessId,
+                pNotification->ProcessName,
+                displayName);
+
+        if (pNotification->MajorFunction == IRP_MJ_CREATE) {
+            wprintf(L"  [T%lu]    Access: 0x%08lX  Share: 0x%lX  Disposition: %lu  Options: 0x%08lX\n",
+                    threadId,
+                    pNotification->DesiredAccess,
+                    pNotification->ShareAccess,
+                    pNotification->CreateDisposition,
+                    pNotification->CreateOptions);
+        }
+    }
+
+    if (decision == PolicyDecisionAllow || decision == PolicyDecisionBlock) {
+        if (!AggregateEvent(pNotification,
+                            (decision == PolicyDecisionBlock) ? EventBlockedByRule : EventAllowedByRule,
+                            ruleLine)) {
+            wprintf(L"  [T%lu] -> %s by rule (line %lu)\n",
+                    threadId,
+                    (decision == PolicyDecisionBlock) ? L"BLOCKED" : L"ALLOWED",
+                    ruleLine);
+        }
+        FinishMessage(Message, decision == PolicyDecisionBlock);
+        return;
+    }
+
+    if (!admitted) {
+        if (!AggregateEvent(pNotification, EventAllowedOverRate, 0)) {
+            wprintf(L"  [T%lu] -> ALLOWED, over the process's consultation rate\n", threadId);
+        }
+        FinishMessage(Message, FALSE);
+        return;
+    }
+
+    //
+    //  An audited file is allowed now and the consultant asked all the
+    //  same, without the operation waiting for it
+    //
+
+    if (decision == PolicyDecisionAudit) {
+        if (!AggregateEvent(pNotification, EventAudited, 0)) {
+            wprintf(L"  [T%lu] -> ALLOWED speculatively, auditing\n", threadId);
+        }
+        InterlockedIncrement(&gAudited);
+        SendVerdict(Message, FALSE, AVF_VERDICT_FLAG_SPECULATIVE | Message->VerdictFlags);
+        Message->Speculative = TRUE;
+    }
+
+    //
+    //  Ask the security consultant.  The verdict is sent when its response
+    //  comes in (ConsultationCompleted).
+    //
+
+    Message->Consultation.Audit = Message->Speculative;
+
+    if (!StartConsultation(&Message->Consultation, pNotification)) {
+
+        if (!Message->Speculative) {
+            AggregateEvent(pNotification, EventNoConsultant, 0);
+        }
+
+        FinishMessage(Message, FALSE);
+    }
+}
+
+
+VOID
+DeferNotification(
+    _Inout_ PAVF_MESSAGE Message
+    )
+/*++
+
+Routine Description:
+
+    Holds a message whose rules test the signer of an image that is being
+    verified, until ImageSignerResolved.  If it was verified meanwhile the
+    message is decided again at once.
+
+Arguments:
+
+    Message - The message buffer.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    AcquireSRWLockExclusive(&gDeferredLock);
+
+    //
+    //  Checked under gDeferredLock, which ImageSignerResolved takes after
+    //  the signer is stored, so that the message is never missed
+    //
+
+    if (IsImageSignerPending(Message->Notification.ProcessKey)) {
+        Message->DeferredNext = gDeferredMessages;
+        gDeferredMessages = Message;
+        ReleaseSRWLockExclusive(&gDeferredLock);
+        return;
+    }
+
+    ReleaseSRWLockExclusive(&gDeferredLock);
+
+    InterlockedDecrement(&Message->Worker->Busy);
+    ProcessNotification(Message, gCurrentReader);
+}
+
+
+VOID
+ImageSignerResolved(
+    _In_ ULONG ProcessKey
+    )
+/*++
+
+Routine Description:
+
+    Called by avfRules.c, on the thread pool, once the image of a process
+    was verified.  Hands the messages deferred for it back to their
+    workers to be decided again.
+
+Arguments:
+
+    ProcessKey - The process's key.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    PAVF_MESSAGE *link;
+    PAVF_MESSAGE message;
+    PAVF_MESSAGE resumed = NULL;
+
+    AcquireSRWLockExclusive(&gDeferredLock);
+
+    link = &gDeferredMessages;
+
+    while (*link != NULL) {
+
+        message = *link;
+
+        if (message->Notification.ProcessKey == ProcessKey) {
+            *link = message->DeferredNext;
+            message->DeferredNext = resumed;
+            resumed = message;
+        } else {
+            link = &message->DeferredNext;
+        }
+    }
+
+    ReleaseSRWLockExclusive(&gDeferredLock);
+
+    while (resumed != NULL) {
+
+        message = resumed;
+        resumed = message->DeferredNext;
+        message->DeferredNext = NULL;
+
+        RtlZeroMemory(&message->Finish.Overlapped, sizeof(OVERLAPPED));
+        message->Finish.Complete = ResumeNotification;
+
+        //
+        //  Without a packet there is no worker to decide on it; allow it
+        //
+
+        if (!PostQueuedCompletionStatus(message->Worker->Port, 0, AVF_KEY_IO, &message->Finish.Overlapped)) {
+            FinishMessage(message, FALSE);
+        }
+    }
+}
+
+
+VOID
+ResumeNotification(
+    _In_ PAVF_IO Io,
+    _In_ DWORD BytesTransferred,
+    _In_ BOOL Success
+    )
+/*++
+
+Routine Description:
+
+    Decides again on a message that was deferred for a signer, now known.
+
+Arguments:
+
+    Io - The message's Finish.
+    BytesTransferred - Unused.
+    Success - Unused.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    PAVF_MESSAGE message = CONTAINING_RECORD(Io, AVF_MESSAGE, Finish);
+
+    UNREFERENCED_PARAMETER(BytesTransferred);
+    UNREFERENCED_PARAMETER(Success);
+
+    InterlockedDecrement(&message->Worker->Busy);
+    ProcessNotification(message, gCurrentReader);
+}
+
+
+AVF_POLICY_DECISION
+DecideByPolicy(
+    _In_ PAVF_USER_POLICY Policy,
+    _In_ PAVF_FILE_NOTIFICATION pNotification,
+    _In_ BOOLEAN Shadow,
+    _Out_ PULONG RuleLine,
+    _Out_ PBOOLEAN Timed
+    )
+/*++
+
+Routine Description:
+
+    Decides what a policy does with a notification: whether the file is
+    protected, and if so what the rules say and whether it is audited.
+
+Arguments:
+
+    Policy - The active policy, or the candidate one.
+    pNotification - The notification.
+    Shadow - Policy is the candidate policy.  The filter marked the
+             notification for the active policy, so the file is only
+             checked by its path.
+    RuleLine - Receives the line of the rule that decided, or 0.
+    Timed - Receives whether the decision depended on the time.
+
+Return Value:
+
+    The decision.
+
+--*/
+{
+    AVF_RULE_ACTION action = RuleActionConsult;
+    BOOL bloomMiss = FALSE;
+    BOOL protectedFile;
+
+    *RuleLine = 0;
+    *Timed = FALSE;
+
+    //
+    //  A Bloom filter match only means the file may be protected.  Settle
+    //  it against the exact file ID set before doing any work.
+    //
+
+    if (!Shadow) {
+
+        bloomMiss = FlagOn(pNotification->Flags, AVF_NOTIFY_FLAG_BLOOM_MATCH) &&
+                    FlagOn(pNotification->Flags, AVF_NOTIFY_FLAG_FILE_ID_VALID) &&
+                    !FlagOn(pNotification->Flags, AVF_NOTIFY_FLAG_RULE_MATCH) &&
+                    !IsFileIdProtected(Policy, &pNotification->FileId);
+
+        if (bloomMiss) {
+            InterlockedIncrement(&gBloomFalsePositives);
+        }
+    }
+
+    //
+    //  Check if this file is in our protected list
+    //
+
+    protectedFile = !bloomMiss &&
+                    (Policy->MonitorAll ||
+                     (!Shadow && FlagOn(pNotification->Flags, AVF_NOTIFY_FLAG_RULE_MATCH)) ||
+                     IsFileProtected(Policy, pNotification->FileName));
+
+    if (!protectedFile) {
+        return PolicyDecisionUnprotected;
+    }
+
+    if (Policy->Rules != NULL) {
+        action = EvaluateRules(Policy->Rules, pNotification, RuleLine, Timed);
+    }
+
+    switch (action) {
+    case RuleActionAllow:
+        return PolicyDecisionAllow;
+    case RuleActionBlock:
+        return PolicyDecisionBlock;
+    case RuleActionAudit:
+        return PolicyDecisionAudit;
+    case RuleActionDefer:
+        return PolicyDecisionDefer;
+    default:
+        return IsFileAudited(Policy, pNotification) ? PolicyDecisionAudit : PolicyDecisionConsult;
+    }
+}
+
+
+VOID
+ConsultationCompleted(
+    _Inout_ PAVF_CONSULTATION Consultation
+    )
+/*++
+
+Routine Description:
+
+    Called by avfConsultant.c when the consultation of a message is over.
+    The verdict is sent by the worker that owns the message: here if this
+    is its thread, else once it dequeues the message's Finish packet.
+
+Arguments:
+
+    Consultation - The message's consultation.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    PAVF_MESSAGE message = CONTAINING_RECORD(Consultation, AVF_MESSAGE, Consultation);
+
+    RtlZeroMemory(&message->Finish.Overlapped, sizeof(OVERLAPPED));
+    message->Finish.Complete = FinishConsultation;
+
+    if (gCurrentWorker != message->Worker &&
+        PostQueuedCompletionStatus(message->Worker->Port, 0, AVF_KEY_IO, &message->Finish.Overlapped)) {
+
+        return;
+    }
+
+    FinishConsultation(&message->Finish, 0, TRUE);
+}
+
+
+VOID
+FinishConsultation(
+    _In_ PAVF_IO Io,
+    _In_ DWORD BytesTransferred,
+    _In_ BOOL Success
+    )
+/*++
+
+Routine Description:
+
+    Sends the verdict of a message whose consultation is over, or, if the
+    operation was allowed speculatively, records the consultant's verdict
+    on it.
+
+Arguments:
+
+    Io - The message's Finish.
+    BytesTransferred - Unused.
+    Success - Unused.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    PAVF_MESSAGE message = CONTAINING_RECORD(Io, AVF_MESSAGE, Finish);
+    PAVF_CONSULTATION consultation = &message->Consultation;
+    DWORD threadId = GetCurrentThreadId();
+    BOOLEAN block = FALSE;
+
+    UNREFERENCED_PARAMETER(BytesTransferred);
+    UNREFERENCED_PARAMETER(Success);
+
+    if (message->Speculative) {
+
+        //
+        //  Only the consultant's own verdict is cached
+        //
+
+        if (consultation->Result) {
+
+            if (consultation->Response.Decision == AVF_DECISION_BLOCK) {
+                wprintf(L"  [T%lu] ALERT: %s (PID %lu) was allowed access the consultant blocks (reason code: %lu)\n",
+                        threadId,
+                        message->Notification.ProcessName,
+                        message->Notification.ProcessId,
+                        consultation->Response.Reason);
+                InterlockedIncrement(&gAuditBlocked);
+                block = TRUE;
+            }
+
+            //
+            //  A verdict that is not cached was not kept a key for
+            //
+
+            if (!FlagOn(message->VerdictFlags, AVF_VERDICT_FLAG_NO_CACHE)) {
+                SendVerdict(message, block, AVF_VERDICT_FLAG_AUDITED);
+            }
+
+        } else {
+            wprintf(L"  [T%lu] -> Audit not completed\n", threadId);
+        }
+
+    } else if (consultation->Expired) {
+        if (!AggregateEvent(&message->Notification, EventOverdue, 0)) {
+            wprintf(L"  [T%lu] -> Overdue before the consultant could see it\n", threadId);
+        }
+    } else if (consultation->Result) {
+        if (consultation->Response.Decision == AVF_DECISION_BLOCK) {
+            if (!AggregateEvent(&message->Notification, EventBlockedByConsultant, consultation->Response.Reason)) {
+                wprintf(L"  [T%lu] -> BLOCKED by consultant (reason code: %lu)\n", threadId, consultation->Response.Reason);
+            }
+            block = TRUE;
+        } else if (!AggregateEvent(&message->Notification, EventAllowedByConsultant, 0)) {
+            wprintf(L"  [T%lu] -> ALLOWED by consultant\n", threadId);
+        }
+    } else if (!AggregateEvent(&message->Notification, EventNoConsultant, 0)) {
+        wprintf(L"  [T%lu] -> Consultant disconnected, allowing\n", threadId);
+    }
+
+    FinishMessage(message, block);
+}
+
+
+VOID
+FinishMessage(
+    _Inout_ PAVF_MESSAGE Message,
+    _In_ BOOLEAN Block
+    )
+/*++
+
+Routine Description:
+
+    Sends the verdict on a message's notification, unless it was allowed
+    speculatively, and queues the buffer for the next one.
+
+Arguments:
+
+    Message - The message buffer.
+    Block - Whether to block the operation.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    if (!Message->Speculative) {
+        SendVerdict(Message, Block, Message->VerdictFlags);
+    }
+
+    //
+    //  Queue another async read using the same message buffer
+    //
+
+    if (gRunning) {
+        QueueMessage(Message);
+    }
+
+    InterlockedDecrement(&Message->Worker->Busy);
+}
+
+
+VOID
+SendVerdict(
+    _In_ PAVF_MESSAGE Message,
+    _In_ BOOLEAN Block,
+    _In_ ULONG Flags
+    )
+/*++
+
+Routine Description:
+
+    Sends a verdict on a message's notification to the filter.
+
+Arguments:
+
+    Message - The message buffer.
+    Block - Whether to block the operation.
+    Flags - AVF_VERDICT_FLAG_*.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    AVF_VERDICT_MESSAGE verdictMessage;
+    DWORD bytesReturned;
+    HRESULT hr;
+
+    //
+    //  Send the verdict back to kernel.  The operation stays pended in
+    //  the filter until it arrives.  FilterSendMessage has no overlapped
+    //  form, but the filter only completes that operation and returns.
+    //
+
+    verdictMessage.Command = ReplyVerdict;
+    verdictMessage.Reserved = 0;
+    verdictMessage.Verdict.RequestId = Message->Notification.RequestId;
+    verdictMessage.Verdict.BlockOperation = Block ? 1 : 0;
+    verdictMessage.Verdict.Flags = Flags;
+
+    hr = FilterSendMessage(
+            Message->Worker->Filter,
+            &verdictMessage,
+            sizeof(verdictMessage),
+            NULL,
+            0,
+            &bytesReturned);
+
+    //
+    //  An audited verdict is not found when the filter no longer keeps the
+    //  operation's key; it is then only not cached
+    //
+
+    if (FAILED(hr)) {
+        if (hr == HRESULT_FROM_WIN32(ERROR_NOT_FOUND)) {
+            if (!FlagOn(Flags, AVF_VERDICT_FLAG_AUDITED)) {
+                wprintf(L"  [T%lu] -> Operation already completed (timed out or cancelled)\n", GetCurrentThreadId());
+            }
+        } else {
+            wprintf(L"  [T%lu] WARNING: Failed to send verdict (0x%08X)\n", GetCurrentThreadId(), hr);
+        }
+    }
+}
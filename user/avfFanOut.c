@@ -0,0 +1,615 @@
+/*++
+
+Copyright (c) 1989-2002  Microsoft Corporation
+Modified for AV Filter functionality
+
+Module Name:
+
+    avfFanOut.c
+
+Abstract:
+
+    Consulting several security consultants at once.  When more than one
+    is listed (-consultant), say one for reputation, one for data loss
+    prevention and one for ransomware heuristics, a consultation whose
+    turn came is sent to all of them in parallel, each on its own
+    connection, and their verdicts are combined (-combine) into the
+    consultation's.
+
+    Each consultant's part is a leg of the fan-out.  The verdict is
+    combined again as each leg answers, fails or runs past its
+    consultant's deadline, and the consultation is handed back as soon as
+    the verdict can no longer change: a block under block-wins does not
+    wait for the slower consultants.  The legs still out are left to
+    finish on their own; the fan-out is freed with the last of them.
+
+Environment:
+
+    User mode
+
+--*/
+
+#include <windows.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "avfUser.h"
+
+#define AVF_FANOUT_NONE             ((ULONG)-1)
+
+//
+//  Where a leg is
+//
+
+typedef enum _AVF_LEG_STATE {
+    LegPending,                            // Not answered yet
+    LegAllowed,
+    LegBlocked,
+    LegSilent                              // Not available, failed or past its deadline
+} AVF_LEG_STATE;
+
+//
+//  A consultation sent to every consultant.  A reference is held for
+//  each leg until it completes, for the timer while it is set, and by the
+//  sender while it starts the legs.
+//
+
+struct _AVF_FANOUT {
+    PAVF_CONSULTATION Consultation;        // The one fanned out
+    volatile LONG References;
+    SRWLOCK Lock;                          // Protects Settled and State
+    BOOLEAN Settled;                       // The verdict is known
+    ULONGLONG Start;                       // GetTickCount64 when the legs were sent
+    PTP_TIMER Timer;                       // Runs out the deadlines, or NULL
+    ULONG LegCount;
+    AVF_LEG_STATE State[AVF_MAX_CONSULTANTS];
+    AVF_CONSULTATION Legs[ANYSIZE_ARRAY];
+};
+
+//
+//  -combine and -quorum.  A quorum of 0 is a majority of the consultants.
+//
+
+AVF_COMBINE_MODE gCombineMode = CombineBlockWins;
+ULONG gCombineQuorum = 0;
+
+volatile LONG64 gFanOuts = 0;
+volatile LONG64 gFanOutsEarly = 0;         // Decided while legs were still out
+volatile LONG64 gLegsAnswered[AVF_MAX_CONSULTANTS];
+volatile LONG64 gLegsLate[AVF_MAX_CONSULTANTS];
+volatile LONG64 gLegsSilent[AVF_MAX_CONSULTANTS];
+
+//
+//  Function prototypes
+//
+
+BOOLEAN
+CombineVerdicts(
+    _Inout_ PAVF_FANOUT FanOut
+    );
+
+VOID
+SettleFanOut(
+    _In_ PAVF_FANOUT FanOut
+    );
+
+BOOLEAN
+SetFanOutTimer(
+    _In_ PAVF_FANOUT FanOut,
+    _In_ ULONGLONG Now
+    );
+
+VOID CALLBACK
+FanOutTimerCallback(
+    _Inout_ PTP_CALLBACK_INSTANCE Instance,
+    _Inout_opt_ PVOID Context,
+    _Inout_ PTP_TIMER Timer
+    );
+
+VOID
+DereferenceFanOut(
+    _In_ PAVF_FANOUT FanOut
+    );
+
+
+VOID
+FanOutConsultation(
+    _Inout_ PAVF_CONSULTATION Consultation
+    )
+/*++
+
+Routine Description:
+
+    Sends a consultation to every consultant.  Called by SendConsultation,
+    with the scheduler's slot, which is freed once the verdict is known.
+
+Arguments:
+
+    Consultation - The consultation, with its request built.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    PAVF_FANOUT fanOut;
+    PAVF_CONSULTATION leg;
+    PAVF_CONSULTANT_CONNECTION connection;
+    ULONG i;
+
+    fanOut = HeapAlloc(GetProcessHeap(),
+                       HEAP_ZERO_MEMORY,
+                       FIELD_OFFSET(AVF_FANOUT, Legs) + gConsultantCount * sizeof(AVF_CONSULTATION));
+
+    if (fanOut == NULL) {
+        CompleteConsultation(Consultation, FALSE);
+        return;
+    }
+
+    fanOut->Consultation = Consultation;
+    fanOut->References = gConsultantCount + 1;
+    fanOut->Start = GetTickCount64();
+    fanOut->LegCount = gConsultantCount;
+    InitializeSRWLock(&fanOut->Lock);
+
+    InterlockedIncrement64(&gFanOuts);
+
+    //
+    //  The deadlines are run out on the thread pool
+    //
+
+    for (i = 0; i < fanOut->LegCount; i++) {
+        if (GetConsultantDeadline(i) != 0) {
+            break;
+        }
+    }
+
+    if (i < fanOut->LegCount) {
+
+        fanOut->Timer = CreateThreadpoolTimer(FanOutTimerCallback, fanOut, NULL);
+
+        if (fanOut->Timer != NULL) {
+            InterlockedIncrement(&fanOut->References);
+            SetFanOutTimer(fanOut, fanOut->Start);
+        }
+    }
+
+    for (i = 0; i < fanOut->LegCount; i++) {
+
+        leg = &fanOut->Legs[i];
+        leg->Request = Consultation->Request;
+        leg->Port = Consultation->Port;
+        leg->FanOut = fanOut;
+        leg->Leg = i;
+
+        connection = AcquireConsultant(i);
+
+        if (connection == NULL) {
+            FanOutLegCompleted(leg);
+        } else {
+            SubmitConsultation(leg, connection);
+        }
+    }
+
+    DereferenceFanOut(fanOut);
+}
+
+
+VOID
+FanOutLegCompleted(
+    _Inout_ PAVF_CONSULTATION Leg
+    )
+/*++
+
+Routine Description:
+
+    Called by CompleteConsultation when a consultant's part of a fan-out
+    is over, and for a consultant that is not available.  Hands the
+    consultation back if that decides it.
+
+Arguments:
+
+    Leg - The leg; Response is valid if Result is TRUE.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    PAVF_FANOUT fanOut = Leg->FanOut;
+    BOOLEAN settle = FALSE;
+
+    AcquireSRWLockExclusive(&fanOut->Lock);
+
+    //
+    //  A leg past its deadline had its say already
+    //
+
+    if (fanOut->State[Leg->Leg] == LegPending) {
+
+        if (!Leg->Result) {
+            fanOut->State[Leg->Leg] = LegSilent;
+            InterlockedIncrement64(&gLegsSilent[Leg->Leg]);
+        } else {
+            fanOut->State[Leg->Leg] = (Leg->Response.Decision == AVF_DECISION_BLOCK) ? LegBlocked : LegAllowed;
+            InterlockedIncrement64(&gLegsAnswered[Leg->Leg]);
+        }
+
+        settle = !fanOut->Settled && CombineVerdicts(fanOut);
+    }
+
+    ReleaseSRWLockExclusive(&fanOut->Lock);
+
+    if (settle) {
+        SettleFanOut(fanOut);
+    }
+
+    DereferenceFanOut(fanOut);
+}
+
+
+BOOLEAN
+CombineVerdicts(
+    _Inout_ PAVF_FANOUT FanOut
+    )
+/*++
+
+Routine Description:
+
+    Combines the verdicts of the legs so far.  If the verdict can no longer
+    change, sets the consultation's response to it and marks the fan-out
+    settled.  Called with the fan-out's lock held.
+
+    The response is the deciding consultant's, so that its reason code is
+    kept.  If the consultants that answered did not decide it (a quorum
+    not reached by blocks alone) it is a plain allow, and if none answered
+    the consultation has no result, as with a single consultant that is
+    gone.
+
+Arguments:
+
+    FanOut - The fan-out, not settled.
+
+Return Value:
+
+    TRUE if it is settled.
+
+--*/
+{
+    PAVF_CONSULTATION consultation = FanOut->Consultation;
+    ULONG decider = AVF_FANOUT_NONE;
+    ULONG firstBlock = AVF_FANOUT_NONE;
+    ULONG firstAllow = AVF_FANOUT_NONE;
+    ULONG blocks = 0;
+    ULONG allows = 0;
+    ULONG pending = 0;
+    ULONG quorum;
+    BOOLEAN block;
+    ULONG i;
+
+    for (i = 0; i < FanOut->LegCount; i++) {
+
+        switch (FanOut->State[i]) {
+
+        case LegPending:
+            pending++;
+            break;
+
+        case LegBlocked:
+            if (blocks++ == 0) {
+                firstBlock = i;
+            }
+            break;
+
+        case LegAllowed:
+            if (allows++ == 0) {
+                firstAllow = i;
+            }
+            break;
+
+        default:
+            break;
+        }
+    }
+
+    switch (gCombineMode) {
+
+    case CombinePriority:
+
+        //
+        //  The first consultant listed that answers, once every one before
+        //  it has turned out to have no say
+        //
+
+        for (i = 0; i < FanOut->LegCount; i++) {
+
+            if (FanOut->State[i] == LegPending) {
+                return FALSE;
+            }
+
+            if (FanOut->State[i] != LegSilent) {
+                decider = i;
+                break;
+            }
+        }
+
+        block = (decider != AVF_FANOUT_NONE && FanOut->State[decider] == LegBlocked);
+        break;
+
+    case CombineQuorum:
+
+        quorum = (gCombineQuorum != 0) ? min(gCombineQuorum, FanOut->LegCount) : FanOut->LegCount / 2 + 1;
+
+        if (blocks >= quorum) {
+            block = TRUE;
+            decider = firstBlock;
+        } else if (blocks + pending < quorum) {
+            block = FALSE;
+            decider = firstAllow;
+        } else {
+            return FALSE;
+        }
+        break;
+
+    default:
+
+        if (blocks != 0) {
+            block = TRUE;
+            decider = firstBlock;
+        } else if (pending == 0) {
+            block = FALSE;
+            decider = firstAllow;
+        } else {
+            return FALSE;
+        }
+        break;
+    }
+
+    if (decider != AVF_FANOUT_NONE) {
+        consultation->Response = FanOut->Legs[decider].Response;
+        consultation->Result = TRUE;
+    } else if (blocks + allows != 0) {
+        RtlZeroMemory(&consultation->Response, sizeof(consultation->Response));
+        consultation->Response.Decision = block ? AVF_DECISION_BLOCK : AVF_DECISION_ALLOW;
+        consultation->Result = TRUE;
+    } else {
+        consultation->Result = FALSE;
+    }
+
+    FanOut->Settled = TRUE;
+
+    if (pending != 0) {
+        InterlockedIncrement64(&gFanOutsEarly);
+    }
+
+    return TRUE;
+}
+
+
+VOID
+SettleFanOut(
+    _In_ PAVF_FANOUT FanOut
+    )
+/*++
+
+Routine Description:
+
+    Hands a consultation whose fan-out is settled back to the engine and
+    frees its scheduler slot.
+
+Arguments:
+
+    FanOut - The fan-out.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    ReleaseConsultationSlot();
+
+    CompleteCoalesced(FanOut->Consultation);
+}
+
+
+BOOLEAN
+SetFanOutTimer(
+    _In_ PAVF_FANOUT FanOut,
+    _In_ ULONGLONG Now
+    )
+/*++
+
+Routine Description:
+
+    Sets the timer for the next deadline of a leg still out.  Called with
+    the fan-out's lock held, or before the legs are sent.
+
+Arguments:
+
+    FanOut - The fan-out.
+    Now - GetTickCount64.
+
+Return Value:
+
+    TRUE if the timer is set, FALSE if no leg still out has a deadline.
+
+--*/
+{
+    ULONGLONG next = MAXULONGLONG;
+    ULONGLONG due;
+    LARGE_INTEGER dueTime;
+    FILETIME fileTime;
+    ULONG deadline;
+    ULONG i;
+
+    for (i = 0; i < FanOut->LegCount; i++) {
+
+        deadline = GetConsultantDeadline(i);
+
+        if (FanOut->State[i] == LegPending && deadline != 0) {
+            next = min(next, FanOut->Start + deadline);
+        }
+    }
+
+    if (next == MAXULONGLONG) {
+        return FALSE;
+    }
+
+    //
+    //  Relative, in 100ns units
+    //
+
+    due = (next > Now) ? next - Now : 1;
+
+    dueTime.QuadPart = -(LONGLONG)(due * 10000);
+    fileTime.dwLowDateTime = dueTime.LowPart;
+    fileTime.dwHighDateTime = (DWORD)dueTime.HighPart;
+
+    SetThreadpoolTimer(FanOut->Timer, &fileTime, 0, 0);
+
+    return TRUE;
+}
+
+
+VOID CALLBACK
+FanOutTimerCallback(
+    _Inout_ PTP_CALLBACK_INSTANCE Instance,
+    _Inout_opt_ PVOID Context,
+    _Inout_ PTP_TIMER Timer
+    )
+/*++
+
+Routine Description:
+
+    Takes the say from the legs whose consultant's deadline passed, which
+    may decide the fan-out, and sets the timer for the next deadline.
+
+Arguments:
+
+    Instance - Unused.
+    Context - The fan-out.
+    Timer - Unused.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    PAVF_FANOUT fanOut = Context;
+    ULONGLONG now = GetTickCount64();
+    BOOLEAN settle = FALSE;
+    BOOLEAN set = FALSE;
+    ULONG deadline;
+    ULONG i;
+
+    UNREFERENCED_PARAMETER(Instance);
+    UNREFERENCED_PARAMETER(Timer);
+
+    AcquireSRWLockExclusive(&fanOut->Lock);
+
+    for (i = 0; i < fanOut->LegCount; i++) {
+
+        deadline = GetConsultantDeadline(i);
+
+        if (fanOut->State[i] == LegPending && deadline != 0 && now - fanOut->Start >= deadline) {
+            fanOut->State[i] = LegSilent;
+            InterlockedIncrement64(&gLegsLate[i]);
+        }
+    }
+
+    if (!fanOut->Settled) {
+        settle = CombineVerdicts(fanOut);
+        set = !settle && SetFanOutTimer(fanOut, now);
+    }
+
+    ReleaseSRWLockExclusive(&fanOut->Lock);
+
+    if (settle) {
+        SettleFanOut(fanOut);
+    }
+
+    //
+    //  The reference stays with the timer while it is set
+    //
+
+    if (!set) {
+        DereferenceFanOut(fanOut);
+    }
+}
+
+
+VOID
+DereferenceFanOut(
+    _In_ PAVF_FANOUT FanOut
+    )
+/*++
+
+Routine Description:
+
+    Drops a reference to a fan-out, freeing it with the last one.  The
+    timer may be closed from its own callback; the thread pool frees it
+    once the callback returns.
+
+Arguments:
+
+    FanOut - The fan-out.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    if (InterlockedDecrement(&FanOut->References) != 0) {
+        return;
+    }
+
+    if (FanOut->Timer != NULL) {
+        CloseThreadpoolTimer(FanOut->Timer);
+    }
+
+    HeapFree(GetProcessHeap(), 0, FanOut);
+}
+
+
+VOID
+PrintFanOutStatistics(
+    VOID
+    )
+/*++
+
+Routine Description:
+
+    Prints how the fan-outs went, and how each consultant did in them.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    ULONG i;
+
+    if (gFanOuts == 0) {
+        return;
+    }
+
+    wprintf(L"  Sent to every consultant: %lld (%lld decided before all answered)\n",
+            gFanOuts,
+            gFanOutsEarly);
+
+    for (i = 0; i < gConsultantCount; i++) {
+        wprintf(L"    %s: %lld answered, %lld past the deadline, %lld without an answer\n",
+                GetConsultantName(i),
+                gLegsAnswered[i],
+                gLegsLate[i],
+                gLegsSilent[i]);
+    }
+}
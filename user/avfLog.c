@@ -209,7 +209,7 @@ Return Value:
 --*/
 {
     va_list args;
-    WCHAR buffer[1024];
+    WCHAR buffer[2048];
     int len;
     DWORD written;
 
@@ -0,0 +1,1022 @@
+/*++
+
+Copyright (c) 1989-2002  Microsoft Corporation
+Modified for AV Filter functionality
+
+Module Name:
+
+    avfPipe.c
+
+Abstract:
+
+    Named pipe transport for the security consultant, used when the
+    consultant did not take the shared memory ring.
+
+    The pipe is opened for overlapped I/O on the engine's completion port.
+    One read is always pending for the next reply; requests are written
+    one message at a time, without waiting for the replies to the earlier
+    ones, which the consultant answers in order.
+
+    Submitted requests are held until the engine flushes at the end of a
+    round of completions, or until the write before them completes.  If
+    the consultant advertises AVF_CONSULTANT_CAP_BATCH, what is held then
+    goes as one batch.  While a batch is unanswered the next one is held
+    open until it is full or gConsultantBatchWaitUs passed, so that under
+    load requests travel in full batches.  The wait is run out on a high
+    resolution waitable timer where the system has them, since the timer
+    tick is far longer than a batch is meant to be held.
+
+Environment:
+
+    User mode
+
+--*/
+
+#include <windows.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "avfUser.h"
+
+#define AVF_BATCH_WAIT_US           50      // Default gConsultantBatchWaitUs
+#define AVF_PIPE_MAX_FRAMES         64      // Unanswered messages; a power of two
+#define AVF_PIPE_BUCKET_COUNT       256     // Outstanding requests hash; a power of two
+
+#ifndef CREATE_WAITABLE_TIMER_HIGH_RESOLUTION
+#define CREATE_WAITABLE_TIMER_HIGH_RESOLUTION   0x00000002
+#endif
+
+//
+//  A message written and not answered yet.  BatchId is 0 for a lone
+//  request.
+//
+
+typedef struct _AVF_PIPE_FRAME {
+    ULONG BatchId;
+    ULONG Count;
+    ULONGLONG SentTime;                    // GetTickCount64
+} AVF_PIPE_FRAME, *PAVF_PIPE_FRAME;
+
+typedef struct _AVF_PIPE_CHANNEL {
+    PAVF_CONSULTANT_CONNECTION Connection; // Not referenced; owns the channel
+    HANDLE Pipe;
+    ULONG Version;
+    BOOLEAN Batched;                       // AVF_CONSULTANT_CAP_BATCH
+    HANDLE BatchTimer;                     // Ends the wait of a held batch
+    PTP_WAIT BatchWait;                    // Sends the batch when BatchTimer fires
+
+    //
+    //  Everything below is protected by Lock
+    //
+
+    SRWLOCK Lock;
+    BOOLEAN Broken;
+    BOOLEAN Writing;                       // WriteIo is pending
+    BOOLEAN BatchTimerSet;                 // Holds a reference on Connection
+
+    //
+    //  Consultations submitted and not written yet, oldest first
+    //
+
+    PAVF_CONSULTATION HeldHead;
+    PAVF_CONSULTATION *HeldTailLink;
+    ULONG HeldCount;
+    LONGLONG HeldSince;                    // QueryPerformanceCounter of the oldest
+
+    //
+    //  Consultations written and waiting for their response, by RequestId
+    //
+
+    PAVF_CONSULTATION Outstanding[AVF_PIPE_BUCKET_COUNT];
+
+    //
+    //  Messages written and not answered yet, oldest at FrameHead
+    //
+
+    AVF_PIPE_FRAME Frames[AVF_PIPE_MAX_FRAMES];
+    ULONG FrameHead;
+    ULONG FrameTail;
+    ULONG BatchId;
+
+    AVF_IO WriteIo;
+    AVF_IO ReadIo;
+    PUCHAR RequestFrame;
+    PUCHAR ResponseFrame;
+
+    LONGLONG Requests;
+    LONGLONG BatchedRequests;
+    LONGLONG Batches;
+} AVF_PIPE_CHANNEL, *PAVF_PIPE_CHANNEL;
+
+#define AVF_PIPE_REQUEST_FRAME_SIZE \
+    (sizeof(AVF_CONSULTANT_BATCH_HEADER) + AVF_CONSULTANT_MAX_BATCH * sizeof(AVF_CONSULTANT_REQUEST))
+
+#define AVF_PIPE_RESPONSE_FRAME_SIZE \
+    (sizeof(AVF_CONSULTANT_BATCH_HEADER) + AVF_CONSULTANT_MAX_BATCH * sizeof(AVF_CONSULTANT_RESPONSE))
+
+#define AvfPipeBucket(_requestId)   ((_requestId) & (AVF_PIPE_BUCKET_COUNT - 1))
+
+ULONG gConsultantBatchWaitUs = AVF_BATCH_WAIT_US;
+
+//
+//  Function prototypes
+//
+
+VOID
+SubmitPipeTransport(
+    _In_ PVOID Context,
+    _Inout_ PAVF_CONSULTATION Consultation
+    );
+
+BOOLEAN
+FlushPipeTransport(
+    _In_ PVOID Context
+    );
+
+VOID
+CancelPipeTransport(
+    _In_ PVOID Context
+    );
+
+VOID
+ClosePipeTransport(
+    _In_ PVOID Context
+    );
+
+BOOL
+StartPipeRead(
+    _Inout_ PAVF_PIPE_CHANNEL Channel
+    );
+
+VOID
+SendHeldRequests(
+    _Inout_ PAVF_PIPE_CHANNEL Channel,
+    _Out_ PAVF_CONSULTATION *Failed
+    );
+
+VOID CALLBACK
+BatchTimerCallback(
+    _Inout_ PTP_CALLBACK_INSTANCE Instance,
+    _Inout_opt_ PVOID Context,
+    _Inout_ PTP_WAIT Wait,
+    _In_ TP_WAIT_RESULT WaitResult
+    );
+
+VOID
+PipeWriteComplete(
+    _In_ PAVF_IO Io,
+    _In_ DWORD BytesTransferred,
+    _In_ BOOL Success
+    );
+
+VOID
+PipeReadComplete(
+    _In_ PAVF_IO Io,
+    _In_ DWORD BytesTransferred,
+    _In_ BOOL Success
+    );
+
+BOOL
+TakeResponse(
+    _Inout_ PAVF_PIPE_CHANNEL Channel,
+    _In_ const AVF_CONSULTANT_RESPONSE *Response,
+    _Inout_ PAVF_CONSULTATION *Answered
+    );
+
+VOID
+BreakPipeChannel(
+    _Inout_ PAVF_PIPE_CHANNEL Channel,
+    _Inout_ PAVF_CONSULTATION *Failed
+    );
+
+VOID
+CompleteConsultationList(
+    _In_opt_ PAVF_CONSULTATION List,
+    _In_ BOOL Result
+    );
+
+const AVF_CONSULTANT_TRANSPORT gPipeTransport = {
+    L"named pipe",
+    NULL,
+    SubmitPipeTransport,
+    FlushPipeTransport,
+    CancelPipeTransport,
+    ClosePipeTransport
+};
+
+
+PVOID
+CreatePipeTransport(
+    _In_ PAVF_CONSULTANT_CONNECTION Connection
+    )
+/*++
+
+Routine Description:
+
+    Creates the pipe transport of a consultant connection and starts
+    reading replies.
+
+Arguments:
+
+    Connection - The connection, after the handshake.
+
+Return Value:
+
+    The pipe transport context, or NULL if it could not be set up.
+
+--*/
+{
+    PAVF_PIPE_CHANNEL channel;
+
+    channel = HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, sizeof(AVF_PIPE_CHANNEL));
+    if (channel == NULL) {
+        return NULL;
+    }
+
+    channel->RequestFrame = HeapAlloc(GetProcessHeap(), 0, AVF_PIPE_REQUEST_FRAME_SIZE);
+    channel->ResponseFrame = HeapAlloc(GetProcessHeap(), 0, AVF_PIPE_RESPONSE_FRAME_SIZE);
+
+    if (channel->RequestFrame == NULL || channel->ResponseFrame == NULL) {
+        ClosePipeTransport(channel);
+        return NULL;
+    }
+
+    channel->Connection = Connection;
+    channel->Pipe = GetConsultantPipe(Connection);
+    channel->Version = GetConsultantVersion(Connection);
+    channel->Batched = FlagOn(GetConsultantCapabilities(Connection), AVF_CONSULTANT_CAP_BATCH) != 0;
+    channel->HeldTailLink = &channel->HeldHead;
+    channel->WriteIo.Complete = PipeWriteComplete;
+    channel->ReadIo.Complete = PipeReadComplete;
+    InitializeSRWLock(&channel->Lock);
+
+    //
+    //  A batch is held for microseconds.  Without a high resolution timer
+    //  (before Windows 10 1803) it waits a timer tick instead, and without
+    //  any timer, for the engine to flush again.
+    //
+
+    if (channel->Batched && gConsultantBatchWaitUs != 0) {
+
+        channel->BatchTimer = CreateWaitableTimerExW(NULL, NULL, CREATE_WAITABLE_TIMER_HIGH_RESOLUTION, TIMER_ALL_ACCESS);
+
+        if (channel->BatchTimer == NULL) {
+            channel->BatchTimer = CreateWaitableTimerExW(NULL, NULL, 0, TIMER_ALL_ACCESS);
+        }
+
+        if (channel->BatchTimer != NULL) {
+
+            channel->BatchWait = CreateThreadpoolWait(BatchTimerCallback, channel, NULL);
+
+            if (channel->BatchWait == NULL) {
+                CloseHandle(channel->BatchTimer);
+                channel->BatchTimer = NULL;
+            }
+        }
+    }
+
+    if (!StartPipeRead(channel)) {
+        ClosePipeTransport(channel);
+        return NULL;
+    }
+
+    return channel;
+}
+
+
+VOID
+SubmitPipeTransport(
+    _In_ PVOID Context,
+    _Inout_ PAVF_CONSULTATION Consultation
+    )
+/*++
+
+Routine Description:
+
+    Holds a consultation for the next write.  A full batch is written at
+    once; anything less waits for FlushPipeTransport.
+
+Arguments:
+
+    Context - The pipe channel.
+    Consultation - The consultation, with its request built.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    PAVF_PIPE_CHANNEL channel = Context;
+    PAVF_CONSULTATION failed = NULL;
+    LARGE_INTEGER now;
+
+    AcquireSRWLockExclusive(&channel->Lock);
+
+    if (channel->Broken) {
+        ReleaseSRWLockExclusive(&channel->Lock);
+        CompleteConsultation(Consultation, FALSE);
+        return;
+    }
+
+    if (channel->HeldCount == 0) {
+        QueryPerformanceCounter(&now);
+        channel->HeldSince = now.QuadPart;
+    }
+
+    Consultation->Next = NULL;
+    *channel->HeldTailLink = Consultation;
+    channel->HeldTailLink = &Consultation->Next;
+    channel->HeldCount++;
+
+    if (channel->HeldCount >= AVF_CONSULTANT_MAX_BATCH) {
+        SendHeldRequests(channel, &failed);
+    }
+
+    ReleaseSRWLockExclusive(&channel->Lock);
+
+    CompleteConsultationList(failed, FALSE);
+}
+
+
+BOOLEAN
+FlushPipeTransport(
+    _In_ PVOID Context
+    )
+/*++
+
+Routine Description:
+
+    Writes the held requests if the pipe is free for them, and gives up
+    on a consultant that has not answered in AVF_CONSULTANT_TIMEOUT_MS.
+
+Arguments:
+
+    Context - The pipe channel.
+
+Return Value:
+
+    TRUE if requests are still held for the batch wait and there is no
+    timer to send them, so that the engine is to flush again shortly.
+
+--*/
+{
+    PAVF_PIPE_CHANNEL channel = Context;
+    PAVF_CONSULTATION failed = NULL;
+    BOOLEAN held;
+
+    AcquireSRWLockExclusive(&channel->Lock);
+
+    if (!channel->Broken &&
+        channel->FrameHead != channel->FrameTail &&
+        GetTickCount64() - channel->Frames[channel->FrameHead & (AVF_PIPE_MAX_FRAMES - 1)].SentTime >=
+            AVF_CONSULTANT_TIMEOUT_MS) {
+
+        wprintf(L"  -> Consultant did not answer in time\n");
+        BreakPipeChannel(channel, &failed);
+    }
+
+    SendHeldRequests(channel, &failed);
+    held = (channel->HeldCount != 0 && channel->BatchWait == NULL);
+
+    ReleaseSRWLockExclusive(&channel->Lock);
+
+    CompleteConsultationList(failed, FALSE);
+    return held;
+}
+
+
+VOID
+SendHeldRequests(
+    _Inout_ PAVF_PIPE_CHANNEL Channel,
+    _Out_ PAVF_CONSULTATION *Failed
+    )
+/*++
+
+Routine Description:
+
+    Writes held requests as one message, unless a write is pending, too
+    many messages are unanswered or, for batches, a batch is unanswered
+    and the next one is neither full nor old enough, in which case the
+    batch timer is set for when it will be.  Called with the channel lock
+    held.
+
+Arguments:
+
+    Channel - The pipe channel.
+    Failed - Receives consultations to fail if the pipe broke, linked
+        through Next.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    PAVF_CONSULTANT_BATCH_HEADER header;
+    PAVF_CONSULTATION consultation;
+    PAVF_PIPE_FRAME frame;
+    LARGE_INTEGER frequency;
+    LARGE_INTEGER now;
+    LARGE_INTEGER dueTime;
+    LONGLONG remaining;
+    PUCHAR buffer;
+    DWORD size;
+    ULONG count;
+    ULONG bucket;
+    ULONG i;
+
+    if (Channel->Broken ||
+        Channel->Writing ||
+        Channel->HeldCount == 0 ||
+        Channel->FrameTail - Channel->FrameHead == AVF_PIPE_MAX_FRAMES) {
+
+        return;
+    }
+
+    //
+    //  Hold a batch open while the last one is on its way
+    //
+
+    if (Channel->Batched &&
+        Channel->FrameHead != Channel->FrameTail &&
+        Channel->HeldCount < AVF_CONSULTANT_MAX_BATCH) {
+
+        QueryPerformanceFrequency(&frequency);
+        QueryPerformanceCounter(&now);
+
+        remaining = Channel->HeldSince + frequency.QuadPart * gConsultantBatchWaitUs / 1000000 - now.QuadPart;
+
+        if (remaining > 0) {
+
+            //
+            //  Relative, in 100ns units, rounded up
+            //
+
+            if (Channel->BatchWait != NULL && !Channel->BatchTimerSet) {
+
+                dueTime.QuadPart = -((remaining * 10000000 + frequency.QuadPart - 1) / frequency.QuadPart);
+
+                if (SetWaitableTimer(Channel->BatchTimer, &dueTime, 0, NULL, NULL, FALSE)) {
+                    ReferenceConsultant(Channel->Connection);
+                    Channel->BatchTimerSet = TRUE;
+                    SetThreadpoolWait(Channel->BatchWait, Channel->BatchTimer, NULL);
+                }
+            }
+
+            return;
+        }
+    }
+
+    //
+    //  A lone request goes as it is; several go as a batch
+    //
+
+    count = Channel->Batched ? min(Channel->HeldCount, AVF_CONSULTANT_MAX_BATCH) : 1;
+
+    frame = &Channel->Frames[Channel->FrameTail & (AVF_PIPE_MAX_FRAMES - 1)];
+    frame->Count = count;
+    frame->SentTime = GetTickCount64();
+
+    if (count == 1) {
+
+        frame->BatchId = 0;
+        buffer = (PUCHAR)&Channel->HeldHead->Request;
+        size = Channel->HeldHead->RequestSize;
+
+    } else {
+
+        header = (PAVF_CONSULTANT_BATCH_HEADER)Channel->RequestFrame;
+        header->Version = Channel->Version;
+        header->BatchId = ++Channel->BatchId;
+        header->Count = count;
+        header->Operation = AVF_CONSULTANT_OP_BATCH;
+
+        frame->BatchId = header->BatchId;
+        buffer = (PUCHAR)(header + 1);
+
+        consultation = Channel->HeldHead;
+
+        for (i = 0; i < count; i++) {
+            RtlCopyMemory(buffer, &consultation->Request, consultation->RequestSize);
+            buffer += consultation->RequestSize;
+            consultation = consultation->Next;
+        }
+
+        size = (DWORD)(buffer - Channel->RequestFrame);
+        buffer = Channel->RequestFrame;
+
+        Channel->BatchedRequests += count;
+        Channel->Batches++;
+    }
+
+    //
+    //  Move the requests to the outstanding table before the write, whose
+    //  buffer a lone request still is
+    //
+
+    while (count-- != 0) {
+
+        consultation = Channel->HeldHead;
+        Channel->HeldHead = consultation->Next;
+        Channel->HeldCount--;
+
+        bucket = AvfPipeBucket(consultation->Request.RequestId);
+        consultation->Next = Channel->Outstanding[bucket];
+        Channel->Outstanding[bucket] = consultation;
+
+        Channel->Requests++;
+    }
+
+    if (Channel->HeldHead == NULL) {
+        Channel->HeldTailLink = &Channel->HeldHead;
+    } else {
+        QueryPerformanceCounter(&now);
+        Channel->HeldSince = now.QuadPart;
+    }
+
+    Channel->FrameTail++;
+    Channel->Writing = TRUE;
+
+    RtlZeroMemory(&Channel->WriteIo.Overlapped, sizeof(OVERLAPPED));
+    ReferenceConsultant(Channel->Connection);
+
+    if (!WriteFile(Channel->Pipe, buffer, size, NULL, &Channel->WriteIo.Overlapped) &&
+        GetLastError() != ERROR_IO_PENDING) {
+
+        Channel->Writing = FALSE;
+        ReleaseConsultant(Channel->Connection);
+        BreakPipeChannel(Channel, Failed);
+    }
+}
+
+
+VOID CALLBACK
+BatchTimerCallback(
+    _Inout_ PTP_CALLBACK_INSTANCE Instance,
+    _Inout_opt_ PVOID Context,
+    _Inout_ PTP_WAIT Wait,
+    _In_ TP_WAIT_RESULT WaitResult
+    )
+/*++
+
+Routine Description:
+
+    Thread pool callback of the batch timer: sends the batch whose wait
+    is over, and drops the reference the timer held.
+
+Arguments:
+
+    Instance - Unused.
+    Context - The pipe channel.
+    Wait - Unused.
+    WaitResult - Unused.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    PAVF_PIPE_CHANNEL channel = Context;
+    PAVF_CONSULTANT_CONNECTION connection = channel->Connection;
+    PAVF_CONSULTATION failed = NULL;
+
+    UNREFERENCED_PARAMETER(Instance);
+    UNREFERENCED_PARAMETER(Wait);
+    UNREFERENCED_PARAMETER(WaitResult);
+
+    AcquireSRWLockExclusive(&channel->Lock);
+
+    channel->BatchTimerSet = FALSE;
+    SendHeldRequests(channel, &failed);
+
+    ReleaseSRWLockExclusive(&channel->Lock);
+
+    CompleteConsultationList(failed, FALSE);
+
+    ReleaseConsultant(connection);
+}
+
+
+VOID
+PipeWriteComplete(
+    _In_ PAVF_IO Io,
+    _In_ DWORD BytesTransferred,
+    _In_ BOOL Success
+    )
+/*++
+
+Routine Description:
+
+    Completion of a write; writes what was held meanwhile.
+
+Arguments:
+
+    Io - The channel's WriteIo.
+    BytesTransferred - Unused.
+    Success - Whether the write succeeded.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    PAVF_PIPE_CHANNEL channel = CONTAINING_RECORD(Io, AVF_PIPE_CHANNEL, WriteIo);
+    PAVF_CONSULTANT_CONNECTION connection = channel->Connection;
+    PAVF_CONSULTATION failed = NULL;
+
+    UNREFERENCED_PARAMETER(BytesTransferred);
+
+    AcquireSRWLockExclusive(&channel->Lock);
+
+    channel->Writing = FALSE;
+
+    if (!Success) {
+        BreakPipeChannel(channel, &failed);
+    }
+
+    SendHeldRequests(channel, &failed);
+
+    ReleaseSRWLockExclusive(&channel->Lock);
+
+    CompleteConsultationList(failed, FALSE);
+
+    if (!Success) {
+        DisconnectConsultant(connection);
+    }
+
+    ReleaseConsultant(connection);
+}
+
+
+BOOL
+StartPipeRead(
+    _Inout_ PAVF_PIPE_CHANNEL Channel
+    )
+/*++
+
+Routine Description:
+
+    Starts reading the next reply.
+
+Arguments:
+
+    Channel - The pipe channel.
+
+Return Value:
+
+    TRUE if the read is pending, FALSE if the pipe broke.
+
+--*/
+{
+    RtlZeroMemory(&Channel->ReadIo.Overlapped, sizeof(OVERLAPPED));
+    ReferenceConsultant(Channel->Connection);
+
+    if (!ReadFile(Channel->Pipe,
+                  Channel->ResponseFrame,
+                  AVF_PIPE_RESPONSE_FRAME_SIZE,
+                  NULL,
+                  &Channel->ReadIo.Overlapped) &&
+        GetLastError() != ERROR_IO_PENDING) {
+
+        ReleaseConsultant(Channel->Connection);
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+
+VOID
+PipeReadComplete(
+    _In_ PAVF_IO Io,
+    _In_ DWORD BytesTransferred,
+    _In_ BOOL Success
+    )
+/*++
+
+Routine Description:
+
+    Completion of a read: hands out the responses of the reply to the
+    oldest unanswered message and reads the next one.  A reply that does
+    not match that message breaks the connection.
+
+Arguments:
+
+    Io - The channel's ReadIo.
+    BytesTransferred - Size of the reply.
+    Success - Whether the read succeeded; a reply larger than the buffer
+        fails it.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    PAVF_PIPE_CHANNEL channel = CONTAINING_RECORD(Io, AVF_PIPE_CHANNEL, ReadIo);
+    PAVF_CONSULTANT_CONNECTION connection = channel->Connection;
+    PAVF_CONSULTANT_BATCH_HEADER header;
+    PAVF_CONSULTANT_RESPONSE responses;
+    PAVF_CONSULTATION answered = NULL;
+    PAVF_CONSULTATION failed = NULL;
+    PAVF_PIPE_FRAME frame;
+    BOOL broken = !Success;
+    ULONG i;
+
+    AcquireSRWLockExclusive(&channel->Lock);
+
+    if (channel->Broken) {
+        broken = TRUE;
+    } else if (!broken) {
+
+        if (channel->FrameHead == channel->FrameTail) {
+
+            broken = TRUE;
+
+        } else {
+
+            frame = &channel->Frames[channel->FrameHead & (AVF_PIPE_MAX_FRAMES - 1)];
+            channel->FrameHead++;
+
+            if (frame->BatchId == 0) {
+
+                broken = BytesTransferred < sizeof(AVF_CONSULTANT_RESPONSE) ||
+                         !TakeResponse(channel, (PAVF_CONSULTANT_RESPONSE)channel->ResponseFrame, &answered);
+
+            } else {
+
+                header = (PAVF_CONSULTANT_BATCH_HEADER)channel->ResponseFrame;
+                responses = (PAVF_CONSULTANT_RESPONSE)(header + 1);
+
+                broken = BytesTransferred < sizeof(*header) ||
+                         header->Operation != AVF_CONSULTANT_OP_BATCH ||
+                         header->BatchId != frame->BatchId ||
+                         header->Count != frame->Count ||
+                         BytesTransferred < sizeof(*header) + header->Count * sizeof(AVF_CONSULTANT_RESPONSE);
+
+                //
+                //  Responses come in any order; match them by RequestId
+                //
+
+                for (i = 0; !broken && i < header->Count; i++) {
+                    broken = !TakeResponse(channel, &responses[i], &answered);
+                }
+            }
+        }
+
+        if (broken) {
+            wprintf(L"  -> Consultant reply does not match a request\n");
+        }
+    }
+
+    if (broken) {
+        BreakPipeChannel(channel, &failed);
+    } else {
+        SendHeldRequests(channel, &failed);
+    }
+
+    ReleaseSRWLockExclusive(&channel->Lock);
+
+    CompleteConsultationList(answered, TRUE);
+    CompleteConsultationList(failed, FALSE);
+
+    if (broken) {
+        DisconnectConsultant(connection);
+    } else if (!StartPipeRead(channel)) {
+        CancelPipeTransport(channel);
+        DisconnectConsultant(connection);
+    }
+
+    ReleaseConsultant(connection);
+}
+
+
+BOOL
+TakeResponse(
+    _Inout_ PAVF_PIPE_CHANNEL Channel,
+    _In_ const AVF_CONSULTANT_RESPONSE *Response,
+    _Inout_ PAVF_CONSULTATION *Answered
+    )
+/*++
+
+Routine Description:
+
+    Takes the outstanding consultation a response is for out of the table.
+    Called with the channel lock held.
+
+Arguments:
+
+    Channel - The pipe channel.
+    Response - A response from the consultant.
+    Answered - List the consultation is added to, linked through Next.
+
+Return Value:
+
+    TRUE if the response was for an outstanding consultation.
+
+--*/
+{
+    PAVF_CONSULTATION *link;
+    PAVF_CONSULTATION consultation;
+
+    for (link = &Channel->Outstanding[AvfPipeBucket(Response->RequestId)]; *link != NULL; link = &(*link)->Next) {
+
+        consultation = *link;
+
+        if (consultation->Request.RequestId == Response->RequestId) {
+            *link = consultation->Next;
+            consultation->Response = *Response;
+            consultation->Next = *Answered;
+            *Answered = consultation;
+            return TRUE;
+        }
+    }
+
+    return FALSE;
+}
+
+
+VOID
+BreakPipeChannel(
+    _Inout_ PAVF_PIPE_CHANNEL Channel,
+    _Inout_ PAVF_CONSULTATION *Failed
+    )
+/*++
+
+Routine Description:
+
+    Marks the channel broken and takes every held and outstanding
+    consultation off it to be failed.  Called with the channel lock held.
+
+Arguments:
+
+    Channel - The pipe channel.
+    Failed - List the consultations are added to, linked through Next.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    PAVF_CONSULTATION consultation;
+    ULONG i;
+
+    Channel->Broken = TRUE;
+
+    while (Channel->HeldHead != NULL) {
+        consultation = Channel->HeldHead;
+        Channel->HeldHead = consultation->Next;
+        consultation->Next = *Failed;
+        *Failed = consultation;
+    }
+
+    Channel->HeldTailLink = &Channel->HeldHead;
+    Channel->HeldCount = 0;
+
+    for (i = 0; i < AVF_PIPE_BUCKET_COUNT; i++) {
+        while (Channel->Outstanding[i] != NULL) {
+            consultation = Channel->Outstanding[i];
+            Channel->Outstanding[i] = consultation->Next;
+            consultation->Next = *Failed;
+            *Failed = consultation;
+        }
+    }
+
+    Channel->FrameHead = Channel->FrameTail;
+}
+
+
+VOID
+CompleteConsultationList(
+    _In_opt_ PAVF_CONSULTATION List,
+    _In_ BOOL Result
+    )
+/*++
+
+Routine Description:
+
+    Completes a list of consultations taken off the channel.
+
+Arguments:
+
+    List - Consultations linked through Next.
+    Result - TRUE if they have their response.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    PAVF_CONSULTATION consultation;
+
+    while (List != NULL) {
+        consultation = List;
+        List = consultation->Next;
+        consultation->Next = NULL;
+        CompleteConsultation(consultation, Result);
+    }
+}
+
+
+VOID
+CancelPipeTransport(
+    _In_ PVOID Context
+    )
+/*++
+
+Routine Description:
+
+    Fails every consultation on the channel, and any that follow, and
+    aborts the pending I/O.
+
+Arguments:
+
+    Context - The pipe channel.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    PAVF_PIPE_CHANNEL channel = Context;
+    PAVF_CONSULTATION failed = NULL;
+    LARGE_INTEGER dueTime;
+
+    AcquireSRWLockExclusive(&channel->Lock);
+
+    BreakPipeChannel(channel, &failed);
+
+    //
+    //  Have a set batch timer fire now, to drop its reference
+    //
+
+    if (channel->BatchTimerSet) {
+        dueTime.QuadPart = -1;
+        SetWaitableTimer(channel->BatchTimer, &dueTime, 0, NULL, NULL, FALSE);
+    }
+
+    ReleaseSRWLockExclusive(&channel->Lock);
+
+    CancelIoEx(channel->Pipe, NULL);
+
+    CompleteConsultationList(failed, FALSE);
+}
+
+
+VOID
+ClosePipeTransport(
+    _In_ PVOID Context
+    )
+/*++
+
+Routine Description:
+
+    Frees a pipe channel.  No I/O or consultation may be in flight.
+
+Arguments:
+
+    Context - The pipe channel.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    PAVF_PIPE_CHANNEL channel = Context;
+
+    if (channel->Batches != 0) {
+        wprintf(L"Consultant requests: %lld, %lld of them in %lld batches\n",
+                channel->Requests,
+                channel->BatchedRequests,
+                channel->Batches);
+    }
+
+    //
+    //  The timer is not set, as it would hold a reference; this may be the
+    //  timer's own callback, so its callbacks are not waited for
+    //
+
+    if (channel->BatchWait != NULL) {
+        CloseThreadpoolWait(channel->BatchWait);
+    }
+
+    if (channel->BatchTimer != NULL) {
+        CloseHandle(channel->BatchTimer);
+    }
+
+    if (channel->RequestFrame != NULL) {
+        HeapFree(GetProcessHeap(), 0, channel->RequestFrame);
+    }
+
+    if (channel->ResponseFrame != NULL) {
+        HeapFree(GetProcessHeap(), 0, channel->ResponseFrame);
+    }
+
+    HeapFree(GetProcessHeap(), 0, channel);
+}
@@ -0,0 +1,382 @@
+/*++
+
+Copyright (c) 1989-2002  Microsoft Corporation
+Modified for AV Filter functionality
+
+Module Name:
+
+    avfPlugin.c
+
+Abstract:
+
+    The security consultant plugin (-plugin, see avfPlugin.h): a DLL whose
+    verdicts are had in the engine worker, without a round trip to another
+    process.
+
+    A consultation is put on its worker's batch when it starts, and the
+    batch goes to the plugin when it is full or when the worker is done
+    with its round of completion packets (FlushConsultations), so a busy
+    worker hands the plugin up to AVF_PLUGIN_MAX_BATCH requests at once.
+    What the plugin decides is handed back to the engine at once; what it
+    defers goes on to the security consultants on the pipe.
+
+Environment:
+
+    User mode
+
+--*/
+
+#include <windows.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "avfUser.h"
+#include "avfPlugin.h"
+
+//
+//  The loaded plugin.  Evaluate is NULL if there is none.
+//
+
+typedef struct _AVF_PLUGIN {
+    HMODULE Module;
+    PVOID Context;                         // Its own, from AvfPluginInitialize
+    AVF_PLUGIN_EVALUATE *Evaluate;
+    AVF_PLUGIN_EVALUATE_BATCH *EvaluateBatch;
+    AVF_PLUGIN_SHUTDOWN *Shutdown;
+} AVF_PLUGIN, *PAVF_PLUGIN;
+
+//
+//  The consultations a worker started in this round of completion packets
+//
+
+typedef struct _AVF_PLUGIN_BATCH {
+    ULONG Count;
+    PAVF_CONSULTATION Consultations[AVF_PLUGIN_MAX_BATCH];
+    PAVF_FILE_NOTIFICATION Notifications[AVF_PLUGIN_MAX_BATCH];
+} AVF_PLUGIN_BATCH, *PAVF_PLUGIN_BATCH;
+
+//
+//  -plugin and -pluginargs
+//
+
+PCWSTR gPluginPath = NULL;
+PCWSTR gPluginArguments = NULL;
+
+AVF_PLUGIN gPlugin;
+
+DECLSPEC_THREAD AVF_PLUGIN_BATCH gPluginBatch;
+
+volatile LONG64 gPluginDecided = 0;
+volatile LONG64 gPluginDeferred = 0;
+volatile LONG64 gPluginFailed = 0;
+volatile LONG64 gPluginCalls = 0;
+volatile LONG64 gPluginTicks = 0;          // QueryPerformanceCounter, in the plugin
+
+//
+//  Function prototypes
+//
+
+VOID
+EvaluatePluginBatch(
+    _Inout_ PAVF_PLUGIN_BATCH Batch
+    );
+
+
+BOOL
+LoadPlugin(
+    VOID
+    )
+/*++
+
+Routine Description:
+
+    Loads and initializes the plugin given with -plugin, if any.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    TRUE if there is no plugin or it is ready, FALSE if it could not be
+    loaded.
+
+--*/
+{
+    AVF_PLUGIN_INITIALIZE *initialize;
+    AVF_PLUGIN plugin;
+    HRESULT hr;
+
+    if (gPluginPath == NULL) {
+        return TRUE;
+    }
+
+    RtlZeroMemory(&plugin, sizeof(plugin));
+
+    plugin.Module = LoadLibraryExW(gPluginPath, NULL, LOAD_WITH_ALTERED_SEARCH_PATH);
+
+    if (plugin.Module == NULL) {
+        wprintf(L"ERROR: Failed to load plugin %s (error %lu)\n", gPluginPath, GetLastError());
+        return FALSE;
+    }
+
+    initialize = (AVF_PLUGIN_INITIALIZE *)GetProcAddress(plugin.Module, AVF_PLUGIN_INITIALIZE_NAME);
+    plugin.Evaluate = (AVF_PLUGIN_EVALUATE *)GetProcAddress(plugin.Module, AVF_PLUGIN_EVALUATE_NAME);
+    plugin.EvaluateBatch = (AVF_PLUGIN_EVALUATE_BATCH *)GetProcAddress(plugin.Module, AVF_PLUGIN_EVALUATE_BATCH_NAME);
+    plugin.Shutdown = (AVF_PLUGIN_SHUTDOWN *)GetProcAddress(plugin.Module, AVF_PLUGIN_SHUTDOWN_NAME);
+
+    if (initialize == NULL || plugin.Evaluate == NULL) {
+        wprintf(L"ERROR: %s is not an AVF plugin\n", gPluginPath);
+        FreeLibrary(plugin.Module);
+        return FALSE;
+    }
+
+    hr = initialize(AVF_PLUGIN_ABI_VERSION, gPluginArguments, &plugin.Context);
+
+    if (FAILED(hr)) {
+        wprintf(L"ERROR: Plugin %s failed to initialize (0x%08X)\n", gPluginPath, hr);
+        FreeLibrary(plugin.Module);
+        return FALSE;
+    }
+
+    gPlugin = plugin;
+
+    wprintf(L"Plugin: %s%s\n",
+            gPluginPath,
+            (plugin.EvaluateBatch != NULL) ? L" (batches)" : L"");
+
+    return TRUE;
+}
+
+
+VOID
+UnloadPlugin(
+    VOID
+    )
+/*++
+
+Routine Description:
+
+    Shuts the plugin down and unloads it.  Called once the engine has
+    stopped.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    if (gPlugin.Evaluate == NULL) {
+        return;
+    }
+
+    if (gPlugin.Shutdown != NULL) {
+        gPlugin.Shutdown(gPlugin.Context);
+    }
+
+    FreeLibrary(gPlugin.Module);
+    RtlZeroMemory(&gPlugin, sizeof(gPlugin));
+}
+
+
+BOOLEAN
+PluginConsultation(
+    _Inout_ PAVF_CONSULTATION Consultation,
+    _In_ PAVF_FILE_NOTIFICATION pNotification
+    )
+/*++
+
+Routine Description:
+
+    Puts a consultation on the worker's batch for the plugin.  Called by
+    StartConsultation.
+
+Arguments:
+
+    Consultation - The consultation, with its request built.
+    pNotification - File access notification it is for; it must stay
+                    valid until the consultation is over.
+
+Return Value:
+
+    TRUE if the plugin takes it, FALSE if there is no plugin.
+
+--*/
+{
+    PAVF_PLUGIN_BATCH batch = &gPluginBatch;
+
+    if (gPlugin.Evaluate == NULL) {
+        return FALSE;
+    }
+
+    batch->Consultations[batch->Count] = Consultation;
+    batch->Notifications[batch->Count] = pNotification;
+
+    if (++batch->Count == AVF_PLUGIN_MAX_BATCH) {
+        EvaluatePluginBatch(batch);
+    }
+
+    return TRUE;
+}
+
+
+VOID
+FlushPluginConsultations(
+    VOID
+    )
+/*++
+
+Routine Description:
+
+    Gives the plugin what is on this worker's batch.  Called by
+    FlushConsultations.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    if (gPluginBatch.Count != 0) {
+        EvaluatePluginBatch(&gPluginBatch);
+    }
+}
+
+
+VOID
+EvaluatePluginBatch(
+    _Inout_ PAVF_PLUGIN_BATCH Batch
+    )
+/*++
+
+Routine Description:
+
+    Has the plugin decide a batch, in one call if it takes batches, and
+    hands back or forwards each consultation.  The batch is empty
+    afterwards.
+
+Arguments:
+
+    Batch - The worker's batch, not empty.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    AVF_PLUGIN_BATCH batch = *Batch;
+    const AVF_CONSULTANT_REQUEST *requests[AVF_PLUGIN_MAX_BATCH];
+    AVF_CONSULTANT_RESPONSE responses[AVF_PLUGIN_MAX_BATCH];
+    HRESULT results[AVF_PLUGIN_MAX_BATCH];
+    PAVF_CONSULTATION consultation;
+    LARGE_INTEGER start;
+    LARGE_INTEGER end;
+    HRESULT hr;
+    ULONG i;
+
+    //
+    //  Handing a consultation back may start another one on this thread
+    //
+
+    Batch->Count = 0;
+
+    for (i = 0; i < batch.Count; i++) {
+        batch.Consultations[i]->Request.Version = AVF_CONSULTANT_PROTOCOL_VERSION;
+        requests[i] = &batch.Consultations[i]->Request;
+        RtlZeroMemory(&responses[i], sizeof(responses[i]));
+    }
+
+    QueryPerformanceCounter(&start);
+
+    if (gPlugin.EvaluateBatch != NULL && batch.Count > 1) {
+
+        hr = gPlugin.EvaluateBatch(gPlugin.Context, batch.Count, requests, responses);
+
+        for (i = 0; i < batch.Count; i++) {
+            results[i] = hr;
+        }
+
+        InterlockedIncrement64(&gPluginCalls);
+
+    } else {
+
+        for (i = 0; i < batch.Count; i++) {
+            results[i] = gPlugin.Evaluate(gPlugin.Context, requests[i], &responses[i]);
+        }
+
+        InterlockedAdd64(&gPluginCalls, batch.Count);
+    }
+
+    QueryPerformanceCounter(&end);
+    InterlockedAdd64(&gPluginTicks, end.QuadPart - start.QuadPart);
+
+    for (i = 0; i < batch.Count; i++) {
+
+        consultation = batch.Consultations[i];
+
+        if (FAILED(results[i])) {
+            InterlockedIncrement64(&gPluginFailed);
+        } else if (responses[i].Decision == AVF_DECISION_ALLOW ||
+                   responses[i].Decision == AVF_DECISION_BLOCK) {
+
+            InterlockedIncrement64(&gPluginDecided);
+
+            consultation->Response = responses[i];
+            consultation->Response.Version = consultation->Request.Version;
+            consultation->Response.RequestId = consultation->Request.RequestId;
+            consultation->Result = TRUE;
+
+            ConsultationCompleted(consultation);
+            continue;
+        }
+
+        InterlockedIncrement64(&gPluginDeferred);
+        ForwardConsultation(consultation, batch.Notifications[i]);
+    }
+}
+
+
+VOID
+PrintPluginStatistics(
+    VOID
+    )
+/*++
+
+Routine Description:
+
+    Prints how much the plugin decided, and how fast.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    LARGE_INTEGER frequency;
+    LONG64 requests = gPluginDecided + gPluginDeferred + gPluginFailed;
+
+    if (requests == 0) {
+        return;
+    }
+
+    QueryPerformanceFrequency(&frequency);
+
+    wprintf(L"  Decided by the plugin: %lld of %lld (%lld failed), %.2f us per request in %lld calls\n",
+            gPluginDecided,
+            requests,
+            gPluginFailed,
+            (double)gPluginTicks * 1000000.0 / (double)frequency.QuadPart / (double)requests,
+            gPluginCalls);
+}
@@ -0,0 +1,839 @@
+/*++
+
+Copyright (c) 1989-2002  Microsoft Corporation
+Modified for AV Filter functionality
+
+Module Name:
+
+    avfReload.c
+
+Abstract:
+
+    This module builds the user policy from its sources, publishes it to
+    the worker threads and the filter, and reloads it when a list file,
+    policy bundle or rules file changes.
+
+    The sources given after -shadow make up a candidate policy, built,
+    published and reloaded the same way but never sent to the filter:
+    only the shadow thread reads it (avfShadow.c).
+
+    Workers read the current policy without taking a lock.  Each worker
+    owns a reader slot in which it announces the publication epoch it
+    entered at while it looks at the policy, and clears it when done.  A
+    new policy is published with an atomic pointer swap; the old one is
+    freed after a grace period, once every slot is either clear or shows
+    an epoch that began after the swap.
+
+Environment:
+
+    User mode
+
+--*/
+
+#include <windows.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <fltUser.h>
+#include "avfUser.h"
+
+//
+//  Policy reader slots, one cache line each so that workers entering and
+//  leaving do not contend
+//
+
+#define AVF_MAX_POLICY_READERS      (AVF_MAX_WORKERS + 1)      // And the shadow thread
+
+typedef struct DECLSPEC_CACHEALIGN _AVF_POLICY_READER {
+    volatile LONG64 Epoch;         // Epoch entered at, or 0 when not reading
+} AVF_POLICY_READER, *PAVF_POLICY_READER;
+
+static AVF_POLICY_READER gPolicyReaders[AVF_MAX_POLICY_READERS];
+static volatile LONG gPolicyReaderCount = 0;
+static volatile LONG64 gPolicyEpoch = 1;
+
+//
+//  The published policy
+//
+
+static PAVF_USER_POLICY volatile gUserPolicy = NULL;
+static PAVF_USER_POLICY volatile gShadowPolicy = NULL;
+
+//
+//  Policy sources, in command line order
+//
+
+static PAVF_POLICY_SOURCE gPolicySources = NULL;
+static ULONG gPolicySourceCount = 0;
+static ULONG gPolicySourceCapacity = 0;
+static ULONG gShadowSourceCount = 0;
+static BOOLEAN gAddingShadowSources = FALSE;
+
+//
+//  Function prototypes
+//
+
+VOID
+WaitForPolicyReaders(
+    VOID
+    );
+
+BOOL
+GetSourceWriteTime(
+    _In_ PAVF_POLICY_SOURCE Source,
+    _Out_ PFILETIME LastWriteTime
+    );
+
+BOOLEAN
+HavePolicySourcesChanged(
+    _In_ BOOLEAN Shadow
+    );
+
+
+BOOL
+AddPolicySource(
+    _In_ AVF_POLICY_SOURCE_TYPE Type,
+    _In_ PCWSTR Path,
+    _In_ BOOLEAN Audit
+    )
+/*++
+
+Routine Description:
+
+    Adds a source of protected files.  Sources are read in the order they
+    were added each time the user policy is built.  After
+    BeginShadowSources, they are the candidate policy's.
+
+Arguments:
+
+    Type - What the source is.
+    Path - Path of the file, list file or bundle.  Must stay valid for the
+           life of the process (it comes from the command line).
+    Audit - The files of a file or list file source are audited.
+
+Return Value:
+
+    TRUE if the source was added, FALSE if out of memory.
+
+--*/
+{
+    PAVF_POLICY_SOURCE newSources;
+    ULONG newCapacity;
+
+    if (gPolicySourceCount == gPolicySourceCapacity) {
+
+        newCapacity = (gPolicySourceCapacity == 0) ? 16 : gPolicySourceCapacity * 2;
+
+        if (gPolicySources == NULL) {
+            newSources = HeapAlloc(GetProcessHeap(), 0, newCapacity * sizeof(AVF_POLICY_SOURCE));
+        } else {
+            newSources = HeapReAlloc(GetProcessHeap(), 0, gPolicySources, newCapacity * sizeof(AVF_POLICY_SOURCE));
+        }
+
+        if (newSources == NULL) {
+            wprintf(L"WARNING: Out of memory adding %s\n", Path);
+            return FALSE;
+        }
+
+        gPolicySources = newSources;
+        gPolicySourceCapacity = newCapacity;
+    }
+
+    gPolicySources[gPolicySourceCount].Type = Type;
+    gPolicySources[gPolicySourceCount].Path = Path;
+    gPolicySources[gPolicySourceCount].Audit = Audit;
+    gPolicySources[gPolicySourceCount].Shadow = gAddingShadowSources;
+    gPolicySources[gPolicySourceCount].LastWriteTime.dwLowDateTime = 0;
+    gPolicySources[gPolicySourceCount].LastWriteTime.dwHighDateTime = 0;
+    gPolicySourceCount++;
+
+    if (gAddingShadowSources) {
+        gShadowSourceCount++;
+    }
+
+    return TRUE;
+}
+
+
+VOID
+BeginShadowSources(
+    VOID
+    )
+/*++
+
+Routine Description:
+
+    Makes the sources added from now on the candidate policy's (-shadow).
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    gAddingShadowSources = TRUE;
+}
+
+
+BOOL
+GetSourceWriteTime(
+    _In_ PAVF_POLICY_SOURCE Source,
+    _Out_ PFILETIME LastWriteTime
+    )
+/*++
+
+Routine Description:
+
+    Gets the last write time of a list file, bundle or rules source.
+
+Arguments:
+
+    Source - The source.
+    LastWriteTime - Receives the last write time, or zero if the source
+                    cannot be read.
+
+Return Value:
+
+    TRUE if the source is watched for changes, FALSE for a plain file
+    source.
+
+--*/
+{
+    WIN32_FILE_ATTRIBUTE_DATA data;
+
+    LastWriteTime->dwLowDateTime = 0;
+    LastWriteTime->dwHighDateTime = 0;
+
+    if (Source->Type == PolicySourceFile) {
+        return FALSE;
+    }
+
+    if (GetFileAttributesExW(Source->Path, GetFileExInfoStandard, &data)) {
+        *LastWriteTime = data.ftLastWriteTime;
+    }
+
+    return TRUE;
+}
+
+
+ULONG
+LoadProtectedFiles(
+    _In_ BOOLEAN Shadow,
+    _In_ BOOLEAN Verbose
+    )
+/*++
+
+Routine Description:
+
+    Adds the files of every file and list file source of the active or
+    candidate policy to the protected files list being built.
+
+Arguments:
+
+    Shadow - Add the candidate policy's files.
+    Verbose - Print each source as it is added.
+
+Return Value:
+
+    Number of files added.
+
+--*/
+{
+    ULONG added = 0;
+    ULONG count;
+    ULONG i;
+
+    for (i = 0; i < gPolicySourceCount; i++) {
+
+        if (gPolicySources[i].Shadow != Shadow) {
+            continue;
+        }
+
+        switch (gPolicySources[i].Type) {
+
+        case PolicySourceFile:
+
+            if (AddProtectedFile(gPolicySources[i].Path, gPolicySources[i].Audit)) {
+                added++;
+                if (Verbose) {
+                    wprintf(L"%s: %s\n",
+                            gPolicySources[i].Audit ? L"Auditing" : L"Monitoring",
+                            gPolicySources[i].Path);
+                }
+            }
+            break;
+
+        case PolicySourceList:
+
+            count = LoadProtectedFileList(gPolicySources[i].Path, gPolicySources[i].Audit);
+            added += count;
+            if (Verbose) {
+                wprintf(L"%s %lu file(s) from %s\n",
+                        gPolicySources[i].Audit ? L"Auditing" : L"Monitoring",
+                        count,
+                        gPolicySources[i].Path);
+            }
+            break;
+
+        default:
+            break;
+        }
+    }
+
+    return added;
+}
+
+
+PAVF_USER_POLICY
+BuildUserPolicy(
+    _In_ BOOLEAN Shadow,
+    _In_ BOOLEAN Verbose
+    )
+/*++
+
+Routine Description:
+
+    Builds a user policy from the policy sources.  This is the slow part
+    of a reload (paths are converted and file IDs resolved), and runs
+    while the workers keep using the published policy.
+
+Arguments:
+
+    Shadow - Build the candidate policy, from the sources after -shadow.
+    Verbose - Print each source as it is added.
+
+Return Value:
+
+    The user policy, or NULL if it could not be built.
+
+--*/
+{
+    PAVF_USER_POLICY policy;
+    PCWSTR bundlePath = NULL;
+    PCWSTR rulesPath = NULL;
+    ULONG fileSources = 0;
+    ULONG i;
+
+    //
+    //  Note the source times first, so that a change made while we build
+    //  is picked up by the next check
+    //
+
+    for (i = 0; i < gPolicySourceCount; i++) {
+
+        if (gPolicySources[i].Shadow != Shadow) {
+            continue;
+        }
+
+        GetSourceWriteTime(&gPolicySources[i], &gPolicySources[i].LastWriteTime);
+
+        if (gPolicySources[i].Type == PolicySourceBundle) {
+            bundlePath = gPolicySources[i].Path;
+        }
+
+        if (gPolicySources[i].Type == PolicySourceRules) {
+
+            if (rulesPath != NULL) {
+                wprintf(L"ERROR: Only one rules file can be given\n");
+                return NULL;
+            }
+
+            rulesPath = gPolicySources[i].Path;
+
+        } else {
+            fileSources++;
+        }
+    }
+
+    if (bundlePath != NULL && fileSources > 1) {
+        wprintf(L"ERROR: Files cannot be given together with a policy bundle\n");
+        return NULL;
+    }
+
+    policy = HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, sizeof(AVF_USER_POLICY));
+    if (policy == NULL) {
+        wprintf(L"ERROR: Out of memory building policy\n");
+        return NULL;
+    }
+
+    if (rulesPath != NULL) {
+
+        policy->Rules = CompileRules(rulesPath, Shadow);
+        if (policy->Rules == NULL) {
+            HeapFree(GetProcessHeap(), 0, policy);
+            return NULL;
+        }
+
+        if (Verbose) {
+            wprintf(L"Rules: %lu from %s\n", GetRuleCount(policy->Rules), rulesPath);
+        }
+    }
+
+    if (bundlePath != NULL) {
+
+        if (!LoadPolicyBundle(bundlePath, policy)) {
+            FreeRules(policy->Rules);
+            HeapFree(GetProcessHeap(), 0, policy);
+            return NULL;
+        }
+
+        if (Verbose) {
+            wprintf(L"Policy bundle: %s\n", bundlePath);
+        }
+
+        return policy;
+    }
+
+    LoadProtectedFiles(Shadow, Verbose);
+
+    policy->FilterPolicy = BuildFilterPolicy();
+
+    //
+    //  The policy takes over the list that was built, which also frees it
+    //  if the filter policy could not be built
+    //
+
+    policy->Files = gProtectedFiles;
+    policy->FileCount = gProtectedFileCount;
+    policy->FileIds = gProtectedIds;
+    policy->FileIdCount = gProtectedIdCount;
+    policy->MonitorAll = (gProtectedFileCount == 0);
+
+    gProtectedFiles = NULL;
+    gProtectedFileCount = 0;
+    gProtectedFileCapacity = 0;
+    gProtectedIds = NULL;
+    gProtectedIdCount = 0;
+
+    if (policy->FilterPolicy == NULL || !BuildAuditSet(policy)) {
+        FreeUserPolicy(policy);
+        return NULL;
+    }
+
+    return policy;
+}
+
+
+VOID
+FreeUserPolicy(
+    _In_ PAVF_USER_POLICY Policy
+    )
+/*++
+
+Routine Description:
+
+    Frees a user policy that no worker can be reading.
+
+Arguments:
+
+    Policy - The user policy.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    ULONG i;
+
+    FreeRules(Policy->Rules);
+
+    if (Policy->Bundle != NULL) {
+
+        //
+        //  Everything lies in the mapping
+        //
+
+        UnmapViewOfFile(Policy->Bundle);
+
+    } else {
+
+        for (i = 0; i < Policy->FileCount; i++) {
+            HeapFree(GetProcessHeap(), 0, Policy->Files[i].Path);
+        }
+
+        if (Policy->Files != NULL) {
+            HeapFree(GetProcessHeap(), 0, Policy->Files);
+        }
+
+        if (Policy->FileIds != NULL) {
+            HeapFree(GetProcessHeap(), 0, Policy->FileIds);
+        }
+
+        if (Policy->AuditIds != NULL) {
+            HeapFree(GetProcessHeap(), 0, Policy->AuditIds);
+        }
+
+        if (Policy->FilterPolicy != NULL) {
+            HeapFree(GetProcessHeap(), 0, Policy->FilterPolicy);
+        }
+    }
+
+    HeapFree(GetProcessHeap(), 0, Policy);
+}
+
+
+ULONG
+RegisterPolicyReader(
+    VOID
+    )
+/*++
+
+Routine Description:
+
+    Gives the calling worker thread its reader slot.  Called once by each
+    worker before it reads the policy.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    The reader slot, for AcquireUserPolicy and ReleaseUserPolicy.
+
+--*/
+{
+    return (ULONG)InterlockedIncrement(&gPolicyReaderCount) - 1;
+}
+
+
+PAVF_USER_POLICY
+AcquireUserPolicy(
+    _In_ ULONG Reader
+    )
+/*++
+
+Routine Description:
+
+    Returns the published policy.  It stays valid until the caller calls
+    ReleaseUserPolicy.  Takes no lock: the interlocked exchange orders the
+    announcement in our own slot before the read of the policy pointer.
+
+Arguments:
+
+    Reader - The caller's reader slot.
+
+Return Value:
+
+    The published policy.
+
+--*/
+{
+    InterlockedExchange64(&gPolicyReaders[Reader].Epoch, gPolicyEpoch);
+    return gUserPolicy;
+}
+
+
+PAVF_USER_POLICY
+AcquireShadowPolicy(
+    _In_ ULONG Reader
+    )
+/*++
+
+Routine Description:
+
+    Returns the published candidate policy, as AcquireUserPolicy does the
+    active one.  Released with ReleaseUserPolicy.
+
+Arguments:
+
+    Reader - The caller's reader slot.
+
+Return Value:
+
+    The published candidate policy, or NULL if there is none.
+
+--*/
+{
+    InterlockedExchange64(&gPolicyReaders[Reader].Epoch, gPolicyEpoch);
+    return gShadowPolicy;
+}
+
+
+VOID
+ReleaseUserPolicy(
+    _In_ ULONG Reader
+    )
+/*++
+
+Routine Description:
+
+    Ends the caller's use of the policy returned by AcquireUserPolicy.
+
+Arguments:
+
+    Reader - The caller's reader slot.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    InterlockedExchange64(&gPolicyReaders[Reader].Epoch, 0);
+}
+
+
+VOID
+WaitForPolicyReaders(
+    VOID
+    )
+/*++
+
+Routine Description:
+
+    Waits out the grace period after the policy pointer was swapped: until
+    no worker can still be reading the policy it replaced.  A worker that
+    entered before the swap shows an older epoch until it leaves.  Workers
+    only hold the policy for a lookup, so this is short, and it never
+    makes a worker wait.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    LONG64 epoch;
+    LONG64 readerEpoch;
+    LONG count;
+    LONG i;
+
+    epoch = InterlockedIncrement64(&gPolicyEpoch);
+    count = gPolicyReaderCount;
+
+    for (i = 0; i < count; i++) {
+
+        for (;;) {
+
+            readerEpoch = gPolicyReaders[i].Epoch;
+
+            if (readerEpoch == 0 || readerEpoch >= epoch) {
+                break;
+            }
+
+            SwitchToThread();
+        }
+    }
+}
+
+
+BOOL
+PublishUserPolicy(
+    _In_ PAVF_USER_POLICY Policy
+    )
+/*++
+
+Routine Description:
+
+    Makes a user policy current for the workers and the filter, and frees
+    the one it replaces.  Called by one thread at a time.
+
+    The workers switch first and the filter second.  Any notification the
+    new filter policy produces is then judged against the new user policy;
+    one still in flight from the old filter policy is judged against a
+    user policy that either protects the file too or has dropped it on
+    purpose.  There is no point at which a protected file is unprotected,
+    and the filter never loses its client.
+
+Arguments:
+
+    Policy - The user policy to publish.  Freed if it cannot be published.
+
+Return Value:
+
+    TRUE if the policy was published, FALSE if the filter rejected it (the
+    previous policy stays current).
+
+--*/
+{
+    PAVF_USER_POLICY oldPolicy;
+
+    oldPolicy = InterlockedExchangePointer((PVOID volatile *)&gUserPolicy, Policy);
+
+    if (!SendFilterPolicy(Policy)) {
+
+        InterlockedExchangePointer((PVOID volatile *)&gUserPolicy, oldPolicy);
+        WaitForPolicyReaders();
+        FreeUserPolicy(Policy);
+        return FALSE;
+    }
+
+    WaitForPolicyReaders();
+
+    if (oldPolicy != NULL) {
+        FreeUserPolicy(oldPolicy);
+    }
+
+    return TRUE;
+}
+
+
+VOID
+PublishShadowPolicy(
+    _In_ PAVF_USER_POLICY Policy
+    )
+/*++
+
+Routine Description:
+
+    Makes a candidate policy current for the shadow thread, and frees the
+    one it replaces.  Called by one thread at a time.
+
+Arguments:
+
+    Policy - The candidate policy to publish.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    PAVF_USER_POLICY oldPolicy;
+
+    oldPolicy = InterlockedExchangePointer((PVOID volatile *)&gShadowPolicy, Policy);
+
+    if (oldPolicy != NULL) {
+        WaitForPolicyReaders();
+        FreeUserPolicy(oldPolicy);
+    }
+}
+
+
+VOID
+UnpublishUserPolicy(
+    VOID
+    )
+/*++
+
+Routine Description:
+
+    Frees the published policy, and the candidate policy, at shutdown.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    PAVF_USER_POLICY oldPolicy;
+
+    oldPolicy = InterlockedExchangePointer((PVOID volatile *)&gUserPolicy, NULL);
+
+    if (oldPolicy != NULL) {
+        WaitForPolicyReaders();
+        FreeUserPolicy(oldPolicy);
+    }
+
+    PublishShadowPolicy(NULL);
+}
+
+
+VOID
+ReloadPolicyIfChanged(
+    _In_ BOOLEAN Force
+    )
+/*++
+
+Routine Description:
+
+    Builds and publishes a new policy if a list file, bundle or rules
+    source has changed since the last build, and a new candidate policy
+    if one of its sources has.  If a new policy cannot be built or is
+    rejected, the current one stays in place.
+
+Arguments:
+
+    Force - Reload even if no source changed.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    PAVF_USER_POLICY policy;
+    ULONGLONG start;
+
+    if (Force || HavePolicySourcesChanged(FALSE)) {
+
+        wprintf(L"\nReloading policy...\n");
+        start = GetTickCount64();
+
+        policy = BuildUserPolicy(FALSE, FALSE);
+
+        if (policy == NULL) {
+            wprintf(L"WARNING: Policy reload failed, keeping the current policy\n");
+        } else if (PublishUserPolicy(policy)) {
+            wprintf(L"Policy reloaded in %llu ms\n\n", GetTickCount64() - start);
+        } else {
+            wprintf(L"WARNING: Policy reload rejected, keeping the current policy\n");
+        }
+    }
+
+    if (gShadowSourceCount != 0 && (Force || HavePolicySourcesChanged(TRUE))) {
+
+        wprintf(L"\nReloading shadow policy...\n");
+        start = GetTickCount64();
+
+        policy = BuildUserPolicy(TRUE, FALSE);
+
+        if (policy == NULL) {
+            wprintf(L"WARNING: Shadow policy reload failed, keeping the current one\n");
+        } else {
+            PublishShadowPolicy(policy);
+            wprintf(L"Shadow policy reloaded in %llu ms\n\n", GetTickCount64() - start);
+        }
+    }
+}
+
+
+BOOLEAN
+HavePolicySourcesChanged(
+    _In_ BOOLEAN Shadow
+    )
+/*++
+
+Routine Description:
+
+    Checks whether a watched source of the active or candidate policy has
+    changed since the policy was last built.
+
+Arguments:
+
+    Shadow - Check the candidate policy's sources.
+
+Return Value:
+
+    TRUE if a source has changed.
+
+--*/
+{
+    FILETIME lastWriteTime;
+    ULONG i;
+
+    for (i = 0; i < gPolicySourceCount; i++) {
+
+        if (gPolicySources[i].Shadow == Shadow &&
+            GetSourceWriteTime(&gPolicySources[i], &lastWriteTime) &&
+            CompareFileTime(&lastWriteTime, &gPolicySources[i].LastWriteTime) != 0) {
+
+            return TRUE;
+        }
+    }
+
+    return FALSE;
+}
@@ -0,0 +1,356 @@
+/*++
+
+Copyright (c) 1989-2002  Microsoft Corporation
+Modified for AV Filter functionality
+
+Module Name:
+
+    avfRing.c
+
+Abstract:
+
+    Shared memory ring transport for the security consultant.  After the
+    pipe handshake, a consultant speaking protocol version 3 is offered a
+    ring (avfRing.h); if it accepts, requests go in ring slots and wait
+    there for the responses instead of serializing on the pipe.  The ring
+    is synchronous, so avfConsultant.c runs its queries on the thread pool
+    and posts their completions to the engine.
+
+    The pipe stays connected while the ring is in use; a query waiting on
+    a slot checks it now and then to notice a consultant that went away.
+
+Environment:
+
+    User mode
+
+--*/
+
+#include <windows.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "avfUser.h"
+#include "avfRing.h"
+
+#define AVF_RING_LIVENESS_MS        500     // How often a waiter checks the pipe
+
+C_ASSERT(sizeof(AVF_CONSULTANT_REQUEST) <= AVF_RING_REQUEST_BYTES);
+C_ASSERT(sizeof(AVF_CONSULTANT_RESPONSE) <= AVF_RING_RESPONSE_BYTES);
+
+typedef struct _AVF_RING_CHANNEL {
+    HANDLE Pipe;                           // Owned by avfConsultant.c
+    HANDLE Section;
+    PAVF_RING Ring;
+    HANDLE RequestEvent;
+    HANDLE SlotEvents[AVF_RING_SLOT_COUNT];
+    volatile LONG Cancelled;
+} AVF_RING_CHANNEL, *PAVF_RING_CHANNEL;
+
+//
+//  Function prototypes
+//
+
+BOOL
+QueryRingTransport(
+    _In_ PVOID Context,
+    _In_reads_bytes_(RequestSize) const AVF_CONSULTANT_REQUEST *Request,
+    _In_ ULONG RequestSize,
+    _Out_ PAVF_CONSULTANT_RESPONSE Response
+    );
+
+VOID
+CancelRingTransport(
+    _In_ PVOID Context
+    );
+
+VOID
+CloseRingTransport(
+    _In_ PVOID Context
+    );
+
+const AVF_CONSULTANT_TRANSPORT gRingTransport = {
+    L"shared memory ring",
+    QueryRingTransport,
+    NULL,
+    NULL,
+    CancelRingTransport,
+    CloseRingTransport
+};
+
+
+PVOID
+OfferRingTransport(
+    _In_ HANDLE Pipe,
+    _In_ ULONG Version
+    )
+/*++
+
+Routine Description:
+
+    Creates a ring and its events and offers them to the consultant over
+    the pipe.
+
+Arguments:
+
+    Pipe - Connected consultant pipe, after the handshake.
+    Version - Protocol version agreed in the handshake.
+
+Return Value:
+
+    The ring transport context if the consultant accepted the ring, NULL
+    if it declined or the ring could not be set up; the pipe is then still
+    usable.
+
+--*/
+{
+    static volatile LONG offerCount = 0;
+    PAVF_RING_CHANNEL channel;
+    AVF_CONSULTANT_REQUEST request;
+    AVF_CONSULTANT_RESPONSE response;
+    WCHAR baseName[AVF_MAX_PATH];
+    WCHAR eventName[AVF_MAX_PATH];
+    DWORD bytesRead;
+    ULONG i;
+
+    if (Version < 3) {
+        return NULL;
+    }
+
+    channel = HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, sizeof(AVF_RING_CHANNEL));
+    if (channel == NULL) {
+        return NULL;
+    }
+
+    channel->Pipe = Pipe;
+
+    swprintf_s(baseName,
+               AVF_MAX_PATH,
+               L"Local\\AvfConsultantRing.%lu.%ld",
+               GetCurrentProcessId(),
+               InterlockedIncrement(&offerCount));
+
+    //
+    //  Refuse names someone else created first
+    //
+
+    channel->Section = CreateFileMappingW(INVALID_HANDLE_VALUE,
+                                          NULL,
+                                          PAGE_READWRITE,
+                                          0,
+                                          sizeof(AVF_RING),
+                                          baseName);
+
+    if (channel->Section == NULL || GetLastError() == ERROR_ALREADY_EXISTS) {
+        goto Error;
+    }
+
+    channel->Ring = MapViewOfFile(channel->Section, FILE_MAP_ALL_ACCESS, 0, 0, sizeof(AVF_RING));
+    if (channel->Ring == NULL) {
+        goto Error;
+    }
+
+    AvfRingInitialize(channel->Ring);
+
+    swprintf_s(eventName, AVF_MAX_PATH, L"%s.Request", baseName);
+    channel->RequestEvent = CreateEventW(NULL, FALSE, FALSE, eventName);
+
+    if (channel->RequestEvent == NULL || GetLastError() == ERROR_ALREADY_EXISTS) {
+        goto Error;
+    }
+
+    for (i = 0; i < AVF_RING_SLOT_COUNT; i++) {
+
+        swprintf_s(eventName, AVF_MAX_PATH, L"%s.Slot%lu", baseName, i);
+        channel->SlotEvents[i] = CreateEventW(NULL, FALSE, FALSE, eventName);
+
+        if (channel->SlotEvents[i] == NULL || GetLastError() == ERROR_ALREADY_EXISTS) {
+            goto Error;
+        }
+    }
+
+    //
+    //  Offer it
+    //
+
+    RtlZeroMemory(&request, sizeof(request));
+    request.Version = Version;
+    request.RequestId = 0;
+    request.ProcessId = GetCurrentProcessId();
+    request.Operation = AVF_CONSULTANT_OP_RING_OFFER;
+    wcscpy_s(request.ProcessName, AVF_MAX_PROCESS_NAME, L"AVF_RING_OFFER");
+    wcscpy_s(request.FileName, AVF_MAX_PATH, baseName);
+
+    if (!TransactConsultantPipe(Pipe, &request, sizeof(request), &response, sizeof(response), &bytesRead) ||
+        bytesRead < sizeof(response) ||
+        response.Version != Version ||
+        response.RequestId != 0 ||
+        response.Decision != AVF_DECISION_ALLOW) {
+
+        goto Error;
+    }
+
+    return channel;
+
+Error:
+
+    CloseRingTransport(channel);
+    return NULL;
+}
+
+
+BOOL
+QueryRingTransport(
+    _In_ PVOID Context,
+    _In_reads_bytes_(RequestSize) const AVF_CONSULTANT_REQUEST *Request,
+    _In_ ULONG RequestSize,
+    _Out_ PAVF_CONSULTANT_RESPONSE Response
+    )
+/*++
+
+Routine Description:
+
+    Puts a request in a ring slot and waits there for its response.  Any
+    number of threads may call this at once.
+
+Arguments:
+
+    Context - The ring channel.
+    Request - Request to send.
+    RequestSize - Size of the request for the agreed protocol version.
+    Response - Receives the consultant's response.
+
+Return Value:
+
+    TRUE if a response arrived, FALSE if the ring was cancelled, the
+    consultant went away or did not answer in AVF_CONSULTANT_TIMEOUT_MS.
+    A slot given up on is never freed; the caller disconnects.
+
+--*/
+{
+    PAVF_RING_CHANNEL channel = Context;
+    PAVF_RING_SLOT slot;
+    HANDLE slotEvent;
+    ULONGLONG start;
+    uint64_t position;
+    BOOL result;
+
+    if (RequestSize > AVF_RING_REQUEST_BYTES) {
+        return FALSE;
+    }
+
+    //
+    //  Every slot is only busy if the consultant stopped taking requests
+    //
+
+    while ((slot = AvfRingClaim(channel->Ring, &position)) == NULL) {
+
+        if (channel->Cancelled) {
+            return FALSE;
+        }
+
+        SwitchToThread();
+    }
+
+    RtlCopyMemory(slot->Request, Request, RequestSize);
+    slot->RequestSize = RequestSize;
+    slot->ResponseSize = 0;
+
+    AvfRingSubmit(channel->Ring, slot, position, channel->RequestEvent);
+
+    slotEvent = channel->SlotEvents[position & (AVF_RING_SLOT_COUNT - 1)];
+    start = GetTickCount64();
+
+    while (!AvfRingWaitForResponse(slot, position, slotEvent, AVF_RING_LIVENESS_MS)) {
+
+        if (channel->Cancelled ||
+            GetTickCount64() - start >= AVF_CONSULTANT_TIMEOUT_MS ||
+            !PeekNamedPipe(channel->Pipe, NULL, 0, NULL, NULL, NULL)) {
+
+            return FALSE;
+        }
+    }
+
+    result = (slot->ResponseSize >= sizeof(*Response));
+
+    if (result) {
+        RtlCopyMemory(Response, slot->Response, sizeof(*Response));
+    }
+
+    AvfRingRelease(slot, position);
+    return result;
+}
+
+
+VOID
+CancelRingTransport(
+    _In_ PVOID Context
+    )
+/*++
+
+Routine Description:
+
+    Makes queries waiting on the ring, and any that follow, fail.
+
+Arguments:
+
+    Context - The ring channel.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    PAVF_RING_CHANNEL channel = Context;
+    ULONG i;
+
+    InterlockedExchange(&channel->Cancelled, 1);
+
+    for (i = 0; i < AVF_RING_SLOT_COUNT; i++) {
+        SetEvent(channel->SlotEvents[i]);
+    }
+}
+
+
+VOID
+CloseRingTransport(
+    _In_ PVOID Context
+    )
+/*++
+
+Routine Description:
+
+    Unmaps a ring and closes its events.  No query may be in flight.
+
+Arguments:
+
+    Context - The ring channel, possibly partly set up.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    PAVF_RING_CHANNEL channel = Context;
+    ULONG i;
+
+    for (i = 0; i < AVF_RING_SLOT_COUNT; i++) {
+        if (channel->SlotEvents[i] != NULL) {
+            CloseHandle(channel->SlotEvents[i]);
+        }
+    }
+
+    if (channel->RequestEvent != NULL) {
+        CloseHandle(channel->RequestEvent);
+    }
+
+    if (channel->Ring != NULL) {
+        UnmapViewOfFile(channel->Ring);
+    }
+
+    if (channel->Section != NULL) {
+        CloseHandle(channel->Section);
+    }
+
+    HeapFree(GetProcessHeap(), 0, channel);
+}
@@ -0,0 +1,2364 @@
+/*++
+
+Copyright (c) 1989-2002  Microsoft Corporation
+Modified for AV Filter functionality
+
+Module Name:
+
+    avfRules.c
+
+Abstract:
+
+    Local rules (-rules): access to protected files decided in the engine
+    worker from a rules file, without asking the security consultant.
+
+    A rules file holds one rule per line; blank lines and lines starting
+    with '#' are skipped.  A rule is an action followed by conditions,
+    all of which must hold, and the first rule that matches decides:
+
+        # Only backup.exe may write to the backups
+        allow  path C:\Backups\** image backup.exe
+        block  path C:\Backups\** access write
+        audit  path *.docx,*.xlsx op write signer !*
+        block  path C:\Payroll\** days sat,sun
+        default ask
+
+    Actions: allow, block, audit (allow now, then ask the consultant, as
+    -audit does) and ask (ask the consultant).  "default <action>" says
+    what happens when no rule matches; the default is ask.
+
+    Conditions, each "<name> <value>[,<value>...]" matching if any value
+    does, and negated by a '!' before the values.  Values with blanks or
+    commas are quoted.
+
+        path     A file name pattern (*.docx) matches the last component
+                 of the file's path.  A Win32 path (C:\..., \\server\...)
+                 is converted to its NT path; any other pattern with a
+                 backslash (**\Secret\*) is matched against the NT path.
+                 '?' and '*' do not match a backslash, '**' does.
+        image    The same, against the process's image
+        signer   The subject of the image's Authenticode signature, as a
+                 pattern: * is any signed image, !* an unsigned one.  Only
+                 embedded signatures are checked; an image signed through
+                 a catalog counts as unsigned.
+        op       open, read or write
+        access   read, write, execute, delete or a mask.  An open matches
+                 if it asks for any of that access (write includes the
+                 overwriting dispositions); a read or write operation
+                 matches read or write.
+        time     HH:MM-HH:MM, local time; it may span midnight
+        days     sun, mon, ... sat, or a range such as mon-fri
+
+    Rules only see the accesses the filter reports: those to protected
+    files, or every access if none are given.
+
+    The rules are compiled when the policy is built, into a program for
+    each operation.  The op conditions, and the access ones of reads and
+    writes, are settled while compiling, so that a program only holds
+    the rules that can match its operation and only the tests that are
+    left.  A test that fails jumps to the next rule, past the rules that
+    start with the same test and into those that start with its opposite,
+    so rules sharing a path are tested once.  A worker runs its
+    notification's program without locking and without a round trip.
+
+    A verdict that depended on a time or days condition is sent with
+    AVF_VERDICT_FLAG_NO_CACHE, as it may not hold later.
+
+    Verifying an image's signature reads the whole image, so it is not
+    done on a worker: the first test of a process's signer starts it on
+    the thread pool and the decision is deferred (RuleActionDefer).  The
+    engine decides again once the signer is known (ImageSignerResolved).
+
+Environment:
+
+    User mode
+
+--*/
+
+#include <windows.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <wctype.h>
+#include <wincrypt.h>
+#include <wintrust.h>
+#include <softpub.h>
+#include "avfUser.h"
+
+#define AVF_RULES_MAX_LINE          1024
+#define AVF_RULES_MAX_TESTS         16      // Conditions in a rule
+#define AVF_RULES_MAX_VALUES        64      // Values in a condition
+#define AVF_RULES_MAX_SIGNER        128
+#define AVF_SIGNER_CACHE_SIZE       256     // Power of two
+#define AVF_SIGNER_PROBES           4       // Slots a process key may go in
+
+//
+//  The programs, by operation
+//
+
+#define AVF_RULES_PROGRAM_OPEN      0
+#define AVF_RULES_PROGRAM_READ      1
+#define AVF_RULES_PROGRAM_WRITE     2
+#define AVF_RULES_PROGRAM_COUNT     3
+
+#define AVF_RULES_ALL_PROGRAMS      ((1 << AVF_RULES_PROGRAM_COUNT) - 1)
+
+//
+//  Access named in access conditions.  Generic and maximum access may be
+//  any of them.
+//
+
+#define AVF_RULES_ANY_ACCESS        (GENERIC_ALL | MAXIMUM_ALLOWED)
+#define AVF_RULES_READ_ACCESS       (FILE_READ_DATA | GENERIC_READ | AVF_RULES_ANY_ACCESS)
+#define AVF_RULES_WRITE_ACCESS      (FILE_WRITE_DATA | FILE_APPEND_DATA | FILE_WRITE_EA | \
+                                     FILE_WRITE_ATTRIBUTES | WRITE_DAC | WRITE_OWNER | \
+                                     GENERIC_WRITE | AVF_RULES_ANY_ACCESS)
+#define AVF_RULES_EXECUTE_ACCESS    (FILE_EXECUTE | GENERIC_EXECUTE | AVF_RULES_ANY_ACCESS)
+#define AVF_RULES_DELETE_ACCESS     (DELETE | AVF_RULES_ANY_ACCESS)
+
+#define AVF_RULES_WRITE_DISPOSITIONS (AVF_DISPOSITION_SUPERSEDE | \
+                                      AVF_DISPOSITION_OVERWRITE | \
+                                      AVF_DISPOSITION_OVERWRITE_IF)
+
+typedef enum _AVF_RULE_OPCODE {
+    RuleOpDecide,                  // Operand: AVF_RULE_ACTION; Operand2: line
+    RuleOpPath,                    // Operand, Count: patterns
+    RuleOpImage,                   // Operand, Count: patterns
+    RuleOpSigner,                  // Operand, Count: patterns
+    RuleOpAccess,                  // Operand: access; Operand2: AVF_DISPOSITION_*
+    RuleOpTime,                    // Operand to Operand2: minutes into the day
+    RuleOpDays                     // Operand: 1 << day of the week
+} AVF_RULE_OPCODE;
+
+//
+//  A test, or the decision that ends a rule
+//
+
+typedef struct _AVF_RULE_INSTRUCTION {
+    UCHAR Opcode;                  // AVF_RULE_OPCODE
+    BOOLEAN Negate;
+    USHORT Count;
+    ULONG Operand;
+    ULONG Operand2;
+    ULONG Next;                    // Where to go if the test fails
+} AVF_RULE_INSTRUCTION, *PAVF_RULE_INSTRUCTION;
+
+typedef struct _AVF_RULE_PATTERN {
+    PWSTR Text;                    // Upper-case
+    BOOLEAN Name;                  // Matched against the last component
+} AVF_RULE_PATTERN, *PAVF_RULE_PATTERN;
+
+struct _AVF_RULES {
+    ULONG Programs[AVF_RULES_PROGRAM_COUNT];   // Where each starts in Code
+    PAVF_RULE_INSTRUCTION Code;
+    ULONG CodeCount;
+    ULONG CodeCapacity;
+    PAVF_RULE_PATTERN Patterns;
+    ULONG PatternCount;
+    ULONG PatternCapacity;
+    ULONG RuleCount;
+    BOOLEAN Shadow;                // A candidate policy's; not counted
+};
+
+//
+//  A rule as parsed, before it is compiled into the programs
+//
+
+typedef struct _AVF_PARSED_RULE {
+    ULONG Line;
+    AVF_RULE_ACTION Action;
+    ULONG Programs;                // 1 << AVF_RULES_PROGRAM_* it may match
+    ULONG TestCount;
+    AVF_RULE_INSTRUCTION Tests[AVF_RULES_MAX_TESTS];
+} AVF_PARSED_RULE, *PAVF_PARSED_RULE;
+
+//
+//  What a notification's tests look at, found when first needed
+//
+
+typedef struct _AVF_RULE_CONTEXT {
+    PAVF_FILE_NOTIFICATION Notification;
+    BOOLEAN HavePath;
+    BOOLEAN HaveImage;
+    BOOLEAN HaveSigner;
+    BOOLEAN HaveTime;
+    BOOLEAN Signed;
+    BOOLEAN Deferred;              // The signer is being verified
+    PCWSTR PathName;               // Last component of Path
+    PCWSTR ImageName;              // Last component of Image
+    ULONG Minute;                  // Into the day, local time
+    ULONG Day;                     // 1 << day of the week
+    WCHAR Path[AVF_MAX_PATH];
+    WCHAR Image[AVF_MAX_PROCESS_NAME];
+    WCHAR Signer[AVF_RULES_MAX_SIGNER];
+} AVF_RULE_CONTEXT, *PAVF_RULE_CONTEXT;
+
+//
+//  Signers of the images of the processes seen, by process key.  An
+//  entry being verified is not reused until it is done.
+//
+
+typedef struct _AVF_SIGNER_ENTRY {
+    ULONG ProcessKey;              // 0 if unused
+    BOOLEAN Resolving;             // Verified on the thread pool
+    BOOLEAN Signed;
+    WCHAR Signer[AVF_RULES_MAX_SIGNER];    // Upper-case
+} AVF_SIGNER_ENTRY, *PAVF_SIGNER_ENTRY;
+
+//
+//  What the thread pool verifies
+//
+
+typedef struct _AVF_SIGNER_REQUEST {
+    ULONG ProcessKey;
+    WCHAR ProcessName[AVF_MAX_PROCESS_NAME];
+} AVF_SIGNER_REQUEST, *PAVF_SIGNER_REQUEST;
+
+AVF_SIGNER_ENTRY gSignerCache[AVF_SIGNER_CACHE_SIZE];
+SRWLOCK gSignerCacheLock = SRWLOCK_INIT;
+
+static const PCWSTR gRuleActionNames[] = { L"ask", L"allow", L"block", L"audit" };
+static const PCWSTR gDayNames[] = { L"sun", L"mon", L"tue", L"wed", L"thu", L"fri", L"sat" };
+
+volatile LONG64 gRulesEvaluated = 0;
+volatile LONG64 gRulesDecided[RuleActionCount];
+volatile LONG64 gRulesTicks = 0;           // QueryPerformanceCounter, evaluating
+volatile LONG64 gRulesDeferred = 0;        // Waiting for a signer
+
+//
+//  Self-test (-selftest): patterns and the texts they are to match or not,
+//  and programs with the jumps LinkRuleProgram is to give their tests.
+//  A program's rules are also run both ways for every outcome of their
+//  tests, linked and one rule after the other, to the same decision.
+//
+
+#define AVF_LINK_TEST_MAX_CODE      12
+
+#define AVF_TEST_PATH(_set, _next)          { RuleOpPath, FALSE, 1, (_set), 0, (_next) }
+#define AVF_TEST_NOT_PATH(_set, _next)      { RuleOpPath, TRUE, 1, (_set), 0, (_next) }
+#define AVF_TEST_IMAGE(_set, _next)         { RuleOpImage, FALSE, 1, (_set), 0, (_next) }
+#define AVF_TEST_DAYS(_days, _next)         { RuleOpDays, FALSE, 0, (_days), 0, (_next) }
+#define AVF_TEST_DECIDE(_action, _line)     { RuleOpDecide, FALSE, 0, (_action), (_line), 0 }
+
+//
+//  A 512 character path of one letter directories, on which matching by
+//  trying every place for each star would take hours
+//
+
+#define AVF_TEST_DIRS_32    L"A\\A\\A\\A\\A\\A\\A\\A\\A\\A\\A\\A\\A\\A\\A\\A\\"
+#define AVF_TEST_DIRS_128   AVF_TEST_DIRS_32 AVF_TEST_DIRS_32 AVF_TEST_DIRS_32 AVF_TEST_DIRS_32
+#define AVF_TEST_DIRS_512   AVF_TEST_DIRS_128 AVF_TEST_DIRS_128 AVF_TEST_DIRS_128 AVF_TEST_DIRS_128
+
+typedef struct _AVF_GLOB_TEST {
+    PCWSTR Pattern;
+    PCWSTR Text;
+    BOOLEAN Match;
+} AVF_GLOB_TEST;
+
+typedef struct _AVF_LINK_TEST {
+    PCWSTR Name;
+    ULONG CodeCount;
+    AVF_RULE_INSTRUCTION Code[AVF_LINK_TEST_MAX_CODE];     // Next is the jump expected
+} AVF_LINK_TEST;
+
+static const AVF_GLOB_TEST gGlobTests[] = {
+    { L"*.DOCX",                    L"REPORT.DOCX",                         TRUE },
+    { L"*.DOCX",                    L"REPORT.DOC",                          FALSE },
+    { L"*.DOCX",                    L"A\\REPORT.DOCX",                      FALSE },
+    { L"C?T",                       L"CAT",                                 TRUE },
+    { L"C?T",                       L"CT",                                  FALSE },
+    { L"C?T",                       L"C\\T",                                FALSE },
+    { L"*",                         L"",                                    TRUE },
+    { L"*",                         L"\\",                                  FALSE },
+    { L"**",                        L"",                                    TRUE },
+    { L"**",                        L"\\A\\B",                              TRUE },
+    { L"A**",                       L"A",                                   TRUE },
+    { L"A**B",                      L"A\\X\\Y\\B",                          TRUE },
+    { L"A*B",                       L"A\\B",                                FALSE },
+    { L"***",                       L"A\\B",                                TRUE },
+    { L"**.EXE",                    L"\\X\\Y.EXE",                          TRUE },
+    { L"**\\*.TMP",                 L"\\A\\B.TMP",                          TRUE },
+    { L"**\\*.TMP",                 L"B.TMP",                               FALSE },
+    { L"**\\SECRET\\*",             L"\\DEVICE\\V1\\X\\SECRET\\A.TXT",      TRUE },
+    { L"**\\SECRET\\*",             L"\\DEVICE\\V1\\SECRET\\SUB\\A.TXT",    FALSE },
+    { L"\\DEVICE\\V1\\BACKUPS\\**", L"\\DEVICE\\V1\\BACKUPS\\A\\B\\C.BAK",  TRUE },
+    { L"\\DEVICE\\V1\\BACKUPS\\**", L"\\DEVICE\\V1\\BACKUPS\\",             TRUE },
+    { L"\\DEVICE\\V1\\BACKUPS\\**", L"\\DEVICE\\V1\\BACKUPS",               FALSE },
+    { L"\\DEVICE\\V1\\BACKUPS\\**", L"\\DEVICE\\V1\\BACKUPSX\\A",           FALSE },
+    { L"*A*A*A*",                   L"AAA",                                 TRUE },
+    { L"*A*A*A*",                   L"AABBB",                               FALSE },
+    { L"**A**A**",                  L"\\A\\\\A\\",                          TRUE },
+    { L"**A**A**A**B",              AVF_TEST_DIRS_512,                      FALSE },
+    { L"**A**A**A**A\\",            AVF_TEST_DIRS_512,                      TRUE },
+    { L"*A*A*A*B",                  AVF_TEST_DIRS_512,                      FALSE }
+};
+
+static const AVF_LINK_TEST gLinkTests[] = {
+
+    //
+    //  allow path A image X / block path A image Y / block path B
+    //
+
+    { L"shared first test", 9, {
+        AVF_TEST_PATH(0, 6),                //  0: known to fail again at 3
+        AVF_TEST_IMAGE(1, 3),               //  1
+        AVF_TEST_DECIDE(RuleActionAllow, 1),
+        AVF_TEST_PATH(0, 6),                //  3
+        AVF_TEST_IMAGE(2, 6),               //  4
+        AVF_TEST_DECIDE(RuleActionBlock, 2),
+        AVF_TEST_PATH(3, 8),                //  6
+        AVF_TEST_DECIDE(RuleActionBlock, 3),
+        AVF_TEST_DECIDE(RuleActionConsult, 9) } },
+
+    //
+    //  allow path A / block !path A image X / ask image X
+    //
+
+    { L"opposite test", 8, {
+        AVF_TEST_PATH(0, 3),                //  0: known to hold at 2
+        AVF_TEST_DECIDE(RuleActionAllow, 1),
+        AVF_TEST_NOT_PATH(0, 5),            //  2
+        AVF_TEST_IMAGE(1, 7),               //  3: known to fail again at 5
+        AVF_TEST_DECIDE(RuleActionBlock, 2),
+        AVF_TEST_IMAGE(1, 7),               //  5
+        AVF_TEST_DECIDE(RuleActionConsult, 3),
+        AVF_TEST_DECIDE(RuleActionAllow, 9) } },
+
+    //
+    //  allow path A days X / block path A / block path A image Y
+    //
+
+    { L"chain of the same test", 9, {
+        AVF_TEST_PATH(0, 8),                //  0: fails again at 3 and 5
+        AVF_TEST_DAYS(0x41, 3),             //  1
+        AVF_TEST_DECIDE(RuleActionAllow, 1),
+        AVF_TEST_PATH(0, 8),                //  3: fails again at 5
+        AVF_TEST_DECIDE(RuleActionBlock, 2),
+        AVF_TEST_PATH(0, 8),                //  5
+        AVF_TEST_IMAGE(1, 8),               //  6
+        AVF_TEST_DECIDE(RuleActionBlock, 3),
+        AVF_TEST_DECIDE(RuleActionConsult, 9) } },
+
+    //
+    //  allow path A / block path B: other patterns are another test
+    //
+
+    { L"different operands", 5, {
+        AVF_TEST_PATH(0, 2),                //  0
+        AVF_TEST_DECIDE(RuleActionAllow, 1),
+        AVF_TEST_PATH(1, 4),                //  2
+        AVF_TEST_DECIDE(RuleActionBlock, 2),
+        AVF_TEST_DECIDE(RuleActionConsult, 9) } },
+
+    //
+    //  allow !path A / block !path A image X
+    //
+
+    { L"negated test", 6, {
+        AVF_TEST_NOT_PATH(0, 5),            //  0: fails again at 2
+        AVF_TEST_DECIDE(RuleActionAllow, 1),
+        AVF_TEST_NOT_PATH(0, 5),            //  2
+        AVF_TEST_IMAGE(1, 5),               //  3
+        AVF_TEST_DECIDE(RuleActionBlock, 2),
+        AVF_TEST_DECIDE(RuleActionConsult, 9) } },
+
+    //
+    //  allow path A image X / block !path A / ask image X
+    //
+
+    { L"opposite test past a shared one", 8, {
+        AVF_TEST_PATH(0, 4),                //  0: known to hold at 3
+        AVF_TEST_IMAGE(1, 3),               //  1
+        AVF_TEST_DECIDE(RuleActionAllow, 1),
+        AVF_TEST_NOT_PATH(0, 5),            //  3
+        AVF_TEST_DECIDE(RuleActionBlock, 2),
+        AVF_TEST_IMAGE(1, 7),               //  5
+        AVF_TEST_DECIDE(RuleActionConsult, 3),
+        AVF_TEST_DECIDE(RuleActionAllow, 9) } }
+};
+
+//
+//  Function prototypes
+//
+
+BOOL
+ParseRule(
+    _Inout_ PAVF_RULES Rules,
+    _In_ PCWSTR Path,
+    _In_ ULONG Line,
+    _In_ PWSTR Text,
+    _Out_ PAVF_PARSED_RULE Rule,
+    _Inout_ AVF_RULE_ACTION *DefaultAction
+    );
+
+BOOL
+ParseCondition(
+    _Inout_ PAVF_RULES Rules,
+    _In_ PCWSTR Name,
+    _In_ BOOLEAN Negate,
+    _In_reads_(ValueCount) PWSTR *Values,
+    _In_ ULONG ValueCount,
+    _Inout_ PAVF_PARSED_RULE Rule,
+    _Outptr_result_maybenull_ PCWSTR *Error
+    );
+
+PWSTR
+NextRuleWord(
+    _Inout_ PWSTR *Cursor,
+    _Out_writes_(AVF_RULES_MAX_VALUES) PWSTR *Values,
+    _Out_ PULONG ValueCount
+    );
+
+BOOL
+AddRulePatterns(
+    _Inout_ PAVF_RULES Rules,
+    _In_ AVF_RULE_OPCODE Opcode,
+    _In_reads_(ValueCount) PWSTR *Values,
+    _In_ ULONG ValueCount,
+    _Out_ PULONG First
+    );
+
+BOOL
+EmitRuleInstruction(
+    _Inout_ PAVF_RULES Rules,
+    _In_ const AVF_RULE_INSTRUCTION *Instruction
+    );
+
+BOOL
+CompileRulePrograms(
+    _Inout_ PAVF_RULES Rules,
+    _In_reads_(RuleCount) PAVF_PARSED_RULE ParsedRules,
+    _In_ ULONG RuleCount,
+    _In_ AVF_RULE_ACTION DefaultAction
+    );
+
+VOID
+LinkRuleProgram(
+    _Inout_ PAVF_RULES Rules,
+    _In_ ULONG Start
+    );
+
+BOOLEAN
+TestRule(
+    _In_ const AVF_RULES *Rules,
+    _In_ const AVF_RULE_INSTRUCTION *Instruction,
+    _Inout_ PAVF_RULE_CONTEXT Context,
+    _Inout_ PBOOLEAN Timed
+    );
+
+BOOLEAN
+MatchRulePatterns(
+    _In_ const AVF_RULES *Rules,
+    _In_ const AVF_RULE_INSTRUCTION *Instruction,
+    _In_ PCWSTR Text,
+    _In_ PCWSTR Name
+    );
+
+BOOLEAN
+MatchRuleGlob(
+    _In_ PCWSTR Pattern,
+    _In_ PCWSTR Text
+    );
+
+BOOLEAN
+GetImageSigner(
+    _In_ PAVF_FILE_NOTIFICATION pNotification,
+    _In_ BOOLEAN Wait,
+    _Out_writes_(AVF_RULES_MAX_SIGNER) PWCHAR Signer,
+    _Out_ PBOOLEAN Signed
+    );
+
+PAVF_SIGNER_ENTRY
+FindSignerEntry(
+    _In_ ULONG ProcessKey
+    );
+
+VOID
+StoreImageSigner(
+    _In_ ULONG ProcessKey,
+    _In_ BOOLEAN Signed,
+    _In_ PCWSTR Signer
+    );
+
+VOID CALLBACK
+ResolveSignerCallback(
+    _Inout_ PTP_CALLBACK_INSTANCE Instance,
+    _Inout_opt_ PVOID Context
+    );
+
+BOOLEAN
+VerifyImageSigner(
+    _In_ PCWSTR ProcessName,
+    _Out_writes_(AVF_RULES_MAX_SIGNER) PWCHAR Signer
+    );
+
+ULONG
+RunLinkTest(
+    _In_ const AVF_LINK_TEST *Test
+    );
+
+ULONG
+DecideLinkTest(
+    _In_ const AVF_RULE_INSTRUCTION *Code,
+    _In_ ULONG CodeCount,
+    _In_reads_(CodeCount) const ULONG *Variables,
+    _In_ ULONG Outcomes,
+    _In_ BOOLEAN Linked
+    );
+
+
+PAVF_RULES
+CompileRules(
+    _In_ PCWSTR Path,
+    _In_ BOOLEAN Shadow
+    )
+/*++
+
+Routine Description:
+
+    Reads a rules file and compiles it.
+
+Arguments:
+
+    Path - Path of the rules file.
+    Shadow - The rules are a candidate policy's (-shadow); their decisions
+             are left out of the rules' statistics.
+
+Return Value:
+
+    The compiled rules, or NULL if the file cannot be read or has an
+    error, which is printed.
+
+--*/
+{
+    PAVF_RULES rules;
+    PAVF_PARSED_RULE parsedRules = NULL;
+    PAVF_PARSED_RULE newRules;
+    ULONG capacity = 0;
+    ULONG count = 0;
+    AVF_RULE_ACTION defaultAction = RuleActionConsult;
+    WCHAR text[AVF_RULES_MAX_LINE];
+    ULONG line = 0;
+    FILE *file;
+    BOOL ok = TRUE;
+    PWSTR start;
+    size_t len;
+
+    if (_wfopen_s(&file, Path, L"rt, ccs=UTF-8") != 0) {
+        wprintf(L"ERROR: Failed to open rules file: %s\n", Path);
+        return NULL;
+    }
+
+    rules = HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, sizeof(AVF_RULES));
+    if (rules == NULL) {
+        wprintf(L"ERROR: Out of memory compiling rules\n");
+        fclose(file);
+        return NULL;
+    }
+
+    while (ok && fgetws(text, AVF_RULES_MAX_LINE, file) != NULL) {
+
+        line++;
+
+        len = wcslen(text);
+        while (len > 0 && (text[len - 1] == L'\n' || text[len - 1] == L'\r' ||
+                           text[len - 1] == L' ' || text[len - 1] == L'\t')) {
+            text[--len] = L'\0';
+        }
+
+        for (start = text; *start == L' ' || *start == L'\t'; start++);
+
+        if (*start == L'\0' || *start == L'#') {
+            continue;
+        }
+
+        if (count == capacity) {
+
+            capacity = (capacity == 0) ? 64 : capacity * 2;
+
+            if (parsedRules == NULL) {
+                newRules = HeapAlloc(GetProcessHeap(), 0, capacity * sizeof(AVF_PARSED_RULE));
+            } else {
+                newRules = HeapReAlloc(GetProcessHeap(), 0, parsedRules, capacity * sizeof(AVF_PARSED_RULE));
+            }
+
+            if (newRules == NULL) {
+                wprintf(L"ERROR: Out of memory compiling rules\n");
+                ok = FALSE;
+                break;
+            }
+
+            parsedRules = newRules;
+        }
+
+        ok = ParseRule(rules, Path, line, start, &parsedRules[count], &defaultAction);
+
+        //
+        //  "default" lines are not rules
+        //
+
+        if (ok && parsedRules[count].Line != 0) {
+            count++;
+        }
+    }
+
+    fclose(file);
+
+    if (ok) {
+        ok = CompileRulePrograms(rules, parsedRules, count, defaultAction);
+    }
+
+    if (parsedRules != NULL) {
+        HeapFree(GetProcessHeap(), 0, parsedRules);
+    }
+
+    if (!ok) {
+        FreeRules(rules);
+        return NULL;
+    }
+
+    rules->RuleCount = count;
+    rules->Shadow = Shadow;
+    return rules;
+}
+
+
+VOID
+FreeRules(
+    _In_opt_ PAVF_RULES Rules
+    )
+/*++
+
+Routine Description:
+
+    Frees compiled rules.
+
+Arguments:
+
+    Rules - The rules, or NULL.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    ULONG i;
+
+    if (Rules == NULL) {
+        return;
+    }
+
+    for (i = 0; i < Rules->PatternCount; i++) {
+        HeapFree(GetProcessHeap(), 0, Rules->Patterns[i].Text);
+    }
+
+    if (Rules->Patterns != NULL) {
+        HeapFree(GetProcessHeap(), 0, Rules->Patterns);
+    }
+
+    if (Rules->Code != NULL) {
+        HeapFree(GetProcessHeap(), 0, Rules->Code);
+    }
+
+    HeapFree(GetProcessHeap(), 0, Rules);
+}
+
+
+ULONG
+GetRuleCount(
+    _In_ const AVF_RULES *Rules
+    )
+/*++
+
+Routine Description:
+
+    Gets the number of rules compiled.
+
+Arguments:
+
+    Rules - The rules.
+
+Return Value:
+
+    The number of rules, not counting the default.
+
+--*/
+{
+    return Rules->RuleCount;
+}
+
+
+AVF_RULE_ACTION
+EvaluateRules(
+    _In_ const AVF_RULES *Rules,
+    _In_ PAVF_FILE_NOTIFICATION pNotification,
+    _Out_ PULONG Line,
+    _Out_ PBOOLEAN Timed
+    )
+/*++
+
+Routine Description:
+
+    Runs the program of a notification's operation.  The rules of the
+    candidate policy wait for a signer; those of the active policy defer
+    the decision instead.
+
+Arguments:
+
+    Rules - The rules.
+    pNotification - The notification.
+    Line - Receives the line of the rule that matched, or 0 for the
+           default.
+    Timed - Receives whether a time or days condition was tested, so that
+            the verdict may not hold later.
+
+Return Value:
+
+    What to do with the operation, or RuleActionDefer if a signer is
+    tested that is not known yet.
+
+--*/
+{
+    const AVF_RULE_INSTRUCTION *instruction;
+    AVF_RULE_CONTEXT context;
+    LARGE_INTEGER start;
+    LARGE_INTEGER end;
+    ULONG pc;
+
+    QueryPerformanceCounter(&start);
+
+    context.Notification = pNotification;
+    context.HavePath = FALSE;
+    context.HaveImage = FALSE;
+    context.HaveSigner = FALSE;
+    context.HaveTime = FALSE;
+    context.Deferred = FALSE;
+
+    *Timed = FALSE;
+
+    switch (pNotification->MajorFunction) {
+    case IRP_MJ_CREATE:
+        pc = Rules->Programs[AVF_RULES_PROGRAM_OPEN];
+        break;
+    case IRP_MJ_READ:
+        pc = Rules->Programs[AVF_RULES_PROGRAM_READ];
+        break;
+    case IRP_MJ_WRITE:
+        pc = Rules->Programs[AVF_RULES_PROGRAM_WRITE];
+        break;
+    default:
+        *Line = 0;
+        return RuleActionConsult;
+    }
+
+    for (;;) {
+
+        instruction = &Rules->Code[pc];
+
+        if (instruction->Opcode == RuleOpDecide) {
+            break;
+        }
+
+        if (TestRule(Rules, instruction, &context, Timed) != instruction->Negate) {
+            pc++;
+        } else {
+            pc = instruction->Next;
+        }
+
+        if (context.Deferred) {
+            InterlockedIncrement64(&gRulesDeferred);
+            *Line = 0;
+            return RuleActionDefer;
+        }
+    }
+
+    if (!Rules->Shadow) {
+
+        QueryPerformanceCounter(&end);
+
+        InterlockedIncrement64(&gRulesEvaluated);
+        InterlockedIncrement64(&gRulesDecided[instruction->Operand]);
+        InterlockedAdd64(&gRulesTicks, end.QuadPart - start.QuadPart);
+    }
+
+    *Line = instruction->Operand2;
+    return (AVF_RULE_ACTION)instruction->Operand;
+}
+
+
+BOOLEAN
+IsImageSignerPending(
+    _In_ ULONG ProcessKey
+    )
+/*++
+
+Routine Description:
+
+    Checks if the image of a process is being verified, so that an access
+    deferred for its signer waits for ImageSignerResolved.
+
+Arguments:
+
+    ProcessKey - The process's key.
+
+Return Value:
+
+    TRUE if it is being verified.
+
+--*/
+{
+    PAVF_SIGNER_ENTRY entry;
+    BOOLEAN pending;
+
+    AcquireSRWLockShared(&gSignerCacheLock);
+
+    entry = FindSignerEntry(ProcessKey);
+    pending = (entry != NULL && entry->Resolving);
+
+    ReleaseSRWLockShared(&gSignerCacheLock);
+
+    return pending;
+}
+
+
+VOID
+PrintRuleStatistics(
+    VOID
+    )
+/*++
+
+Routine Description:
+
+    Prints how the rules decided, and how fast.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    LARGE_INTEGER frequency;
+
+    if (gRulesEvaluated == 0) {
+        return;
+    }
+
+    QueryPerformanceFrequency(&frequency);
+
+    wprintf(L"  Decided by rules: %lld allowed, %lld blocked, %lld audited of %lld, %.2f us per decision\n",
+            gRulesDecided[RuleActionAllow],
+            gRulesDecided[RuleActionBlock],
+            gRulesDecided[RuleActionAudit],
+            gRulesEvaluated,
+            (double)gRulesTicks * 1000000.0 / (double)frequency.QuadPart / (double)gRulesEvaluated);
+
+    if (gRulesDeferred != 0) {
+        wprintf(L"  Deferred for a signer: %lld\n", gRulesDeferred);
+    }
+}
+
+
+BOOL
+SelfTestRules(
+    VOID
+    )
+/*++
+
+Routine Description:
+
+    Runs the pattern matcher and the linker of the rule programs over
+    their test tables (-selftest) and prints what failed.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    TRUE if every test passed.
+
+--*/
+{
+    ULONG failures = 0;
+    ULONG i;
+
+    for (i = 0; i < RTL_NUMBER_OF(gGlobTests); i++) {
+
+        if (MatchRuleGlob(gGlobTests[i].Pattern, gGlobTests[i].Text) != gGlobTests[i].Match) {
+
+            wprintf(L"FAILED: pattern \"%s\" %s \"%s\"\n",
+                    gGlobTests[i].Pattern,
+                    gGlobTests[i].Match ? L"does not match" : L"matches",
+                    gGlobTests[i].Text);
+
+            failures++;
+        }
+    }
+
+    for (i = 0; i < RTL_NUMBER_OF(gLinkTests); i++) {
+        failures += RunLinkTest(&gLinkTests[i]);
+    }
+
+    wprintf(L"Rules self-test: %lu pattern(s), %lu program(s), %lu failure(s)\n",
+            (ULONG)RTL_NUMBER_OF(gGlobTests),
+            (ULONG)RTL_NUMBER_OF(gLinkTests),
+            failures);
+
+    return failures == 0;
+}
+
+
+BOOL
+ParseRule(
+    _Inout_ PAVF_RULES Rules,
+    _In_ PCWSTR Path,
+    _In_ ULONG Line,
+    _In_ PWSTR Text,
+    _Out_ PAVF_PARSED_RULE Rule,
+    _Inout_ AVF_RULE_ACTION *DefaultAction
+    )
+/*++
+
+Routine Description:
+
+    Parses a line of a rules file.
+
+Arguments:
+
+    Rules - The rules being compiled; the rule's patterns are added.
+    Path - Path of the rules file, for errors.
+    Line - Line number, for errors.
+    Text - The line, without leading blanks; taken apart.
+    Rule - Receives the rule.  Its Line is 0 for a "default" line.
+    DefaultAction - Set by a "default" line.
+
+Return Value:
+
+    TRUE, or FALSE if the line has an error, which is printed.
+
+--*/
+{
+    PWSTR values[AVF_RULES_MAX_VALUES];
+    ULONG valueCount;
+    PCWSTR error = NULL;
+    BOOLEAN isDefault = FALSE;
+    BOOLEAN negate;
+    PWSTR cursor = Text;
+    PWSTR word;
+    ULONG action;
+
+    RtlZeroMemory(Rule, FIELD_OFFSET(AVF_PARSED_RULE, Tests));
+    Rule->Programs = AVF_RULES_ALL_PROGRAMS;
+
+    word = NextRuleWord(&cursor, values, &valueCount);
+
+    if (_wcsicmp(word, L"default") == 0) {
+        isDefault = TRUE;
+        word = NextRuleWord(&cursor, values, &valueCount);
+    }
+
+    for (action = 0; action < RuleActionCount; action++) {
+        if (_wcsicmp(word, gRuleActionNames[action]) == 0) {
+            break;
+        }
+    }
+
+    if (action == RuleActionCount) {
+        error = L"expected allow, block, audit, ask or default";
+        goto Done;
+    }
+
+    if (isDefault) {
+
+        *DefaultAction = (AVF_RULE_ACTION)action;
+
+        if (*NextRuleWord(&cursor, values, &valueCount) != L'\0') {
+            error = L"a default takes no conditions";
+        }
+
+        goto Done;
+    }
+
+    Rule->Line = Line;
+    Rule->Action = (AVF_RULE_ACTION)action;
+
+    //
+    //  Conditions
+    //
+
+    for (;;) {
+
+        word = NextRuleWord(&cursor, values, &valueCount);
+
+        if (*word == L'\0') {
+            break;
+        }
+
+        NextRuleWord(&cursor, values, &valueCount);
+
+        negate = (valueCount > 0 && values[0][0] == L'!');
+        if (negate) {
+            values[0]++;
+        }
+
+        if (valueCount == 0 || values[0][0] == L'\0') {
+            error = L"a condition needs a value";
+            break;
+        }
+
+        if (!ParseCondition(Rules, word, negate, values, valueCount, Rule, &error)) {
+            break;
+        }
+    }
+
+Done:
+
+    if (error != NULL) {
+        wprintf(L"ERROR: %s(%lu): %s\n", Path, Line, error);
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+
+BOOL
+ParseCondition(
+    _Inout_ PAVF_RULES Rules,
+    _In_ PCWSTR Name,
+    _In_ BOOLEAN Negate,
+    _In_reads_(ValueCount) PWSTR *Values,
+    _In_ ULONG ValueCount,
+    _Inout_ PAVF_PARSED_RULE Rule,
+    _Outptr_result_maybenull_ PCWSTR *Error
+    )
+/*++
+
+Routine Description:
+
+    Adds a condition to a rule being parsed.
+
+Arguments:
+
+    Rules - The rules being compiled.
+    Name - The condition's name.
+    Negate - The values were preceded by '!'.
+    Values - The values.
+    ValueCount - Number of values, at least 1.
+    Rule - The rule.
+    Error - Receives what is wrong with the condition.
+
+Return Value:
+
+    TRUE, or FALSE with Error set.
+
+--*/
+{
+    AVF_RULE_INSTRUCTION test;
+    ULONG programs = 0;
+    ULONG first;
+    ULONG from[2];
+    ULONG to[2];
+    ULONG day;
+    ULONG last;
+    ULONG i;
+    PWSTR dash;
+
+    *Error = NULL;
+
+    RtlZeroMemory(&test, sizeof(test));
+    test.Negate = Negate;
+
+    if (_wcsicmp(Name, L"op") == 0) {
+
+        //
+        //  Settled while compiling
+        //
+
+        for (i = 0; i < ValueCount; i++) {
+
+            if (_wcsicmp(Values[i], L"open") == 0 || _wcsicmp(Values[i], L"create") == 0) {
+                programs |= 1 << AVF_RULES_PROGRAM_OPEN;
+            } else if (_wcsicmp(Values[i], L"read") == 0) {
+                programs |= 1 << AVF_RULES_PROGRAM_READ;
+            } else if (_wcsicmp(Values[i], L"write") == 0) {
+                programs |= 1 << AVF_RULES_PROGRAM_WRITE;
+            } else {
+                *Error = L"expected open, read or write";
+                return FALSE;
+            }
+        }
+
+        Rule->Programs &= Negate ? ~programs : programs;
+        return TRUE;
+    }
+
+    if (Rule->TestCount == AVF_RULES_MAX_TESTS) {
+        *Error = L"too many conditions";
+        return FALSE;
+    }
+
+    if (_wcsicmp(Name, L"path") == 0 ||
+        _wcsicmp(Name, L"image") == 0 ||
+        _wcsicmp(Name, L"signer") == 0) {
+
+        test.Opcode = (UCHAR)((_wcsicmp(Name, L"path") == 0) ? RuleOpPath :
+                              (_wcsicmp(Name, L"image") == 0) ? RuleOpImage : RuleOpSigner);
+
+        if (!AddRulePatterns(Rules, test.Opcode, Values, ValueCount, &first)) {
+            *Error = L"a path cannot be converted, or out of memory";
+            return FALSE;
+        }
+
+        test.Operand = first;
+        test.Count = (USHORT)ValueCount;
+
+    } else if (_wcsicmp(Name, L"access") == 0) {
+
+        test.Opcode = RuleOpAccess;
+
+        for (i = 0; i < ValueCount; i++) {
+
+            if (_wcsicmp(Values[i], L"read") == 0) {
+                test.Operand |= AVF_RULES_READ_ACCESS;
+            } else if (_wcsicmp(Values[i], L"write") == 0) {
+                test.Operand |= AVF_RULES_WRITE_ACCESS;
+                test.Operand2 |= AVF_RULES_WRITE_DISPOSITIONS;
+            } else if (_wcsicmp(Values[i], L"execute") == 0) {
+                test.Operand |= AVF_RULES_EXECUTE_ACCESS;
+            } else if (_wcsicmp(Values[i], L"delete") == 0) {
+                test.Operand |= AVF_RULES_DELETE_ACCESS;
+            } else if (iswdigit(Values[i][0])) {
+                test.Operand |= wcstoul(Values[i], NULL, 0);
+            } else {
+                *Error = L"expected read, write, execute, delete or a mask";
+                return FALSE;
+            }
+        }
+
+    } else if (_wcsicmp(Name, L"time") == 0) {
+
+        test.Opcode = RuleOpTime;
+
+        if (ValueCount != 1 ||
+            swscanf_s(Values[0], L"%lu:%lu-%lu:%lu", &from[0], &from[1], &to[0], &to[1]) != 4 ||
+            from[0] > 23 || from[1] > 59 || to[0] > 24 || to[1] > 59) {
+
+            *Error = L"expected HH:MM-HH:MM";
+            return FALSE;
+        }
+
+        test.Operand = from[0] * 60 + from[1];
+        test.Operand2 = to[0] * 60 + to[1];
+
+    } else if (_wcsicmp(Name, L"days") == 0) {
+
+        test.Opcode = RuleOpDays;
+
+        for (i = 0; i < ValueCount; i++) {
+
+            dash = wcschr(Values[i], L'-');
+            if (dash != NULL) {
+                *dash++ = L'\0';
+            }
+
+            for (day = 0; day < 7 && _wcsicmp(Values[i], gDayNames[day]) != 0; day++);
+            for (last = 0; last < 7 && _wcsicmp((dash != NULL) ? dash : Values[i], gDayNames[last]) != 0; last++);
+
+            if (day == 7 || last == 7) {
+                *Error = L"expected sun, mon, tue, wed, thu, fri or sat";
+                return FALSE;
+            }
+
+            for (;;) {
+                test.Operand |= 1 << day;
+                if (day == last) {
+                    break;
+                }
+                day = (day + 1) % 7;
+            }
+        }
+
+    } else {
+        *Error = L"expected path, image, signer, op, access, time or days";
+        return FALSE;
+    }
+
+    Rule->Tests[Rule->TestCount++] = test;
+    return TRUE;
+}
+
+
+PWSTR
+NextRuleWord(
+    _Inout_ PWSTR *Cursor,
+    _Out_writes_(AVF_RULES_MAX_VALUES) PWSTR *Values,
+    _Out_ PULONG ValueCount
+    )
+/*++
+
+Routine Description:
+
+    Takes the next word off a line, splitting it into its values at the
+    commas and removing the quotes.
+
+Arguments:
+
+    Cursor - Where the rest of the line starts; moved past the word.
+    Values - Receives the values, in place in the line.
+    ValueCount - Receives the number of values.
+
+Return Value:
+
+    The word, empty at the end of the line.
+
+--*/
+{
+    PWSTR word;
+    PWSTR in;
+    PWSTR out;
+    BOOLEAN quoted = FALSE;
+
+    for (in = *Cursor; *in == L' ' || *in == L'\t'; in++);
+
+    word = out = in;
+    Values[0] = out;
+    *ValueCount = (*in != L'\0') ? 1 : 0;
+
+    for (; *in != L'\0'; in++) {
+
+        if (*in == L'"') {
+            quoted = !quoted;
+        } else if (!quoted && (*in == L' ' || *in == L'\t')) {
+            in++;
+            break;
+        } else if (!quoted && *in == L',') {
+            *out++ = L'\0';
+            if (*ValueCount < AVF_RULES_MAX_VALUES) {
+                Values[(*ValueCount)++] = out;
+            }
+        } else {
+            *out++ = *in;
+        }
+    }
+
+    *out = L'\0';
+    *Cursor = in;
+
+    return word;
+}
+
+
+BOOL
+AddRulePatterns(
+    _Inout_ PAVF_RULES Rules,
+    _In_ AVF_RULE_OPCODE Opcode,
+    _In_reads_(ValueCount) PWSTR *Values,
+    _In_ ULONG ValueCount,
+    _Out_ PULONG First
+    )
+/*++
+
+Routine Description:
+
+    Adds the patterns of a path, image or signer condition, reusing those
+    of an earlier condition with the same ones so that their tests can be
+    told to be the same.
+
+Arguments:
+
+    Rules - The rules being compiled.
+    Opcode - What the patterns are matched against.
+    Values - The patterns as written.
+    ValueCount - Number of patterns.
+    First - Receives the index of the first pattern.
+
+Return Value:
+
+    TRUE, or FALSE if a path cannot be converted or memory ran out.
+
+--*/
+{
+    PAVF_RULE_PATTERN newPatterns;
+    PAVF_RULE_PATTERN pattern;
+    WCHAR text[AVF_MAX_PATH];
+    ULONG start = Rules->PatternCount;
+    ULONG newCapacity;
+    ULONG i;
+    size_t len;
+
+    for (i = 0; i < ValueCount; i++) {
+
+        if (Rules->PatternCount == Rules->PatternCapacity) {
+
+            newCapacity = (Rules->PatternCapacity == 0) ? 64 : Rules->PatternCapacity * 2;
+
+            if (Rules->Patterns == NULL) {
+                newPatterns = HeapAlloc(GetProcessHeap(), 0, newCapacity * sizeof(AVF_RULE_PATTERN));
+            } else {
+                newPatterns = HeapReAlloc(GetProcessHeap(), 0, Rules->Patterns, newCapacity * sizeof(AVF_RULE_PATTERN));
+            }
+
+            if (newPatterns == NULL) {
+                return FALSE;
+            }
+
+            Rules->Patterns = newPatterns;
+            Rules->PatternCapacity = newCapacity;
+        }
+
+        pattern = &Rules->Patterns[Rules->PatternCount];
+
+        //
+        //  Win32 paths become NT paths, which ConvertToNtPath upper-cases
+        //
+
+        if (Opcode != RuleOpSigner &&
+            ((iswalpha(Values[i][0]) && Values[i][1] == L':') ||
+             (Values[i][0] == L'\\' && Values[i][1] == L'\\'))) {
+
+            if (!ConvertToNtPath(Values[i], text, AVF_MAX_PATH, NULL)) {
+                wprintf(L"WARNING: Failed to convert path: %s\n", Values[i]);
+                return FALSE;
+            }
+
+        } else {
+            wcsncpy_s(text, AVF_MAX_PATH, Values[i], _TRUNCATE);
+            _wcsupr_s(text, AVF_MAX_PATH);
+        }
+
+        len = wcslen(text) + 1;
+
+        pattern->Name = (Opcode != RuleOpSigner && wcschr(text, L'\\') == NULL);
+        pattern->Text = HeapAlloc(GetProcessHeap(), 0, len * sizeof(WCHAR));
+
+        if (pattern->Text == NULL) {
+            return FALSE;
+        }
+
+        wcscpy_s(pattern->Text, len, text);
+        Rules->PatternCount++;
+    }
+
+    //
+    //  The same patterns as an earlier condition's are shared with it
+    //
+
+    for (*First = 0; *First + ValueCount <= start; (*First)++) {
+
+        for (i = 0; i < ValueCount; i++) {
+            if (Rules->Patterns[*First + i].Name != Rules->Patterns[start + i].Name ||
+                wcscmp(Rules->Patterns[*First + i].Text, Rules->Patterns[start + i].Text) != 0) {
+                break;
+            }
+        }
+
+        if (i == ValueCount) {
+
+            while (Rules->PatternCount > start) {
+                HeapFree(GetProcessHeap(), 0, Rules->Patterns[--Rules->PatternCount].Text);
+            }
+
+            return TRUE;
+        }
+    }
+
+    *First = start;
+    return TRUE;
+}
+
+
+BOOL
+EmitRuleInstruction(
+    _Inout_ PAVF_RULES Rules,
+    _In_ const AVF_RULE_INSTRUCTION *Instruction
+    )
+/*++
+
+Routine Description:
+
+    Appends an instruction to the code.
+
+Arguments:
+
+    Rules - The rules being compiled.
+    Instruction - The instruction.
+
+Return Value:
+
+    TRUE, or FALSE if out of memory.
+
+--*/
+{
+    PAVF_RULE_INSTRUCTION newCode;
+    ULONG newCapacity;
+
+    if (Rules->CodeCount == Rules->CodeCapacity) {
+
+        newCapacity = (Rules->CodeCapacity == 0) ? 256 : Rules->CodeCapacity * 2;
+
+        if (Rules->Code == NULL) {
+            newCode = HeapAlloc(GetProcessHeap(), 0, newCapacity * sizeof(AVF_RULE_INSTRUCTION));
+        } else {
+            newCode = HeapReAlloc(GetProcessHeap(), 0, Rules->Code, newCapacity * sizeof(AVF_RULE_INSTRUCTION));
+        }
+
+        if (newCode == NULL) {
+            wprintf(L"ERROR: Out of memory compiling rules\n");
+            return FALSE;
+        }
+
+        Rules->Code = newCode;
+        Rules->CodeCapacity = newCapacity;
+    }
+
+    Rules->Code[Rules->CodeCount++] = *Instruction;
+    return TRUE;
+}
+
+
+BOOL
+CompileRulePrograms(
+    _Inout_ PAVF_RULES Rules,
+    _In_reads_(RuleCount) PAVF_PARSED_RULE ParsedRules,
+    _In_ ULONG RuleCount,
+    _In_ AVF_RULE_ACTION DefaultAction
+    )
+/*++
+
+Routine Description:
+
+    Compiles the parsed rules into a program for each operation.
+
+    A rule that cannot match the operation is left out, as are the tests
+    of a rule that always hold for it; a rule whose tests all hold ends
+    the program.  The tests of a rule jump to the next rule when they fail
+    (LinkRuleProgram).
+
+Arguments:
+
+    Rules - The rules being compiled.
+    ParsedRules - The rules, in order.
+    RuleCount - Number of rules.
+    DefaultAction - What happens when no rule matches.
+
+Return Value:
+
+    TRUE, or FALSE if out of memory.
+
+--*/
+{
+    const AVF_RULE_INSTRUCTION *test;
+    AVF_RULE_INSTRUCTION decide;
+    ULONG operationAccess;
+    ULONG program;
+    ULONG start;
+    ULONG tests;
+    ULONG i;
+    ULONG j;
+    BOOLEAN holds;
+    BOOLEAN unconditional;
+
+    RtlZeroMemory(&decide, sizeof(decide));
+    decide.Opcode = RuleOpDecide;
+
+    for (program = 0; program < AVF_RULES_PROGRAM_COUNT; program++) {
+
+        Rules->Programs[program] = start = Rules->CodeCount;
+        unconditional = FALSE;
+
+        //
+        //  The access a read or write operation stands for
+        //
+
+        operationAccess = (program == AVF_RULES_PROGRAM_READ) ? FILE_READ_DATA :
+                          (program == AVF_RULES_PROGRAM_WRITE) ? FILE_WRITE_DATA : 0;
+
+        for (i = 0; i < RuleCount && !unconditional; i++) {
+
+            if (!FlagOn(ParsedRules[i].Programs, 1 << program)) {
+                continue;
+            }
+
+            tests = Rules->CodeCount;
+            holds = TRUE;
+
+            for (j = 0; j < ParsedRules[i].TestCount && holds; j++) {
+
+                test = &ParsedRules[i].Tests[j];
+
+                if (test->Opcode == RuleOpAccess && program != AVF_RULES_PROGRAM_OPEN) {
+                    holds = (FlagOn(test->Operand, operationAccess) != 0) != test->Negate;
+                    continue;
+                }
+
+                if (!EmitRuleInstruction(Rules, test)) {
+                    return FALSE;
+                }
+            }
+
+            if (!holds) {
+                Rules->CodeCount = tests;
+                continue;
+            }
+
+            unconditional = (Rules->CodeCount == tests);
+
+            decide.Operand = ParsedRules[i].Action;
+            decide.Operand2 = ParsedRules[i].Line;
+
+            if (!EmitRuleInstruction(Rules, &decide)) {
+                return FALSE;
+            }
+        }
+
+        if (!unconditional) {
+
+            decide.Operand = DefaultAction;
+            decide.Operand2 = 0;
+
+            if (!EmitRuleInstruction(Rules, &decide)) {
+                return FALSE;
+            }
+        }
+
+        LinkRuleProgram(Rules, start);
+    }
+
+    return TRUE;
+}
+
+
+VOID
+LinkRuleProgram(
+    _Inout_ PAVF_RULES Rules,
+    _In_ ULONG Start
+    )
+/*++
+
+Routine Description:
+
+    Sets where the tests of a program jump when they fail: to the next
+    rule, but past a test there that is known to fail as well, or that is
+    known to hold, since it is the same as the one that failed or its
+    opposite.
+
+    Done from the end, so that the jumps of the later tests are final by
+    the time an earlier test follows them.
+
+Arguments:
+
+    Rules - The rules being compiled.
+    Start - Where the program starts; it ends with the code.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    PAVF_RULE_INSTRUCTION code = Rules->Code;
+    ULONG nextRule = Rules->CodeCount;
+    ULONG target;
+    ULONG pc;
+
+    for (pc = Rules->CodeCount; pc-- > Start;) {
+
+        if (code[pc].Opcode == RuleOpDecide) {
+
+            //
+            //  The rule before this decision ends here
+            //
+
+            nextRule = pc + 1;
+            continue;
+        }
+
+        target = nextRule;
+
+        while (code[target].Opcode != RuleOpDecide &&
+               code[target].Opcode == code[pc].Opcode &&
+               code[target].Count == code[pc].Count &&
+               code[target].Operand == code[pc].Operand &&
+               code[target].Operand2 == code[pc].Operand2) {
+
+            target = (code[target].Negate == code[pc].Negate) ? code[target].Next : target + 1;
+        }
+
+        code[pc].Next = target;
+    }
+}
+
+
+BOOLEAN
+TestRule(
+    _In_ const AVF_RULES *Rules,
+    _In_ const AVF_RULE_INSTRUCTION *Instruction,
+    _Inout_ PAVF_RULE_CONTEXT Context,
+    _Inout_ PBOOLEAN Timed
+    )
+/*++
+
+Routine Description:
+
+    Runs a test, before its negation.
+
+Arguments:
+
+    Rules - The rules.
+    Instruction - The test.
+    Context - What the notification's tests look at.
+    Timed - Set if the test depends on the time.
+
+Return Value:
+
+    Whether the test holds.
+
+--*/
+{
+    PAVF_FILE_NOTIFICATION pNotification = Context->Notification;
+    SYSTEMTIME now;
+    PCWSTR separator;
+    ULONG disposition;
+
+    switch (Instruction->Opcode) {
+
+    case RuleOpPath:
+
+        if (!Context->HavePath) {
+            UpcaseFilePath(pNotification->FileName, Context->Path);
+            separator = wcsrchr(Context->Path, L'\\');
+            Context->PathName = (separator != NULL) ? separator + 1 : Context->Path;
+            Context->HavePath = TRUE;
+        }
+
+        return MatchRulePatterns(Rules, Instruction, Context->Path, Context->PathName);
+
+    case RuleOpImage:
+
+        if (!Context->HaveImage) {
+            wcsncpy_s(Context->Image, AVF_MAX_PROCESS_NAME, pNotification->ProcessName, _TRUNCATE);
+            _wcsupr_s(Context->Image, AVF_MAX_PROCESS_NAME);
+            separator = wcsrchr(Context->Image, L'\\');
+            Context->ImageName = (separator != NULL) ? separator + 1 : Context->Image;
+            Context->HaveImage = TRUE;
+        }
+
+        return MatchRulePatterns(Rules, Instruction, Context->Image, Context->ImageName);
+
+    case RuleOpSigner:
+
+        if (!Context->HaveSigner) {
+
+            if (!GetImageSigner(pNotification, Rules->Shadow, Context->Signer, &Context->Signed)) {
+                Context->Deferred = TRUE;
+                return FALSE;
+            }
+
+            Context->HaveSigner = TRUE;
+        }
+
+        return Context->Signed &&
+               MatchRulePatterns(Rules, Instruction, Context->Signer, Context->Signer);
+
+    case RuleOpAccess:
+
+        if (pNotification->MajorFunction != IRP_MJ_CREATE) {
+            return FALSE;
+        }
+
+        disposition = pNotification->CreateDisposition;
+
+        return FlagOn(pNotification->DesiredAccess, Instruction->Operand) != 0 ||
+               (disposition < 32 && FlagOn(Instruction->Operand2, 1 << disposition) != 0);
+
+    case RuleOpTime:
+    case RuleOpDays:
+
+        if (!Context->HaveTime) {
+            GetLocalTime(&now);
+            Context->Minute = now.wHour * 60 + now.wMinute;
+            Context->Day = 1 << now.wDayOfWeek;
+            Context->HaveTime = TRUE;
+        }
+
+        *Timed = TRUE;
+
+        if (Instruction->Opcode == RuleOpDays) {
+            return FlagOn(Context->Day, Instruction->Operand) != 0;
+        }
+
+        //
+        //  A window that ends before it starts spans midnight
+        //
+
+        if (Instruction->Operand <= Instruction->Operand2) {
+            return Context->Minute >= Instruction->Operand && Context->Minute < Instruction->Operand2;
+        }
+
+        return Context->Minute >= Instruction->Operand || Context->Minute < Instruction->Operand2;
+
+    default:
+        return FALSE;
+    }
+}
+
+
+BOOLEAN
+MatchRulePatterns(
+    _In_ const AVF_RULES *Rules,
+    _In_ const AVF_RULE_INSTRUCTION *Instruction,
+    _In_ PCWSTR Text,
+    _In_ PCWSTR Name
+    )
+/*++
+
+Routine Description:
+
+    Checks a path, image or signer against the patterns of a test.
+
+Arguments:
+
+    Rules - The rules.
+    Instruction - The test.
+    Text - Upper-case path, image or signer.
+    Name - Its last component.
+
+Return Value:
+
+    Whether any pattern matches.
+
+--*/
+{
+    const AVF_RULE_PATTERN *pattern = &Rules->Patterns[Instruction->Operand];
+    ULONG i;
+
+    for (i = 0; i < Instruction->Count; i++, pattern++) {
+
+        if (MatchRuleGlob(pattern->Text, pattern->Name ? Name : Text)) {
+            return TRUE;
+        }
+    }
+
+    return FALSE;
+}
+
+
+BOOLEAN
+MatchRuleGlob(
+    _In_ PCWSTR Pattern,
+    _In_ PCWSTR Text
+    )
+/*++
+
+Routine Description:
+
+    Matches a pattern: '?' is any character and '*' any characters but a
+    backslash, '**' any characters.
+
+    On a mismatch the last '*' takes one more character, and if it cannot
+    the last '**' does, and the pattern is matched again from there.  Only
+    the last of each has to be tried again: what comes before the last
+    '**' matched as early as it could, and so did what comes before the
+    last '*', in text that has no backslash for the '*' to take.  The
+    work is then at most the length of the pattern times that of the
+    text, whatever name the process opening the file chose.
+
+Arguments:
+
+    Pattern - The pattern.
+    Text - The text, of the same case.
+
+Return Value:
+
+    Whether the pattern matches the whole text.
+
+--*/
+{
+    PCWSTR starPattern = NULL;
+    PCWSTR starText = NULL;
+    PCWSTR crossPattern = NULL;
+    PCWSTR crossText = NULL;
+
+    for (;;) {
+
+        if (*Pattern == L'*') {
+
+            if (Pattern[1] == L'*') {
+
+                while (*Pattern == L'*') {
+                    Pattern++;
+                }
+
+                crossPattern = Pattern;
+                crossText = Text;
+                starPattern = NULL;
+
+            } else {
+
+                Pattern++;
+                starPattern = Pattern;
+                starText = Text;
+            }
+
+            continue;
+        }
+
+        if (*Text == L'\0') {
+
+            if (*Pattern == L'\0') {
+                return TRUE;
+            }
+
+        } else if (*Pattern == *Text || (*Pattern == L'?' && *Text != L'\\')) {
+
+            Pattern++;
+            Text++;
+            continue;
+        }
+
+        //
+        //  A mismatch
+        //
+
+        if (starPattern != NULL && *starText != L'\0' && *starText != L'\\') {
+
+            Pattern = starPattern;
+            Text = ++starText;
+
+        } else if (crossPattern != NULL && *crossText != L'\0') {
+
+            Pattern = crossPattern;
+            Text = ++crossText;
+            starPattern = NULL;
+
+        } else {
+
+            return FALSE;
+        }
+    }
+}
+
+
+BOOLEAN
+GetImageSigner(
+    _In_ PAVF_FILE_NOTIFICATION pNotification,
+    _In_ BOOLEAN Wait,
+    _Out_writes_(AVF_RULES_MAX_SIGNER) PWCHAR Signer,
+    _Out_ PBOOLEAN Signed
+    )
+/*++
+
+Routine Description:
+
+    Gets who signed the image of a notification's process.  The image is
+    verified once per process, on the thread pool, the first time one of
+    its accesses is tested for its signer; a process's image does not
+    change while it runs.
+
+Arguments:
+
+    pNotification - The notification.
+    Wait - Verify the image on this thread if its signer is not known,
+        rather than defer.
+    Signer - Receives the upper-case subject of the signer's certificate.
+    Signed - Receives whether the image has a valid embedded signature.
+
+Return Value:
+
+    TRUE if the signer is known, FALSE if it is being verified and the
+    decision is to be deferred.
+
+--*/
+{
+    PAVF_SIGNER_ENTRY entry;
+    PAVF_SIGNER_ENTRY slot;
+    PAVF_SIGNER_REQUEST request;
+    ULONG processKey = pNotification->ProcessKey;
+    BOOLEAN known;
+    ULONG i;
+
+    AcquireSRWLockShared(&gSignerCacheLock);
+
+    entry = FindSignerEntry(processKey);
+
+    if (entry != NULL && !entry->Resolving) {
+        *Signed = entry->Signed;
+        wcscpy_s(Signer, AVF_RULES_MAX_SIGNER, entry->Signer);
+        ReleaseSRWLockShared(&gSignerCacheLock);
+        return TRUE;
+    }
+
+    ReleaseSRWLockShared(&gSignerCacheLock);
+
+    //
+    //  Processes the filter did not know have no entry to wait on, and the
+    //  candidate policy's rules do not run on a worker
+    //
+
+    if (processKey == 0 || Wait) {
+        *Signed = VerifyImageSigner(pNotification->ProcessName, Signer);
+        return TRUE;
+    }
+
+    AcquireSRWLockExclusive(&gSignerCacheLock);
+
+    //
+    //  Another worker may have started verifying it, or finished, since
+    //
+
+    entry = FindSignerEntry(processKey);
+
+    if (entry != NULL) {
+
+        known = !entry->Resolving;
+
+        if (known) {
+            *Signed = entry->Signed;
+            wcscpy_s(Signer, AVF_RULES_MAX_SIGNER, entry->Signer);
+        }
+
+        ReleaseSRWLockExclusive(&gSignerCacheLock);
+        return known;
+    }
+
+    //
+    //  A free slot, or else the first one that is not being verified
+    //
+
+    entry = NULL;
+
+    for (i = 0; i < AVF_SIGNER_PROBES; i++) {
+
+        slot = &gSignerCache[(processKey + i) & (AVF_SIGNER_CACHE_SIZE - 1)];
+
+        if (slot->ProcessKey == 0) {
+            entry = slot;
+            break;
+        }
+
+        if (entry == NULL && !slot->Resolving) {
+            entry = slot;
+        }
+    }
+
+    if (entry == NULL) {
+        ReleaseSRWLockExclusive(&gSignerCacheLock);
+        *Signed = VerifyImageSigner(pNotification->ProcessName, Signer);
+        return TRUE;
+    }
+
+    entry->ProcessKey = processKey;
+    entry->Resolving = TRUE;
+    entry->Signed = FALSE;
+    entry->Signer[0] = L'\0';
+
+    ReleaseSRWLockExclusive(&gSignerCacheLock);
+
+    request = HeapAlloc(GetProcessHeap(), 0, sizeof(AVF_SIGNER_REQUEST));
+
+    if (request != NULL) {
+
+        request->ProcessKey = processKey;
+        wcscpy_s(request->ProcessName, AVF_MAX_PROCESS_NAME, pNotification->ProcessName);
+
+        if (TrySubmitThreadpoolCallback(ResolveSignerCallback, request, NULL)) {
+            return FALSE;
+        }
+
+        HeapFree(GetProcessHeap(), 0, request);
+    }
+
+    //
+    //  Verified here after all; other workers may have deferred on it
+    //  meanwhile
+    //
+
+    *Signed = VerifyImageSigner(pNotification->ProcessName, Signer);
+    StoreImageSigner(processKey, *Signed, Signer);
+
+    return TRUE;
+}
+
+
+PAVF_SIGNER_ENTRY
+FindSignerEntry(
+    _In_ ULONG ProcessKey
+    )
+/*++
+
+Routine Description:
+
+    Finds the signer cache entry of a process.  Called with
+    gSignerCacheLock held.
+
+Arguments:
+
+    ProcessKey - The process's key.
+
+Return Value:
+
+    The entry, or NULL if there is none.
+
+--*/
+{
+    PAVF_SIGNER_ENTRY entry;
+    ULONG i;
+
+    if (ProcessKey == 0) {
+        return NULL;
+    }
+
+    for (i = 0; i < AVF_SIGNER_PROBES; i++) {
+
+        entry = &gSignerCache[(ProcessKey + i) & (AVF_SIGNER_CACHE_SIZE - 1)];
+
+        if (entry->ProcessKey == ProcessKey) {
+            return entry;
+        }
+    }
+
+    return NULL;
+}
+
+
+VOID
+StoreImageSigner(
+    _In_ ULONG ProcessKey,
+    _In_ BOOLEAN Signed,
+    _In_ PCWSTR Signer
+    )
+/*++
+
+Routine Description:
+
+    Fills in the entry of a process whose image was verified, and has the
+    engine decide again on the accesses deferred for it.
+
+Arguments:
+
+    ProcessKey - The process's key.
+    Signed - Whether the image has a valid embedded signature.
+    Signer - The upper-case subject of the signer's certificate.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    PAVF_SIGNER_ENTRY entry;
+
+    AcquireSRWLockExclusive(&gSignerCacheLock);
+
+    //
+    //  An entry being verified is not taken, so it is still there
+    //
+
+    entry = FindSignerEntry(ProcessKey);
+
+    if (entry != NULL) {
+        entry->Signed = Signed;
+        wcscpy_s(entry->Signer, AVF_RULES_MAX_SIGNER, Signer);
+        entry->Resolving = FALSE;
+    }
+
+    ReleaseSRWLockExclusive(&gSignerCacheLock);
+
+    ImageSignerResolved(ProcessKey);
+}
+
+
+VOID CALLBACK
+ResolveSignerCallback(
+    _Inout_ PTP_CALLBACK_INSTANCE Instance,
+    _Inout_opt_ PVOID Context
+    )
+/*++
+
+Routine Description:
+
+    Thread pool callback that verifies a process's image.
+
+Arguments:
+
+    Instance - The callback instance.
+    Context - The AVF_SIGNER_REQUEST, freed here.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    PAVF_SIGNER_REQUEST request = Context;
+    WCHAR signer[AVF_RULES_MAX_SIGNER];
+    BOOLEAN isSigned;
+
+    //
+    //  WinVerifyTrust reads the whole image
+    //
+
+    CallbackMayRunLong(Instance);
+
+    isSigned = VerifyImageSigner(request->ProcessName, signer);
+    StoreImageSigner(request->ProcessKey, isSigned, signer);
+
+    HeapFree(GetProcessHeap(), 0, request);
+}
+
+
+BOOLEAN
+VerifyImageSigner(
+    _In_ PCWSTR ProcessName,
+    _Out_writes_(AVF_RULES_MAX_SIGNER) PWCHAR Signer
+    )
+/*++
+
+Routine Description:
+
+    Verifies the embedded signature of an image.
+
+Arguments:
+
+    ProcessName - The image's NT path.
+    Signer - Receives the upper-case subject of the signer's certificate.
+
+Return Value:
+
+    TRUE if the image has a valid embedded signature.
+
+--*/
+{
+    GUID action = WINTRUST_ACTION_GENERIC_VERIFY_V2;
+    WINTRUST_FILE_INFO fileInfo;
+    WINTRUST_DATA trustData;
+    CRYPT_PROVIDER_DATA *provider;
+    CRYPT_PROVIDER_SGNR *providerSigner;
+    CRYPT_PROVIDER_CERT *certificate;
+    WCHAR path[AVF_MAX_PROCESS_NAME + 16];
+    BOOLEAN isSigned = FALSE;
+
+    Signer[0] = L'\0';
+
+    //
+    //  The image is named by its NT path
+    //
+
+    swprintf_s(path, RTL_NUMBER_OF(path), L"\\\\?\\GLOBALROOT%s", ProcessName);
+
+    RtlZeroMemory(&fileInfo, sizeof(fileInfo));
+    fileInfo.cbStruct = sizeof(fileInfo);
+    fileInfo.pcwszFilePath = path;
+
+    RtlZeroMemory(&trustData, sizeof(trustData));
+    trustData.cbStruct = sizeof(trustData);
+    trustData.dwUIChoice = WTD_UI_NONE;
+    trustData.fdwRevocationChecks = WTD_REVOKE_NONE;
+    trustData.dwUnionChoice = WTD_CHOICE_FILE;
+    trustData.pFile = &fileInfo;
+    trustData.dwStateAction = WTD_STATEACTION_VERIFY;
+    trustData.dwProvFlags = WTD_CACHE_ONLY_URL_RETRIEVAL;
+
+    if (WinVerifyTrust(INVALID_HANDLE_VALUE, &action, &trustData) == ERROR_SUCCESS) {
+
+        provider = WTHelperProvDataFromStateData(trustData.hWVTStateData);
+        providerSigner = (provider != NULL) ? WTHelperGetProvSignerFromChain(provider, 0, FALSE, 0) : NULL;
+        certificate = (providerSigner != NULL) ? WTHelperGetProvCertFromChain(providerSigner, 0) : NULL;
+
+        if (certificate != NULL &&
+            CertGetNameStringW(certificate->pCert,
+                               CERT_NAME_SIMPLE_DISPLAY_TYPE,
+                               0,
+                               NULL,
+                               Signer,
+                               AVF_RULES_MAX_SIGNER) > 1) {
+
+            _wcsupr_s(Signer, AVF_RULES_MAX_SIGNER);
+            isSigned = TRUE;
+        }
+    }
+
+    trustData.dwStateAction = WTD_STATEACTION_CLOSE;
+    WinVerifyTrust(INVALID_HANDLE_VALUE, &action, &trustData);
+
+    return isSigned;
+}
+
+
+ULONG
+RunLinkTest(
+    _In_ const AVF_LINK_TEST *Test
+    )
+/*++
+
+Routine Description:
+
+    Links a test program, checks the jump of each of its tests, and runs
+    it for every outcome of its tests against the rules taken one after
+    the other.
+
+Arguments:
+
+    Test - The program, with the jumps expected.
+
+Return Value:
+
+    The number of failures.
+
+--*/
+{
+    AVF_RULE_INSTRUCTION code[AVF_LINK_TEST_MAX_CODE];
+    ULONG variables[AVF_LINK_TEST_MAX_CODE];
+    const AVF_RULE_INSTRUCTION *tests[AVF_LINK_TEST_MAX_CODE];
+    AVF_RULES rules;
+    ULONG testCount = 0;
+    ULONG failures = 0;
+    ULONG outcomes;
+    ULONG linked;
+    ULONG plain;
+    ULONG pc;
+    ULONG i;
+
+    RtlZeroMemory(&rules, sizeof(rules));
+    RtlCopyMemory(code, Test->Code, Test->CodeCount * sizeof(AVF_RULE_INSTRUCTION));
+
+    rules.Code = code;
+    rules.CodeCount = Test->CodeCount;
+
+    //
+    //  Tests that are the same, negated or not, are one variable
+    //
+
+    for (pc = 0; pc < Test->CodeCount; pc++) {
+
+        code[pc].Next = 0;
+
+        if (code[pc].Opcode == RuleOpDecide) {
+            continue;
+        }
+
+        for (i = 0; i < testCount; i++) {
+
+            if (tests[i]->Opcode == code[pc].Opcode &&
+                tests[i]->Count == code[pc].Count &&
+                tests[i]->Operand == code[pc].Operand &&
+                tests[i]->Operand2 == code[pc].Operand2) {
+
+                break;
+            }
+        }
+
+        if (i == testCount) {
+            tests[testCount++] = &Test->Code[pc];
+        }
+
+        variables[pc] = i;
+    }
+
+    LinkRuleProgram(&rules, 0);
+
+    for (pc = 0; pc < Test->CodeCount; pc++) {
+
+        if (code[pc].Opcode != RuleOpDecide && code[pc].Next != Test->Code[pc].Next) {
+
+            wprintf(L"FAILED: %s: the test at %lu jumps to %lu, not %lu\n",
+                    Test->Name,
+                    pc,
+                    code[pc].Next,
+                    Test->Code[pc].Next);
+
+            failures++;
+        }
+    }
+
+    for (outcomes = 0; outcomes < (1UL << testCount); outcomes++) {
+
+        linked = DecideLinkTest(code, Test->CodeCount, variables, outcomes, TRUE);
+        plain = DecideLinkTest(code, Test->CodeCount, variables, outcomes, FALSE);
+
+        if (linked != plain) {
+
+            wprintf(L"FAILED: %s: with outcomes 0x%lX the program decides by line %lu, the rules by line %lu\n",
+                    Test->Name,
+                    outcomes,
+                    linked,
+                    plain);
+
+            failures++;
+        }
+    }
+
+    return failures;
+}
+
+
+ULONG
+DecideLinkTest(
+    _In_ const AVF_RULE_INSTRUCTION *Code,
+    _In_ ULONG CodeCount,
+    _In_reads_(CodeCount) const ULONG *Variables,
+    _In_ ULONG Outcomes,
+    _In_ BOOLEAN Linked
+    )
+/*++
+
+Routine Description:
+
+    Runs a test program for given outcomes of its tests, following the
+    jumps as EvaluateRules does, or rule by rule.
+
+Arguments:
+
+    Code - The program.
+    CodeCount - Its length.
+    Variables - The variable of each test.
+    Outcomes - Bit n set if the tests of variable n hold.
+    Linked - Follow the jumps; else try each rule in turn.
+
+Return Value:
+
+    The line of the decision, or MAXULONG if a jump goes back or leaves
+    the program.
+
+--*/
+{
+    BOOLEAN holds;
+    BOOLEAN matched = TRUE;
+    ULONG pc = 0;
+
+    while (pc < CodeCount) {
+
+        if (Code[pc].Opcode == RuleOpDecide) {
+
+            if (Linked || matched) {
+                return Code[pc].Operand2;
+            }
+
+            matched = TRUE;
+            pc++;
+            continue;
+        }
+
+        holds = (((Outcomes >> Variables[pc]) & 1) != 0) != Code[pc].Negate;
+
+        if (Linked) {
+
+            if (!holds && Code[pc].Next <= pc) {
+                break;
+            }
+
+            pc = holds ? pc + 1 : Code[pc].Next;
+
+        } else {
+            matched = matched && holds;
+            pc++;
+        }
+    }
+
+    return MAXULONG;
+}
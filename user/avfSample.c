@@ -0,0 +1,366 @@
+/*++
+
+Copyright (c) 1989-2002  Microsoft Corporation
+Modified for AV Filter functionality
+
+Module Name:
+
+    avfSample.c
+
+Abstract:
+
+    Sampling and rate limiting when every file is monitored.  With no
+    protected files every operation on the machine is reported, and a
+    process that opens a file a microsecond can keep the engine and the
+    consultant busy on its own.
+
+    The filter does most of the work (see "Sampling" in avf.h): it reports
+    one operation in N (-sample) or a reservoir sample per time window
+    (-reservoir), at most so many a second per process (-processrate), and
+    allows the rest at once.  It counts what it did not report, per volume
+    and per process; a process's count comes with its next notification.
+
+    Here those counts are added up per process, and each process gets a
+    token bucket of its own for consultations (-consultrate): past it, an
+    operation is allowed without asking the consultant, and counted.
+
+    Processes are kept in a small table by process key.  When the slots
+    a key may go in are taken, the least recently seen process there is
+    folded into the "other processes" line to make room.
+
+Environment:
+
+    User mode
+
+--*/
+
+#include <windows.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "avfUser.h"
+
+#define AVF_SAMPLE_PROCESSES        1024    // Must be a power of 2
+#define AVF_SAMPLE_PROBES           16      // Slots a process key may go in
+#define AVF_SAMPLE_NAME_LENGTH      48      // Characters of the image name kept
+#define AVF_SAMPLE_MAX_REPORTED     10      // Processes printed
+
+//
+//  Sent to the filter with the policy (see -sample, -reservoir and
+//  -processrate)
+//
+
+AVF_SAMPLING gSampling = { AVF_SAMPLE_ALL, 0, 0, 0, 0 };
+
+//
+//  Consultations a second per process, and at once (see -consultrate);
+//  0 for no limit
+//
+
+ULONG gConsultRate = 0;
+ULONG gConsultBurst = 0;
+
+typedef struct _AVF_SAMPLE_PROCESS {
+    ULONG ProcessKey;                      // 0 if the slot is free
+    ULONG ProcessId;
+    LONG64 LastSeen;                       // Performance counter
+    LONG64 ConsultTime;                    // When its bucket is full again
+    LONG64 Reported;                       // Notifications
+    LONG64 Dropped;                        // Not reported by the filter
+    LONG64 ConsultsSkipped;                // Over -consultrate
+    WCHAR ImageName[AVF_SAMPLE_NAME_LENGTH];
+} AVF_SAMPLE_PROCESS, *PAVF_SAMPLE_PROCESS;
+
+//
+//  Processes and the counters, protected by gSampleLock.  gSampleOther
+//  holds the counts of the processes that were pushed out of the table.
+//
+
+SRWLOCK gSampleLock = SRWLOCK_INIT;
+AVF_SAMPLE_PROCESS gSampleProcesses[AVF_SAMPLE_PROCESSES];
+AVF_SAMPLE_PROCESS gSampleOther;
+LONG64 gSampleFrequency = 0;
+
+//
+//  Function prototypes
+//
+
+PAVF_SAMPLE_PROCESS
+FindSampleProcess(
+    _In_ PAVF_FILE_NOTIFICATION pNotification,
+    _In_ LONG64 Now
+    );
+
+int __cdecl
+CompareSampleProcesses(
+    _In_ const void *Left,
+    _In_ const void *Right
+    );
+
+
+PAVF_SAMPLE_PROCESS
+FindSampleProcess(
+    _In_ PAVF_FILE_NOTIFICATION pNotification,
+    _In_ LONG64 Now
+    )
+/*++
+
+Routine Description:
+
+    Finds the table entry of a notification's process, making one if it
+    has none.  Called with gSampleLock held exclusive.
+
+Arguments:
+
+    pNotification - The notification.
+    Now - The performance counter.
+
+Return Value:
+
+    The entry.
+
+--*/
+{
+    PAVF_SAMPLE_PROCESS process;
+    PAVF_SAMPLE_PROCESS oldest = NULL;
+    PCWSTR name;
+    ULONG slot;
+    ULONG i;
+
+    //
+    //  Processes the filter did not know share the "other" line
+    //
+
+    if (pNotification->ProcessKey == 0) {
+        return &gSampleOther;
+    }
+
+    slot = pNotification->ProcessKey * 2654435761UL;
+
+    for (i = 0; i < AVF_SAMPLE_PROBES; i++) {
+
+        process = &gSampleProcesses[(slot + i) & (AVF_SAMPLE_PROCESSES - 1)];
+
+        if (process->ProcessKey == pNotification->ProcessKey) {
+            return process;
+        }
+
+        if (process->ProcessKey == 0) {
+            oldest = process;
+            break;
+        }
+
+        if (oldest == NULL || process->LastSeen < oldest->LastSeen) {
+            oldest = process;
+        }
+    }
+
+    process = oldest;
+
+    if (process->ProcessKey != 0) {
+        gSampleOther.Reported += process->Reported;
+        gSampleOther.Dropped += process->Dropped;
+        gSampleOther.ConsultsSkipped += process->ConsultsSkipped;
+    }
+
+    RtlZeroMemory(process, sizeof(*process));
+    process->ProcessKey = pNotification->ProcessKey;
+    process->ProcessId = pNotification->ProcessId;
+    process->ConsultTime = Now;
+
+    name = wcsrchr(pNotification->ProcessName, L'\\');
+    name = (name != NULL) ? name + 1 : pNotification->ProcessName;
+    wcsncpy_s(process->ImageName, AVF_SAMPLE_NAME_LENGTH, name, _TRUNCATE);
+
+    return process;
+}
+
+
+BOOLEAN
+SampleNotification(
+    _In_ PAVF_FILE_NOTIFICATION pNotification,
+    _In_ BOOLEAN Consult
+    )
+/*++
+
+Routine Description:
+
+    Counts a notification received while every file is monitored against
+    its process, with the operations the filter did not report before it,
+    and charges a consultation for it to the process's token bucket.
+
+    The bucket is kept as the time at which it is full again: each
+    consultation moves that time 1 / gConsultRate seconds on, and one is
+    refused if that would put it more than gConsultBurst of those ahead.
+
+Arguments:
+
+    pNotification - The notification.
+    Consult - The consultant would be asked about it.
+
+Return Value:
+
+    FALSE if the process is over its consultation rate and the operation
+    is to be allowed without asking, TRUE otherwise.
+
+--*/
+{
+    PAVF_SAMPLE_PROCESS process;
+    LARGE_INTEGER counter;
+    LARGE_INTEGER frequency;
+    LONG64 period;
+    LONG64 next;
+    BOOLEAN admitted = TRUE;
+
+    QueryPerformanceCounter(&counter);
+
+    AcquireSRWLockExclusive(&gSampleLock);
+
+    if (gSampleFrequency == 0) {
+        QueryPerformanceFrequency(&frequency);
+        gSampleFrequency = frequency.QuadPart;
+    }
+
+    process = FindSampleProcess(pNotification, counter.QuadPart);
+    process->LastSeen = counter.QuadPart;
+    process->Reported++;
+    process->Dropped += pNotification->Dropped;
+
+    if (Consult && gConsultRate != 0 && process != &gSampleOther) {
+
+        period = gSampleFrequency / gConsultRate;
+        next = max(process->ConsultTime, counter.QuadPart) + period;
+
+        if (next - counter.QuadPart > period * max(gConsultBurst, 1)) {
+            process->ConsultsSkipped++;
+            admitted = FALSE;
+        } else {
+            process->ConsultTime = next;
+        }
+    }
+
+    ReleaseSRWLockExclusive(&gSampleLock);
+
+    return admitted;
+}
+
+
+int __cdecl
+CompareSampleProcesses(
+    _In_ const void *Left,
+    _In_ const void *Right
+    )
+/*++
+
+Routine Description:
+
+    qsort callback ordering processes by the operations they made, most
+    first.
+
+Arguments:
+
+    Left - The first AVF_SAMPLE_PROCESS.
+    Right - The second AVF_SAMPLE_PROCESS.
+
+Return Value:
+
+    <0, 0, or >0.
+
+--*/
+{
+    const AVF_SAMPLE_PROCESS *left = Left;
+    const AVF_SAMPLE_PROCESS *right = Right;
+    LONG64 leftCount = left->Reported + left->Dropped;
+    LONG64 rightCount = right->Reported + right->Dropped;
+
+    if (leftCount != rightCount) {
+        return (leftCount > rightCount) ? -1 : 1;
+    }
+
+    return 0;
+}
+
+
+VOID
+PrintSamplingStatistics(
+    VOID
+    )
+/*++
+
+Routine Description:
+
+    Prints the operations reported and not reported, and the consultations
+    skipped, in all and for the processes that made the most operations.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    PAVF_SAMPLE_PROCESS processes;
+    AVF_SAMPLE_PROCESS total;
+    AVF_SAMPLE_PROCESS other;
+    ULONG count = 0;
+    ULONG i;
+
+    processes = HeapAlloc(GetProcessHeap(), 0, sizeof(gSampleProcesses));
+
+    if (processes == NULL) {
+        return;
+    }
+
+    AcquireSRWLockExclusive(&gSampleLock);
+
+    other = gSampleOther;
+    total = other;
+
+    for (i = 0; i < AVF_SAMPLE_PROCESSES; i++) {
+
+        if (gSampleProcesses[i].ProcessKey != 0) {
+
+            processes[count++] = gSampleProcesses[i];
+
+            total.Reported += gSampleProcesses[i].Reported;
+            total.Dropped += gSampleProcesses[i].Dropped;
+            total.ConsultsSkipped += gSampleProcesses[i].ConsultsSkipped;
+        }
+    }
+
+    ReleaseSRWLockExclusive(&gSampleLock);
+
+    if (total.Dropped == 0 && total.ConsultsSkipped == 0) {
+        HeapFree(GetProcessHeap(), 0, processes);
+        return;
+    }
+
+    wprintf(L"  Sampling: %lld operation(s) reported, %lld not reported (%.1f%%), %lld consultation(s) skipped over the process's rate\n",
+            total.Reported,
+            total.Dropped,
+            100.0 * total.Dropped / (total.Reported + total.Dropped),
+            total.ConsultsSkipped);
+
+    qsort(processes, count, sizeof(AVF_SAMPLE_PROCESS), CompareSampleProcesses);
+
+    for (i = 0; i < count && i < AVF_SAMPLE_MAX_REPORTED; i++) {
+        wprintf(L"    %-24s PID: %5lu  reported: %-10lld not reported: %-10lld skipped: %lld\n",
+                processes[i].ImageName,
+                processes[i].ProcessId,
+                processes[i].Reported,
+                processes[i].Dropped,
+                processes[i].ConsultsSkipped);
+    }
+
+    if (other.Reported + other.Dropped != 0) {
+        wprintf(L"    %-24s             reported: %-10lld not reported: %-10lld skipped: %lld\n",
+                L"(other processes)",
+                other.Reported,
+                other.Dropped,
+                other.ConsultsSkipped);
+    }
+
+    HeapFree(GetProcessHeap(), 0, processes);
+}
@@ -0,0 +1,565 @@
+/*++
+
+Copyright (c) 1989-2002  Microsoft Corporation
+Modified for AV Filter functionality
+
+Module Name:
+
+    avfSchedule.c
+
+Abstract:
+
+    Scheduling of consultations.  At most gConsultantWindow consultations
+    are at the consultant at once; the others wait here, in one queue per
+    priority, so that an interactive open is not stuck behind the writes
+    of a bulk copy.
+
+    The priority comes from the operation and the requestor: opens by
+    processes in an interactive session come first, their other I/O next,
+    then what services and background processes (I/O below normal
+    priority) do, and audits of operations that were allowed already.
+    A consultation moves up a level for every AVF_SCHEDULE_AGING_MS it
+    waits, so none starves, and one within AVF_SCHEDULE_URGENT_MS of the
+    filter's deadline goes first.  One past its deadline is not sent at
+    all; the filter already allowed it.  A consultation that others were
+    coalesced onto (see avfCoalesce.c) is raised to the best priority and
+    the earliest deadline among them.
+
+Environment:
+
+    User mode
+
+--*/
+
+#include <windows.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "avfUser.h"
+
+#define AVF_SCHEDULE_WINDOW         64      // Default gConsultantWindow
+#define AVF_SCHEDULE_AGING_MS       250     // Wait that moves a consultation up a level
+#define AVF_SCHEDULE_URGENT_MS      5000    // Time left that makes a consultation urgent
+
+typedef struct _AVF_SCHEDULE_QUEUE {
+    PAVF_CONSULTATION Head;
+    PAVF_CONSULTATION *TailLink;
+} AVF_SCHEDULE_QUEUE, *PAVF_SCHEDULE_QUEUE;
+
+ULONG gConsultantWindow = AVF_SCHEDULE_WINDOW;
+
+//
+//  Scheduler state, protected by gScheduleLock.  gScheduleDispatching is
+//  set while a thread hands consultations out, so that completions on
+//  the way do not do it too.
+//
+
+SRWLOCK gScheduleLock = SRWLOCK_INIT;
+AVF_SCHEDULE_QUEUE gScheduleQueues[PriorityCount];
+ULONG gScheduleInFlight = 0;
+BOOLEAN gScheduleDispatching = FALSE;
+
+LONGLONG gScheduled[PriorityCount];
+LONGLONG gScheduleQueued = 0;
+LONGLONG gSchedulePromoted = 0;
+LONGLONG gScheduleRaised = 0;
+LONGLONG gScheduleOverdue = 0;
+
+//
+//  Function prototypes
+//
+
+AVF_PRIORITY
+ClassifyConsultation(
+    _In_ PAVF_FILE_NOTIFICATION pNotification
+    );
+
+VOID
+DispatchConsultations(
+    VOID
+    );
+
+PAVF_CONSULTATION
+PickConsultation(
+    _In_ ULONGLONG Now,
+    _Inout_ PAVF_CONSULTATION *Overdue
+    );
+
+VOID
+InsertScheduleQueue(
+    _Inout_ PAVF_SCHEDULE_QUEUE Queue,
+    _Inout_ PAVF_CONSULTATION Consultation
+    );
+
+
+AVF_PRIORITY
+ClassifyConsultation(
+    _In_ PAVF_FILE_NOTIFICATION pNotification
+    )
+/*++
+
+Routine Description:
+
+    Gives a file access its priority class.
+
+Arguments:
+
+    pNotification - File access notification.
+
+Return Value:
+
+    The priority of its consultation.
+
+--*/
+{
+    BOOLEAN open = (pNotification->MajorFunction == IRP_MJ_CREATE);
+
+    if (pNotification->TimeoutMs < AVF_SCHEDULE_URGENT_MS) {
+        return PriorityUrgent;
+    }
+
+    //
+    //  Background mode lowers the I/O priority of everything a process does
+    //
+
+    if (pNotification->IoPriority < AVF_IO_PRIORITY_NORMAL) {
+        return PriorityBackground;
+    }
+
+    //
+    //  Services run in session 0
+    //
+
+    if (pNotification->SessionId == 0 || pNotification->SessionId == AVF_SESSION_UNKNOWN) {
+        return open ? PriorityNormal : PriorityBackground;
+    }
+
+    return open ? PriorityInteractive : PriorityNormal;
+}
+
+
+VOID
+PrioritizeConsultation(
+    _Inout_ PAVF_CONSULTATION Consultation,
+    _In_ PAVF_FILE_NOTIFICATION pNotification
+    )
+/*++
+
+Routine Description:
+
+    Gives a consultation its priority and deadline, before it is coalesced
+    or scheduled.
+
+Arguments:
+
+    Consultation - The consultation, with its request built.
+    pNotification - File access notification it is for.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    //
+    //  Nothing waits for an audit
+    //
+
+    Consultation->Priority = Consultation->Audit ? PriorityBackground : ClassifyConsultation(pNotification);
+    Consultation->QueuedTime = GetTickCount64();
+    Consultation->Deadline = Consultation->QueuedTime + pNotification->TimeoutMs;
+    Consultation->Queued = FALSE;
+}
+
+
+VOID
+ScheduleConsultation(
+    _Inout_ PAVF_CONSULTATION Consultation
+    )
+/*++
+
+Routine Description:
+
+    Queues a consultation by its priority and sends it if the window has
+    room.
+
+Arguments:
+
+    Consultation - The consultation, with its request built and its
+        priority set by PrioritizeConsultation.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    PAVF_SCHEDULE_QUEUE queue;
+
+    Consultation->Next = NULL;
+
+    //
+    //  Its priority may be raised by a follower until it is queued
+    //
+
+    AcquireSRWLockExclusive(&gScheduleLock);
+
+    queue = &gScheduleQueues[Consultation->Priority];
+
+    if (queue->Head == NULL) {
+        queue->TailLink = &queue->Head;
+    }
+
+    *queue->TailLink = Consultation;
+    queue->TailLink = &Consultation->Next;
+    Consultation->Queued = TRUE;
+
+    gScheduled[Consultation->Priority]++;
+
+    if (gScheduleInFlight >= gConsultantWindow) {
+        gScheduleQueued++;
+    }
+
+    ReleaseSRWLockExclusive(&gScheduleLock);
+
+    DispatchConsultations();
+}
+
+
+VOID
+RaiseConsultation(
+    _Inout_ PAVF_CONSULTATION Leader,
+    _In_ PAVF_CONSULTATION Follower
+    )
+/*++
+
+Routine Description:
+
+    Gives a leader the priority and the deadline of a follower that was
+    coalesced onto it, where they are better than its own, and moves it
+    to the queue of its new priority if it is waiting for the window.
+    Called with gCoalesceLock held, so the leader is not over.
+
+Arguments:
+
+    Leader - The consultation sent for both.
+    Follower - The consultation that waits on it.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    PAVF_SCHEDULE_QUEUE queue;
+    PAVF_CONSULTATION *link;
+
+    AcquireSRWLockExclusive(&gScheduleLock);
+
+    if (Leader->Queued && Follower->Priority < Leader->Priority) {
+
+        queue = &gScheduleQueues[Leader->Priority];
+
+        link = &queue->Head;
+
+        while (*link != Leader) {
+            link = &(*link)->Next;
+        }
+
+        *link = Leader->Next;
+
+        if (queue->TailLink == &Leader->Next) {
+            queue->TailLink = link;
+        }
+
+        InsertScheduleQueue(&gScheduleQueues[Follower->Priority], Leader);
+        gScheduleRaised++;
+    }
+
+    Leader->Priority = min(Leader->Priority, Follower->Priority);
+    Leader->Deadline = min(Leader->Deadline, Follower->Deadline);
+
+    ReleaseSRWLockExclusive(&gScheduleLock);
+}
+
+
+VOID
+InsertScheduleQueue(
+    _Inout_ PAVF_SCHEDULE_QUEUE Queue,
+    _Inout_ PAVF_CONSULTATION Consultation
+    )
+/*++
+
+Routine Description:
+
+    Puts a consultation on a queue in arrival order, which it may not be
+    the last in.  Called with gScheduleLock held.
+
+Arguments:
+
+    Queue - The queue.
+    Consultation - The consultation.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    PAVF_CONSULTATION *link;
+
+    if (Queue->Head == NULL) {
+        Queue->TailLink = &Queue->Head;
+    }
+
+    link = &Queue->Head;
+
+    while (*link != NULL && (*link)->QueuedTime <= Consultation->QueuedTime) {
+        link = &(*link)->Next;
+    }
+
+    Consultation->Next = *link;
+    *link = Consultation;
+
+    if (Consultation->Next == NULL) {
+        Queue->TailLink = &Consultation->Next;
+    }
+}
+
+
+VOID
+ReleaseConsultationSlot(
+    VOID
+    )
+/*++
+
+Routine Description:
+
+    Frees the window slot of a consultation that is over and sends the
+    next one.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    AcquireSRWLockExclusive(&gScheduleLock);
+    gScheduleInFlight--;
+    ReleaseSRWLockExclusive(&gScheduleLock);
+
+    DispatchConsultations();
+}
+
+
+VOID
+DispatchConsultations(
+    VOID
+    )
+/*++
+
+Routine Description:
+
+    Sends queued consultations, best first, while the window has room,
+    unless another call is at it already.  Overdue consultations are
+    handed back to the engine unsent.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    PAVF_CONSULTATION consultation;
+    PAVF_CONSULTATION overdue;
+    PAVF_CONSULTATION next;
+
+    AcquireSRWLockExclusive(&gScheduleLock);
+
+    if (gScheduleDispatching) {
+        ReleaseSRWLockExclusive(&gScheduleLock);
+        return;
+    }
+
+    gScheduleDispatching = TRUE;
+
+    for (;;) {
+
+        overdue = NULL;
+        consultation = NULL;
+
+        if (gScheduleInFlight < gConsultantWindow) {
+
+            consultation = PickConsultation(GetTickCount64(), &overdue);
+
+            if (consultation != NULL) {
+                gScheduleInFlight++;
+            }
+        }
+
+        if (consultation == NULL && overdue == NULL) {
+            break;
+        }
+
+        //
+        //  Sending may complete it, and others, right away; their
+        //  ReleaseConsultationSlot finds gScheduleDispatching set and
+        //  leaves the next one to this loop
+        //
+
+        ReleaseSRWLockExclusive(&gScheduleLock);
+
+        while (overdue != NULL) {
+            next = overdue->Next;
+            overdue->Next = NULL;
+            overdue->Expired = TRUE;
+            CompleteCoalesced(overdue);
+            overdue = next;
+        }
+
+        if (consultation != NULL) {
+            SendConsultation(consultation);
+        }
+
+        AcquireSRWLockExclusive(&gScheduleLock);
+    }
+
+    gScheduleDispatching = FALSE;
+
+    ReleaseSRWLockExclusive(&gScheduleLock);
+}
+
+
+PAVF_CONSULTATION
+PickConsultation(
+    _In_ ULONGLONG Now,
+    _Inout_ PAVF_CONSULTATION *Overdue
+    )
+/*++
+
+Routine Description:
+
+    Takes the consultation to send next off its queue.  Each queue is in
+    arrival order, so only the heads compete: a head's level is its
+    priority less one for every AVF_SCHEDULE_AGING_MS it waited, or
+    PriorityUrgent close to its deadline; the best level wins, the
+    earlier deadline on a tie.  Called with gScheduleLock held.
+
+Arguments:
+
+    Now - GetTickCount64.
+    Overdue - List heads past their deadline are taken onto, linked
+        through Next.
+
+Return Value:
+
+    The consultation, or NULL if none is queued.
+
+--*/
+{
+    PAVF_SCHEDULE_QUEUE queue;
+    PAVF_CONSULTATION head;
+    ULONG best = PriorityCount;
+    ULONG bestLevel = PriorityCount;
+    ULONG level;
+    ULONG aged;
+    ULONG i;
+
+    for (i = 0; i < PriorityCount; i++) {
+
+        queue = &gScheduleQueues[i];
+
+        //
+        //  The filter allowed these without waiting any longer
+        //
+
+        while ((head = queue->Head) != NULL && head->Deadline <= Now) {
+            queue->Head = head->Next;
+            head->Queued = FALSE;
+            head->Next = *Overdue;
+            *Overdue = head;
+            gScheduleOverdue++;
+        }
+
+        if (head == NULL) {
+            continue;
+        }
+
+        if (head->Deadline - Now < AVF_SCHEDULE_URGENT_MS) {
+            level = PriorityUrgent;
+        } else {
+            aged = (ULONG)min((Now - head->QueuedTime) / AVF_SCHEDULE_AGING_MS, i);
+            level = i - aged;
+        }
+
+        if (level < bestLevel ||
+            (level == bestLevel && head->Deadline < gScheduleQueues[best].Head->Deadline)) {
+
+            best = i;
+            bestLevel = level;
+        }
+    }
+
+    if (best == PriorityCount) {
+        return NULL;
+    }
+
+    queue = &gScheduleQueues[best];
+    head = queue->Head;
+    queue->Head = head->Next;
+    head->Next = NULL;
+    head->Queued = FALSE;
+
+    if (bestLevel < best) {
+        gSchedulePromoted++;
+    }
+
+    return head;
+}
+
+
+VOID
+PrintScheduleStatistics(
+    VOID
+    )
+/*++
+
+Routine Description:
+
+    Prints how many consultations of each priority were scheduled and how
+    many had to wait.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    if (gScheduled[PriorityUrgent] + gScheduled[PriorityInteractive] +
+        gScheduled[PriorityNormal] + gScheduled[PriorityBackground] == 0) {
+        return;
+    }
+
+    wprintf(L"\nConsultations: %lld urgent, %lld interactive, %lld normal, %lld background\n",
+            gScheduled[PriorityUrgent],
+            gScheduled[PriorityInteractive],
+            gScheduled[PriorityNormal],
+            gScheduled[PriorityBackground]);
+
+    wprintf(L"  Waited for the window: %lld (%lld moved up by aging, %lld raised by a coalesced one, %lld overdue)\n",
+            gScheduleQueued,
+            gSchedulePromoted,
+            gScheduleRaised,
+            gScheduleOverdue);
+}
@@ -0,0 +1,461 @@
+/*++
+
+Copyright (c) 1989-2002  Microsoft Corporation
+Modified for AV Filter functionality
+
+Module Name:
+
+    avfShadow.c
+
+Abstract:
+
+    Shadow evaluation (-shadow): a candidate policy decides on the same
+    events as the active one without being enforced, so that a new policy
+    can be tried out on real traffic before it is rolled out.
+
+    A worker decides on a notification with the active policy as always,
+    timing it, and queues a copy of the notification with that decision
+    for the shadow thread; the verdict is sent without waiting for it.
+    The shadow thread decides on the copy with the candidate policy and
+    counts where the two disagree, what each decision cost and how many
+    consultations each would make.  The first disagreements are printed.
+
+    Copies come from a fixed pool: when the shadow thread falls behind, an
+    event is skipped rather than held, and the skips are counted.
+
+    The candidate only sees the events the filter reports for the active
+    policy.  Files it protects that the active policy does not are only
+    seen when the active policy protects nothing, and so sees everything.
+    Its files are matched by path only, and its time rules against the
+    time the shadow thread gets to the event.
+
+Environment:
+
+    User mode
+
+--*/
+
+#include <windows.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "avfUser.h"
+
+#define AVF_SHADOW_EVENT_COUNT      1024    // Events queued at once
+#define AVF_SHADOW_MAX_REPORTED     100     // Disagreements printed
+
+//
+//  A notification the active policy decided on, for the candidate
+//
+
+typedef struct DECLSPEC_ALIGN(MEMORY_ALLOCATION_ALIGNMENT) _AVF_SHADOW_EVENT {
+    SLIST_ENTRY Entry;
+    AVF_POLICY_DECISION Decision;          // The active policy's
+    LONG64 Ticks;                          // The active policy took to decide
+    AVF_FILE_NOTIFICATION Notification;
+} AVF_SHADOW_EVENT, *PAVF_SHADOW_EVENT;
+
+volatile BOOLEAN gShadowRunning = FALSE;
+
+PAVF_SHADOW_EVENT gShadowEvents = NULL;
+SLIST_HEADER gShadowFree;
+SLIST_HEADER gShadowQueue;
+HANDLE gShadowWake = NULL;                 // Set when the queue stops being empty
+HANDLE gShadowThread = NULL;
+volatile BOOLEAN gShadowStopping = FALSE;
+
+//
+//  Counters.  Only the shadow thread updates them, but Skipped.
+//
+
+LONG64 gShadowEvaluated = 0;
+volatile LONG64 gShadowSkipped = 0;
+LONG64 gShadowDisagreements = 0;
+LONG64 gShadowActiveTicks = 0;
+LONG64 gShadowCandidateTicks = 0;
+LONG64 gShadowDecisions[PolicyDecisionCount][PolicyDecisionCount];    // [active][candidate]
+
+static const PCWSTR gPolicyDecisionNames[] = {
+    L"not protected",
+    L"allowed by rule",
+    L"blocked by rule",
+    L"audited",
+    L"consultant"
+};
+
+C_ASSERT(RTL_NUMBER_OF(gPolicyDecisionNames) == PolicyDecisionCount);
+
+//
+//  Function prototypes
+//
+
+DWORD WINAPI
+ShadowThread(
+    _In_ LPVOID lpParameter
+    );
+
+VOID
+EvaluateShadowEvent(
+    _In_ PAVF_SHADOW_EVENT Event,
+    _In_ ULONG Reader
+    );
+
+
+BOOL
+StartShadow(
+    VOID
+    )
+/*++
+
+Routine Description:
+
+    Starts the shadow thread.  Called once the candidate policy is
+    published and before the engine starts.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    TRUE if the shadow thread started.
+
+--*/
+{
+    ULONG i;
+
+    gShadowEvents = HeapAlloc(GetProcessHeap(), 0, AVF_SHADOW_EVENT_COUNT * sizeof(AVF_SHADOW_EVENT));
+    gShadowWake = CreateEventW(NULL, FALSE, FALSE, NULL);
+
+    if (gShadowEvents == NULL || gShadowWake == NULL) {
+        wprintf(L"ERROR: Failed to set up shadow evaluation (error %lu)\n", GetLastError());
+        return FALSE;
+    }
+
+    InitializeSListHead(&gShadowFree);
+    InitializeSListHead(&gShadowQueue);
+
+    for (i = 0; i < AVF_SHADOW_EVENT_COUNT; i++) {
+        InterlockedPushEntrySList(&gShadowFree, &gShadowEvents[i].Entry);
+    }
+
+    gShadowThread = CreateThread(NULL, 0, ShadowThread, NULL, 0, NULL);
+
+    if (gShadowThread == NULL) {
+        wprintf(L"ERROR: Failed to start the shadow thread (error %lu)\n", GetLastError());
+        return FALSE;
+    }
+
+    gShadowRunning = TRUE;
+    return TRUE;
+}
+
+
+VOID
+StopShadow(
+    VOID
+    )
+/*++
+
+Routine Description:
+
+    Stops the shadow thread once the engine has stopped.  Events still
+    queued are dropped.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    if (gShadowThread == NULL) {
+        return;
+    }
+
+    gShadowRunning = FALSE;
+    gShadowStopping = TRUE;
+    SetEvent(gShadowWake);
+
+    WaitForSingleObject(gShadowThread, INFINITE);
+    CloseHandle(gShadowThread);
+    gShadowThread = NULL;
+
+    CloseHandle(gShadowWake);
+    gShadowWake = NULL;
+
+    HeapFree(GetProcessHeap(), 0, gShadowEvents);
+    gShadowEvents = NULL;
+}
+
+
+VOID
+QueueShadowEvaluation(
+    _In_ PAVF_FILE_NOTIFICATION pNotification,
+    _In_ AVF_POLICY_DECISION Decision,
+    _In_ LONG64 Ticks
+    )
+/*++
+
+Routine Description:
+
+    Queues a notification the active policy decided on for the candidate
+    policy.  Called by the engine workers; never waits.
+
+Arguments:
+
+    pNotification - The notification.
+    Decision - The active policy's decision.
+    Ticks - The time it took, in QueryPerformanceCounter ticks.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    PAVF_SHADOW_EVENT event;
+
+    event = (PAVF_SHADOW_EVENT)InterlockedPopEntrySList(&gShadowFree);
+
+    if (event == NULL) {
+        InterlockedIncrement64(&gShadowSkipped);
+        return;
+    }
+
+    event->Decision = Decision;
+    event->Ticks = Ticks;
+    RtlCopyMemory(&event->Notification, pNotification, sizeof(AVF_FILE_NOTIFICATION));
+
+    if (InterlockedPushEntrySList(&gShadowQueue, &event->Entry) == NULL) {
+        SetEvent(gShadowWake);
+    }
+}
+
+
+DWORD WINAPI
+ShadowThread(
+    _In_ LPVOID lpParameter
+    )
+/*++
+
+Routine Description:
+
+    The shadow thread.  Takes the queued events when woken and has the
+    candidate policy decide on them, oldest first.
+
+Arguments:
+
+    lpParameter - Unused.
+
+Return Value:
+
+    0.
+
+--*/
+{
+    PSLIST_ENTRY entry;
+    PSLIST_ENTRY next;
+    PSLIST_ENTRY oldest;
+    ULONG reader = RegisterPolicyReader();
+
+    UNREFERENCED_PARAMETER(lpParameter);
+
+    while (!gShadowStopping) {
+
+        WaitForSingleObject(gShadowWake, INFINITE);
+
+        while (!gShadowStopping) {
+
+            entry = InterlockedFlushSList(&gShadowQueue);
+
+            if (entry == NULL) {
+                break;
+            }
+
+            //
+            //  The list comes newest first
+            //
+
+            oldest = NULL;
+
+            while (entry != NULL) {
+                next = entry->Next;
+                entry->Next = oldest;
+                oldest = entry;
+                entry = next;
+            }
+
+            while (oldest != NULL) {
+                next = oldest->Next;
+                EvaluateShadowEvent(CONTAINING_RECORD(oldest, AVF_SHADOW_EVENT, Entry), reader);
+                InterlockedPushEntrySList(&gShadowFree, oldest);
+                oldest = next;
+            }
+        }
+    }
+
+    return 0;
+}
+
+
+VOID
+EvaluateShadowEvent(
+    _In_ PAVF_SHADOW_EVENT Event,
+    _In_ ULONG Reader
+    )
+/*++
+
+Routine Description:
+
+    Has the candidate policy decide on an event and compares it with the
+    active policy's decision.
+
+Arguments:
+
+    Event - The event.
+    Reader - The shadow thread's policy reader slot.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    PAVF_FILE_NOTIFICATION pNotification = &Event->Notification;
+    PAVF_USER_POLICY policy;
+    AVF_POLICY_DECISION decision;
+    LARGE_INTEGER start;
+    LARGE_INTEGER end;
+    WCHAR displayName[AVF_MAX_PATH];
+    ULONG ruleLine;
+    BOOLEAN timed;
+
+    QueryPerformanceCounter(&start);
+
+    policy = AcquireShadowPolicy(Reader);
+
+    if (policy == NULL) {
+        ReleaseUserPolicy(Reader);
+        return;
+    }
+
+    decision = DecideByPolicy(policy, pNotification, TRUE, &ruleLine, &timed);
+
+    ReleaseUserPolicy(Reader);
+
+    QueryPerformanceCounter(&end);
+
+    gShadowEvaluated++;
+    gShadowActiveTicks += Event->Ticks;
+    gShadowCandidateTicks += end.QuadPart - start.QuadPart;
+    gShadowDecisions[Event->Decision][decision]++;
+
+    if (decision == Event->Decision) {
+        return;
+    }
+
+    if (++gShadowDisagreements > AVF_SHADOW_MAX_REPORTED) {
+        return;
+    }
+
+    if (!ConvertToWin32Path(pNotification->FileName, displayName, AVF_MAX_PATH)) {
+        wcscpy_s(displayName, AVF_MAX_PATH, pNotification->FileName);
+    }
+
+    wprintf(L"[SHADOW] [%s] PID: %5lu  Process: %-20s  File: %s\n",
+            pNotification->MajorFunction == IRP_MJ_CREATE ? L"OPEN " :
+            pNotification->MajorFunction == IRP_MJ_READ ? L"READ " : L"WRITE",
+            pNotification->ProcessId,
+            pNotification->ProcessName,
+            displayName);
+
+    if (ruleLine != 0) {
+        wprintf(L"  [SHADOW] -> active: %s, candidate: %s (line %lu)\n",
+                gPolicyDecisionNames[Event->Decision],
+                gPolicyDecisionNames[decision],
+                ruleLine);
+    } else {
+        wprintf(L"  [SHADOW] -> active: %s, candidate: %s\n",
+                gPolicyDecisionNames[Event->Decision],
+                gPolicyDecisionNames[decision]);
+    }
+
+    if (gShadowDisagreements == AVF_SHADOW_MAX_REPORTED) {
+        wprintf(L"  [SHADOW] Further disagreements are only counted\n");
+    }
+}
+
+
+VOID
+PrintShadowStatistics(
+    VOID
+    )
+/*++
+
+Routine Description:
+
+    Prints how the candidate policy compared with the active one: where
+    they disagreed, what their decisions cost and how the load on the
+    consultant would change.  Called once the shadow thread has stopped.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    LARGE_INTEGER frequency;
+    LONG64 activeConsultations = 0;
+    LONG64 candidateConsultations = 0;
+    ULONG active;
+    ULONG candidate;
+
+    if (gShadowEvaluated == 0) {
+        return;
+    }
+
+    QueryPerformanceFrequency(&frequency);
+
+    wprintf(L"  Shadow policy: %lld events, %lld disagreements, %lld skipped\n",
+            gShadowEvaluated,
+            gShadowDisagreements,
+            gShadowSkipped);
+
+    for (active = 0; active < PolicyDecisionCount; active++) {
+
+        for (candidate = 0; candidate < PolicyDecisionCount; candidate++) {
+
+            if (active == PolicyDecisionAudit || active == PolicyDecisionConsult) {
+                activeConsultations += gShadowDecisions[active][candidate];
+            }
+
+            if (candidate == PolicyDecisionAudit || candidate == PolicyDecisionConsult) {
+                candidateConsultations += gShadowDecisions[active][candidate];
+            }
+
+            if (active != candidate && gShadowDecisions[active][candidate] != 0) {
+                wprintf(L"    %s -> %s: %lld\n",
+                        gPolicyDecisionNames[active],
+                        gPolicyDecisionNames[candidate],
+                        gShadowDecisions[active][candidate]);
+            }
+        }
+    }
+
+    wprintf(L"    Cost per event: %.2f us active, %.2f us candidate\n",
+            (double)gShadowActiveTicks * 1000000.0 / (double)frequency.QuadPart / (double)gShadowEvaluated,
+            (double)gShadowCandidateTicks * 1000000.0 / (double)frequency.QuadPart / (double)gShadowEvaluated);
+
+    wprintf(L"    Consultations: %lld active, %lld candidate (%+.1f%%)\n",
+            activeConsultations,
+            candidateConsultations,
+            (activeConsultations != 0) ?
+                (double)(candidateConsultations - activeConsultations) * 100.0 / (double)activeConsultations : 0.0);
+}
@@ -13,8 +13,9 @@ Abstract:
     of the AV Filter. It connects to the kernel minifilter and receives
     notifications about file accesses.
 
-    This version uses multiple worker threads to handle requests concurrently,
-    preventing deadlocks when the consultant needs to access files.
+    Notifications are decided by the engine (avfEngine.c), which keeps
+    many consultations in flight without blocking a thread on any, so the
+    consultant can access files without deadlocking.
 
 Environment:
 
@@ -25,16 +26,16 @@ Environment:
 #include <windows.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <math.h>
 #include <fltUser.h>
 #include <dontuse.h>
-#include "avf.h"
+#include "avfUser.h"
 
 //
 //  Configuration
 //
 
-#define AVF_WORKER_THREAD_COUNT     4
-#define AVF_MAX_PENDING_REQUESTS    16
+#define AVF_RELOAD_CHECK_INTERVAL   10      // In 100 ms main loop ticks
 
 //
 //  Global variables
@@ -43,72 +44,78 @@ Environment:
 HANDLE gPort = INVALID_HANDLE_VALUE;
 HANDLE gCompletionPort = INVALID_HANDLE_VALUE;
 volatile BOOLEAN gRunning = TRUE;
+volatile BOOLEAN gReloadRequested = FALSE;
 
 //
-//  Consultant connection - protected by critical section
+//  Protected files list being built - stores NT device paths for
+//  comparison.  Grows on demand, since a list file (-list) can name
+//  millions of files.  BuildUserPolicy moves it into the user policy it
+//  builds, leaving it empty for the next build.
 //
 
-CRITICAL_SECTION gConsultantLock;
-HANDLE gConsultantPipe = INVALID_HANDLE_VALUE;
-BOOLEAN gConsultantConnected = FALSE;
+PAVF_PROTECTED_FILE gProtectedFiles = NULL;
+ULONG gProtectedFileCount = 0;
+ULONG gProtectedFileCapacity = 0;
+ULONG gPolicyGeneration = 0;
 
 //
-//  Protected files list - stores NT device paths for comparison
+//  Every protected file ID of the list being built, sorted, for the exact
+//  check behind the filter's Bloom filter matches (see BuildFilterPolicy).
+//  IDs of different volumes share the
+//  table; a collision only costs a consultation.
 //
 
-#define MAX_PROTECTED_FILES 100
-WCHAR gProtectedFiles[MAX_PROTECTED_FILES][AVF_MAX_PATH];
-ULONG gProtectedFileCount = 0;
+PFILE_ID_128 gProtectedIds = NULL;
+ULONG gProtectedIdCount = 0;
 
 //
-//  Worker thread context
+//  Bloom filter settings (see -bloomfpr and -bloomsize).  When either is
+//  set, file IDs are sent to the filter as a per-volume Bloom filter
+//  instead of an exact list.
 //
 
-typedef struct _AVF_WORKER_CONTEXT {
-    HANDLE Port;
-    HANDLE CompletionPort;
-} AVF_WORKER_CONTEXT, *PAVF_WORKER_CONTEXT;
+double gBloomFalsePositiveRate = 0.0;
+ULONG gBloomSizeBytes = 0;
+volatile LONG gBloomFalsePositives = 0;
 
 //
-//  Message structure for async operations
+//  Which opens of a protected file the filter reports (see -access,
+//  -disposition, -sharedeny, -nodeleteonclose and -allopens)
 //
 
-typedef struct _AVF_MESSAGE {
-    FILTER_MESSAGE_HEADER Header;
-    AVF_FILE_NOTIFICATION Notification;
-    OVERLAPPED Overlapped;
-} AVF_MESSAGE, *PAVF_MESSAGE;
+AVF_CREATE_FILTER gCreateFilter = {
+    AVF_CREATE_FILTER_ENABLED | AVF_CREATE_FILTER_DELETE_ON_CLOSE,
+    AVF_DEFAULT_CREATE_ACCESS_MASK,
+    AVF_DEFAULT_CREATE_DISPOSITIONS,
+    0
+};
 
 //
 //  Function prototypes
 //
 
-BOOL
-ConnectToConsultant(
-    VOID
-    );
-
-BOOL
-QueryConsultant(
-    _In_ PAVF_FILE_NOTIFICATION pNotification,
-    _Out_ PAVF_CONSULTANT_RESPONSE pResponse
+int __cdecl
+CompareProtectedFiles(
+    _In_ const void *Left,
+    _In_ const void *Right
     );
 
-BOOL
-ConvertToNtPath(
-    _In_ PCWSTR Win32Path,
-    _Out_writes_(NtPathSize) PWSTR NtPath,
-    _In_ ULONG NtPathSize
+VOID
+ComputeBloomGeometry(
+    _In_ ULONG Count,
+    _Out_ PULONG BitCount,
+    _Out_ PULONG HashCount
     );
 
 BOOL
-AddProtectedFile(
-    _In_ PCWSTR FilePath
+MatchProtectedFile(
+    _In_ PAVF_PROTECTED_FILE File,
+    _In_ PCWSTR UpperPath
     );
 
-BOOL
-IsFileProtected(
-    _In_ PCWSTR FilePath
+VOID
+PrintVolumeStatistics(
+    VOID
     );
 
 BOOL WINAPI
@@ -116,11 +123,6 @@ ConsoleCtrlHandler(
     DWORD CtrlType
     );
 
-DWORD WINAPI
-WorkerThread(
-    _In_ LPVOID lpParameter
-    );
-
 
 int
 wmain(
@@ -132,7 +134,7 @@ wmain(
 Routine Description:
 
     Main entry point for the userspace listener application.
-    Creates worker threads and an I/O completion port for concurrent request handling.
+    Creates an I/O completion port and starts the engine on it.
 
 Arguments:
 
@@ -147,10 +149,16 @@ Return Value:
 {
     HRESULT hr;
     int i;
-    HANDLE workerThreads[AVF_WORKER_THREAD_COUNT];
-    AVF_WORKER_CONTEXT workerContext;
-    PAVF_MESSAGE messages[AVF_MAX_PENDING_REQUESTS];
-    DWORD threadId;
+    PCWSTR compilePath = NULL;
+    PWSTR deadline;
+    PWSTR second;
+    PCWSTR logPath = NULL;
+    PAVF_USER_POLICY policy;
+    PAVF_USER_POLICY shadowPolicy = NULL;
+    BOOLEAN shadow = FALSE;
+    BOOLEAN selfTest = FALSE;
+    ULONG ticks = 0;
+    int status;
 
     wprintf(L"AV Filter - File Access Monitor (Multi-threaded)\n");
     wprintf(L"=================================================\n\n");
@@ -166,27 +174,253 @@ Return Value:
     //
 
     if (argc < 2) {
-        wprintf(L"Usage: %s <file1> [file2] [file3] ...\n", argv[0]);
+        wprintf(L"Usage: %s [options] <file1> [file2] [file3] ...\n", argv[0]);
         wprintf(L"\nSpecify files to monitor. When any process accesses these files,\n");
         wprintf(L"the process PID and name will be displayed.\n\n");
+        wprintf(L"Options controlling which opens are reported:\n");
+        wprintf(L"  -access <mask>       Access bits that are reported (default 0x%08X)\n",
+                AVF_DEFAULT_CREATE_ACCESS_MASK);
+        wprintf(L"  -disposition <mask>  AVF_DISPOSITION_* bits that are reported (default 0x%02X)\n",
+                AVF_DEFAULT_CREATE_DISPOSITIONS);
+        wprintf(L"  -sharedeny <mask>    Report opens denying these FILE_SHARE_* bits (default 0)\n");
+        wprintf(L"  -nodeleteonclose     Do not report delete-on-close opens by themselves\n");
+        wprintf(L"  -allopens            Report every open\n\n");
+        wprintf(L"Options for large protected sets:\n");
+        wprintf(L"  -list <file>         Protect every path in <file>, one per line\n");
+        wprintf(L"  -audit <path>        Allow access to <path> at once and ask the\n");
+        wprintf(L"                       consultant afterwards; its verdict is cached\n");
+        wprintf(L"                       for the next access (not kept by -compile)\n");
+        wprintf(L"  -auditlist <file>    Audit every path in <file> the same way\n");
+        wprintf(L"  -bloomfpr <rate>     Send file IDs as a Bloom filter sized for this\n");
+        wprintf(L"                       false positive rate, e.g. 0.001\n");
+        wprintf(L"  -bloomsize <KB>      Send file IDs as a Bloom filter of this size\n");
+        wprintf(L"  -compile <bundle>    Compile the files into a policy bundle and exit\n");
+        wprintf(L"  -bundle <bundle>     Protect the files of a compiled policy bundle\n");
+        wprintf(L"  -rules <file>        Allow, block or audit accesses by the rules in\n");
+        wprintf(L"                       <file> before asking the consultant\n");
+        wprintf(L"  -shadow              The files, lists, bundle and rules after this make\n");
+        wprintf(L"                       up a candidate policy, which decides on the same\n");
+        wprintf(L"                       events in the background without being enforced\n\n");
+        wprintf(L"Options for monitoring every file (no files given):\n");
+        wprintf(L"  -sample <n>          Report one operation in <n>; the others are allowed\n");
+        wprintf(L"  -reservoir <n>[,<ms>]\n");
+        wprintf(L"                       Report a sample of about <n> operations every <ms>\n");
+        wprintf(L"                       (default 1000), growing slowly with the load\n");
+        wprintf(L"  -processrate <n>[,<burst>]\n");
+        wprintf(L"                       Report at most <n> operations a second for each\n");
+        wprintf(L"                       process, <burst> at once (default <n>)\n");
+        wprintf(L"  -consultrate <n>[,<burst>]\n");
+        wprintf(L"                       Ask the consultant about at most <n> operations a\n");
+        wprintf(L"                       second for each process, and allow the others\n\n");
+        wprintf(L"Options for the security consultant:\n");
+        wprintf(L"  -consultant <pipe>[,<ms>]\n");
+        wprintf(L"                       Ask the consultant on <pipe>, waiting at most\n");
+        wprintf(L"                       <ms> for it; repeat to ask up to %d at once\n",
+                AVF_MAX_CONSULTANTS);
+        wprintf(L"  -plugin <dll>        Ask the consultant plugin <dll> in the engine\n");
+        wprintf(L"                       first; what it defers goes to the consultants\n");
+        wprintf(L"  -pluginargs <text>   Passed to the plugin when it is loaded\n");
+        wprintf(L"  -combine <mode>      Block if any consultant blocks (block, default),\n");
+        wprintf(L"                       if a quorum does (quorum), or as the first one\n");
+        wprintf(L"                       listed that answers says (priority)\n");
+        wprintf(L"  -quorum <n>          Blocks needed with -combine quorum (default a\n");
+        wprintf(L"                       majority of the consultants)\n");
+        wprintf(L"  -batchwait <us>      Longest time a batch of requests is held open\n");
+        wprintf(L"                       under load (default 50, 0 = never); rounded up\n");
+        wprintf(L"                       to a timer tick before Windows 10 1803\n");
+        wprintf(L"  -window <n>          Most requests at the consultant at once; the\n");
+        wprintf(L"                       others wait by priority (default 64)\n");
+        wprintf(L"  -coalesce <scope>    Send one request for the same access to the same\n");
+        wprintf(L"                       file by any process (file), by processes of the\n");
+        wprintf(L"                       same image (image, default) or by the same\n");
+        wprintf(L"                       process (process) while one is in flight; none\n");
+        wprintf(L"                       sends every request\n\n");
+        wprintf(L"Options for the output:\n");
+        wprintf(L"  -aggregate <ms>      Write the same access to the same file by the same\n");
+        wprintf(L"                       process with the same verdict once every <ms>, with\n");
+        wprintf(L"                       a count, its first and last time and the bytes\n");
+        wprintf(L"  -log <file>          Also write the aggregated events to <file>\n\n");
+        wprintf(L"Options for the engine:\n");
+        wprintf(L"  -workers <n>         Number of engine workers (default %d, or one per\n",
+                AVF_WORKER_THREAD_COUNT);
+        wprintf(L"                       processor with -affinity; at most %d)\n", AVF_MAX_WORKERS);
+        wprintf(L"  -affinity <where>    Pin each worker to a processor (cpu) or spread\n");
+        wprintf(L"                       them over the NUMA nodes (node); default none\n");
+        wprintf(L"  -selftest            Test the matching of rule patterns and the jumps\n");
+        wprintf(L"                       of compiled rules, and exit\n\n");
+        wprintf(L"List files and bundles are reloaded when they change, or on Ctrl+Break.\n\n");
         wprintf(L"Example: %s C:\\important.txt C:\\secret.doc\n\n", argv[0]);
     }
 
     //
-    //  Add protected files from command line
+    //  Parse options, and note where the protected files come from
     //
 
     for (i = 1; i < argc; i++) {
-        if (AddProtectedFile(argv[i])) {
-            wprintf(L"Monitoring: %s\n", argv[i]);
+
+        if (_wcsicmp(argv[i], L"-allopens") == 0) {
+            ClearFlag(gCreateFilter.Flags, AVF_CREATE_FILTER_ENABLED);
+        } else if (_wcsicmp(argv[i], L"-nodeleteonclose") == 0) {
+            ClearFlag(gCreateFilter.Flags, AVF_CREATE_FILTER_DELETE_ON_CLOSE);
+        } else if (_wcsicmp(argv[i], L"-access") == 0 && i + 1 < argc) {
+            gCreateFilter.AccessMask = wcstoul(argv[++i], NULL, 0);
+        } else if (_wcsicmp(argv[i], L"-disposition") == 0 && i + 1 < argc) {
+            gCreateFilter.Dispositions = wcstoul(argv[++i], NULL, 0);
+        } else if (_wcsicmp(argv[i], L"-sharedeny") == 0 && i + 1 < argc) {
+            gCreateFilter.ShareDenyMask = wcstoul(argv[++i], NULL, 0);
+        } else if (_wcsicmp(argv[i], L"-bloomfpr") == 0 && i + 1 < argc) {
+            gBloomFalsePositiveRate = _wtof(argv[++i]);
+        } else if (_wcsicmp(argv[i], L"-bloomsize") == 0 && i + 1 < argc) {
+            gBloomSizeBytes = wcstoul(argv[++i], NULL, 0) * 1024;
+        } else if (_wcsicmp(argv[i], L"-batchwait") == 0 && i + 1 < argc) {
+            gConsultantBatchWaitUs = wcstoul(argv[++i], NULL, 0);
+        } else if (_wcsicmp(argv[i], L"-window") == 0 && i + 1 < argc) {
+            gConsultantWindow = max(wcstoul(argv[++i], NULL, 0), 1);
+        } else if (_wcsicmp(argv[i], L"-consultant") == 0 && i + 1 < argc) {
+            deadline = wcschr(argv[++i], L',');
+            if (deadline != NULL) {
+                *deadline++ = L'\0';
+            }
+            AddConsultant(argv[i], (deadline != NULL) ? wcstoul(deadline, NULL, 0) : 0);
+        } else if (_wcsicmp(argv[i], L"-plugin") == 0 && i + 1 < argc) {
+            gPluginPath = argv[++i];
+        } else if (_wcsicmp(argv[i], L"-pluginargs") == 0 && i + 1 < argc) {
+            gPluginArguments = argv[++i];
+        } else if (_wcsicmp(argv[i], L"-combine") == 0 && i + 1 < argc) {
+            i++;
+            if (_wcsicmp(argv[i], L"quorum") == 0) {
+                gCombineMode = CombineQuorum;
+            } else if (_wcsicmp(argv[i], L"priority") == 0) {
+                gCombineMode = CombinePriority;
+            } else {
+                gCombineMode = CombineBlockWins;
+            }
+        } else if (_wcsicmp(argv[i], L"-quorum") == 0 && i + 1 < argc) {
+            gCombineQuorum = wcstoul(argv[++i], NULL, 0);
+        } else if (_wcsicmp(argv[i], L"-coalesce") == 0 && i + 1 < argc) {
+            i++;
+            if (_wcsicmp(argv[i], L"file") == 0) {
+                gCoalesceScope = CoalesceFile;
+            } else if (_wcsicmp(argv[i], L"process") == 0) {
+                gCoalesceScope = CoalesceProcess;
+            } else if (_wcsicmp(argv[i], L"none") == 0) {
+                gCoalesceScope = CoalesceNone;
+            } else {
+                gCoalesceScope = CoalesceImage;
+            }
+        } else if (_wcsicmp(argv[i], L"-sample") == 0 && i + 1 < argc) {
+            gSampling.Mode = AVF_SAMPLE_ONE_IN_N;
+            gSampling.Rate = max(wcstoul(argv[++i], NULL, 0), 1);
+        } else if (_wcsicmp(argv[i], L"-reservoir") == 0 && i + 1 < argc) {
+            second = wcschr(argv[++i], L',');
+            gSampling.Mode = AVF_SAMPLE_RESERVOIR;
+            gSampling.Rate = max(wcstoul(argv[i], NULL, 0), 1);
+            gSampling.WindowMs = (second != NULL) ? max(wcstoul(second + 1, NULL, 0), 1) : 1000;
+        } else if (_wcsicmp(argv[i], L"-processrate") == 0 && i + 1 < argc) {
+            second = wcschr(argv[++i], L',');
+            gSampling.ProcessRate = wcstoul(argv[i], NULL, 0);
+            gSampling.ProcessBurst = (second != NULL) ? wcstoul(second + 1, NULL, 0) : gSampling.ProcessRate;
+        } else if (_wcsicmp(argv[i], L"-consultrate") == 0 && i + 1 < argc) {
+            second = wcschr(argv[++i], L',');
+            gConsultRate = wcstoul(argv[i], NULL, 0);
+            gConsultBurst = (second != NULL) ? wcstoul(second + 1, NULL, 0) : gConsultRate;
+        } else if (_wcsicmp(argv[i], L"-aggregate") == 0 && i + 1 < argc) {
+            gAggregateWindowMs = wcstoul(argv[++i], NULL, 0);
+        } else if (_wcsicmp(argv[i], L"-log") == 0 && i + 1 < argc) {
+            logPath = argv[++i];
+        } else if (_wcsicmp(argv[i], L"-workers") == 0 && i + 1 < argc) {
+            gEngineWorkerCount = wcstoul(argv[++i], NULL, 0);
+        } else if (_wcsicmp(argv[i], L"-affinity") == 0 && i + 1 < argc) {
+            i++;
+            if (_wcsicmp(argv[i], L"cpu") == 0) {
+                gEngineAffinity = AffinityProcessor;
+            } else if (_wcsicmp(argv[i], L"node") == 0) {
+                gEngineAffinity = AffinityNode;
+            } else {
+                gEngineAffinity = AffinityNone;
+            }
+        } else if (_wcsicmp(argv[i], L"-list") == 0 && i + 1 < argc) {
+            AddPolicySource(PolicySourceList, argv[++i], FALSE);
+        } else if (_wcsicmp(argv[i], L"-audit") == 0 && i + 1 < argc) {
+            AddPolicySource(PolicySourceFile, argv[++i], TRUE);
+        } else if (_wcsicmp(argv[i], L"-auditlist") == 0 && i + 1 < argc) {
+            AddPolicySource(PolicySourceList, argv[++i], TRUE);
+        } else if (_wcsicmp(argv[i], L"-compile") == 0 && i + 1 < argc) {
+            compilePath = argv[++i];
+        } else if (_wcsicmp(argv[i], L"-bundle") == 0 && i + 1 < argc) {
+            AddPolicySource(PolicySourceBundle, argv[++i], FALSE);
+        } else if (_wcsicmp(argv[i], L"-rules") == 0 && i + 1 < argc) {
+            AddPolicySource(PolicySourceRules, argv[++i], FALSE);
+        } else if (_wcsicmp(argv[i], L"-shadow") == 0) {
+            BeginShadowSources();
+            shadow = TRUE;
+        } else if (_wcsicmp(argv[i], L"-selftest") == 0) {
+            selfTest = TRUE;
+        } else {
+            AddPolicySource(PolicySourceFile, argv[i], FALSE);
         }
     }
 
-    if (gProtectedFileCount == 0) {
+    //
+    //  The self-test needs neither the volumes nor the filter
+    //
+
+    if (selfTest) {
+        status = SelfTestRules() ? 0 : 1;
+        DeleteCriticalSection(&gConsultantLock);
+        return status;
+    }
+
+    //
+    //  Map drive letters and mount points to volume devices, to convert
+    //  protected paths and to show the names in events
+    //
+
+    if (!InitializeVolumeMap()) {
+        wprintf(L"ERROR: Failed to enumerate volumes\n");
+        DeleteCriticalSection(&gConsultantLock);
+        return 1;
+    }
+
+    //
+    //  Compiling a bundle does not need the filter
+    //
+
+    if (compilePath != NULL) {
+        LoadProtectedFiles(FALSE, TRUE);
+        i = CompilePolicyBundle(compilePath) ? 0 : 1;
+        UninitializeVolumeMap();
+        DeleteCriticalSection(&gConsultantLock);
+        return i;
+    }
+
+    policy = BuildUserPolicy(FALSE, TRUE);
+
+    if (policy == NULL) {
+        UninitializeVolumeMap();
+        DeleteCriticalSection(&gConsultantLock);
+        return 1;
+    }
+
+    if (shadow) {
+
+        wprintf(L"\nShadow policy:\n");
+        shadowPolicy = BuildUserPolicy(TRUE, TRUE);
+
+        if (shadowPolicy == NULL) {
+            FreeUserPolicy(policy);
+            UninitializeVolumeMap();
+            DeleteCriticalSection(&gConsultantLock);
+            return 1;
+        }
+    }
+
+    if (policy->MonitorAll) {
         wprintf(L"\nNo files specified - will display ALL file access events.\n");
         wprintf(L"Press Ctrl+C to exit.\n\n");
     } else {
-        wprintf(L"\nMonitoring %lu file(s). Press Ctrl+C to exit.\n\n", gProtectedFileCount);
+        wprintf(L"\nMonitoring %lu file(s). Press Ctrl+C to exit.\n\n",
+                policy->Bundle != NULL ? policy->Bundle->FileCount : policy->FileCount);
     }
 
     //
@@ -211,6 +445,11 @@ Return Value:
         wprintf(L"ERROR: Failed to connect to filter (0x%08X)\n", hr);
         wprintf(L"Make sure the avf driver is loaded.\n");
         wprintf(L"Run: fltmc load avf\n");
+        FreeUserPolicy(policy);
+        if (shadowPolicy != NULL) {
+            FreeUserPolicy(shadowPolicy);
+        }
+        UninitializeVolumeMap();
         DeleteCriticalSection(&gConsultantLock);
         return 1;
     }
@@ -218,136 +457,137 @@ Return Value:
     wprintf(L"Connected to avf filter.\n");
 
     //
-    //  Create I/O completion port
+    //  Tell the filter which volumes and paths to watch
     //
 
-    gCompletionPort = CreateIoCompletionPort(gPort, NULL, 0, AVF_WORKER_THREAD_COUNT);
-    if (gCompletionPort == NULL) {
-        wprintf(L"ERROR: Failed to create completion port (error %lu)\n", GetLastError());
+    if (!PublishUserPolicy(policy)) {
+        if (shadowPolicy != NULL) {
+            FreeUserPolicy(shadowPolicy);
+        }
         CloseHandle(gPort);
+        UninitializeVolumeMap();
         DeleteCriticalSection(&gConsultantLock);
         return 1;
     }
 
     //
-    //  Try to connect to security consultant
-    //
-
-    if (ConnectToConsultant()) {
-        wprintf(L"Connected to security consultant.\n");
-    } else {
-        wprintf(L"Security consultant not available - will allow all operations.\n");
-        wprintf(L"Start consultant to enable security decisions.\n");
-    }
-
-    wprintf(L"\nStarting %d worker threads...\n", AVF_WORKER_THREAD_COUNT);
-
-    //
-    //  Set up worker context
+    //  The candidate policy is only read by the shadow thread, which has to
+    //  be running before the engine queues events for it
     //
 
-    workerContext.Port = gPort;
-    workerContext.CompletionPort = gCompletionPort;
-
-    //
-    //  Create worker threads
-    //
+    if (shadowPolicy != NULL) {
 
-    for (i = 0; i < AVF_WORKER_THREAD_COUNT; i++) {
-        workerThreads[i] = CreateThread(
-                            NULL,
-                            0,
-                            WorkerThread,
-                            &workerContext,
-                            0,
-                            &threadId);
+        PublishShadowPolicy(shadowPolicy);
 
-        if (workerThreads[i] == NULL) {
-            wprintf(L"ERROR: Failed to create worker thread %d (error %lu)\n", i, GetLastError());
-        } else {
-            wprintf(L"  Worker thread %d started (TID %lu)\n", i, threadId);
+        if (!StartShadow()) {
+            CloseHandle(gPort);
+            UnpublishUserPolicy();
+            UninitializeVolumeMap();
+            DeleteCriticalSection(&gConsultantLock);
+            return 1;
         }
     }
 
     //
-    //  Allocate message structures and queue initial async reads
+    //  The plugin is called by the engine workers
     //
 
-    for (i = 0; i < AVF_MAX_PENDING_REQUESTS; i++) {
-        messages[i] = (PAVF_MESSAGE)HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, sizeof(AVF_MESSAGE));
-        if (messages[i] != NULL) {
-            hr = FilterGetMessage(gPort, &messages[i]->Header, sizeof(AVF_MESSAGE), &messages[i]->Overlapped);
-            if (hr != HRESULT_FROM_WIN32(ERROR_IO_PENDING) && FAILED(hr)) {
-                wprintf(L"WARNING: Failed to queue message %d (0x%08X)\n", i, hr);
-            }
-        }
+    if (!LoadPlugin()) {
+        StopShadow();
+        CloseHandle(gPort);
+        UnpublishUserPolicy();
+        UninitializeVolumeMap();
+        DeleteCriticalSection(&gConsultantLock);
+        return 1;
     }
 
-    wprintf(L"\nWaiting for file access events...\n\n");
-
     //
-    //  Wait for shutdown signal
+    //  Aggregated events go to the console and the -log file.  Without the
+    //  file they still go to the console.
     //
 
-    while (gRunning) {
-        Sleep(100);
-    }
+    InitializeLogging(logPath);
+    InitializeAggregation();
 
     //
-    //  Signal workers to stop by posting completion packets
+    //  Start the engine workers, each with its own connection to the filter
+    //  and completion port.  The consultant pipe joins the first worker's
+    //  port when connected.
     //
 
-    for (i = 0; i < AVF_WORKER_THREAD_COUNT; i++) {
-        PostQueuedCompletionStatus(gCompletionPort, 0, 0, NULL);
+    if (!StartEngine()) {
+        UninitializeAggregation();
+        ShutdownLogging();
+        UnloadPlugin();
+        StopShadow();
+        CloseHandle(gPort);
+        UnpublishUserPolicy();
+        UninitializeVolumeMap();
+        DeleteCriticalSection(&gConsultantLock);
+        return 1;
     }
 
     //
-    //  Wait for worker threads to exit
+    //  Try to connect to security consultant
     //
 
-    WaitForMultipleObjects(AVF_WORKER_THREAD_COUNT, workerThreads, TRUE, 5000);
+    StartConsultant();
+
+    wprintf(L"\nWaiting for file access events...\n\n");
 
     //
-    //  Cleanup worker threads
+    //  Wait for shutdown signal, reloading the policy when its list files
+    //  or bundle change.  The engine keeps deciding on the old policy until
+    //  the new one is published.
     //
 
-    for (i = 0; i < AVF_WORKER_THREAD_COUNT; i++) {
-        if (workerThreads[i] != NULL) {
-            CloseHandle(workerThreads[i]);
+    while (gRunning) {
+
+        Sleep(100);
+
+        RefreshVolumeMapIfStale();
+        FlushAggregatedEvents(FALSE);
+
+        if (gReloadRequested || ++ticks % AVF_RELOAD_CHECK_INTERVAL == 0) {
+            ReloadPolicyIfChanged(gReloadRequested);
+            gReloadRequested = FALSE;
         }
     }
 
     //
-    //  Free message structures
+    //  Fail the consultations in flight, then let the engine send the
+    //  verdicts it still owes
     //
 
-    for (i = 0; i < AVF_MAX_PENDING_REQUESTS; i++) {
-        if (messages[i] != NULL) {
-            HeapFree(GetProcessHeap(), 0, messages[i]);
-        }
-    }
+    StopConsultant();
+    StopEngine();
+    UnloadPlugin();
+    StopShadow();
+    FlushAggregatedEvents(TRUE);
+    UninitializeAggregation();
+
+    PrintVolumeStatistics();
+    PrintScheduleStatistics();
+    PrintCoalesceStatistics();
+    PrintFanOutStatistics();
+    PrintPluginStatistics();
+    PrintRuleStatistics();
+    PrintShadowStatistics();
+    PrintSamplingStatistics();
+    PrintAggregateStatistics();
 
     //
     //  Cleanup
     //
 
-    EnterCriticalSection(&gConsultantLock);
-    if (gConsultantPipe != INVALID_HANDLE_VALUE) {
-        CloseHandle(gConsultantPipe);
-        gConsultantPipe = INVALID_HANDLE_VALUE;
-    }
-    LeaveCriticalSection(&gConsultantLock);
-
-    if (gCompletionPort != INVALID_HANDLE_VALUE) {
-        CloseHandle(gCompletionPort);
-        gCompletionPort = INVALID_HANDLE_VALUE;
-    }
-
     if (gPort != INVALID_HANDLE_VALUE) {
         CloseHandle(gPort);
         gPort = INVALID_HANDLE_VALUE;
     }
 
+    ShutdownLogging();
+    UnpublishUserPolicy();
+    UninitializeVolumeMap();
     DeleteCriticalSection(&gConsultantLock);
 
     wprintf(L"\nExiting...\n");
@@ -355,628 +595,999 @@ Return Value:
 }
 
 
-DWORD WINAPI
-WorkerThread(
-    _In_ LPVOID lpParameter
+BOOL
+AddProtectedFile(
+    _In_ PCWSTR FilePath,
+    _In_ BOOLEAN Audit
     )
 /*++
 
 Routine Description:
 
-    Worker thread that processes file access notifications from the kernel.
+    Adds a file to the protected files list.
 
 Arguments:
 
-    lpParameter - Pointer to AVF_WORKER_CONTEXT.
+    FilePath - Path to the file to protect.
+    Audit - Access to the file is allowed at once and audited.
 
 Return Value:
 
-    Thread exit code.
+    TRUE if successful, FALSE otherwise.
 
 --*/
 {
-    PAVF_WORKER_CONTEXT context = (PAVF_WORKER_CONTEXT)lpParameter;
-    DWORD bytesTransferred;
-    ULONG_PTR completionKey;
-    LPOVERLAPPED overlapped;
-    PAVF_MESSAGE message;
-    PAVF_FILE_NOTIFICATION pNotification;
-    HRESULT hr;
-    DWORD threadId = GetCurrentThreadId();
+    PAVF_PROTECTED_FILE entry;
+    PAVF_PROTECTED_FILE newFiles;
+    WCHAR ntPath[AVF_MAX_PATH];
+    ULONG newCapacity;
+    DWORD attributes;
+    HANDLE file;
+    FILE_ID_INFO idInfo;
+    size_t len;
 
-    struct {
-        FILTER_REPLY_HEADER Header;
-        AVF_REPLY Reply;
-    } replyBuffer;
+    if (gProtectedFileCount == gProtectedFileCapacity) {
 
-    while (gRunning) {
-        //
-        //  Wait for a completion packet
-        //
+        newCapacity = (gProtectedFileCapacity == 0) ? 64 : gProtectedFileCapacity * 2;
 
-        if (!GetQueuedCompletionStatus(
-                context->CompletionPort,
-                &bytesTransferred,
-                &completionKey,
-                &overlapped,
-                1000)) {  // 1 second timeout
+        if (gProtectedFiles == NULL) {
+            newFiles = HeapAlloc(GetProcessHeap(), 0, newCapacity * sizeof(AVF_PROTECTED_FILE));
+        } else {
+            newFiles = HeapReAlloc(GetProcessHeap(), 0, gProtectedFiles, newCapacity * sizeof(AVF_PROTECTED_FILE));
+        }
 
-            DWORD error = GetLastError();
-            if (error == WAIT_TIMEOUT) {
-                continue;
-            }
-            if (error == ERROR_OPERATION_ABORTED) {
-                continue;
-            }
-            break;
+        if (newFiles == NULL) {
+            wprintf(L"WARNING: Out of memory adding protected file\n");
+            return FALSE;
         }
 
-        //
-        //  Check for shutdown signal (NULL overlapped)
-        //
+        gProtectedFiles = newFiles;
+        gProtectedFileCapacity = newCapacity;
+    }
+
+    entry = &gProtectedFiles[gProtectedFileCount];
+    RtlZeroMemory(entry, sizeof(AVF_PROTECTED_FILE));
+    entry->Audit = Audit;
+
+    //
+    //  Convert Win32 path to NT device path for comparison with kernel
+    //  paths.  A path that exists is asked for its final name, which
+    //  follows junctions and symbolic links to where the filter sees the
+    //  opens; one that does not is converted lexically.
+    //
 
-        if (overlapped == NULL) {
-            break;
+    file = CreateFileW(FilePath,
+                       FILE_READ_ATTRIBUTES,
+                       FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+                       NULL,
+                       OPEN_EXISTING,
+                       FILE_FLAG_BACKUP_SEMANTICS,
+                       NULL);
+
+    len = 0;
+
+    if (file != INVALID_HANDLE_VALUE) {
+
+        len = GetFinalPathNameByHandleW(file,
+                                        ntPath,
+                                        AVF_MAX_PATH,
+                                        FILE_NAME_NORMALIZED | VOLUME_NAME_NT);
+
+        if (len > 0 && len < AVF_MAX_PATH) {
+            _wcsupr_s(ntPath, AVF_MAX_PATH);
+            entry->VolumeLength = GetNtVolumeLength(ntPath);
+        } else {
+            len = 0;
         }
+    }
+
+    if (len == 0 &&
+        !ConvertToNtPath(FilePath,
+                         ntPath,
+                         AVF_MAX_PATH,
+                         &entry->VolumeLength)) {
+        wprintf(L"WARNING: Failed to convert path: %s\n", FilePath);
+        goto Error;
+    }
+
+    if (entry->VolumeLength == 0 || entry->VolumeLength > AVF_MAX_VOLUME_NAME) {
+        wprintf(L"WARNING: Not on a known volume: %s\n", FilePath);
+        goto Error;
+    }
+
+    len = wcslen(ntPath) + 1;
+    entry->Path = HeapAlloc(GetProcessHeap(), 0, len * sizeof(WCHAR));
+
+    if (entry->Path == NULL) {
+        wprintf(L"WARNING: Out of memory adding protected file\n");
+        goto Error;
+    }
+
+    wcscpy_s(entry->Path, len, ntPath);
+
+    //
+    //  A directory protects everything below it
+    //
+
+    attributes = GetFileAttributesW(FilePath);
+    entry->Directory = (attributes != INVALID_FILE_ATTRIBUTES &&
+                        FlagOn(attributes, FILE_ATTRIBUTE_DIRECTORY));
+
+    if (entry->Directory) {
 
         //
-        //  Get the message structure from the overlapped pointer
+        //  Drop the trailing backslash, except on the volume root
         //
 
-        message = CONTAINING_RECORD(overlapped, AVF_MESSAGE, Overlapped);
-        pNotification = &message->Notification;
+        len = wcslen(entry->Path);
+        if (len > entry->VolumeLength + 1 && entry->Path[len - 1] == L'\\') {
+            entry->Path[len - 1] = L'\0';
+        }
+
+    } else if (file != INVALID_HANDLE_VALUE) {
 
         //
-        //  Check if this file is in our protected list
+        //  An existing file is protected by its file ID, which follows it
+        //  across renames and covers every hard link to it.  Files that do
+        //  not exist yet fall back to a path rule.
         //
 
-        if (gProtectedFileCount == 0 || IsFileProtected(pNotification->FileName)) {
+        if (GetFileInformationByHandleEx(file, FileIdInfo, &idInfo, sizeof(idInfo))) {
+            entry->FileId = idInfo.FileId;
+            entry->HasFileId = TRUE;
+        }
+    }
 
-            //
-            //  Print the file access information
-            //
+    if (file != INVALID_HANDLE_VALUE) {
+        CloseHandle(file);
+    }
 
-            wprintf(L"[T%lu] [%s] PID: %5lu  Process: %-20s  File: %s\n",
-                    threadId,
-                    pNotification->MajorFunction == IRP_MJ_CREATE ? L"OPEN " :
-                    pNotification->MajorFunction == IRP_MJ_READ ? L"READ " : L"WRITE",
-                    pNotification->ProcessId,
-                    pNotification->ProcessName,
-                    pNotification->FileName);
+    gProtectedFileCount++;
+    return TRUE;
 
-            //
-            //  Query security consultant (thread-safe)
-            //
+Error:
 
-            EnterCriticalSection(&gConsultantLock);
+    if (file != INVALID_HANDLE_VALUE) {
+        CloseHandle(file);
+    }
 
-            if (!gConsultantConnected) {
-                //
-                //  Try to reconnect to consultant
-                //
-                if (ConnectToConsultant()) {
-                    wprintf(L"  [T%lu] -> Connected to security consultant\n", threadId);
-                }
-            }
+    return FALSE;
+}
 
-            if (gConsultantConnected) {
-                AVF_CONSULTANT_RESPONSE response;
-
-                LeaveCriticalSection(&gConsultantLock);
-
-                //
-                //  Query consultant outside of lock to allow concurrent queries
-                //
-
-                EnterCriticalSection(&gConsultantLock);
-                BOOL connected = gConsultantConnected;
-                LeaveCriticalSection(&gConsultantLock);
-
-                if (connected && QueryConsultant(pNotification, &response)) {
-                    if (response.Decision == AVF_DECISION_BLOCK) {
-                        wprintf(L"  [T%lu] -> BLOCKED by consultant (reason code: %lu)\n", threadId, response.Reason);
-                        replyBuffer.Reply.BlockOperation = 1;
-                    } else {
-                        wprintf(L"  [T%lu] -> ALLOWED by consultant\n", threadId);
-                        replyBuffer.Reply.BlockOperation = 0;
-                    }
-                } else {
-                    wprintf(L"  [T%lu] -> Consultant disconnected, allowing\n", threadId);
-                    replyBuffer.Reply.BlockOperation = 0;
-                }
-            } else {
-                LeaveCriticalSection(&gConsultantLock);
-                replyBuffer.Reply.BlockOperation = 0;
-            }
-        } else {
-            //
-            //  Not a protected file - allow
-            //
-            replyBuffer.Reply.BlockOperation = 0;
-        }
 
-        //
-        //  Send reply back to kernel
-        //
+ULONG
+LoadProtectedFileList(
+    _In_ PCWSTR ListPath,
+    _In_ BOOLEAN Audit
+    )
+/*++
 
-        replyBuffer.Header.Status = 0;
-        replyBuffer.Header.MessageId = message->Header.MessageId;
+Routine Description:
+
+    Adds every path in a list file to the protected files list.  The file
+    holds one Win32 path per line; blank lines and lines starting with '#'
+    are skipped.
+
+Arguments:
 
-        hr = FilterReplyMessage(
-                context->Port,
-                &replyBuffer.Header,
-                sizeof(replyBuffer.Header) + sizeof(replyBuffer.Reply));
+    ListPath - Path of the list file.
+    Audit - Access to the files is allowed at once and audited.
 
-        if (FAILED(hr)) {
-            wprintf(L"  [T%lu] WARNING: FilterReplyMessage failed (0x%08X)\n", threadId, hr);
+Return Value:
+
+    Number of files added.
+
+--*/
+{
+    FILE *list;
+    WCHAR line[AVF_MAX_PATH];
+    ULONG added = 0;
+    size_t len;
+
+    if (_wfopen_s(&list, ListPath, L"rt, ccs=UTF-8") != 0) {
+        wprintf(L"WARNING: Failed to open list file: %s\n", ListPath);
+        return 0;
+    }
+
+    while (fgetws(line, AVF_MAX_PATH, list) != NULL) {
+
+        len = wcslen(line);
+        while (len > 0 && (line[len - 1] == L'\n' || line[len - 1] == L'\r' ||
+                           line[len - 1] == L' ' || line[len - 1] == L'\t')) {
+            line[--len] = L'\0';
         }
 
-        //
-        //  Queue another async read using the same message buffer
-        //
+        if (len == 0 || line[0] == L'#') {
+            continue;
+        }
 
-        RtlZeroMemory(&message->Overlapped, sizeof(OVERLAPPED));
-        hr = FilterGetMessage(context->Port, &message->Header, sizeof(AVF_MESSAGE), &message->Overlapped);
-        if (hr != HRESULT_FROM_WIN32(ERROR_IO_PENDING) && FAILED(hr)) {
-            if (hr != HRESULT_FROM_WIN32(ERROR_OPERATION_ABORTED)) {
-                wprintf(L"  [T%lu] WARNING: FilterGetMessage failed (0x%08X)\n", threadId, hr);
-            }
+        if (AddProtectedFile(line, Audit)) {
+            added++;
         }
     }
 
-    wprintf(L"  [T%lu] Worker thread exiting\n", threadId);
-    return 0;
+    fclose(list);
+    return added;
 }
 
 
 BOOL
-ConvertToNtPath(
-    _In_ PCWSTR Win32Path,
-    _Out_writes_(NtPathSize) PWSTR NtPath,
-    _In_ ULONG NtPathSize
+IsFileProtected(
+    _In_ PAVF_USER_POLICY Policy,
+    _In_ PCWSTR FilePath
     )
 /*++
 
 Routine Description:
 
-    Converts a Win32 path (C:\...) to NT device path (\Device\HarddiskVolumeX\...).
+    Checks if a file is in the protected files list or policy bundle of a
+    user policy.
 
 Arguments:
 
-    Win32Path - Win32 path to convert.
-    NtPath - Buffer to receive NT path.
-    NtPathSize - Size of buffer in characters.
+    Policy - The user policy to check against.
+    FilePath - NT device path to check (from kernel notification).
 
 Return Value:
 
-    TRUE if successful, FALSE otherwise.
+    TRUE if the file is protected, FALSE otherwise.
 
 --*/
 {
-    WCHAR fullPath[MAX_PATH];
-    WCHAR drive[3];
-    WCHAR deviceName[MAX_PATH];
-    DWORD result;
-    size_t deviceLen;
-    size_t pathLen;
+    WCHAR upperPath[AVF_MAX_PATH];
+    ULONG i;
 
     //
-    //  Get full path name first
+    //  Convert kernel path to uppercase for comparison
     //
 
-    result = GetFullPathNameW(Win32Path, MAX_PATH, fullPath, NULL);
-    if (result == 0 || result >= MAX_PATH) {
-        return FALSE;
+    UpcaseFilePath(FilePath, upperPath);
+
+    if (Policy->Bundle != NULL) {
+        return IsPathInPolicyBundle(Policy->Bundle, upperPath);
     }
 
     //
-    //  Extract drive letter (e.g., "C:")
+    //  Check against protected files list (exact match for files, prefix
+    //  match for directories)
     //
 
-    if (fullPath[1] != L':') {
-        //
-        //  Not a drive-letter path, just copy as-is
-        //
-        wcsncpy_s(NtPath, NtPathSize, fullPath, _TRUNCATE);
-        _wcsupr_s(NtPath, NtPathSize);
-        return TRUE;
+    for (i = 0; i < Policy->FileCount; i++) {
+        if (MatchProtectedFile(&Policy->Files[i], upperPath)) {
+            return TRUE;
+        }
     }
 
-    drive[0] = fullPath[0];
-    drive[1] = L':';
-    drive[2] = L'\0';
+    return FALSE;
+}
 
-    //
-    //  Query the DOS device name to get NT device path
-    //
 
-    result = QueryDosDeviceW(drive, deviceName, MAX_PATH);
-    if (result == 0) {
-        return FALSE;
-    }
+BOOL
+IsFileAudited(
+    _In_ PAVF_USER_POLICY Policy,
+    _In_ PAVF_FILE_NOTIFICATION pNotification
+    )
+/*++
 
-    //
-    //  Build NT path: \Device\HarddiskVolumeX + rest of path after drive letter
-    //
+Routine Description:
+
+    Checks if access to a protected file is audited rather than waited
+    for.  A file that a protecting entry names as well is not.
 
-    deviceLen = wcslen(deviceName);
-    pathLen = wcslen(fullPath + 2);  // Skip "C:"
+Arguments:
+
+    Policy - The user policy to check against.
+    pNotification - File access notification for the file.
+
+Return Value:
+
+    TRUE if the file is audited, FALSE otherwise.
+
+--*/
+{
+    WCHAR upperPath[AVF_MAX_PATH];
+    BOOL audited = FALSE;
+    ULONG i;
 
-    if (deviceLen + pathLen + 1 >= NtPathSize) {
+    if (Policy->AuditCount == 0) {
         return FALSE;
     }
 
-    wcscpy_s(NtPath, NtPathSize, deviceName);
-    wcscat_s(NtPath, NtPathSize, fullPath + 2);  // Append path after "C:"
+    if (FlagOn(pNotification->Flags, AVF_NOTIFY_FLAG_FILE_ID_VALID) &&
+        Policy->AuditIdCount != 0 &&
+        bsearch(&pNotification->FileId, Policy->AuditIds, Policy->AuditIdCount, sizeof(FILE_ID_128), CompareFileIds) != NULL) {
 
-    //
-    //  Convert to uppercase for case-insensitive comparison
-    //
+        audited = TRUE;
+    }
 
-    _wcsupr_s(NtPath, NtPathSize);
+    UpcaseFilePath(pNotification->FileName, upperPath);
 
-    return TRUE;
+    for (i = 0; i < Policy->FileCount; i++) {
+
+        if (MatchProtectedFile(&Policy->Files[i], upperPath)) {
+
+            if (!Policy->Files[i].Audit) {
+                return FALSE;
+            }
+
+            audited = TRUE;
+        }
+    }
+
+    return audited;
 }
 
 
 BOOL
-AddProtectedFile(
-    _In_ PCWSTR FilePath
+BuildAuditSet(
+    _Inout_ PAVF_USER_POLICY Policy
     )
 /*++
 
 Routine Description:
 
-    Adds a file to the protected files list.
+    Counts the audited files of a user policy built from a protected files
+    list and keeps their file IDs, sorted, for IsFileAudited.
 
 Arguments:
 
-    FilePath - Path to the file to protect.
+    Policy - The user policy, owning its protected files list.
 
 Return Value:
 
-    TRUE if successful, FALSE otherwise.
+    TRUE if successful, FALSE if out of memory.
 
 --*/
 {
-    if (gProtectedFileCount >= MAX_PROTECTED_FILES) {
-        wprintf(L"WARNING: Maximum protected file limit reached (%d)\n", MAX_PROTECTED_FILES);
-        return FALSE;
+    ULONG i;
+
+    for (i = 0; i < Policy->FileCount; i++) {
+        if (Policy->Files[i].Audit) {
+            Policy->AuditCount++;
+        }
     }
 
-    //
-    //  Convert Win32 path to NT device path for comparison with kernel paths
-    //
+    if (Policy->AuditCount == 0) {
+        return TRUE;
+    }
 
-    if (!ConvertToNtPath(FilePath, 
-                         gProtectedFiles[gProtectedFileCount], 
-                         AVF_MAX_PATH)) {
-        wprintf(L"WARNING: Failed to convert path: %s\n", FilePath);
+    Policy->AuditIds = HeapAlloc(GetProcessHeap(), 0, Policy->AuditCount * sizeof(FILE_ID_128));
+
+    if (Policy->AuditIds == NULL) {
+        wprintf(L"ERROR: Out of memory building policy\n");
         return FALSE;
     }
 
-    gProtectedFileCount++;
+    for (i = 0; i < Policy->FileCount; i++) {
+        if (Policy->Files[i].Audit && Policy->Files[i].HasFileId) {
+            Policy->AuditIds[Policy->AuditIdCount++] = Policy->Files[i].FileId;
+        }
+    }
+
+    qsort(Policy->AuditIds, Policy->AuditIdCount, sizeof(FILE_ID_128), CompareFileIds);
+
     return TRUE;
 }
 
 
-BOOL
-IsFileProtected(
-    _In_ PCWSTR FilePath
+VOID
+UpcaseFilePath(
+    _In_ PCWSTR FilePath,
+    _Out_writes_(AVF_MAX_PATH) PWCHAR UpperPath
     )
 /*++
 
 Routine Description:
 
-    Checks if a file is in the protected files list.
+    Copies a path from a kernel notification upper-cased, as the paths of
+    the protected files list are, truncating it to AVF_MAX_PATH.
 
 Arguments:
 
-    FilePath - NT device path to check (from kernel notification).
+    FilePath - NT device path.
+    UpperPath - Receives the upper-case path.
 
 Return Value:
 
-    TRUE if the file is protected, FALSE otherwise.
+    None.
 
 --*/
 {
-    WCHAR upperPath[AVF_MAX_PATH];
-    ULONG i;
     size_t len;
 
-    //
-    //  Convert kernel path to uppercase for comparison
-    //
-
     len = wcslen(FilePath);
     if (len >= AVF_MAX_PATH) {
         len = AVF_MAX_PATH - 1;
     }
 
-    wcsncpy_s(upperPath, AVF_MAX_PATH, FilePath, len);
-    upperPath[len] = L'\0';
-    _wcsupr_s(upperPath, AVF_MAX_PATH);
+    wcsncpy_s(UpperPath, AVF_MAX_PATH, FilePath, len);
+    UpperPath[len] = L'\0';
+    _wcsupr_s(UpperPath, AVF_MAX_PATH);
+}
+
 
-    //
-    //  Check against protected files list (exact match)
-    //
+BOOL
+MatchProtectedFile(
+    _In_ PAVF_PROTECTED_FILE File,
+    _In_ PCWSTR UpperPath
+    )
+/*++
 
-    for (i = 0; i < gProtectedFileCount; i++) {
-        if (wcscmp(upperPath, gProtectedFiles[i]) == 0) {
-            return TRUE;
-        }
+Routine Description:
+
+    Checks a path against a protected files list entry: an exact match for
+    a file, a prefix match for a directory.
+
+Arguments:
+
+    File - The entry.
+    UpperPath - Upper-case NT device path.
+
+Return Value:
+
+    TRUE if the entry covers the path, FALSE otherwise.
+
+--*/
+{
+    size_t len;
+
+    if (!File->Directory) {
+        return wcscmp(UpperPath, File->Path) == 0;
     }
 
-    return FALSE;
-}
+    len = wcslen(File->Path);
 
+    return wcsncmp(UpperPath, File->Path, len) == 0 &&
+           (UpperPath[len] == L'\0' ||
+            UpperPath[len] == L'\\' ||
+            File->Path[len - 1] == L'\\');
+}
 
-BOOL WINAPI
-ConsoleCtrlHandler(
-    DWORD CtrlType
+BOOL
+IsFileIdProtected(
+    _In_ PAVF_USER_POLICY Policy,
+    _In_ const FILE_ID_128 *FileId
     )
 /*++
 
 Routine Description:
 
-    Console control handler for clean shutdown.
+    Checks if a file ID belongs to a protected file.  This is the exact
+    check behind a Bloom filter match in the kernel.
 
 Arguments:
 
-    CtrlType - Type of control signal.
+    Policy - The user policy to check against.
+    FileId - File ID from the kernel notification.
 
 Return Value:
 
-    TRUE if handled.
+    TRUE if the file is protected, FALSE otherwise.
 
 --*/
 {
-    UNREFERENCED_PARAMETER(CtrlType);
+    return Policy->FileIdCount != 0 &&
+           bsearch(FileId, Policy->FileIds, Policy->FileIdCount, sizeof(FILE_ID_128), CompareFileIds) != NULL;
+}
 
-    gRunning = FALSE;
 
-    //
-    //  Cancel pending I/O on the port
-    //
+int __cdecl
+CompareFileIds(
+    _In_ const void *Left,
+    _In_ const void *Right
+    )
+{
+    return memcmp(Left, Right, sizeof(FILE_ID_128));
+}
 
-    if (gPort != INVALID_HANDLE_VALUE) {
-        CancelIoEx(gPort, NULL);
+
+int __cdecl
+CompareProtectedFiles(
+    _In_ const void *Left,
+    _In_ const void *Right
+    )
+{
+    const AVF_PROTECTED_FILE *left = Left;
+    const AVF_PROTECTED_FILE *right = Right;
+
+    if (left->VolumeLength != right->VolumeLength) {
+        return (left->VolumeLength < right->VolumeLength) ? -1 : 1;
     }
 
-    return TRUE;
+    return _wcsnicmp(left->Path, right->Path, left->VolumeLength);
 }
 
 
-BOOL
-ConnectToConsultant(
-    VOID
+VOID
+ComputeBloomGeometry(
+    _In_ ULONG Count,
+    _Out_ PULONG BitCount,
+    _Out_ PULONG HashCount
     )
 /*++
 
 Routine Description:
 
-    Connects to the security consultant process via named pipe and performs handshake.
+    Sizes a Bloom filter for Count file IDs.  With -bloomsize the size is
+    given and only the number of hashes is chosen; otherwise the size is
+    the smallest that meets the -bloomfpr false positive rate.
 
 Arguments:
 
-    None.
+    Count - Number of file IDs in the filter.
+    BitCount - Receives the size in bits, a multiple of 32.
+    HashCount - Receives the number of bits set per file ID.
 
 Return Value:
 
-    TRUE if connected and handshake succeeded, FALSE otherwise.
+    None.
 
 --*/
 {
-    AVF_CONSULTANT_REQUEST handshakeRequest;
-    AVF_CONSULTANT_RESPONSE handshakeResponse;
-    DWORD bytesWritten;
-    DWORD bytesRead;
-    DWORD mode;
+    double bits;
+    double hashes;
 
-    //
-    //  Try to connect to the consultant's named pipe
-    //
+    if (gBloomSizeBytes != 0) {
+        bits = (double)gBloomSizeBytes * 8;
+    } else {
+        bits = -(double)Count * log(gBloomFalsePositiveRate) / (log(2.0) * log(2.0));
+    }
 
-    wprintf(L"  [Handshake] Connecting to consultant pipe...\n");
+    if (bits < 64) {
+        bits = 64;
+    }
+
+    if (bits > AVF_MAX_BLOOM_BITS) {
+        bits = AVF_MAX_BLOOM_BITS;
+    }
 
-    gConsultantPipe = CreateFileW(
-                        AVF_CONSULTANT_PIPE_NAME,
-                        GENERIC_READ | GENERIC_WRITE,
-                        0,
-                        NULL,
-                        OPEN_EXISTING,
-                        0,
-                        NULL);
+    *BitCount = (ULONG)ROUND_TO_SIZE((ULONG)bits, 32);
 
-    if (gConsultantPipe == INVALID_HANDLE_VALUE) {
-        wprintf(L"  [Handshake] Failed to open pipe (error %lu)\n", GetLastError());
-        gConsultantConnected = FALSE;
-        return FALSE;
+    hashes = floor((double)*BitCount / (Count ? Count : 1) * log(2.0) + 0.5);
+
+    if (hashes < 1) {
+        hashes = 1;
+    }
+
+    if (hashes > AVF_MAX_BLOOM_HASHES) {
+        hashes = AVF_MAX_BLOOM_HASHES;
     }
 
-    wprintf(L"  [Handshake] Pipe opened, setting message mode...\n");
+    *HashCount = (ULONG)hashes;
+}
+
+
+PAVF_POLICY_HEADER
+BuildFilterPolicy(
+    VOID
+    )
+/*++
+
+Routine Description:
+
+    Builds the filter policy from the protected files list.  Files are
+    grouped by volume so that the filter can leave volumes without
+    protected files in pass-through.  Within a volume block, files with a
+    known file ID are sent as a sorted ID list, or as a Bloom filter if one
+    was asked for, and the rest as path rules.
+
+    Also rebuilds the sorted set of every protected file ID.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    The policy, allocated from the process heap, or NULL if out of memory.
+    The caller sets its Generation and CreateFilter.
+
+--*/
+{
+    PAVF_POLICY_HEADER header;
+    PAVF_VOLUME_POLICY volumePolicy;
+    PAVF_PATH_RULE pathRule;
+    PFILE_ID_128 fileIds;
+    PULONG bloomBits;
+    PAVF_PROTECTED_FILE file;
+    BOOLEAN useBloom;
+    SIZE_T size;
+    ULONG offset;
+    ULONG volumeOffset;
+    ULONG pathLength;
+    ULONG groupEnd;
+    ULONG idCount;
+    ULONG bitCount;
+    ULONG hashCount;
+    ULONGLONG hash;
+    ULONG bit;
+    ULONG i;
+    ULONG j;
+    ULONG k;
+
+    useBloom = (gBloomFalsePositiveRate > 0.0 && gBloomFalsePositiveRate < 1.0) ||
+               gBloomSizeBytes != 0;
 
     //
-    //  Set pipe to message mode
+    //  Group the files by volume
     //
 
-    mode = PIPE_READMODE_MESSAGE;
-    if (!SetNamedPipeHandleState(gConsultantPipe, &mode, NULL, NULL)) {
-        wprintf(L"  [Handshake] Failed to set message mode (error %lu)\n", GetLastError());
-        CloseHandle(gConsultantPipe);
-        gConsultantPipe = INVALID_HANDLE_VALUE;
-        gConsultantConnected = FALSE;
-        return FALSE;
+    if (gProtectedFileCount != 0) {
+        qsort(gProtectedFiles, gProtectedFileCount, sizeof(AVF_PROTECTED_FILE), CompareProtectedFiles);
     }
 
     //
-    //  Send handshake request (RequestId = 0, Operation = 0xFF for handshake)
+    //  Keep every file ID, sorted, for the exact check in the workers
     //
 
-    wprintf(L"  [Handshake] Sending handshake request...\n");
+    if (gProtectedIds != NULL) {
+        HeapFree(GetProcessHeap(), 0, gProtectedIds);
+        gProtectedIds = NULL;
+    }
+    gProtectedIdCount = 0;
 
-    RtlZeroMemory(&handshakeRequest, sizeof(handshakeRequest));
-    handshakeRequest.Version = AVF_CONSULTANT_PROTOCOL_VERSION;
-    handshakeRequest.RequestId = 0;  // Special ID for handshake
-    handshakeRequest.ProcessId = GetCurrentProcessId();
-    handshakeRequest.Operation = 0xFF;  // Special operation for handshake
-    wcscpy_s(handshakeRequest.ProcessName, 260, L"AVF_HANDSHAKE");
-    wcscpy_s(handshakeRequest.FileName, AVF_MAX_PATH, L"HANDSHAKE_TEST");
+    if (gProtectedFileCount != 0) {
+        gProtectedIds = HeapAlloc(GetProcessHeap(), 0, gProtectedFileCount * sizeof(FILE_ID_128));
+        if (gProtectedIds == NULL) {
+            wprintf(L"ERROR: Out of memory building filter policy\n");
+            return NULL;
+        }
+    }
 
-    if (!WriteFile(gConsultantPipe, &handshakeRequest, sizeof(handshakeRequest), &bytesWritten, NULL)) {
-        wprintf(L"  [Handshake] Failed to send request (error %lu)\n", GetLastError());
-        CloseHandle(gConsultantPipe);
-        gConsultantPipe = INVALID_HANDLE_VALUE;
-        gConsultantConnected = FALSE;
-        return FALSE;
+    for (i = 0; i < gProtectedFileCount; i++) {
+        if (gProtectedFiles[i].HasFileId) {
+            gProtectedIds[gProtectedIdCount++] = gProtectedFiles[i].FileId;
+        }
     }
 
-    wprintf(L"  [Handshake] Request sent (%lu bytes), waiting for response...\n", bytesWritten);
+    qsort(gProtectedIds, gProtectedIdCount, sizeof(FILE_ID_128), CompareFileIds);
 
     //
-    //  Read handshake response
+    //  Upper bound: every file on its own volume, plus each volume's Bloom
+    //  filter
     //
 
-    if (!ReadFile(gConsultantPipe, &handshakeResponse, sizeof(handshakeResponse), &bytesRead, NULL)) {
-        wprintf(L"  [Handshake] Failed to read response (error %lu)\n", GetLastError());
-        CloseHandle(gConsultantPipe);
-        gConsultantPipe = INVALID_HANDLE_VALUE;
-        gConsultantConnected = FALSE;
-        return FALSE;
+    size = sizeof(AVF_POLICY_HEADER);
+
+    for (i = 0; i < gProtectedFileCount; i++) {
+        size += sizeof(AVF_VOLUME_POLICY) +
+                sizeof(FILE_ID_128) +
+                ROUND_TO_SIZE(FIELD_OFFSET(AVF_PATH_RULE, Path) +
+                              wcslen(gProtectedFiles[i].Path) * sizeof(WCHAR),
+                              sizeof(ULONG));
     }
 
-    wprintf(L"  [Handshake] Response received (%lu bytes)\n", bytesRead);
+    for (i = 0; useBloom && i < gProtectedFileCount; i = groupEnd) {
 
-    //
-    //  Verify handshake response
-    //
+        for (groupEnd = i, idCount = 0;
+             groupEnd < gProtectedFileCount &&
+             CompareProtectedFiles(&gProtectedFiles[i], &gProtectedFiles[groupEnd]) == 0;
+             groupEnd++) {
 
-    if (bytesRead < sizeof(handshakeResponse)) {
-        wprintf(L"  [Handshake] Response too small (%lu < %zu)\n", bytesRead, sizeof(handshakeResponse));
-        CloseHandle(gConsultantPipe);
-        gConsultantPipe = INVALID_HANDLE_VALUE;
-        gConsultantConnected = FALSE;
-        return FALSE;
-    }
+            if (gProtectedFiles[groupEnd].HasFileId) {
+                idCount++;
+            }
+        }
 
-    if (handshakeResponse.Version != AVF_CONSULTANT_PROTOCOL_VERSION) {
-        wprintf(L"  [Handshake] Version mismatch (got %lu, expected %d)\n", 
-                handshakeResponse.Version, AVF_CONSULTANT_PROTOCOL_VERSION);
-        CloseHandle(gConsultantPipe);
-        gConsultantPipe = INVALID_HANDLE_VALUE;
-        gConsultantConnected = FALSE;
-        return FALSE;
+        if (idCount != 0) {
+            ComputeBloomGeometry(idCount, &bitCount, &hashCount);
+            size += bitCount / 8;
+        }
     }
 
-    if (handshakeResponse.RequestId != 0) {
-        wprintf(L"  [Handshake] RequestId mismatch (got %lu, expected 0)\n", handshakeResponse.RequestId);
-        CloseHandle(gConsultantPipe);
-        gConsultantPipe = INVALID_HANDLE_VALUE;
-        gConsultantConnected = FALSE;
-        return FALSE;
+    header = (PAVF_POLICY_HEADER)HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, size);
+    if (header == NULL) {
+        wprintf(L"ERROR: Out of memory building filter policy\n");
+        return NULL;
     }
 
-    wprintf(L"  [Handshake] SUCCESS - Consultant ready (Decision=%lu, Reason=%lu)\n",
-            handshakeResponse.Decision, handshakeResponse.Reason);
+    header->Flags = (gProtectedFileCount == 0) ? AVF_POLICY_FLAG_MONITOR_ALL : 0;
 
-    gConsultantConnected = TRUE;
-    return TRUE;
+    offset = sizeof(AVF_POLICY_HEADER);
+
+    for (i = 0; i < gProtectedFileCount; i = groupEnd) {
+
+        //
+        //  Start a block for this file's volume.  Files on the same volume
+        //  are adjacent after the sort.
+        //
+
+        file = &gProtectedFiles[i];
+
+        for (groupEnd = i, idCount = 0;
+             groupEnd < gProtectedFileCount &&
+             CompareProtectedFiles(file, &gProtectedFiles[groupEnd]) == 0;
+             groupEnd++) {
+
+            if (gProtectedFiles[groupEnd].HasFileId) {
+                idCount++;
+            }
+        }
+
+        volumeOffset = offset;
+        volumePolicy = (PAVF_VOLUME_POLICY)Add2Ptr(header, offset);
+        volumePolicy->VolumeNameLength = (USHORT)(file->VolumeLength * sizeof(WCHAR));
+        RtlCopyMemory(volumePolicy->VolumeName, file->Path, volumePolicy->VolumeNameLength);
+        offset += sizeof(AVF_VOLUME_POLICY);
+
+        if (useBloom && idCount != 0) {
+
+            //
+            //  File IDs as a Bloom filter
+            //
+
+            ComputeBloomGeometry(idCount, &bitCount, &hashCount);
+
+            volumePolicy->BloomBitCount = bitCount;
+            volumePolicy->BloomHashCount = hashCount;
+            bloomBits = (PULONG)Add2Ptr(header, offset);
+
+            for (j = i; j < groupEnd; j++) {
+
+                if (!gProtectedFiles[j].HasFileId) {
+                    continue;
+                }
+
+                hash = AvfHashFileId(&gProtectedFiles[j].FileId);
+
+                for (k = 0; k < hashCount; k++) {
+                    bit = AvfBloomProbe(hash, k, bitCount);
+                    SetFlag(bloomBits[bit / 32], 1UL << (bit % 32));
+                }
+            }
+
+            offset += bitCount / 8;
+
+            wprintf(L"%.*s: %lu file ID(s) in a %lu KB Bloom filter, %lu hashes, expected false positive rate %.4f%%\n",
+                    file->VolumeLength,
+                    file->Path,
+                    idCount,
+                    bitCount / 8 / 1024,
+                    hashCount,
+                    100.0 * pow(1.0 - exp(-(double)hashCount * idCount / bitCount), hashCount));
+
+        } else {
+
+            //
+            //  File IDs as a list, sorted and without duplicates (hard
+            //  links to the same file share one ID)
+            //
+
+            fileIds = (PFILE_ID_128)Add2Ptr(header, offset);
+
+            for (j = i; j < groupEnd; j++) {
+                if (gProtectedFiles[j].HasFileId) {
+                    fileIds[volumePolicy->FileIdCount++] = gProtectedFiles[j].FileId;
+                }
+            }
+
+            qsort(fileIds, volumePolicy->FileIdCount, sizeof(FILE_ID_128), CompareFileIds);
+
+            for (j = 0, k = 0; j < volumePolicy->FileIdCount; j++) {
+                if (k == 0 || CompareFileIds(&fileIds[k - 1], &fileIds[j]) != 0) {
+                    fileIds[k++] = fileIds[j];
+                }
+            }
+
+            volumePolicy->FileIdCount = k;
+            offset += k * sizeof(FILE_ID_128);
+        }
+
+        //
+        //  Then path rules for directories and files without an ID
+        //
+
+        for (j = i; j < groupEnd; j++) {
+
+            if (gProtectedFiles[j].HasFileId) {
+                continue;
+            }
+
+            pathLength = (ULONG)(wcslen(gProtectedFiles[j].Path) - file->VolumeLength) * sizeof(WCHAR);
+
+            pathRule = (PAVF_PATH_RULE)Add2Ptr(header, offset);
+            pathRule->Size = (USHORT)ROUND_TO_SIZE(FIELD_OFFSET(AVF_PATH_RULE, Path) + pathLength,
+                                                   sizeof(ULONG));
+            pathRule->Flags = gProtectedFiles[j].Directory ? AVF_PATH_RULE_PREFIX : 0;
+            pathRule->PathLength = (USHORT)pathLength;
+            RtlCopyMemory(pathRule->Path,
+                          gProtectedFiles[j].Path + file->VolumeLength,
+                          pathLength);
+
+            offset += pathRule->Size;
+            volumePolicy->RuleCount++;
+        }
+
+        volumePolicy->Size = offset - volumeOffset;
+        header->VolumeCount++;
+    }
+
+    header->Size = offset;
+    return header;
 }
 
 
 BOOL
-QueryConsultant(
-    _In_ PAVF_FILE_NOTIFICATION pNotification,
-    _Out_ PAVF_CONSULTANT_RESPONSE pResponse
+SendFilterPolicy(
+    _In_ PAVF_USER_POLICY Policy
     )
 /*++
 
 Routine Description:
 
-    Sends a file access query to the security consultant and gets the response.
-    Thread-safe - uses critical section to protect pipe access.
+    Sends the filter policy of a user policy to the minifilter, which
+    switches every volume over to it as one step.
 
 Arguments:
 
-    pNotification - File access notification to query.
-    pResponse - Receives the consultant's response.
+    Policy - The user policy being published.
 
 Return Value:
 
-    TRUE if query succeeded, FALSE otherwise.
+    TRUE if the filter accepted the policy, FALSE otherwise.
 
 --*/
 {
-    AVF_CONSULTANT_REQUEST request;
-    DWORD bytesWritten;
-    DWORD bytesRead;
-    static volatile LONG requestId = 0;
-    ULONG thisRequestId;
+    PCOMMAND_MESSAGE command;
+    PAVF_POLICY_HEADER policy = Policy->FilterPolicy;
+    PAVF_POLICY_HEADER header;
+    DWORD bytesReturned;
+    HRESULT hr;
 
-    EnterCriticalSection(&gConsultantLock);
+    command = (PCOMMAND_MESSAGE)HeapAlloc(GetProcessHeap(),
+                                          0,
+                                          FIELD_OFFSET(COMMAND_MESSAGE, Data) + policy->Size);
 
-    if (!gConsultantConnected || gConsultantPipe == INVALID_HANDLE_VALUE) {
-        LeaveCriticalSection(&gConsultantLock);
+    if (command == NULL) {
+        wprintf(L"ERROR: Out of memory sending filter policy\n");
         return FALSE;
     }
 
-    //
-    //  Build request
-    //
+    command->Command = SetAvfPolicy;
+    command->Reserved = 0;
+    header = (PAVF_POLICY_HEADER)command->Data;
+    RtlCopyMemory(header, policy, policy->Size);
+    header->Generation = ++gPolicyGeneration;
+    header->CreateFilter = gCreateFilter;
+    header->Sampling = gSampling;
+
+    hr = FilterSendMessage(gPort,
+                           command,
+                           FIELD_OFFSET(COMMAND_MESSAGE, Data) + header->Size,
+                           NULL,
+                           0,
+                           &bytesReturned);
 
-    thisRequestId = (ULONG)InterlockedIncrement(&requestId);
+    if (FAILED(hr)) {
+        wprintf(L"ERROR: Filter rejected policy (0x%08X)\n", hr);
+    } else {
+        wprintf(L"Filter policy loaded (%lu volume(s)).\n", header->VolumeCount);
+    }
 
-    RtlZeroMemory(&request, sizeof(request));
-    request.Version = AVF_CONSULTANT_PROTOCOL_VERSION;
-    request.RequestId = thisRequestId;
-    request.ProcessId = pNotification->ProcessId;
-    request.Operation = pNotification->MajorFunction;
-    wcscpy_s(request.FileName, AVF_MAX_PATH, pNotification->FileName);
-    wcscpy_s(request.ProcessName, 260, pNotification->ProcessName);
+    HeapFree(GetProcessHeap(), 0, command);
+    return SUCCEEDED(hr);
+}
 
-    //
-    //  Send request
-    //
 
-    if (!WriteFile(gConsultantPipe, &request, sizeof(request), &bytesWritten, NULL)) {
-        //
-        //  Pipe broken - consultant disconnected
-        //
-        CloseHandle(gConsultantPipe);
-        gConsultantPipe = INVALID_HANDLE_VALUE;
-        gConsultantConnected = FALSE;
-        LeaveCriticalSection(&gConsultantLock);
-        return FALSE;
+VOID
+PrintVolumeStatistics(
+    VOID
+    )
+/*++
+
+Routine Description:
+
+    Queries the per-volume counters from the minifilter and prints them.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    COMMAND_MESSAGE command;
+    AVF_VOLUME_STATISTICS statistics[32];
+    DWORD bytesReturned = 0;
+    ULONG i;
+    HRESULT hr;
+
+    RtlZeroMemory(&command, sizeof(command));
+    command.Command = GetVolumeStatistics;
+
+    hr = FilterSendMessage(gPort,
+                           &command,
+                           sizeof(command),
+                           statistics,
+                           sizeof(statistics),
+                           &bytesReturned);
+
+    if (FAILED(hr) && hr != HRESULT_FROM_WIN32(ERROR_MORE_DATA)) {
+        return;
     }
 
-    //
-    //  Read response
-    //
+    wprintf(L"\nVolume statistics:\n");
+
+    for (i = 0; i < bytesReturned / sizeof(AVF_VOLUME_STATISTICS); i++) {
+        wprintf(L"  %-32s %-12s rules: %-4lu ids: %-4lu ops: %-10lld notified: %-8lld blocked: %-8lld opens filtered: %-8lld cached: %lld\n",
+                statistics[i].VolumeName,
+                statistics[i].Active ? L"active" : L"pass-through",
+                statistics[i].RuleCount,
+                statistics[i].FileIdCount,
+                statistics[i].Operations,
+                statistics[i].Notified,
+                statistics[i].Blocked,
+                statistics[i].CreatesFiltered,
+                statistics[i].CacheHits);
+
+        if (statistics[i].BloomBitCount != 0) {
+            wprintf(L"  %-32s bloom: %lu KB, %lu hashes, %lld positive(s)\n",
+                    L"",
+                    statistics[i].BloomBitCount / 8 / 1024,
+                    statistics[i].BloomHashCount,
+                    statistics[i].BloomPositives);
+        }
 
-    if (!ReadFile(gConsultantPipe, pResponse, sizeof(*pResponse), &bytesRead, NULL)) {
-        //
-        //  Pipe broken - consultant disconnected
-        //
-        CloseHandle(gConsultantPipe);
-        gConsultantPipe = INVALID_HANDLE_VALUE;
-        gConsultantConnected = FALSE;
-        LeaveCriticalSection(&gConsultantLock);
-        return FALSE;
+        if (statistics[i].SampledOut != 0 || statistics[i].RateLimited != 0) {
+            wprintf(L"  %-32s not reported: %lld sampled out, %lld over their process's rate\n",
+                    L"",
+                    statistics[i].SampledOut,
+                    statistics[i].RateLimited);
+        }
     }
 
-    LeaveCriticalSection(&gConsultantLock);
+    if (gBloomFalsePositives != 0) {
+        wprintf(L"  Bloom false positives settled by file ID: %ld\n", gBloomFalsePositives);
+    }
 
-    if (bytesRead < sizeof(*pResponse)) {
-        return FALSE;
+    if (gAudited != 0) {
+        wprintf(L"  Allowed speculatively and audited: %ld (%ld would have been blocked)\n",
+                gAudited,
+                gAuditBlocked);
+    }
+}
+
+
+BOOL WINAPI
+ConsoleCtrlHandler(
+    DWORD CtrlType
+    )
+/*++
+
+Routine Description:
+
+    Console control handler for clean shutdown and policy reload.
+
+Arguments:
+
+    CtrlType - Type of control signal.
+
+Return Value:
+
+    TRUE if handled.
+
+--*/
+{
+    //
+    //  Ctrl+Break reloads the policy
+    //
+
+    if (CtrlType == CTRL_BREAK_EVENT) {
+        gReloadRequested = TRUE;
+        return TRUE;
     }
 
+    gRunning = FALSE;
+
     //
-    //  Verify response matches request
+    //  Cancel pending I/O on the port
     //
 
-    if (pResponse->Version != AVF_CONSULTANT_PROTOCOL_VERSION ||
-        pResponse->RequestId != thisRequestId) {
-        return FALSE;
+    if (gPort != INVALID_HANDLE_VALUE) {
+        CancelIoEx(gPort, NULL);
     }
 
     return TRUE;
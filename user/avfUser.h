@@ -0,0 +1,988 @@
+/*++
+
+Copyright (c) 1989-2002  Microsoft Corporation
+Modified for AV Filter functionality
+
+Module Name:
+
+    avfUser.h
+
+Abstract:
+
+    Header file which contains the structures, type definitions, global
+    variables and function prototypes shared by the modules of the
+    user-mode component of the AV Filter.
+
+Environment:
+
+    User mode
+
+--*/
+#ifndef __AVFUSER_H__
+#define __AVFUSER_H__
+
+#include "avf.h"
+
+//
+//  Protected files list entry.  Paths are upper-case NT device paths for
+//  comparison with the names in kernel notifications.
+//
+//  Access to an audited file (-audit, -auditlist) is allowed at once and
+//  the consultant asked afterwards; its verdict is recorded and cached by
+//  the filter for the next access.
+//
+
+typedef struct _AVF_PROTECTED_FILE {
+    PWSTR Path;                    // Upper-case NT device path
+    ULONG VolumeLength;            // Leading characters of Path naming the volume
+    BOOLEAN Directory;             // Protects everything below Path
+    BOOLEAN HasFileId;             // Protected by FileId instead of Path
+    BOOLEAN Audit;                 // Allowed speculatively, then audited
+    FILE_ID_128 FileId;
+} AVF_PROTECTED_FILE, *PAVF_PROTECTED_FILE;
+
+//
+//  Policy bundle
+//
+//  A policy bundle is a protected files list compiled ahead of time by
+//  "avf -compile".  It is memory-mapped at startup and used in place: the
+//  filter policy is sent as stored, the file ID set is searched where it
+//  lies and paths are looked up in a hash table, so loading does not
+//  depend on the number of files it protects.
+//
+//  Layout, each section aligned to AVF_BUNDLE_ALIGNMENT:
+//
+//      AVF_BUNDLE_HEADER
+//      Policy      AVF_POLICY_HEADER and its volume blocks, as sent to the
+//                  filter.  Generation and CreateFilter are set when sent.
+//      FileIds     Every protected FILE_ID_128, sorted
+//      PathTable   AVF_BUNDLE_PATH_ENTRY[], a power of two, open addressing
+//                  with linear probing on AvfHashPath
+//      StringPool  The upper-case NT paths the path table refers to
+//
+//  File IDs and volume device names belong to the machine a bundle was
+//  compiled on, so a bundle is only valid there.
+//
+
+#define AVF_BUNDLE_MAGIC            'BFVA'
+#define AVF_BUNDLE_VERSION          2
+#define AVF_BUNDLE_ALIGNMENT        16
+
+typedef struct _AVF_BUNDLE_SECTION {
+    ULONGLONG Offset;              // From the start of the bundle
+    ULONGLONG Size;                // In bytes
+} AVF_BUNDLE_SECTION, *PAVF_BUNDLE_SECTION;
+
+typedef struct _AVF_BUNDLE_HEADER {
+    ULONG Magic;                   // AVF_BUNDLE_MAGIC
+    ULONG Version;                 // AVF_BUNDLE_VERSION
+    ULONG HeaderSize;              // sizeof(AVF_BUNDLE_HEADER)
+    ULONG FileCount;               // Protected files compiled in
+    ULONGLONG Size;                // Size of the whole bundle
+    AVF_BUNDLE_SECTION Policy;
+    AVF_BUNDLE_SECTION FileIds;
+    AVF_BUNDLE_SECTION PathTable;
+    AVF_BUNDLE_SECTION StringPool;
+} AVF_BUNDLE_HEADER, *PAVF_BUNDLE_HEADER;
+
+#define AVF_BUNDLE_PATH_USED        0x0001
+#define AVF_BUNDLE_PATH_DIRECTORY   0x0002
+
+typedef struct _AVF_BUNDLE_PATH_ENTRY {
+    ULONG Hash;                    // Low 32 bits of AvfHashPath
+    USHORT Flags;                  // AVF_BUNDLE_PATH_*
+    USHORT PathLength;             // In characters
+    ULONG PathOffset;              // In characters, into the string pool
+} AVF_BUNDLE_PATH_ENTRY, *PAVF_BUNDLE_PATH_ENTRY;
+
+#define AvfBundleSection(_bundle, _section) \
+    ((PVOID)((PUCHAR)(_bundle) + (_bundle)->_section.Offset))
+
+//
+//  What a local rule (-rules) does with an access; see avfRules.c
+//
+
+typedef enum _AVF_RULE_ACTION {
+    RuleActionConsult,                     // Ask the security consultant
+    RuleActionAllow,
+    RuleActionBlock,
+    RuleActionAudit,                       // Allow, then ask the consultant
+    RuleActionCount,
+    RuleActionDefer = RuleActionCount      // Not a rule's: the image's signer is not known yet
+} AVF_RULE_ACTION;
+
+typedef struct _AVF_RULES AVF_RULES, *PAVF_RULES;
+
+//
+//  A protected set as the workers see it, built from the policy sources
+//  (files, -list files or a -bundle, and -rules) and published by
+//  PublishUserPolicy.  Workers read the current one without locking,
+//  between AcquireUserPolicy and ReleaseUserPolicy; it is freed only once
+//  no worker can still be reading it.
+//
+
+typedef struct _AVF_USER_POLICY {
+    PAVF_PROTECTED_FILE Files;             // Protected files list; NULL with a bundle
+    ULONG FileCount;
+    PFILE_ID_128 FileIds;                  // Sorted, for Bloom filter matches
+    ULONG FileIdCount;
+    ULONG AuditCount;                      // Files that are audited
+    PFILE_ID_128 AuditIds;                 // Sorted file IDs of those files
+    ULONG AuditIdCount;
+    const AVF_BUNDLE_HEADER *Bundle;       // Mapped policy bundle, or NULL
+    PAVF_RULES Rules;                      // Compiled -rules, or NULL
+    PAVF_POLICY_HEADER FilterPolicy;       // Sent to the filter when published
+    BOOLEAN MonitorAll;                    // No files: every event is reported
+} AVF_USER_POLICY, *PAVF_USER_POLICY;
+
+//
+//  Where the protected set comes from.  Kept so that the set can be built
+//  again when a list file or bundle changes.
+//
+
+typedef enum _AVF_POLICY_SOURCE_TYPE {
+    PolicySourceFile,
+    PolicySourceList,
+    PolicySourceBundle,
+    PolicySourceRules
+} AVF_POLICY_SOURCE_TYPE;
+
+typedef struct _AVF_POLICY_SOURCE {
+    AVF_POLICY_SOURCE_TYPE Type;
+    PCWSTR Path;
+    BOOLEAN Audit;                         // Its files are audited
+    BOOLEAN Shadow;                        // Part of the candidate policy (-shadow)
+    FILETIME LastWriteTime;                // As of the last build
+} AVF_POLICY_SOURCE, *PAVF_POLICY_SOURCE;
+
+//
+//  What a policy decides on a notification (DecideByPolicy)
+//
+
+typedef enum _AVF_POLICY_DECISION {
+    PolicyDecisionUnprotected,             // Allowed: the file is not protected
+    PolicyDecisionAllow,                   // Allowed by a rule
+    PolicyDecisionBlock,                   // Blocked by a rule
+    PolicyDecisionAudit,                   // Allowed now, then the consultant is asked
+    PolicyDecisionConsult,                 // The consultant is asked
+    PolicyDecisionCount,
+    PolicyDecisionDefer = PolicyDecisionCount  // Decided again once the image's signer is known
+} AVF_POLICY_DECISION;
+
+//
+//  What became of an event, for aggregation (-aggregate, avfAggregate.c)
+//
+
+typedef enum _AVF_EVENT_VERDICT {
+    EventAllowedByRule,
+    EventBlockedByRule,
+    EventAllowedOverRate,                  // Over the process's -consultrate
+    EventAudited,
+    EventAllowedByConsultant,
+    EventBlockedByConsultant,
+    EventOverdue,
+    EventNoConsultant,
+    EventVerdictCount
+} AVF_EVENT_VERDICT;
+
+#define AVF_WORKER_THREAD_COUNT     4       // Without -affinity
+#define AVF_MAX_WORKERS             AVF_MAX_ENGINE_CONNECTIONS
+
+//
+//  Where the engine workers run (-affinity)
+//
+
+typedef enum _AVF_AFFINITY {
+    AffinityNone,                          // Anywhere
+    AffinityProcessor,                     // Each on a processor of its own
+    AffinityNode                           // Spread over the NUMA nodes
+} AVF_AFFINITY;
+
+//
+//  Completion keys on the engine workers' completion ports.  A packet
+//  without an OVERLAPPED only wakes a worker up.
+//
+
+#define AVF_KEY_FILTER              0       // FilterGetMessage on a worker's connection
+#define AVF_KEY_IO                  1       // The OVERLAPPED of an AVF_IO
+
+//
+//  Any other overlapped I/O, or posted packet, handled by the engine.
+//  Complete is called on an engine thread when its packet is dequeued.
+//
+
+typedef struct _AVF_IO {
+
+    OVERLAPPED Overlapped;
+
+    VOID
+    (*Complete)(
+        _In_ struct _AVF_IO *Io,
+        _In_ DWORD BytesTransferred,
+        _In_ BOOL Success
+        );
+
+} AVF_IO, *PAVF_IO;
+
+typedef struct _AVF_CONSULTANT_CONNECTION AVF_CONSULTANT_CONNECTION, *PAVF_CONSULTANT_CONNECTION;
+typedef struct _AVF_FANOUT AVF_FANOUT, *PAVF_FANOUT;
+
+#define AVF_MAX_CONSULTANTS         8
+
+//
+//  How the verdicts of several consultants make one (-combine).  A
+//  consultant that is not available or misses its deadline has no say.
+//
+
+typedef enum _AVF_COMBINE_MODE {
+    CombineBlockWins,                      // Any block blocks
+    CombineQuorum,                         // gCombineQuorum blocks block
+    CombinePriority                        // The first consultant listed that answers decides
+} AVF_COMBINE_MODE;
+
+//
+//  Priority of a consultation waiting for its turn at the consultant.  A
+//  consultation close to its deadline is urgent whatever its class.
+//
+
+typedef enum _AVF_PRIORITY {
+    PriorityUrgent,                        // Close to its deadline
+    PriorityInteractive,                   // Opens by interactive processes
+    PriorityNormal,                        // Other interactive I/O, opens by services
+    PriorityBackground,                    // Other service I/O, background I/O
+    PriorityCount
+} AVF_PRIORITY;
+
+//
+//  Which of the consultations in flight at once share one request to the
+//  consultant (-coalesce).  They must be for the same file and the same
+//  operation, a create with the same access, sharing, disposition and
+//  options; the scope says whose they may be as well.
+//
+
+typedef enum _AVF_COALESCE_SCOPE {
+    CoalesceNone,                          // None are coalesced
+    CoalesceFile,                          // Any process's
+    CoalesceImage,                         // Processes running the same image
+    CoalesceProcess                        // The same process's
+} AVF_COALESCE_SCOPE;
+
+//
+//  A request to the security consultant in flight.  Embedded in the
+//  engine's message, so that starting one allocates nothing.
+//
+
+typedef struct _AVF_CONSULTATION {
+    struct _AVF_CONSULTATION *Next;        // The scheduler's, then the transport's
+    PAVF_CONSULTANT_CONNECTION Connection; // Referenced while in flight
+    AVF_CONSULTANT_REQUEST Request;
+    ULONG RequestSize;                     // For the agreed protocol version
+    AVF_CONSULTANT_RESPONSE Response;
+    BOOL Result;                           // A matching response arrived
+    BOOLEAN Expired;                       // The filter allowed it before its turn came
+    BOOLEAN Audit;                         // The operation was allowed already
+    BOOLEAN Queued;                        // On a scheduler queue, under gScheduleLock
+    AVF_PRIORITY Priority;
+    ULONGLONG QueuedTime;                  // GetTickCount64
+    ULONGLONG Deadline;                    // GetTickCount64 when the filter allows it
+    HANDLE Port;                           // Completion port of the worker that owns it
+    struct _AVF_CONSULTATION *CoalesceNext; // In its coalescing bucket, or its leader's Followers
+    struct _AVF_CONSULTATION *Followers;   // Coalesced onto it, waiting for its response
+    ULONG CoalesceHash;
+    BOOLEAN Coalescing;                    // In the coalescing table, taking followers
+    PAVF_FANOUT FanOut;                    // The fan-out it is one consultant's part of
+    ULONG Leg;                             // Which consultant's part, in a fan-out
+    AVF_IO Io;                             // The transport's
+} AVF_CONSULTATION, *PAVF_CONSULTATION;
+
+//
+//  A way of carrying requests to the security consultant.  The named pipe
+//  is always there; after the handshake the consultant may accept a faster
+//  one.  A transport either takes consultations asynchronously (Submit)
+//  and calls CompleteConsultation for each, or answers them one at a time
+//  on the calling thread (Query), which avfConsultant.c then runs on the
+//  thread pool.  Close is only called once nothing holds the connection.
+//
+
+typedef struct _AVF_CONSULTANT_TRANSPORT {
+
+    PCWSTR Name;
+
+    BOOL
+    (*Query)(
+        _In_ PVOID Context,
+        _In_reads_bytes_(RequestSize) const AVF_CONSULTANT_REQUEST *Request,
+        _In_ ULONG RequestSize,
+        _Out_ PAVF_CONSULTANT_RESPONSE Response
+        );
+
+    VOID
+    (*Submit)(
+        _In_ PVOID Context,
+        _Inout_ PAVF_CONSULTATION Consultation
+        );
+
+    //
+    //  Optional: send requests Submit held back.  Called after each round
+    //  of completions; returns whether requests are still held.
+    //
+
+    BOOLEAN
+    (*Flush)(
+        _In_ PVOID Context
+        );
+
+    //
+    //  Optional: make consultations in flight fail promptly
+    //
+
+    VOID
+    (*Cancel)(
+        _In_ PVOID Context
+        );
+
+    //
+    //  Optional: free the transport; no consultation is in flight
+    //
+
+    VOID
+    (*Close)(
+        _In_ PVOID Context
+        );
+
+} AVF_CONSULTANT_TRANSPORT, *PAVF_CONSULTANT_TRANSPORT;
+
+//
+//  Global variables
+//
+
+extern PAVF_PROTECTED_FILE gProtectedFiles;
+extern ULONG gProtectedFileCount;
+extern ULONG gProtectedFileCapacity;
+extern PFILE_ID_128 gProtectedIds;
+extern ULONG gProtectedIdCount;
+extern HANDLE gPort;
+extern HANDLE gCompletionPort;             // The first engine worker's
+extern ULONG gEngineWorkerCount;
+extern AVF_AFFINITY gEngineAffinity;
+extern volatile BOOLEAN gRunning;
+extern volatile LONG gBloomFalsePositives;
+extern volatile LONG gAudited;
+extern volatile LONG gAuditBlocked;
+
+//
+//  Functions implemented in avfUser.c
+//
+
+BOOL
+AddProtectedFile(
+    _In_ PCWSTR FilePath,
+    _In_ BOOLEAN Audit
+    );
+
+ULONG
+LoadProtectedFileList(
+    _In_ PCWSTR ListPath,
+    _In_ BOOLEAN Audit
+    );
+
+PAVF_POLICY_HEADER
+BuildFilterPolicy(
+    VOID
+    );
+
+BOOL
+SendFilterPolicy(
+    _In_ PAVF_USER_POLICY Policy
+    );
+
+int __cdecl
+CompareFileIds(
+    _In_ const void *Left,
+    _In_ const void *Right
+    );
+
+BOOL
+IsFileIdProtected(
+    _In_ PAVF_USER_POLICY Policy,
+    _In_ const FILE_ID_128 *FileId
+    );
+
+BOOL
+IsFileProtected(
+    _In_ PAVF_USER_POLICY Policy,
+    _In_ PCWSTR FilePath
+    );
+
+BOOL
+BuildAuditSet(
+    _Inout_ PAVF_USER_POLICY Policy
+    );
+
+BOOL
+IsFileAudited(
+    _In_ PAVF_USER_POLICY Policy,
+    _In_ PAVF_FILE_NOTIFICATION pNotification
+    );
+
+VOID
+UpcaseFilePath(
+    _In_ PCWSTR FilePath,
+    _Out_writes_(AVF_MAX_PATH) PWCHAR UpperPath
+    );
+
+//
+//  Functions implemented in avfBundle.c
+//
+
+BOOL
+CompilePolicyBundle(
+    _In_ PCWSTR BundlePath
+    );
+
+BOOL
+LoadPolicyBundle(
+    _In_ PCWSTR BundlePath,
+    _Out_ PAVF_USER_POLICY Policy
+    );
+
+BOOL
+IsPathInPolicyBundle(
+    _In_ const AVF_BUNDLE_HEADER *Bundle,
+    _In_ PCWSTR UpperPath
+    );
+
+//
+//  Functions implemented in avfReload.c
+//
+
+BOOL
+AddPolicySource(
+    _In_ AVF_POLICY_SOURCE_TYPE Type,
+    _In_ PCWSTR Path,
+    _In_ BOOLEAN Audit
+    );
+
+VOID
+BeginShadowSources(
+    VOID
+    );
+
+ULONG
+LoadProtectedFiles(
+    _In_ BOOLEAN Shadow,
+    _In_ BOOLEAN Verbose
+    );
+
+PAVF_USER_POLICY
+BuildUserPolicy(
+    _In_ BOOLEAN Shadow,
+    _In_ BOOLEAN Verbose
+    );
+
+VOID
+FreeUserPolicy(
+    _In_ PAVF_USER_POLICY Policy
+    );
+
+BOOL
+PublishUserPolicy(
+    _In_ PAVF_USER_POLICY Policy
+    );
+
+VOID
+PublishShadowPolicy(
+    _In_opt_ PAVF_USER_POLICY Policy
+    );
+
+VOID
+UnpublishUserPolicy(
+    VOID
+    );
+
+VOID
+ReloadPolicyIfChanged(
+    _In_ BOOLEAN Force
+    );
+
+ULONG
+RegisterPolicyReader(
+    VOID
+    );
+
+PAVF_USER_POLICY
+AcquireUserPolicy(
+    _In_ ULONG Reader
+    );
+
+PAVF_USER_POLICY
+AcquireShadowPolicy(
+    _In_ ULONG Reader
+    );
+
+VOID
+ReleaseUserPolicy(
+    _In_ ULONG Reader
+    );
+
+//
+//  Functions implemented in avfEngine.c
+//
+
+BOOL
+StartEngine(
+    VOID
+    );
+
+VOID
+StopEngine(
+    VOID
+    );
+
+VOID
+ConsultationCompleted(
+    _Inout_ PAVF_CONSULTATION Consultation
+    );
+
+AVF_POLICY_DECISION
+DecideByPolicy(
+    _In_ PAVF_USER_POLICY Policy,
+    _In_ PAVF_FILE_NOTIFICATION pNotification,
+    _In_ BOOLEAN Shadow,
+    _Out_ PULONG RuleLine,
+    _Out_ PBOOLEAN Timed
+    );
+
+VOID
+ImageSignerResolved(
+    _In_ ULONG ProcessKey
+    );
+
+//
+//  Functions implemented in avfConsultant.c
+//
+
+extern CRITICAL_SECTION gConsultantLock;
+extern ULONG gConsultantCount;
+
+BOOL
+AddConsultant(
+    _In_ PCWSTR PipeName,
+    _In_ ULONG DeadlineMs
+    );
+
+VOID
+StartConsultant(
+    VOID
+    );
+
+VOID
+StopConsultant(
+    VOID
+    );
+
+PAVF_CONSULTANT_CONNECTION
+AcquireConsultant(
+    _In_ ULONG Index
+    );
+
+PCWSTR
+GetConsultantName(
+    _In_ ULONG Index
+    );
+
+ULONG
+GetConsultantDeadline(
+    _In_ ULONG Index
+    );
+
+VOID
+ReferenceConsultant(
+    _In_ PAVF_CONSULTANT_CONNECTION Connection
+    );
+
+VOID
+ReleaseConsultant(
+    _In_ PAVF_CONSULTANT_CONNECTION Connection
+    );
+
+VOID
+DisconnectConsultant(
+    _In_ PAVF_CONSULTANT_CONNECTION Connection
+    );
+
+HANDLE
+GetConsultantPipe(
+    _In_ PAVF_CONSULTANT_CONNECTION Connection
+    );
+
+ULONG
+GetConsultantVersion(
+    _In_ PAVF_CONSULTANT_CONNECTION Connection
+    );
+
+ULONG
+GetConsultantCapabilities(
+    _In_ PAVF_CONSULTANT_CONNECTION Connection
+    );
+
+BOOL
+TransactConsultantPipe(
+    _In_ HANDLE Pipe,
+    _In_reads_bytes_(InputSize) PVOID Input,
+    _In_ ULONG InputSize,
+    _Out_writes_bytes_to_(OutputSize, *BytesRead) PVOID Output,
+    _In_ ULONG OutputSize,
+    _Out_ PDWORD BytesRead
+    );
+
+BOOL
+StartConsultation(
+    _Inout_ PAVF_CONSULTATION Consultation,
+    _In_ PAVF_FILE_NOTIFICATION pNotification
+    );
+
+VOID
+ForwardConsultation(
+    _Inout_ PAVF_CONSULTATION Consultation,
+    _In_ PAVF_FILE_NOTIFICATION pNotification
+    );
+
+VOID
+SendConsultation(
+    _Inout_ PAVF_CONSULTATION Consultation
+    );
+
+VOID
+SubmitConsultation(
+    _Inout_ PAVF_CONSULTATION Consultation,
+    _In_ PAVF_CONSULTANT_CONNECTION Connection
+    );
+
+BOOLEAN
+FlushConsultations(
+    VOID
+    );
+
+VOID
+CompleteConsultation(
+    _Inout_ PAVF_CONSULTATION Consultation,
+    _In_ BOOL Result
+    );
+
+//
+//  Functions implemented in avfSchedule.c
+//
+
+extern ULONG gConsultantWindow;
+
+VOID
+PrioritizeConsultation(
+    _Inout_ PAVF_CONSULTATION Consultation,
+    _In_ PAVF_FILE_NOTIFICATION pNotification
+    );
+
+VOID
+ScheduleConsultation(
+    _Inout_ PAVF_CONSULTATION Consultation
+    );
+
+VOID
+RaiseConsultation(
+    _Inout_ PAVF_CONSULTATION Leader,
+    _In_ PAVF_CONSULTATION Follower
+    );
+
+VOID
+ReleaseConsultationSlot(
+    VOID
+    );
+
+VOID
+PrintScheduleStatistics(
+    VOID
+    );
+
+//
+//  Functions implemented in avfCoalesce.c
+//
+
+extern AVF_COALESCE_SCOPE gCoalesceScope;
+
+BOOLEAN
+CoalesceConsultation(
+    _Inout_ PAVF_CONSULTATION Consultation
+    );
+
+VOID
+CompleteCoalesced(
+    _Inout_ PAVF_CONSULTATION Consultation
+    );
+
+VOID
+PrintCoalesceStatistics(
+    VOID
+    );
+
+//
+//  Functions implemented in avfFanOut.c
+//
+
+extern AVF_COMBINE_MODE gCombineMode;
+extern ULONG gCombineQuorum;
+
+VOID
+FanOutConsultation(
+    _Inout_ PAVF_CONSULTATION Consultation
+    );
+
+VOID
+FanOutLegCompleted(
+    _Inout_ PAVF_CONSULTATION Leg
+    );
+
+VOID
+PrintFanOutStatistics(
+    VOID
+    );
+
+//
+//  Functions implemented in avfPlugin.c
+//
+
+extern PCWSTR gPluginPath;
+extern PCWSTR gPluginArguments;
+
+BOOL
+LoadPlugin(
+    VOID
+    );
+
+VOID
+UnloadPlugin(
+    VOID
+    );
+
+BOOLEAN
+PluginConsultation(
+    _Inout_ PAVF_CONSULTATION Consultation,
+    _In_ PAVF_FILE_NOTIFICATION pNotification
+    );
+
+VOID
+FlushPluginConsultations(
+    VOID
+    );
+
+VOID
+PrintPluginStatistics(
+    VOID
+    );
+
+//
+//  Functions implemented in avfRules.c
+//
+
+PAVF_RULES
+CompileRules(
+    _In_ PCWSTR Path,
+    _In_ BOOLEAN Shadow
+    );
+
+VOID
+FreeRules(
+    _In_opt_ PAVF_RULES Rules
+    );
+
+ULONG
+GetRuleCount(
+    _In_ const AVF_RULES *Rules
+    );
+
+AVF_RULE_ACTION
+EvaluateRules(
+    _In_ const AVF_RULES *Rules,
+    _In_ PAVF_FILE_NOTIFICATION pNotification,
+    _Out_ PULONG Line,
+    _Out_ PBOOLEAN Timed
+    );
+
+BOOLEAN
+IsImageSignerPending(
+    _In_ ULONG ProcessKey
+    );
+
+BOOL
+SelfTestRules(
+    VOID
+    );
+
+VOID
+PrintRuleStatistics(
+    VOID
+    );
+
+//
+//  Functions implemented in avfAggregate.c
+//
+
+extern ULONG gAggregateWindowMs;
+
+VOID
+InitializeAggregation(
+    VOID
+    );
+
+VOID
+UninitializeAggregation(
+    VOID
+    );
+
+BOOLEAN
+AggregateEvent(
+    _In_ PAVF_FILE_NOTIFICATION pNotification,
+    _In_ AVF_EVENT_VERDICT Verdict,
+    _In_ ULONG Detail
+    );
+
+VOID
+FlushAggregatedEvents(
+    _In_ BOOLEAN All
+    );
+
+VOID
+PrintAggregateStatistics(
+    VOID
+    );
+
+//
+//  Functions implemented in avfLog.c
+//
+
+BOOL
+InitializeLogging(
+    _In_opt_ PCWSTR LogFilePath
+    );
+
+VOID
+ShutdownLogging(
+    VOID
+    );
+
+VOID
+LogMessage(
+    _In_ PCWSTR Format,
+    ...
+    );
+
+//
+//  Functions implemented in avfSample.c
+//
+
+extern AVF_SAMPLING gSampling;
+extern ULONG gConsultRate;
+extern ULONG gConsultBurst;
+
+BOOLEAN
+SampleNotification(
+    _In_ PAVF_FILE_NOTIFICATION pNotification,
+    _In_ BOOLEAN Consult
+    );
+
+VOID
+PrintSamplingStatistics(
+    VOID
+    );
+
+//
+//  Functions implemented in avfShadow.c
+//
+
+extern volatile BOOLEAN gShadowRunning;
+
+BOOL
+StartShadow(
+    VOID
+    );
+
+VOID
+StopShadow(
+    VOID
+    );
+
+VOID
+QueueShadowEvaluation(
+    _In_ PAVF_FILE_NOTIFICATION pNotification,
+    _In_ AVF_POLICY_DECISION Decision,
+    _In_ LONG64 Ticks
+    );
+
+VOID
+PrintShadowStatistics(
+    VOID
+    );
+
+//
+//  Functions implemented in avfPipe.c
+//
+
+extern const AVF_CONSULTANT_TRANSPORT gPipeTransport;
+extern ULONG gConsultantBatchWaitUs;
+
+PVOID
+CreatePipeTransport(
+    _In_ PAVF_CONSULTANT_CONNECTION Connection
+    );
+
+//
+//  Functions implemented in avfRing.c
+//
+
+extern const AVF_CONSULTANT_TRANSPORT gRingTransport;
+
+PVOID
+OfferRingTransport(
+    _In_ HANDLE Pipe,
+    _In_ ULONG Version
+    );
+
+//
+//  Functions implemented in avfVolume.c
+//
+
+BOOL
+InitializeVolumeMap(
+    VOID
+    );
+
+VOID
+UninitializeVolumeMap(
+    VOID
+    );
+
+VOID
+RefreshVolumeMapIfStale(
+    VOID
+    );
+
+BOOL
+ConvertToNtPath(
+    _In_ PCWSTR Win32Path,
+    _Out_writes_(NtPathSize) PWSTR NtPath,
+    _In_ ULONG NtPathSize,
+    _Out_opt_ PULONG VolumeLength
+    );
+
+BOOL
+ConvertToWin32Path(
+    _In_ PCWSTR NtPath,
+    _Out_writes_(Win32PathSize) PWSTR Win32Path,
+    _In_ ULONG Win32PathSize
+    );
+
+ULONG
+GetNtVolumeLength(
+    _In_ PCWSTR NtPath
+    );
+
+#endif /* __AVFUSER_H__ */
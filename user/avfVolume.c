@@ -0,0 +1,923 @@
+/*++
+
+Copyright (c) 1989-2002  Microsoft Corporation
+Modified for AV Filter functionality
+
+Module Name:
+
+    avfVolume.c
+
+Abstract:
+
+    This module keeps a cached map between the Win32 names of volumes
+    (drive letters, mount points, volume GUID paths, subst and network
+    drives) and their NT device names, and uses it to convert paths in
+    both directions without system calls.
+
+    The map is built by enumerating volumes and drive letters once, and
+    rebuilt when a volume arrives or leaves, when a conversion meets a
+    drive it does not know, and periodically to pick up drive letter and
+    mount point changes, which raise no device notification.
+
+Environment:
+
+    User mode
+
+--*/
+
+#include <windows.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <cfgmgr32.h>
+#include <initguid.h>
+#include <ntddstor.h>
+#include "avfUser.h"
+
+//
+//  One Win32 name of a volume, or of a directory for a subst drive
+//
+
+typedef struct _AVF_VOLUME_MOUNT {
+    USHORT DosLength;              // Characters, no trailing backslash
+    USHORT NtLength;               // Characters
+    USHORT VolumeLength;           // Leading characters of NtPath naming the volume
+    BOOLEAN Subst;                 // Not used to render NT paths
+    WCHAR DosPath[MAX_PATH];       // Upper case, e.g. "C:" or "C:\MOUNT\DATA"
+    WCHAR NtPath[MAX_PATH];        // e.g. "\Device\HarddiskVolume3"
+} AVF_VOLUME_MOUNT, *PAVF_VOLUME_MOUNT;
+
+typedef struct _AVF_VOLUME_MAP {
+    ULONG Count;
+    ULONG Capacity;
+    AVF_VOLUME_MOUNT Mounts[ANYSIZE_ARRAY];
+} AVF_VOLUME_MAP, *PAVF_VOLUME_MAP;
+
+#define AVF_MUP_DEVICE_NAME             L"\\Device\\Mup"
+#define AVF_MUP_DEVICE_NAME_LENGTH      11
+#define AVF_VOLUME_MAP_REFRESH_INTERVAL 60000   // Milliseconds
+#define AVF_VOLUME_MAP_MISS_INTERVAL    5000    // Milliseconds
+
+//
+//  The current map.  Readers hold the lock shared only while they
+//  convert; a rebuild swaps in a new map under the exclusive lock.
+//
+
+static PAVF_VOLUME_MAP gVolumeMap = NULL;
+static SRWLOCK gVolumeMapLock = SRWLOCK_INIT;
+static volatile BOOLEAN gVolumeMapStale = FALSE;
+static ULONGLONG gVolumeMapBuildTime = 0;
+static HCMNOTIFICATION gVolumeNotification = NULL;
+
+//
+//  Function prototypes
+//
+
+DWORD CALLBACK
+VolumeNotificationCallback(
+    _In_ HCMNOTIFICATION Notification,
+    _In_opt_ PVOID Context,
+    _In_ CM_NOTIFY_ACTION Action,
+    _In_reads_bytes_(EventDataSize) PCM_NOTIFY_EVENT_DATA EventData,
+    _In_ DWORD EventDataSize
+    );
+
+PAVF_VOLUME_MAP
+BuildVolumeMap(
+    VOID
+    );
+
+BOOL
+AddVolumeMount(
+    _Inout_ PAVF_VOLUME_MAP *Map,
+    _In_ PCWSTR DosPath,
+    _In_ PCWSTR NtPath,
+    _In_ ULONG VolumeLength,
+    _In_ BOOLEAN Subst
+    );
+
+PAVF_VOLUME_MOUNT
+FindMountByDosPath(
+    _In_ PAVF_VOLUME_MAP Map,
+    _In_ PCWSTR Path
+    );
+
+PAVF_VOLUME_MOUNT
+FindMountByNtPath(
+    _In_ PAVF_VOLUME_MAP Map,
+    _In_ PCWSTR NtPath
+    );
+
+BOOL
+RefreshVolumeMap(
+    VOID
+    );
+
+
+BOOL
+InitializeVolumeMap(
+    VOID
+    )
+/*++
+
+Routine Description:
+
+    Builds the volume map and registers for volume arrival and removal.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    TRUE if the map was built, FALSE otherwise.
+
+--*/
+{
+    CM_NOTIFY_FILTER filter;
+
+    if (!RefreshVolumeMap()) {
+        return FALSE;
+    }
+
+    RtlZeroMemory(&filter, sizeof(filter));
+    filter.cbSize = sizeof(filter);
+    filter.FilterType = CM_NOTIFY_FILTER_TYPE_DEVICEINTERFACE;
+    filter.u.DeviceInterface.ClassGuid = GUID_DEVINTERFACE_VOLUME;
+
+    if (CM_Register_Notification(&filter,
+                                 NULL,
+                                 VolumeNotificationCallback,
+                                 &gVolumeNotification) != CR_SUCCESS) {
+
+        //
+        //  The periodic refresh still picks up changes
+        //
+
+        wprintf(L"WARNING: Failed to register for volume notifications\n");
+        gVolumeNotification = NULL;
+    }
+
+    return TRUE;
+}
+
+
+VOID
+UninitializeVolumeMap(
+    VOID
+    )
+/*++
+
+Routine Description:
+
+    Unregisters the volume notification and frees the volume map.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    if (gVolumeNotification != NULL) {
+        CM_Unregister_Notification(gVolumeNotification);
+        gVolumeNotification = NULL;
+    }
+
+    AcquireSRWLockExclusive(&gVolumeMapLock);
+
+    if (gVolumeMap != NULL) {
+        HeapFree(GetProcessHeap(), 0, gVolumeMap);
+        gVolumeMap = NULL;
+    }
+
+    ReleaseSRWLockExclusive(&gVolumeMapLock);
+}
+
+
+DWORD CALLBACK
+VolumeNotificationCallback(
+    _In_ HCMNOTIFICATION Notification,
+    _In_opt_ PVOID Context,
+    _In_ CM_NOTIFY_ACTION Action,
+    _In_reads_bytes_(EventDataSize) PCM_NOTIFY_EVENT_DATA EventData,
+    _In_ DWORD EventDataSize
+    )
+/*++
+
+Routine Description:
+
+    Volume interface arrival and removal callback.  Marks the map stale;
+    it is rebuilt by RefreshVolumeMapIfStale, outside the callback.
+
+Arguments:
+
+    Notification - Our notification registration.
+    Context - Unused.
+    Action - What happened to the volume interface.
+    EventData - Unused.
+    EventDataSize - Unused.
+
+Return Value:
+
+    ERROR_SUCCESS.
+
+--*/
+{
+    UNREFERENCED_PARAMETER(Notification);
+    UNREFERENCED_PARAMETER(Context);
+    UNREFERENCED_PARAMETER(EventData);
+    UNREFERENCED_PARAMETER(EventDataSize);
+
+    if (Action == CM_NOTIFY_ACTION_DEVICEINTERFACEARRIVAL ||
+        Action == CM_NOTIFY_ACTION_DEVICEINTERFACEREMOVAL) {
+
+        gVolumeMapStale = TRUE;
+    }
+
+    return ERROR_SUCCESS;
+}
+
+
+BOOL
+AddVolumeMount(
+    _Inout_ PAVF_VOLUME_MAP *Map,
+    _In_ PCWSTR DosPath,
+    _In_ PCWSTR NtPath,
+    _In_ ULONG VolumeLength,
+    _In_ BOOLEAN Subst
+    )
+/*++
+
+Routine Description:
+
+    Adds a Win32 name to a volume map being built, growing it as needed.
+
+Arguments:
+
+    Map - The map; may be reallocated.
+    DosPath - Win32 name, with or without a trailing backslash.
+    NtPath - NT name it stands for.
+    VolumeLength - Leading characters of NtPath naming the volume device.
+    Subst - The name is a subst drive.
+
+Return Value:
+
+    TRUE if added, FALSE if out of memory or a name is too long.
+
+--*/
+{
+    PAVF_VOLUME_MAP newMap;
+    PAVF_VOLUME_MOUNT mount;
+    ULONG newCapacity;
+    size_t dosLength = wcslen(DosPath);
+    size_t ntLength = wcslen(NtPath);
+
+    while (dosLength > 0 && DosPath[dosLength - 1] == L'\\') {
+        dosLength--;
+    }
+
+    while (ntLength > 0 && NtPath[ntLength - 1] == L'\\') {
+        ntLength--;
+    }
+
+    if (dosLength == 0 || dosLength >= MAX_PATH ||
+        ntLength == 0 || ntLength >= MAX_PATH ||
+        VolumeLength > ntLength) {
+
+        return FALSE;
+    }
+
+    if ((*Map)->Count == (*Map)->Capacity) {
+
+        newCapacity = (*Map)->Capacity * 2;
+        newMap = HeapReAlloc(GetProcessHeap(),
+                             0,
+                             *Map,
+                             FIELD_OFFSET(AVF_VOLUME_MAP, Mounts) + newCapacity * sizeof(AVF_VOLUME_MOUNT));
+
+        if (newMap == NULL) {
+            return FALSE;
+        }
+
+        newMap->Capacity = newCapacity;
+        *Map = newMap;
+    }
+
+    mount = &(*Map)->Mounts[(*Map)->Count];
+
+    wcsncpy_s(mount->DosPath, MAX_PATH, DosPath, dosLength);
+    _wcsupr_s(mount->DosPath, MAX_PATH);
+    wcsncpy_s(mount->NtPath, MAX_PATH, NtPath, ntLength);
+
+    mount->DosLength = (USHORT)dosLength;
+    mount->NtLength = (USHORT)ntLength;
+    mount->VolumeLength = (USHORT)VolumeLength;
+    mount->Subst = Subst;
+
+    (*Map)->Count++;
+    return TRUE;
+}
+
+
+PAVF_VOLUME_MAP
+BuildVolumeMap(
+    VOID
+    )
+/*++
+
+Routine Description:
+
+    Enumerates volumes, their mount points and the drive letters, and
+    builds a volume map from them.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    The map, allocated from the process heap, or NULL if out of memory.
+
+--*/
+{
+    PAVF_VOLUME_MAP map;
+    PAVF_VOLUME_MOUNT mount;
+    HANDLE find;
+    WCHAR volumeName[MAX_PATH];
+    WCHAR deviceName[MAX_PATH];
+    WCHAR ntPath[MAX_PATH];
+    WCHAR drives[4 * 26 + 1];
+    PWCHAR pathNames;
+    PWCHAR pathName;
+    PWCHAR share;
+    DWORD pathNamesLength = 1024;
+    DWORD length;
+    size_t nameLength;
+    PWCHAR drive;
+
+    map = HeapAlloc(GetProcessHeap(),
+                    0,
+                    FIELD_OFFSET(AVF_VOLUME_MAP, Mounts) + 16 * sizeof(AVF_VOLUME_MOUNT));
+
+    pathNames = HeapAlloc(GetProcessHeap(), 0, pathNamesLength * sizeof(WCHAR));
+
+    if (map == NULL || pathNames == NULL) {
+        goto Error;
+    }
+
+    map->Count = 0;
+    map->Capacity = 16;
+
+    //
+    //  Every volume, by its GUID path and every path it is mounted at
+    //
+
+    find = FindFirstVolumeW(volumeName, MAX_PATH);
+
+    if (find != INVALID_HANDLE_VALUE) {
+
+        do {
+
+            //
+            //  QueryDosDeviceW takes "Volume{GUID}" without the "\\?\"
+            //  prefix and the trailing backslash
+            //
+
+            nameLength = wcslen(volumeName);
+            if (nameLength < 5 || volumeName[nameLength - 1] != L'\\') {
+                continue;
+            }
+
+            volumeName[nameLength - 1] = L'\0';
+            length = QueryDosDeviceW(&volumeName[4], deviceName, MAX_PATH);
+            volumeName[nameLength - 1] = L'\\';
+
+            if (length == 0) {
+                continue;
+            }
+
+            AddVolumeMount(&map, volumeName, deviceName, (ULONG)wcslen(deviceName), FALSE);
+
+            while (!GetVolumePathNamesForVolumeNameW(volumeName, pathNames, pathNamesLength, &length)) {
+
+                if (GetLastError() != ERROR_MORE_DATA) {
+                    length = 0;
+                    break;
+                }
+
+                HeapFree(GetProcessHeap(), 0, pathNames);
+                pathNamesLength = length;
+                pathNames = HeapAlloc(GetProcessHeap(), 0, pathNamesLength * sizeof(WCHAR));
+
+                if (pathNames == NULL) {
+                    FindVolumeClose(find);
+                    goto Error;
+                }
+            }
+
+            for (pathName = pathNames;
+                 length != 0 && *pathName != L'\0';
+                 pathName += wcslen(pathName) + 1) {
+
+                AddVolumeMount(&map, pathName, deviceName, (ULONG)wcslen(deviceName), FALSE);
+            }
+
+        } while (FindNextVolumeW(find, volumeName, MAX_PATH));
+
+        FindVolumeClose(find);
+    }
+
+    //
+    //  Drive letters that are not volume mount points: subst drives,
+    //  which name a directory, and network drives
+    //
+
+    length = GetLogicalDriveStringsW(ARRAYSIZE(drives) - 1, drives);
+
+    for (drive = drives;
+         length != 0 && length < ARRAYSIZE(drives) && *drive != L'\0';
+         drive += wcslen(drive) + 1) {
+
+        drive[2] = L'\0';                       // "C:\" -> "C:"
+
+        if (FindMountByDosPath(map, drive) != NULL ||
+            QueryDosDeviceW(drive, deviceName, MAX_PATH) == 0) {
+
+            drive[2] = L'\\';
+            continue;
+        }
+
+        if (wcsncmp(deviceName, L"\\??\\", 4) == 0) {
+
+            //
+            //  Subst: "\??\C:\Dir".  Resolve the directory through the
+            //  volumes found so far.
+            //
+
+            mount = FindMountByDosPath(map, &deviceName[4]);
+
+            if (mount != NULL &&
+                swprintf_s(ntPath, MAX_PATH, L"%s%s", mount->NtPath, &deviceName[4 + mount->DosLength]) > 0) {
+
+                AddVolumeMount(&map, drive, ntPath, mount->VolumeLength, TRUE);
+            }
+
+        } else if ((share = wcsstr(deviceName, L"\\;")) != NULL) {
+
+            //
+            //  Redirector: "\Device\LanmanRedirector\;Z:000...\server\share"
+            //  is "\Device\Mup\server\share" to the filter
+            //
+
+            share = wcschr(share + 2, L'\\');
+
+            if (share != NULL &&
+                swprintf_s(ntPath, MAX_PATH, L"%s%s", AVF_MUP_DEVICE_NAME, share) > 0) {
+
+                AddVolumeMount(&map, drive, ntPath, AVF_MUP_DEVICE_NAME_LENGTH, FALSE);
+            }
+
+        } else {
+
+            AddVolumeMount(&map, drive, deviceName, (ULONG)wcslen(deviceName), FALSE);
+        }
+
+        drive[2] = L'\\';
+    }
+
+    HeapFree(GetProcessHeap(), 0, pathNames);
+    return map;
+
+Error:
+
+    if (pathNames != NULL) {
+        HeapFree(GetProcessHeap(), 0, pathNames);
+    }
+
+    if (map != NULL) {
+        HeapFree(GetProcessHeap(), 0, map);
+    }
+
+    return NULL;
+}
+
+
+BOOL
+RefreshVolumeMap(
+    VOID
+    )
+/*++
+
+Routine Description:
+
+    Rebuilds the volume map and swaps it in.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    TRUE if the map was rebuilt, FALSE if out of memory (the old map
+    stays).
+
+--*/
+{
+    PAVF_VOLUME_MAP map;
+    PAVF_VOLUME_MAP oldMap;
+
+    gVolumeMapStale = FALSE;
+    gVolumeMapBuildTime = GetTickCount64();
+
+    map = BuildVolumeMap();
+    if (map == NULL) {
+        return FALSE;
+    }
+
+    AcquireSRWLockExclusive(&gVolumeMapLock);
+    oldMap = gVolumeMap;
+    gVolumeMap = map;
+    ReleaseSRWLockExclusive(&gVolumeMapLock);
+
+    if (oldMap != NULL) {
+        HeapFree(GetProcessHeap(), 0, oldMap);
+    }
+
+    return TRUE;
+}
+
+
+VOID
+RefreshVolumeMapIfStale(
+    VOID
+    )
+/*++
+
+Routine Description:
+
+    Rebuilds the volume map if a volume arrived or left, or if the map has
+    not been rebuilt for a while.  Called from the main loop.
+
+Arguments:
+
+    None.
+
+Return Value:
+
+    None.
+
+--*/
+{
+    if (gVolumeMapStale ||
+        GetTickCount64() - gVolumeMapBuildTime >= AVF_VOLUME_MAP_REFRESH_INTERVAL) {
+
+        RefreshVolumeMap();
+    }
+}
+
+
+PAVF_VOLUME_MOUNT
+FindMountByDosPath(
+    _In_ PAVF_VOLUME_MAP Map,
+    _In_ PCWSTR Path
+    )
+/*++
+
+Routine Description:
+
+    Finds the Win32 name in a volume map that is the longest prefix of a
+    path, so that a mount point wins over the drive it is mounted on.
+
+Arguments:
+
+    Map - The volume map.
+    Path - Full Win32 path.
+
+Return Value:
+
+    The mount, or NULL if no Win32 name in the map is a prefix of Path.
+
+--*/
+{
+    PAVF_VOLUME_MOUNT best = NULL;
+    PAVF_VOLUME_MOUNT mount;
+    ULONG i;
+
+    for (i = 0; i < Map->Count; i++) {
+
+        mount = &Map->Mounts[i];
+
+        if ((best == NULL || mount->DosLength > best->DosLength) &&
+            _wcsnicmp(Path, mount->DosPath, mount->DosLength) == 0 &&
+            (Path[mount->DosLength] == L'\0' || Path[mount->DosLength] == L'\\')) {
+
+            best = mount;
+        }
+    }
+
+    return best;
+}
+
+
+PAVF_VOLUME_MOUNT
+FindMountByNtPath(
+    _In_ PAVF_VOLUME_MAP Map,
+    _In_ PCWSTR NtPath
+    )
+/*++
+
+Routine Description:
+
+    Finds the volume in a volume map whose NT name is the longest prefix
+    of an NT path, and picks its shortest Win32 name, which is its drive
+    letter if it has one.  Subst drives are not considered.
+
+Arguments:
+
+    Map - The volume map.
+    NtPath - NT path.
+
+Return Value:
+
+    The mount, or NULL if no volume in the map is a prefix of NtPath.
+
+--*/
+{
+    PAVF_VOLUME_MOUNT best = NULL;
+    PAVF_VOLUME_MOUNT mount;
+    ULONG i;
+
+    for (i = 0; i < Map->Count; i++) {
+
+        mount = &Map->Mounts[i];
+
+        if (mount->Subst) {
+            continue;
+        }
+
+        if (best != NULL &&
+            (mount->NtLength < best->NtLength ||
+             (mount->NtLength == best->NtLength && mount->DosLength >= best->DosLength))) {
+            continue;
+        }
+
+        if (_wcsnicmp(NtPath, mount->NtPath, mount->NtLength) == 0 &&
+            (NtPath[mount->NtLength] == L'\0' || NtPath[mount->NtLength] == L'\\')) {
+
+            best = mount;
+        }
+    }
+
+    return best;
+}
+
+
+BOOL
+ConvertToNtPath(
+    _In_ PCWSTR Win32Path,
+    _Out_writes_(NtPathSize) PWSTR NtPath,
+    _In_ ULONG NtPathSize,
+    _Out_opt_ PULONG VolumeLength
+    )
+/*++
+
+Routine Description:
+
+    Converts a Win32 path (C:\..., a mount point, subst or network drive,
+    \\?\Volume{GUID}\... or \\server\share\...) to an upper-case NT device
+    path (\DEVICE\HARDDISKVOLUMEX\...), using the volume map.
+
+    This is lexical: junctions and symbolic links inside the path are not
+    followed.  AddProtectedFile resolves them for paths that exist.
+
+Arguments:
+
+    Win32Path - Win32 path to convert.
+    NtPath - Buffer to receive NT path.
+    NtPathSize - Size of buffer in characters.
+    VolumeLength - Receives the number of leading characters of NtPath that
+                   name the volume device, or 0 if the path is not on a
+                   known volume.
+
+Return Value:
+
+    TRUE if successful, FALSE otherwise.
+
+--*/
+{
+    WCHAR fullPath[MAX_PATH];
+    PCWSTR path = fullPath;
+    PAVF_VOLUME_MOUNT mount;
+    DWORD result;
+    int written = -1;
+    ULONG volumeLength = 0;
+    BOOLEAN refreshed = FALSE;
+
+    if (VolumeLength != NULL) {
+        *VolumeLength = 0;
+    }
+
+    //
+    //  Get full path name first
+    //
+
+    result = GetFullPathNameW(Win32Path, MAX_PATH, fullPath, NULL);
+    if (result == 0 || result >= MAX_PATH) {
+        return FALSE;
+    }
+
+    //
+    //  \\?\C:\... is C:\..., and \\?\UNC\server\... is \\server\...
+    //
+
+    if (_wcsnicmp(path, L"\\\\?\\UNC\\", 8) == 0) {
+
+        written = swprintf_s(NtPath, NtPathSize, L"%s%s", AVF_MUP_DEVICE_NAME, &path[7]);
+        volumeLength = AVF_MUP_DEVICE_NAME_LENGTH;
+
+    } else {
+
+        if (wcsncmp(path, L"\\\\?\\", 4) == 0 && path[4] != L'\0' && path[5] == L':') {
+            path += 4;
+        }
+
+        for (;;) {
+
+            AcquireSRWLockShared(&gVolumeMapLock);
+
+            mount = (gVolumeMap != NULL) ? FindMountByDosPath(gVolumeMap, path) : NULL;
+
+            if (mount != NULL) {
+                written = swprintf_s(NtPath, NtPathSize, L"%s%s", mount->NtPath, &path[mount->DosLength]);
+                volumeLength = mount->VolumeLength;
+            }
+
+            ReleaseSRWLockShared(&gVolumeMapLock);
+
+            //
+            //  A drive we do not know may have just arrived.  Rebuild the
+            //  map, but not on every path of a long list on a missing
+            //  drive.
+            //
+
+            if (mount != NULL || refreshed || path[1] != L':' ||
+                GetTickCount64() - gVolumeMapBuildTime < AVF_VOLUME_MAP_MISS_INTERVAL) {
+                break;
+            }
+
+            RefreshVolumeMap();
+            refreshed = TRUE;
+        }
+
+        if (mount == NULL) {
+
+            if (wcsncmp(path, L"\\\\", 2) == 0 && path[2] != L'?' && path[2] != L'.') {
+
+                //
+                //  \\server\share\...
+                //
+
+                written = swprintf_s(NtPath, NtPathSize, L"%s%s", AVF_MUP_DEVICE_NAME, &path[1]);
+                volumeLength = AVF_MUP_DEVICE_NAME_LENGTH;
+
+            } else if (path[1] == L':') {
+
+                //
+                //  A drive letter with no device
+                //
+
+                return FALSE;
+
+            } else {
+
+                //
+                //  Not something we can map, just copy as-is
+                //
+
+                written = swprintf_s(NtPath, NtPathSize, L"%s", path);
+            }
+        }
+    }
+
+    if (written < 0) {
+        return FALSE;
+    }
+
+    if (VolumeLength != NULL) {
+        *VolumeLength = volumeLength;
+    }
+
+    //
+    //  Convert to uppercase for case-insensitive comparison
+    //
+
+    _wcsupr_s(NtPath, NtPathSize);
+
+    return TRUE;
+}
+
+
+BOOL
+ConvertToWin32Path(
+    _In_ PCWSTR NtPath,
+    _Out_writes_(Win32PathSize) PWSTR Win32Path,
+    _In_ ULONG Win32PathSize
+    )
+/*++
+
+Routine Description:
+
+    Converts an NT device path, as reported by the filter, to the Win32
+    path a user would recognize, using the volume map.  A volume's drive
+    letter is preferred over its mount points and GUID path.
+
+Arguments:
+
+    NtPath - NT path to convert.
+    Win32Path - Buffer to receive the Win32 path.
+    Win32PathSize - Size of buffer in characters.
+
+Return Value:
+
+    TRUE if successful, FALSE if the path is not on a known volume or does
+    not fit.
+
+--*/
+{
+    PAVF_VOLUME_MOUNT mount;
+    PCWSTR rest;
+    int written = -1;
+
+    AcquireSRWLockShared(&gVolumeMapLock);
+
+    mount = (gVolumeMap != NULL) ? FindMountByNtPath(gVolumeMap, NtPath) : NULL;
+
+    if (mount != NULL) {
+
+        rest = &NtPath[mount->NtLength];
+
+        written = swprintf_s(Win32Path,
+                             Win32PathSize,
+                             L"%s%s",
+                             mount->DosPath,
+                             (*rest == L'\0' && mount->DosLength == 2) ? L"\\" : rest);
+    }
+
+    ReleaseSRWLockShared(&gVolumeMapLock);
+
+    if (mount == NULL &&
+        _wcsnicmp(NtPath, AVF_MUP_DEVICE_NAME L"\\", AVF_MUP_DEVICE_NAME_LENGTH + 1) == 0) {
+
+        written = swprintf_s(Win32Path, Win32PathSize, L"\\%s", &NtPath[AVF_MUP_DEVICE_NAME_LENGTH]);
+    }
+
+    return written >= 0;
+}
+
+
+ULONG
+GetNtVolumeLength(
+    _In_ PCWSTR NtPath
+    )
+/*++
+
+Routine Description:
+
+    Returns how many leading characters of an NT path name its volume
+    device, using the volume map.
+
+Arguments:
+
+    NtPath - NT path, e.g. from GetFinalPathNameByHandleW.
+
+Return Value:
+
+    The length of the volume device name, or 0 if the path is not on a
+    known volume.
+
+--*/
+{
+    PAVF_VOLUME_MOUNT mount;
+    ULONG length = 0;
+
+    AcquireSRWLockShared(&gVolumeMapLock);
+
+    mount = (gVolumeMap != NULL) ? FindMountByNtPath(gVolumeMap, NtPath) : NULL;
+
+    if (mount != NULL) {
+        length = mount->VolumeLength;
+    }
+
+    ReleaseSRWLockShared(&gVolumeMapLock);
+
+    if (mount == NULL &&
+        _wcsnicmp(NtPath, AVF_MUP_DEVICE_NAME L"\\", AVF_MUP_DEVICE_NAME_LENGTH + 1) == 0) {
+
+        length = AVF_MUP_DEVICE_NAME_LENGTH;
+    }
+
+    return length;
+}